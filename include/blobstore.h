@@ -0,0 +1,39 @@
+/*
+ * Prototypes for our shared attribute value store
+ */
+
+/*
+ * A lot of attribute values are identical across objects (and across
+ * slots): the same CKA_CLASS and CKA_TOKEN values on every object, the
+ * same CKA_ID and CKA_LABEL on a certificate and its keys, the same
+ * issuer on every certificate from a CA, and the same certificate in
+ * the certificate slot and on a token.  So rather than each object
+ * keeping its own copy of every value, values are "interned" here; each
+ * unique byte string is stored once for the whole module, with a
+ * reference count.
+ *
+ * blob_intern() returns a pointer to the stored copy of the data (adding
+ * it if it isn't already there), and takes a reference to it.  Since
+ * there is only ever one copy of a value, two interned values are equal
+ * exactly when the pointers are equal.  The data must never be modified.
+ * blob_release() drops a reference; when the last reference is gone the
+ * value is freed.  Zero-length values all share one static blob, which
+ * is never freed.
+ *
+ * blob_find() returns the stored copy of the data if there is one (or
+ * NULL), without adding it or taking a reference.  The pointer is only
+ * meaningful for comparing against values that were interned while it
+ * was still in the store (see search_object()).
+ *
+ * All of these functions are thread-safe.
+ *
+ * Arguments:
+ *
+ * data		- Data to intern.
+ * len		- Length of data.
+ * blob		- Pointer returned by blob_intern().  NULL is ignored.
+ */
+
+extern const void *blob_intern(const void *data, size_t len);
+extern const void *blob_find(const void *data, size_t len);
+extern void blob_release(const void *blob);
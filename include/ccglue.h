@@ -1,30 +1,52 @@
 /*
  * Prototypes for the glue functions to the CommonCrypto framework
+ *
+ * Users of this header file will need to include
+ * <CommonCrypto/CommonCrypto.h> first.
  */
 
 /*
  * A generic set of message digst (hash functions).  For a type
  * argument they take a PKCS#11 mechanism name, such as CKM_SHA_1
- * or CKM_SHA256.  Only cc_md_init() can return an error.
+ * or CKM_SHA256.  Only cc_md_init() can return an error.  cc_md_len()
+ * returns the size of the digest output for a type (or 0 if the type is
+ * not a digest we support).
+ *
+ * The digest context is storage provided by the caller (generally part
+ * of some larger structure, or on the stack), so none of these functions
+ * allocate any memory.  Once cc_md_final() is called the context can be
+ * re-used by calling cc_md_init() again; a context that has been
+ * initialized but never finalized can simply be discarded.
  *
  * Arguments:
  *
  * type		- A PKCS#11 mechanism type for a message digest,
  *		  like CKM_SHA_1 or CKM_SHA256.
  * context	- A context structure containing the message digest
- *		  internal state.  Allocated by cc_md_init(), freed
- *		  by cc_md_final().
+ *		  internal state.
  * data		- Data to be added to the message digest calculation.
- * len		- Length of data
- * ret_data	- The output of the message digest calculation.  Always
- *		  allocated, must be freed by caller
- * ret_len	- The returned length of the digest.
+ * len		- Length of data.  This can be larger than 4GB.
+ * digest	- Buffer for the output of the message digest calculation;
+ *		  must have room for cc_md_len() (or CC_MD_MAX_LEN) bytes.
+ *
+ * cc_md_final() returns the length of the digest.
  */
 
-typedef struct _md_context *md_context;
+#define CC_MD_MAX_LEN	CC_SHA512_DIGEST_LENGTH	/* Largest digest we do */
+
+struct _md_context {
+	CK_MECHANISM_TYPE	type;
+	union {
+		CC_SHA1_CTX	sha1;
+		CC_SHA256_CTX	sha256;		/* Also used for SHA224 */
+		CC_SHA512_CTX	sha512;		/* Also used for SHA384 */
+	} state;
+};
+
+typedef struct _md_context md_context;
 
 extern bool cc_md_init(CK_MECHANISM_TYPE type, md_context *context);
-extern void cc_md_update(md_context context, const unsigned char *data,
-			 unsigned int len);
-extern void cc_md_final(md_context context, unsigned char **ret_data,
-			unsigned int *ret_len);
+extern unsigned int cc_md_len(CK_MECHANISM_TYPE type);
+extern void cc_md_update(md_context *context, const unsigned char *data,
+			 size_t len);
+extern unsigned int cc_md_final(md_context *context, unsigned char *digest);
@@ -0,0 +1,73 @@
+/*
+ * Prototypes for our on-disk certificate slot cache
+ */
+
+/*
+ * Building the certificate slot means pulling every trusted certificate
+ * out of the Keychain, which is slow.  So after we do that once we
+ * save the resulting object list in a cache file, which later processes
+ * can just read in and use.
+ *
+ * The cache file is keyed on the certificateList preference and a
+ * "stamp" derived from the modification times of the Keychain files;
+ * certcache_key() computes that key.  If the key in the file doesn't
+ * match, certcache_open() treats it as a miss.
+ *
+ * Attribute values in objects returned by certcache_attrs() point
+ * directly into the file contents, so they are valid until
+ * certcache_close().
+ *
+ * Cache files are authenticated with an HMAC, and certcache_setup() has
+ * to be called with the HMAC key before anything else; until it is,
+ * every cache is a miss and nothing is written.  Files that aren't
+ * regular files owned by the user with mode 0600 are ignored.
+ *
+ * certcache_open_named() and certcache_write_named() do the same thing
+ * for some other object list, in a file of its own (we use this for
+ * token objects); the caller is responsible for coming up with the key.
+ *
+ * Arguments:
+ *
+ * mackey	- The HMAC key, CERTCACHE_MACLEN bytes.
+ * match	- The NULL-terminated list of certificate match strings
+ *		  (the certificateList preference).
+ * name		- Name of a cache file in our cache directory; this must
+ *		  be a plain file name, not a path.
+ * key		- The cache key, CERTCACHE_KEYLEN bytes.
+ * cache	- An open cache file, returned by certcache_open().
+ * index	- Object index in the cache, from 0 to certcache_count() - 1
+ * class	- The returned object class
+ * attrs	- Array to be filled in with object attributes; must have
+ *		  room for the count returned by certcache_object().
+ * objs		- Array of objects to write out to the cache.
+ * count	- Count of objects to write.
+ */
+
+#define CERTCACHE_KEYLEN 32
+#define CERTCACHE_MACLEN 32
+
+struct cache_obj {
+	CK_OBJECT_CLASS		class;		/* Object class */
+	CK_ATTRIBUTE_PTR	attrs;		/* Object attributes */
+	unsigned int		attr_count;	/* Count of attributes */
+};
+
+typedef struct _cert_cache *cert_cache;
+
+extern void certcache_setup(const unsigned char *mackey);
+extern void certcache_key(char **match, unsigned char *key);
+extern cert_cache certcache_open(const unsigned char *key);
+extern cert_cache certcache_open_named(const char *name,
+				       const unsigned char *key);
+extern unsigned int certcache_count(cert_cache cache);
+extern unsigned int certcache_object(cert_cache cache, unsigned int index,
+				     CK_OBJECT_CLASS *class);
+extern void certcache_attrs(cert_cache cache, unsigned int index,
+			    CK_ATTRIBUTE_PTR attrs);
+extern bool certcache_same(cert_cache cache, struct cache_obj *objs,
+			   unsigned int count);
+extern bool certcache_write(const unsigned char *key, struct cache_obj *objs,
+			    unsigned int count);
+extern bool certcache_write_named(const char *name, const unsigned char *key,
+				  struct cache_obj *objs, unsigned int count);
+extern void certcache_close(cert_cache cache);
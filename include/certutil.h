@@ -3,11 +3,49 @@
  */
 
 /*
- * Returns "true" if successful, CFDataRef return pointers must be released.
+ * Parse a DER-encoded X.509 certificate in a single pass.  Nothing is
+ * allocated or copied; each field is returned as a slice (an offset and
+ * length) into the certificate bytes that were passed in, so they are
+ * only valid as long as those bytes are.  Use DER_SLICE_PTR() to get a
+ * pointer to a slice.  A slice with a length of 0 wasn't found.
+ *
+ * The serial number, issuer, subject, and SubjectPublicKeyInfo are the
+ * complete DER elements (tag and length included), since that's what
+ * PKCS#11 wants for CKA_SERIAL_NUMBER, CKA_ISSUER, and CKA_SUBJECT.  The
+ * modulus and exponent (only found for RSA keys) and the common name
+ * are just the contents.  is_ca is set if the certificate has a Basic
+ * Constraints extension with the cA flag set.
+ *
+ * Returns "true" if the required fields could be parsed.
+ *
+ * Arguments:
+ *
+ * der		- DER-encoded certificate.
+ * len		- Length of der.
+ * parts	- Certificate parts, filled in on return.
  */
 
-extern bool get_certificate_info(CFDataRef, CFDataRef *, CFDataRef *,
-				 CFDataRef *);
+struct der_slice {
+	size_t			offset;		/* Offset into the DER */
+	size_t			len;		/* Length (0 if not present) */
+};
+
+struct cert_parts {
+	struct der_slice	serial;		/* Serial number */
+	struct der_slice	issuer;		/* Issuer Name */
+	struct der_slice	subject;	/* Subject Name */
+	struct der_slice	spki;		/* SubjectPublicKeyInfo */
+	struct der_slice	modulus;	/* RSA modulus */
+	struct der_slice	exponent;	/* RSA public exponent */
+	struct der_slice	cn;		/* Subject commonName value */
+	bool			is_ca;		/* Basic Constraints cA set */
+};
+
+#define DER_SLICE_PTR(der, slice) ((const unsigned char *) (der) + \
+				   (slice).offset)
+
+extern bool cert_parse(const unsigned char *der, size_t len,
+		       struct cert_parts *parts);
 
 /*
  * Find common name in an encoded X.509 Name
@@ -16,15 +54,3 @@ extern bool get_certificate_info(CFDataRef, CFDataRef *, CFDataRef *,
  */
 
 extern char *get_common_name(unsigned char *, unsigned int);
-
-/*
- * Decode modulus and public exponent from an encoded RSAPublicKey 
- */
-
-extern bool get_pubkey_info(CFDataRef, CFDataRef *, CFDataRef *);
-
-/*
- * Return 'true' if the given certificate is a CA
- */
-
-extern bool is_cert_ca(SecCertificateRef);
@@ -6,9 +6,96 @@
 #define __KEYCHAIN_PKCS11_H__ 1
 
 #include <os/log.h>
+#include <os/signpost.h>
 
 extern os_log_t logsys;
 
+/*
+ * How much logging we do, set once from the "logLevel" preference when we
+ * start up.  At LOG_LEVEL_NONE logsys is OS_LOG_DISABLED, so nothing
+ * gets logged at all.  At LOG_LEVEL_DEBUG (the default) we log what we
+ * always have; that is only recorded if someone has debug logging turned
+ * on, and os_log_debug() doesn't evaluate its arguments otherwise.
+ * LOG_LEVEL_VERBOSE adds tracing from the hot paths (every attribute
+ * fetched, every search template, object dumps); LOG_VERBOSE() costs
+ * nothing more than a test of log_level unless that is turned on.  Use
+ * LOG_VERBOSE_ENABLED() around any tracing that has to do work before
+ * it can log anything.
+ */
+
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_DEBUG		1
+#define LOG_LEVEL_VERBOSE	2
+
+extern int log_level;
+
+#define LOG_VERBOSE_ENABLED() \
+	(__builtin_expect(log_level >= LOG_LEVEL_VERBOSE, 0) && \
+	 os_log_debug_enabled(logsys))
+
+#define LOG_VERBOSE(...) \
+do { \
+	if (__builtin_expect(log_level >= LOG_LEVEL_VERBOSE, 0)) \
+		os_log_debug(logsys, __VA_ARGS__); \
+} while (0)
+
+/*
+ * Signpost intervals, so Instruments can show us where the time goes.
+ * logsp is only set if we're running on a system that has signposts
+ * (10.14 and later), which also means that it is safe to ignore the
+ * availability warnings in these macros.  If nobody is recording
+ * signposts, all this costs is a call to os_signpost_enabled().
+ *
+ * Like os_log_debug(), the signpost name has to be a string constant,
+ * and it has to be the same for SP_BEGIN() and SP_END().
+ *
+ * SP_CALL() wraps a function call in an interval named after the
+ * function, and returns the function's return value:
+ *
+ *	ret = SP_CALL(SecItemCopyMatching, query, &result);
+ */
+
+extern os_log_t logsp;
+
+#ifdef __clang__
+#define SP_NOWARN_BEGIN \
+	_Pragma("clang diagnostic push") \
+	_Pragma("clang diagnostic ignored \"-Wunguarded-availability\"") \
+	_Pragma("clang diagnostic ignored \"-Wunguarded-availability-new\"")
+#define SP_NOWARN_END _Pragma("clang diagnostic pop")
+#else
+#define SP_NOWARN_BEGIN
+#define SP_NOWARN_END
+#endif
+
+#define SP_BEGIN(id, name) \
+do { \
+	SP_NOWARN_BEGIN \
+	id = OS_SIGNPOST_ID_NULL; \
+	if (logsp && os_signpost_enabled(logsp)) { \
+		id = os_signpost_id_generate(logsp); \
+		os_signpost_interval_begin(logsp, id, name); \
+	} \
+	SP_NOWARN_END \
+} while (0)
+
+#define SP_END(id, name) \
+do { \
+	SP_NOWARN_BEGIN \
+	if (id != OS_SIGNPOST_ID_NULL) \
+		os_signpost_interval_end(logsp, id, name); \
+	SP_NOWARN_END \
+} while (0)
+
+#define SP_CALL(func, ...) \
+({ \
+	os_signpost_id_t __spid; \
+	SP_BEGIN(__spid, #func); \
+	__typeof__(func(__VA_ARGS__)) __spret = func(__VA_ARGS__); \
+	SP_END(__spid, #func); \
+	__spret; \
+})
+
 /*
  * I guess the API lied; os_log_debug() REALLY can't take a const char *,
  * it has to be a string constant.  Dammit.  End the string in a "%@" to
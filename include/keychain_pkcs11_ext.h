@@ -0,0 +1,115 @@
+/*
+ * Vendor extensions to the PKCS#11 API provided by Keychain-PKCS11
+ */
+
+/*
+ * These functions are not part of the PKCS#11 function list; they are
+ * exported directly from the module, so use dlsym() to find them.  The
+ * function pointer typedefs are here for that purpose.  You need to
+ * include pkcs11.h (or equivalent) before this file.
+ */
+
+#ifndef __KEYCHAIN_PKCS11_EXT_H__
+#define __KEYCHAIN_PKCS11_EXT_H__ 1
+
+/*
+ * C_KeychainSignBatch - Sign many inputs with one C_SignInit()
+ *
+ * Call C_SignInit() as normal, then call this function instead of
+ * C_Sign().  Every input is signed using the key and mechanism from
+ * C_SignInit(); signatures are computed in parallel (subject to the
+ * maxTokenRequests preference).  Only single-part signing is supported.
+ *
+ * Arguments:
+ *
+ * session	- Session handle, with a signing operation initialized.
+ * count	- The number of inputs to sign.
+ * indata	- Array of count pointers to the data to sign.
+ * indatalen	- Array of count input lengths.
+ * sigbuf	- Output buffer for signatures.  Signature "i" is written
+ *		  at sigbuf + i * sigstride.  If NULL, siglen[0] is set to
+ *		  the signature size and the signing operation stays active
+ *		  (just like C_Sign()).
+ * sigstride	- Spacing between signatures in sigbuf.
+ * siglen	- Array of count signature lengths, filled in on return.
+ *		  If a signature failed then its length is set to
+ *		  CK_UNAVAILABLE_INFORMATION.
+ *
+ * If we know the signature size for this mechanism and sigstride is
+ * smaller than that, CKR_BUFFER_TOO_SMALL is returned (with the size in
+ * siglen[0]) and the operation stays active.  Otherwise the signing
+ * operation is finished when this function returns.  The return value is
+ * CKR_OK if every signature succeeded, or the error from the first failure
+ * we saw (CKR_BUFFER_TOO_SMALL if a signature didn't fit in sigstride).
+ */
+
+extern CK_RV C_KeychainSignBatch(CK_SESSION_HANDLE session, CK_ULONG count,
+				 CK_BYTE_PTR *indata, CK_ULONG_PTR indatalen,
+				 CK_BYTE_PTR sigbuf, CK_ULONG sigstride,
+				 CK_ULONG_PTR siglen);
+
+typedef CK_RV (*CK_C_KeychainSignBatch)(CK_SESSION_HANDLE, CK_ULONG,
+					CK_BYTE_PTR *, CK_ULONG_PTR,
+					CK_BYTE_PTR, CK_ULONG, CK_ULONG_PTR);
+
+/*
+ * C_KeychainGetStats - Return performance statistics
+ *
+ * We keep statistics for every PKCS#11 function (and for a few internal
+ * operations, like scanning for certificates and token insertion) from
+ * the time the library is loaded.  This can be called at any time, even
+ * if C_Initialize() hasn't been called.
+ *
+ * Each statistic has a name, a count of calls, a count of calls that
+ * didn't return CKR_OK, the total time spent in microseconds, and a
+ * latency histogram.  Bucket 0 of the histogram counts calls that took
+ * less than 1 microsecond; bucket "n" counts calls that took at least
+ * 2^(n-1) microseconds but less than 2^n microseconds.  The last bucket
+ * counts everything that took longer than that.  We also count the
+ * number of times each error code was returned (by any function).
+ *
+ * Arguments:
+ *
+ * stats	- Array of statistics to fill in.  If NULL, just return the
+ *		  number of statistics in count.
+ * count	- On entry, the number of entries in stats; on return, the
+ *		  number of statistics we have.
+ * errors	- Array of error code counts to fill in.  If NULL, just
+ *		  return the number of error codes in errcount.
+ * errcount	- On entry, the number of entries in errors; on return, the
+ *		  number of different error codes we've seen.
+ *
+ * Returns CKR_BUFFER_TOO_SMALL if either array isn't large enough (the
+ * counts are still set, and as much as fits is filled in).  The names
+ * are static strings, and are valid as long as the library is loaded.
+ */
+
+#define CK_KEYCHAIN_STATS_BUCKETS 24
+
+typedef struct CK_KEYCHAIN_STAT {
+	const char *	name;		/* Function or operation name */
+	CK_ULONG	calls;		/* Number of calls */
+	CK_ULONG	errors;		/* Calls that didn't return CKR_OK */
+	CK_ULONG	total_usec;	/* Total time, in microseconds */
+	CK_ULONG	histogram[CK_KEYCHAIN_STATS_BUCKETS];
+} CK_KEYCHAIN_STAT;
+
+typedef CK_KEYCHAIN_STAT * CK_KEYCHAIN_STAT_PTR;
+
+typedef struct CK_KEYCHAIN_ERROR_STAT {
+	CK_RV		rv;		/* Error code */
+	CK_ULONG	count;		/* Number of times returned */
+} CK_KEYCHAIN_ERROR_STAT;
+
+typedef CK_KEYCHAIN_ERROR_STAT * CK_KEYCHAIN_ERROR_STAT_PTR;
+
+extern CK_RV C_KeychainGetStats(CK_KEYCHAIN_STAT_PTR stats,
+				CK_ULONG_PTR count,
+				CK_KEYCHAIN_ERROR_STAT_PTR errors,
+				CK_ULONG_PTR errcount);
+
+typedef CK_RV (*CK_C_KeychainGetStats)(CK_KEYCHAIN_STAT_PTR, CK_ULONG_PTR,
+				       CK_KEYCHAIN_ERROR_STAT_PTR,
+				       CK_ULONG_PTR);
+
+#endif /* __KEYCHAIN_PKCS11_EXT_H__ */
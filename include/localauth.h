@@ -16,8 +16,10 @@ enum la_keyusage {
 };
 
 void *lacontext_new(void);
+void *lacontext_retain(void *);
 void lacontext_free(void *);
-CK_RV lacontext_auth(void *, unsigned char *, size_t, void *, enum la_keyusage);
+CK_RV lacontext_auth(void *, unsigned char *, size_t, void **,
+		     enum la_keyusage *, unsigned int);
 void lacontext_logout(void *);
 
 #endif /* __LOCALAUTH_H__ */
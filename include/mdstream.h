@@ -0,0 +1,44 @@
+/*
+ * Prototypes for our pipelined message digest streams
+ *
+ * Users of this header file will need to include
+ * <CommonCrypto/CommonCrypto.h> and "ccglue.h" first.
+ */
+
+/*
+ * When an application hashes a lot of data through a multi-part
+ * operation (signing a large file with C_SignUpdate(), say), normally the
+ * hashing happens inside each update call, so the application can't read
+ * the next chunk while we hash the last one.  A digest stream copies the
+ * data for each update into one of a small ring of large buffers, and
+ * each buffer is hashed on a serial dispatch queue once it is full.  The
+ * caller only waits when every buffer is still waiting to be hashed.
+ *
+ * md_stream_update() adds data to a streamed digest; all of the data
+ * between two calls to md_stream_wait() has to go to the same digest
+ * context, and nothing else can touch that context in the meantime.
+ * md_stream_wait() hashes whatever is left in a partly full buffer and
+ * waits until all of the data given to md_stream_update() has been
+ * added to the digest, so after it returns the context can be used
+ * normally (for cc_md_final(), for example).  md_stream_free() waits for
+ * any outstanding work before freeing the stream.
+ *
+ * A stream is not thread-safe; the caller has to make sure only one
+ * thread uses it at a time (sessions do this with the session mutex).
+ * md_stream_new() returns NULL if it can't allocate the buffers.
+ *
+ * Arguments:
+ *
+ * stream	- A digest stream, from md_stream_new().
+ * context	- The digest context to update.
+ * data		- Data to be added to the digest.
+ * len		- Length of data.
+ */
+
+typedef struct _md_stream *md_stream;
+
+extern md_stream md_stream_new(void);
+extern void md_stream_update(md_stream stream, md_context *context,
+			     const unsigned char *data, size_t len);
+extern void md_stream_wait(md_stream stream);
+extern void md_stream_free(md_stream stream);
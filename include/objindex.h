@@ -0,0 +1,52 @@
+/*
+ * Prototypes for our object attribute index
+ */
+
+/*
+ * A simple index that maps an attribute (type and value) to the list of
+ * object handles that contain that attribute.  We only index the
+ * attributes that applications generally use to find objects:
+ * CKA_CLASS, CKA_ID, CKA_LABEL, CKA_SUBJECT, CKA_ISSUER, and
+ * CKA_SERIAL_NUMBER.  Attributes of any other type passed to
+ * objidx_add() are quietly ignored.
+ *
+ * Handles returned by objidx_lookup() are only CANDIDATES; the caller
+ * still needs to compare the full search template against each object.
+ *
+ * If an index has a fill function (set with objidx_defer()), then the
+ * first lookup that uses an attribute type that isn't in the index will
+ * call the fill function to populate a second, deferred index with
+ * objidx_add().  This is used for attributes that are expensive to
+ * compute, so we only pay for them if somebody searches on them.  The
+ * fill function is only ever called once, even with concurrent lookups.
+ *
+ * Arguments:
+ *
+ * index	- Index structure.  Allocated by objidx_create(), freed
+ *		  by objidx_free().
+ * attr		- Attribute to add to the index.
+ * handle	- Object handle that contains this attribute.
+ * template	- A search template, as passed to C_FindObjectsInit().
+ * count	- Number of entries in the search template.
+ * ret_handles	- The returned array of candidate object handles.  Always
+ *		  allocated when objidx_lookup() returns true, must be
+ *		  freed by caller.
+ * ret_count	- The number of entries in ret_handles (can be zero).
+ * fill		- Function to fill in the deferred index.
+ * context	- Argument passed to the fill function.
+ *
+ * objidx_lookup() returns false if no attributes in the template are
+ * indexed; in that case the caller needs to search every object.
+ */
+
+typedef struct _obj_index *obj_index;
+typedef void (*objidx_fill)(obj_index index, void *context);
+
+extern obj_index objidx_create(void);
+extern void objidx_defer(obj_index index, objidx_fill fill, void *context);
+extern void objidx_add(obj_index index, CK_ATTRIBUTE_PTR attr,
+		       CK_OBJECT_HANDLE handle);
+extern bool objidx_lookup(obj_index index, CK_ATTRIBUTE_PTR template,
+			  unsigned int count, CK_OBJECT_HANDLE **ret_handles,
+			  unsigned int *ret_count);
+extern void objidx_free(obj_index index);
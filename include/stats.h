@@ -0,0 +1,50 @@
+/*
+ * Prototypes for our performance statistics
+ */
+
+/*
+ * We keep a call count, an error count, the total time, and a latency
+ * histogram for every PKCS#11 function (and a few internal operations
+ * that take a while, like the certificate scan).  We also count the
+ * number of times each error code is returned.  All of the counters are
+ * atomic, so recording a statistic never takes a lock.  These are
+ * returned to applications by C_KeychainGetStats().
+ *
+ * Time is measured with mach_absolute_time(); stats_start() returns
+ * the starting time to pass to stats_record().
+ *
+ * Arguments:
+ *
+ * stat		- Statistic to record (one of the STAT_ values).
+ * start	- Starting time, from stats_start().
+ * rv		- Return value of the operation.  If this is not CKR_OK,
+ *		  it counts as an error.  Pass in CK_UNAVAILABLE_INFORMATION
+ *		  if we don't know the return value.
+ * stats	- Array to fill in; has room for count entries.
+ * errors	- Array of error counts to fill in; has room for errcount
+ *		  entries.
+ *
+ * stats_get() returns the number of statistics, and sets *errcount to the
+ * number of error codes we've seen (both of which may be larger than the
+ * arrays passed in).  stats_dump() writes all of the statistics to our
+ * log.
+ */
+
+enum stat_id {
+#define CK_PKCS11_FUNCTION_INFO(name) STAT_ ## name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+	STAT_C_KeychainSignBatch,
+	STAT_C_KeychainGetStats,
+	STAT_CERT_SCAN,			/* Certificate slot scan */
+	STAT_TOKEN_INSERT,		/* Token insertion */
+	STAT_COUNT
+};
+
+extern void stats_init(void);
+extern uint64_t stats_start(void);
+extern void stats_record(enum stat_id stat, uint64_t start, CK_RV rv);
+extern unsigned int stats_get(CK_KEYCHAIN_STAT_PTR stats, unsigned int count,
+			      CK_KEYCHAIN_ERROR_STAT_PTR errors,
+			      unsigned int *errcount);
+extern void stats_dump(void);
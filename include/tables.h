@@ -95,6 +95,22 @@ struct param_map {
 extern const struct param_map keychain_param_map[];
 extern const unsigned int keychain_param_map_size;
 
+/*
+ * Fast lookups into the above tables.
+ *
+ * mechmap_init() builds the lookup index; call it before anything else
+ * (it's fine to call it more than once).  mechmap_lookup() returns the
+ * mechanism map entry for a mechanism, or NULL if we don't support it.
+ * mechmap_params() returns the keychain_param_map entries for a mechanism
+ * (and the number of them in count); these are all of the parameter
+ * combinations that mechanism accepts.
+ */
+
+extern void mechmap_init(void);
+extern const struct mechanism_map *mechmap_lookup(CK_MECHANISM_TYPE mech);
+extern const struct param_map *mechmap_params(const struct mechanism_map *mm,
+					      unsigned int *count);
+
 /*
  * Table used for mapping between Cryptoki key types and Security
  * framework key types.  The same rules apply as above; we use pointers
@@ -0,0 +1,226 @@
+/*
+ * A store of interned attribute values, shared by every object.
+ *
+ * This is a chained hash table (just like the object index) keyed on the
+ * contents of the value.  The value itself comes right after the entry
+ * header, so the pointer we hand out is all we need to find the entry
+ * again when it is released.  Values are interned when object lists (and
+ * lazy attributes) are built and released when object lists are freed;
+ * searches only look values up with blob_find(), which never adds
+ * anything.
+ *
+ * The certificate slot is built by a bunch of threads at once, and they
+ * all intern as they go, so the table is split into shards (picked by
+ * the top bits of the hash; the bucket comes from the bottom bits), each
+ * with its own mutex and its own buckets.  Threads only wait on each
+ * other when they hit the same shard at the same time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "blobstore.h"
+
+struct blob {
+	struct blob *	next;			/* Next blob in bucket */
+	uint32_t	hash;			/* Hash of data */
+	unsigned int	refcount;		/* Number of references */
+	size_t		len;			/* Length of data */
+	unsigned char	data[] __attribute__((aligned(16)));
+};
+
+#define BLOB(p) ((struct blob *) ((unsigned char *) (p) - \
+				  offsetof(struct blob, data)))
+
+#define INITIAL_BUCKETS 32		/* Per shard */
+#define SHARD_BITS	4
+#define SHARDS		(1 << SHARD_BITS)
+
+struct shard {
+	pthread_mutex_t	mutex;			/* Lock for this shard */
+	struct blob **	buckets;		/* Hash buckets */
+	unsigned int	nbuckets;		/* Number of buckets */
+	unsigned int	nblobs;			/* Number of blobs */
+} __attribute__((aligned(64)));
+
+static struct shard shards[SHARDS] = {
+	[0 ... SHARDS - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER },
+};
+
+#define SHARD(hash) (&shards[(hash) >> (32 - SHARD_BITS)])
+
+/*
+ * All zero-length values point here
+ */
+
+static struct blob empty_blob;
+
+static uint32_t blob_hash(const unsigned char *, size_t);
+static void blob_grow(struct shard *);
+
+/*
+ * Return the interned copy of a value, adding it if we need to
+ */
+
+const void *
+blob_intern(const void *data, size_t len)
+{
+	struct shard *sh;
+	uint32_t hash;
+	struct blob *b;
+
+	if (len == 0)
+		return empty_blob.data;
+
+	hash = blob_hash(data, len);
+	sh = SHARD(hash);
+
+	pthread_mutex_lock(&sh->mutex);
+
+	if (! sh->buckets) {
+		sh->nbuckets = INITIAL_BUCKETS;
+		sh->buckets = calloc(sh->nbuckets, sizeof(*sh->buckets));
+	}
+
+	for (b = sh->buckets[hash % sh->nbuckets]; b != NULL; b = b->next) {
+		if (b->hash == hash && b->len == len &&
+		    memcmp(b->data, data, len) == 0) {
+			b->refcount++;
+			goto out;
+		}
+	}
+
+	/*
+	 * Grow the shard once the average chain length hits 2
+	 */
+
+	if (sh->nblobs >= sh->nbuckets * 2)
+		blob_grow(sh);
+
+	b = malloc(sizeof(*b) + len);
+	b->hash = hash;
+	b->refcount = 1;
+	b->len = len;
+	memcpy(b->data, data, len);
+
+	b->next = sh->buckets[hash % sh->nbuckets];
+	sh->buckets[hash % sh->nbuckets] = b;
+	sh->nblobs++;
+
+out:
+	pthread_mutex_unlock(&sh->mutex);
+
+	return b->data;
+}
+
+/*
+ * Find the interned copy of a value, if there is one; no reference is
+ * taken, so this is only good for comparing pointers against
+ */
+
+const void *
+blob_find(const void *data, size_t len)
+{
+	struct shard *sh;
+	uint32_t hash;
+	struct blob *b;
+
+	if (len == 0)
+		return empty_blob.data;
+
+	hash = blob_hash(data, len);
+	sh = SHARD(hash);
+
+	pthread_mutex_lock(&sh->mutex);
+
+	for (b = sh->buckets ? sh->buckets[hash % sh->nbuckets] : NULL;
+						b != NULL; b = b->next)
+		if (b->hash == hash && b->len == len &&
+		    memcmp(b->data, data, len) == 0)
+			break;
+
+	pthread_mutex_unlock(&sh->mutex);
+
+	return b ? b->data : NULL;
+}
+
+/*
+ * Drop a reference to an interned value; free it if it was the last one.
+ * We don't ever shrink the table.
+ */
+
+void
+blob_release(const void *blob)
+{
+	struct blob *b, **bp;
+	struct shard *sh;
+
+	if (! blob || blob == empty_blob.data)
+		return;
+
+	b = BLOB(blob);
+	sh = SHARD(b->hash);
+
+	pthread_mutex_lock(&sh->mutex);
+
+	if (--b->refcount > 0) {
+		pthread_mutex_unlock(&sh->mutex);
+		return;
+	}
+
+	for (bp = &sh->buckets[b->hash % sh->nbuckets]; *bp != b;
+						bp = &(*bp)->next)
+		;
+
+	*bp = b->next;
+	sh->nblobs--;
+
+	pthread_mutex_unlock(&sh->mutex);
+
+	free(b);
+}
+
+/*
+ * FNV-1a, same as the object index
+ */
+
+static uint32_t
+blob_hash(const unsigned char *data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Double the number of buckets in a shard (called with its mutex held)
+ */
+
+static void
+blob_grow(struct shard *sh)
+{
+	unsigned int i, newcount = sh->nbuckets * 2;
+	struct blob **newbuckets = calloc(newcount, sizeof(*newbuckets));
+	struct blob *b, *next;
+
+	for (i = 0; i < sh->nbuckets; i++) {
+		for (b = sh->buckets[i]; b != NULL; b = next) {
+			next = b->next;
+			b->next = newbuckets[b->hash % newcount];
+			newbuckets[b->hash % newcount] = b;
+		}
+	}
+
+	free(sh->buckets);
+	sh->buckets = newbuckets;
+	sh->nbuckets = newcount;
+}
@@ -7,14 +7,12 @@
 #include "mypkcs11.h"
 #include "ccglue.h"
 
-struct _md_context {
-	CK_MECHANISM_TYPE	type;
-	union {
-		CC_SHA1_CTX	sha1;
-		CC_SHA256_CTX	sha256;		/* Also used for SHA224 */
-		CC_SHA512_CTX	sha512;		/* Also used for SHA384 */
-	} state;
-};
+/*
+ * The largest piece we hand to a CommonCrypto update function at once
+ * (it has to fit in a CC_LONG); a multiple of every block size.
+ */
+
+#define CC_MD_MAX_UPDATE (1U << 30)
 
 /*
  * Initialize the appropriate digest function and return "false" on error
@@ -23,112 +21,116 @@ struct _md_context {
 bool
 cc_md_init(CK_MECHANISM_TYPE type, md_context *context)
 {
-	md_context ctx = malloc(sizeof(*ctx));
-
-	ctx->type = type;
+	context->type = type;
 
 	switch (type) {
 	case CKM_SHA_1:
-		CC_SHA1_Init(&(ctx->state.sha1));
+		CC_SHA1_Init(&(context->state.sha1));
 		break;
 	case CKM_SHA224:
-		CC_SHA224_Init(&(ctx->state.sha256));
+		CC_SHA224_Init(&(context->state.sha256));
 		break;
 	case CKM_SHA256:
-		CC_SHA256_Init(&(ctx->state.sha256));
+		CC_SHA256_Init(&(context->state.sha256));
 		break;
 	case CKM_SHA384:
-		CC_SHA384_Init(&(ctx->state.sha512));
+		CC_SHA384_Init(&(context->state.sha512));
 		break;
 	case CKM_SHA512:
-		CC_SHA512_Init(&(ctx->state.sha512));
+		CC_SHA512_Init(&(context->state.sha512));
 		break;
 	default:
-		free(ctx);
 		return false;
 	}
 
-	*context = ctx;
 	return true;
 }
 
 /*
- * Update the hash state with new data
+ * Return the output length of a digest, or 0 if we don't know it
  */
 
-void
-cc_md_update(md_context context, const unsigned char *data, unsigned int len)
+unsigned int
+cc_md_len(CK_MECHANISM_TYPE type)
 {
-	switch (context->type) {
+	switch (type) {
 	case CKM_SHA_1:
-		CC_SHA1_Update(&(context->state.sha1), data, len);
-		break;
+		return CC_SHA1_DIGEST_LENGTH;
 	case CKM_SHA224:
-		CC_SHA224_Update(&(context->state.sha256), data, len);
-		break;
+		return CC_SHA224_DIGEST_LENGTH;
 	case CKM_SHA256:
-		CC_SHA256_Update(&(context->state.sha256), data, len);
-		break;
+		return CC_SHA256_DIGEST_LENGTH;
 	case CKM_SHA384:
-		CC_SHA384_Update(&(context->state.sha512), data, len);
-		break;
+		return CC_SHA384_DIGEST_LENGTH;
 	case CKM_SHA512:
-		CC_SHA512_Update(&(context->state.sha512), data, len);
-		break;
+		return CC_SHA512_DIGEST_LENGTH;
+	default:
+		return 0;
 	}
 }
 
 /*
- * Finalize the hash algorithm, return the digest, and then free the
- * digest state
+ * Update the hash state with new data.  The CommonCrypto update functions
+ * only take a 32-bit length, so anything bigger than that is fed in a
+ * piece at a time.
  */
 
 void
-cc_md_final(md_context context, unsigned char **ret_data,
-	    unsigned int *ret_len) 
+cc_md_update(md_context *context, const unsigned char *data, size_t len)
 {
-	unsigned int len;
-	unsigned char *d;
-
-	switch (context->type) {
-	case CKM_SHA_1:
-		len = CC_SHA1_DIGEST_LENGTH;
-		break;
-	case CKM_SHA224:
-		len = CC_SHA224_DIGEST_LENGTH;
-		break;
-	case CKM_SHA256:
-		len = CC_SHA256_DIGEST_LENGTH;
-		break;
-	case CKM_SHA384:
-		len = CC_SHA384_DIGEST_LENGTH;
-		break;
-	case CKM_SHA512:
-		len = CC_SHA512_DIGEST_LENGTH;
-		break;
-	}
+	CC_LONG n;
+
+	do {
+		n = len > CC_MD_MAX_UPDATE ? CC_MD_MAX_UPDATE : (CC_LONG) len;
+
+		switch (context->type) {
+		case CKM_SHA_1:
+			CC_SHA1_Update(&(context->state.sha1), data, n);
+			break;
+		case CKM_SHA224:
+			CC_SHA224_Update(&(context->state.sha256), data, n);
+			break;
+		case CKM_SHA256:
+			CC_SHA256_Update(&(context->state.sha256), data, n);
+			break;
+		case CKM_SHA384:
+			CC_SHA384_Update(&(context->state.sha512), data, n);
+			break;
+		case CKM_SHA512:
+			CC_SHA512_Update(&(context->state.sha512), data, n);
+			break;
+		}
+
+		data += n;
+		len -= n;
+	} while (len > 0);
+}
 
-	d = malloc(len);
+/*
+ * Finalize the hash algorithm and write the digest into the caller's
+ * buffer.  Returns the digest length.
+ */
 
+unsigned int
+cc_md_final(md_context *context, unsigned char *digest)
+{
 	switch (context->type) {
 	case CKM_SHA_1:
-		CC_SHA1_Final(d, &(context->state.sha1));
+		CC_SHA1_Final(digest, &(context->state.sha1));
 		break;
 	case CKM_SHA224:
-		CC_SHA224_Final(d, &(context->state.sha256));
+		CC_SHA224_Final(digest, &(context->state.sha256));
 		break;
 	case CKM_SHA256:
-		CC_SHA256_Final(d, &(context->state.sha256));
+		CC_SHA256_Final(digest, &(context->state.sha256));
 		break;
 	case CKM_SHA384:
-		CC_SHA384_Final(d, &(context->state.sha512));
+		CC_SHA384_Final(digest, &(context->state.sha512));
 		break;
 	case CKM_SHA512:
-		CC_SHA512_Final(d, &(context->state.sha512));
+		CC_SHA512_Final(digest, &(context->state.sha512));
 		break;
 	}
 
-	free(context);
-	*ret_data = d;
-	*ret_len = len;
+	return cc_md_len(context->type);
 }
@@ -0,0 +1,678 @@
+/*
+ * A persistent cache of the Keychain certificate slot objects (and, if
+ * the tokenCache preference is set, of each token's objects).
+ *
+ * The cache file is laid out so we can read it in and use it directly:
+ *
+ *	struct cache_header
+ *	struct cache_fobj	(one per object)
+ *	struct cache_fattr	(all attributes, for all objects)
+ *	attribute values	(each aligned on an 8 byte boundary)
+ *
+ * All offsets are from the start of the file, and all integers are
+ * stored in native byte order (the cache is per-user and per-machine, so
+ * there's no reason to deal with anything else).  We never update a
+ * cache file in place; a new cache is written to a temporary file and
+ * renamed over the old one, so a process that is using the old file is
+ * unaffected.
+ *
+ * Anything running as the user can write to the cache directory, so we
+ * don't trust the file just because it's there.  It has to be a regular
+ * file that belongs to us and that only we can read and write, and the
+ * header carries an HMAC-SHA256 of the whole file (with the HMAC field
+ * zeroed) using a secret key from the Keychain (see certcache_setup()).
+ * We read the file into our own memory rather than mapping it, so it
+ * can't change after we've checked it.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CommonCrypto/CommonCrypto.h>
+
+#include "mypkcs11.h"
+#include "certcache.h"
+#include "ccglue.h"
+#include "keychain_pkcs11.h"
+#include "config.h"
+
+#define CACHE_MAGIC	"KCPKCS11"
+#define CACHE_VERSION	2
+#define CACHE_FILE	"certslot.cache"
+#define CACHE_ALIGN(x)	(((x) + 7) & ~((uint64_t) 7))
+
+struct cache_header {
+	char		magic[8];		/* CACHE_MAGIC */
+	uint32_t	version;		/* CACHE_VERSION */
+	uint32_t	ulong_size;		/* sizeof(CK_ULONG) */
+	unsigned char	key[CERTCACHE_KEYLEN];	/* Cache key */
+	unsigned char	mac[CERTCACHE_MACLEN];	/* HMAC of file */
+	uint64_t	obj_count;		/* Number of objects */
+	uint64_t	file_size;		/* Total file size */
+};
+
+struct cache_fobj {
+	uint64_t	class;			/* Object class */
+	uint64_t	attr_count;		/* Number of attributes */
+	uint64_t	attr_offset;		/* Offset of first attribute */
+};
+
+struct cache_fattr {
+	uint64_t	type;			/* Attribute type */
+	uint64_t	len;			/* Length of value */
+	uint64_t	offset;			/* Offset of value */
+};
+
+struct _cert_cache {
+	unsigned char *		map;		/* File contents */
+	size_t			size;		/* Size of file */
+	struct cache_fobj *	objs;		/* Object array */
+	unsigned int		obj_count;	/* Number of objects */
+};
+
+/*
+ * The files we look at to decide if the Keychain has changed.  Paths
+ * that don't start with a "/" are relative to the user's home directory.
+ */
+
+static const char *keychain_files[] = {
+	"Library/Keychains/login.keychain-db",
+	"Library/Keychains/login.keychain",
+	"/Library/Keychains/System.keychain",
+	"/System/Library/Keychains/SystemRootCertificates.keychain",
+	"/Library/Trust Settings/Admin.plist",
+	NULL
+};
+
+/*
+ * Our HMAC key, and the name of the directory (under our cache directory)
+ * for cache files that use it; see certcache_setup().
+ */
+
+static unsigned char cache_mackey[CERTCACHE_MACLEN];
+static char cache_subdir[17];
+static bool cache_keyed = false;
+
+static const char *home_dir(void);
+static char *cache_path(const char *);
+static bool cache_mkdir(void);
+static bool cache_valid(struct _cert_cache *);
+static bool cache_name_valid(const char *);
+static void cache_mac(const unsigned char *, size_t, unsigned char *);
+
+/*
+ * Generate our cache key; this is a SHA-256 hash over the cache version,
+ * the certificate match strings, and the size/inode/modification time of
+ * the Keychain files.
+ */
+
+void
+certcache_key(char **match, unsigned char *key)
+{
+	const char *home = home_dir();
+	md_context mdc;
+	unsigned char digest[CC_MD_MAX_LEN];
+	unsigned int i, len;
+	uint32_t version = CACHE_VERSION;
+	char path[PATH_MAX];
+	struct stat st;
+
+	memset(key, 0, CERTCACHE_KEYLEN);
+
+	if (! cc_md_init(CKM_SHA256, &mdc))
+		return;
+
+	cc_md_update(&mdc, (unsigned char *) &version, sizeof(version));
+
+	for (i = 0; match && match[i] != NULL; i++)
+		cc_md_update(&mdc, (unsigned char *) match[i],
+			     strlen(match[i]) + 1);
+
+	for (i = 0; keychain_files[i] != NULL; i++) {
+		uint64_t stamp[3] = { 0, 0, 0 };
+
+		if (keychain_files[i][0] == '/')
+			snprintf(path, sizeof(path), "%s", keychain_files[i]);
+		else if (home)
+			snprintf(path, sizeof(path), "%s/%s", home,
+				 keychain_files[i]);
+		else
+			continue;
+
+		if (stat(path, &st) == 0) {
+			stamp[0] = st.st_size;
+			stamp[1] = st.st_ino;
+			stamp[2] = st.st_mtime;
+		}
+
+		cc_md_update(&mdc, (unsigned char *) path, strlen(path) + 1);
+		cc_md_update(&mdc, (unsigned char *) stamp, sizeof(stamp));
+	}
+
+	len = cc_md_final(&mdc, digest);
+
+	memcpy(key, digest, len < CERTCACHE_KEYLEN ? len : CERTCACHE_KEYLEN);
+}
+
+/*
+ * Set the HMAC key for our cache files.  Every process with the same key
+ * should share cache files, and processes with different keys shouldn't
+ * be rewriting each other's files, so the files go in a subdirectory
+ * named after a hash of the key.
+ */
+
+void
+certcache_setup(const unsigned char *mackey)
+{
+	unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+	unsigned int i;
+
+	memcpy(cache_mackey, mackey, CERTCACHE_MACLEN);
+
+	CC_SHA256(mackey, CERTCACHE_MACLEN, digest);
+
+	for (i = 0; i < (sizeof(cache_subdir) - 1) / 2; i++)
+		snprintf(cache_subdir + i * 2, 3, "%02x", digest[i]);
+
+	cache_keyed = true;
+}
+
+/*
+ * Open our certificate slot cache file
+ */
+
+cert_cache
+certcache_open(const unsigned char *key)
+{
+	return certcache_open_named(CACHE_FILE, key);
+}
+
+/*
+ * Open and read in a cache file.  Returns NULL if the cache doesn't
+ * exist, is corrupt, isn't ours, or doesn't match our key or HMAC.
+ */
+
+cert_cache
+certcache_open_named(const char *name, const unsigned char *key)
+{
+	struct _cert_cache *cache;
+	struct cache_header *hdr;
+	unsigned char mac[CERTCACHE_MACLEN];
+	unsigned char *buf;
+	char *path;
+	struct stat st;
+	ssize_t rc;
+	size_t n;
+	int fd;
+
+	if (! cache_name_valid(name) || ! (path = cache_path(name)))
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+
+	if (fd < 0) {
+		os_log_debug(logsys, "Unable to open cache "
+			     "\"%{public}s\": %{darwin.errno}d", path, errno);
+		free(path);
+		return NULL;
+	}
+
+	free(path);
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (! S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+	    (st.st_mode & 07777) != 0600) {
+		os_log_debug(logsys, "Cache %{public}s is not a private "
+			     "file (uid %d, mode %o), ignoring it", name,
+			     (int) st.st_uid, (int) (st.st_mode & 07777));
+		close(fd);
+		return NULL;
+	}
+
+	if (! (buf = malloc(st.st_size))) {
+		close(fd);
+		return NULL;
+	}
+
+	for (n = 0; n < st.st_size; n += rc) {
+		if ((rc = read(fd, buf + n, st.st_size - n)) <= 0) {
+			if (rc < 0 && errno == EINTR) {
+				rc = 0;
+				continue;
+			}
+			os_log_debug(logsys, "Unable to read cache "
+				     "%{public}s: %{darwin.errno}d", name,
+				     rc < 0 ? errno : 0);
+			close(fd);
+			free(buf);
+			return NULL;
+		}
+	}
+
+	close(fd);
+
+	cache = malloc(sizeof(*cache));
+	cache->map = buf;
+	cache->size = st.st_size;
+
+	hdr = (struct cache_header *) cache->map;
+
+	cache_mac(cache->map, cache->size, mac);
+
+	if (timingsafe_bcmp(hdr->mac, mac, CERTCACHE_MACLEN) != 0) {
+		os_log_debug(logsys, "Cache %{public}s HMAC does not match",
+			     name);
+		certcache_close(cache);
+		return NULL;
+	}
+
+	if (memcmp(hdr->key, key, CERTCACHE_KEYLEN) != 0) {
+		os_log_debug(logsys, "Cache %{public}s key does not match",
+			     name);
+		certcache_close(cache);
+		return NULL;
+	}
+
+	if (! cache_valid(cache)) {
+		os_log_debug(logsys, "Cache %{public}s is invalid", name);
+		certcache_close(cache);
+		return NULL;
+	}
+
+	os_log_debug(logsys, "Read cache %{public}s with %u objects",
+		     name, cache->obj_count);
+
+	return cache;
+}
+
+/*
+ * Return the number of objects in the cache
+ */
+
+unsigned int
+certcache_count(cert_cache cache)
+{
+	return cache->obj_count;
+}
+
+/*
+ * Return the class and attribute count for an object
+ */
+
+unsigned int
+certcache_object(cert_cache cache, unsigned int index, CK_OBJECT_CLASS *class)
+{
+	*class = cache->objs[index].class;
+
+	return cache->objs[index].attr_count;
+}
+
+/*
+ * Fill in the attributes for an object.  Values point into our copy of
+ * the file.
+ */
+
+void
+certcache_attrs(cert_cache cache, unsigned int index, CK_ATTRIBUTE_PTR attrs)
+{
+	struct cache_fattr *fa = (struct cache_fattr *)
+				(cache->map + cache->objs[index].attr_offset);
+	unsigned int i;
+
+	for (i = 0; i < cache->objs[index].attr_count; i++) {
+		attrs[i].type = fa[i].type;
+		attrs[i].ulValueLen = fa[i].len;
+		attrs[i].pValue = cache->map + fa[i].offset;
+	}
+}
+
+/*
+ * Return true if the object list is identical to what is in the cache
+ */
+
+bool
+certcache_same(cert_cache cache, struct cache_obj *objs, unsigned int count)
+{
+	unsigned int i, j;
+
+	if (count != cache->obj_count)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		struct cache_fobj *fo = &cache->objs[i];
+		struct cache_fattr *fa = (struct cache_fattr *)
+						(cache->map + fo->attr_offset);
+
+		if (fo->class != objs[i].class ||
+		    fo->attr_count != objs[i].attr_count)
+			return false;
+
+		for (j = 0; j < objs[i].attr_count; j++) {
+			if (fa[j].type != objs[i].attrs[j].type ||
+			    fa[j].len != objs[i].attrs[j].ulValueLen ||
+			    memcmp(cache->map + fa[j].offset,
+				   objs[i].attrs[j].pValue, fa[j].len) != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Write out a new certificate slot cache file
+ */
+
+bool
+certcache_write(const unsigned char *key, struct cache_obj *objs,
+		unsigned int count)
+{
+	return certcache_write_named(CACHE_FILE, key, objs, count);
+}
+
+/*
+ * Write out a new cache file.  We build the whole thing in memory, write
+ * it to a temporary file, then rename it into place.
+ */
+
+bool
+certcache_write_named(const char *name, const unsigned char *key,
+		      struct cache_obj *objs, unsigned int count)
+{
+	struct cache_header *hdr;
+	struct cache_fobj *fo;
+	struct cache_fattr *fa;
+	uint64_t attr_total = 0, size, attroff, valoff;
+	unsigned char *buf, *p;
+	char *path, *tmp;
+	unsigned int i, j;
+	ssize_t rc;
+	bool ret = false;
+	int fd;
+
+	if (! cache_name_valid(name))
+		return false;
+
+	for (i = 0, size = 0; i < count; i++) {
+		attr_total += objs[i].attr_count;
+		for (j = 0; j < objs[i].attr_count; j++)
+			size += CACHE_ALIGN(objs[i].attrs[j].ulValueLen);
+	}
+
+	attroff = sizeof(*hdr) + sizeof(*fo) * count;
+	valoff = attroff + sizeof(*fa) * attr_total;
+	size += valoff;
+
+	buf = calloc(1, size);
+
+	hdr = (struct cache_header *) buf;
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CACHE_VERSION;
+	hdr->ulong_size = sizeof(CK_ULONG);
+	memcpy(hdr->key, key, CERTCACHE_KEYLEN);
+	hdr->obj_count = count;
+	hdr->file_size = size;
+
+	fo = (struct cache_fobj *) (buf + sizeof(*hdr));
+	fa = (struct cache_fattr *) (buf + attroff);
+
+	for (i = 0; i < count; i++) {
+		fo[i].class = objs[i].class;
+		fo[i].attr_count = objs[i].attr_count;
+		fo[i].attr_offset = attroff;
+
+		for (j = 0; j < objs[i].attr_count; j++, fa++) {
+			fa->type = objs[i].attrs[j].type;
+			fa->len = objs[i].attrs[j].ulValueLen;
+			fa->offset = valoff;
+			memcpy(buf + valoff, objs[i].attrs[j].pValue, fa->len);
+			valoff += CACHE_ALIGN(fa->len);
+		}
+
+		attroff += sizeof(*fa) * objs[i].attr_count;
+	}
+
+	cache_mac(buf, size, hdr->mac);
+
+	if (! cache_mkdir() || ! (path = cache_path(name))) {
+		free(buf);
+		return false;
+	}
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		free(path);
+		free(buf);
+		return false;
+	}
+
+	/*
+	 * mkstemp() creates the file mode 0600, which is what
+	 * certcache_open_named() wants to see.
+	 */
+
+	if ((fd = mkstemp(tmp)) < 0) {
+		os_log_debug(logsys, "Unable to create temporary cache file "
+			     "\"%{public}s\": %{darwin.errno}d", tmp, errno);
+		goto out;
+	}
+
+	for (p = buf; p < buf + size; p += rc) {
+		if ((rc = write(fd, p, buf + size - p)) < 0) {
+			if (errno == EINTR) {
+				rc = 0;
+				continue;
+			}
+			os_log_debug(logsys, "Write to cache file failed: "
+				     "%{darwin.errno}d", errno);
+			close(fd);
+			unlink(tmp);
+			goto out;
+		}
+	}
+
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		os_log_debug(logsys, "Unable to rename cache file: "
+			     "%{darwin.errno}d", errno);
+		unlink(tmp);
+		goto out;
+	}
+
+	os_log_debug(logsys, "Wrote %u objects to cache %{public}s", count,
+		     name);
+
+	ret = true;
+
+out:
+	free(tmp);
+	free(path);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Free our cache
+ */
+
+void
+certcache_close(cert_cache cache)
+{
+	if (! cache)
+		return;
+
+	free(cache->map);
+	free(cache);
+}
+
+/*
+ * Return the user's home directory
+ */
+
+static const char *
+home_dir(void)
+{
+	const char *home = getenv("HOME");
+	struct passwd *pw;
+
+	if (home && *home)
+		return home;
+
+	if ((pw = getpwuid(getuid())) != NULL)
+		return pw->pw_dir;
+
+	return NULL;
+}
+
+/*
+ * Return the path to a file in the cache directory for our HMAC key (or
+ * to that directory, if file is NULL).  Must be free()d.  If we don't
+ * have a key, we don't have a cache directory either.
+ */
+
+static char *
+cache_path(const char *file)
+{
+	const char *home = home_dir();
+	char *path;
+	int rc;
+
+	if (! home || ! cache_keyed)
+		return NULL;
+
+	if (file)
+		rc = asprintf(&path, "%s/Library/Caches/%s/%s/%s", home,
+			      APPIDENTIFIER, cache_subdir, file);
+	else
+		rc = asprintf(&path, "%s/Library/Caches/%s/%s", home,
+			      APPIDENTIFIER, cache_subdir);
+
+	return rc < 0 ? NULL : path;
+}
+
+/*
+ * Make sure our cache directory (and the one above it) exists; it's fine
+ * if they already do.
+ */
+
+static bool
+cache_mkdir(void)
+{
+	char *dir, *slash;
+	bool ret = true;
+
+	if (! (dir = cache_path(NULL)))
+		return false;
+
+	slash = strrchr(dir, '/');
+	*slash = '\0';
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		ret = false;
+
+	*slash = '/';
+
+	if (ret && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		ret = false;
+
+	if (! ret)
+		os_log_debug(logsys, "Unable to create cache directory "
+			     "\"%{public}s\": %{darwin.errno}d", dir, errno);
+
+	free(dir);
+
+	return ret;
+}
+
+/*
+ * Compute the HMAC of a cache file; the HMAC field in the header counts
+ * as all zeros.
+ */
+
+static void
+cache_mac(const unsigned char *buf, size_t size, unsigned char *mac)
+{
+	static const unsigned char zero[CERTCACHE_MACLEN];
+	size_t macoff = offsetof(struct cache_header, mac);
+	CCHmacContext ctx;
+
+	CCHmacInit(&ctx, kCCHmacAlgSHA256, cache_mackey, CERTCACHE_MACLEN);
+	CCHmacUpdate(&ctx, buf, macoff);
+	CCHmacUpdate(&ctx, zero, CERTCACHE_MACLEN);
+	CCHmacUpdate(&ctx, buf + macoff + CERTCACHE_MACLEN,
+		     size - macoff - CERTCACHE_MACLEN);
+	CCHmacFinal(&ctx, mac);
+}
+
+/*
+ * Cache names are just a file name in our cache directory; don't let
+ * anyone sneak a path in.
+ */
+
+static bool
+cache_name_valid(const char *name)
+{
+	return name && *name && *name != '.' && strchr(name, '/') == NULL;
+}
+
+/*
+ * Make sure everything in the cache file is sane, and that nothing
+ * points outside of the file.
+ */
+
+static bool
+cache_valid(struct _cert_cache *cache)
+{
+	struct cache_header *hdr = (struct cache_header *) cache->map;
+	uint64_t i, j, objend;
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != CACHE_VERSION ||
+	    hdr->ulong_size != sizeof(CK_ULONG) ||
+	    hdr->file_size != cache->size)
+		return false;
+
+	if (hdr->obj_count > (cache->size - sizeof(*hdr)) /
+						sizeof(struct cache_fobj))
+		return false;
+
+	cache->objs = (struct cache_fobj *) (cache->map + sizeof(*hdr));
+	cache->obj_count = hdr->obj_count;
+	objend = sizeof(*hdr) + hdr->obj_count * sizeof(struct cache_fobj);
+
+	for (i = 0; i < hdr->obj_count; i++) {
+		struct cache_fobj *fo = &cache->objs[i];
+		struct cache_fattr *fa;
+
+		if (fo->attr_offset < objend || fo->attr_offset % 8 != 0 ||
+		    fo->attr_offset > cache->size ||
+		    fo->attr_count > (cache->size - fo->attr_offset) /
+						sizeof(struct cache_fattr))
+			return false;
+
+		fa = (struct cache_fattr *) (cache->map + fo->attr_offset);
+
+		for (j = 0; j < fo->attr_count; j++)
+			if (fa[j].offset > cache->size ||
+			    fa[j].len > cache->size - fa[j].offset)
+				return false;
+	}
+
+	return true;
+}
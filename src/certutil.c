@@ -4,20 +4,12 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <Security/Security.h>
-#include <Security/SecCertificate.h>
-#include <Security/SecCertificateOIDs.h>
-#include <Security/SecAsn1Coder.h>
-#include <Security/SecAsn1Templates.h>
-#include <Security/SecDigestTransform.h>
 
 #include "certutil.h"
 #include "keychain_pkcs11.h"
 #include "config.h"
 
 /*
- * These are the arrays we need to feed into the Security framework
- * DER decoder so we can extract out the information we need.
- *
  * It turns out that we can't use the Security framework functions like
  * SecCertificateCopyNormalizedSubjectSequence(), because THOSE return
  * "normalized" DER sequence (hence the name) which are really designed
@@ -29,212 +21,183 @@
  * doesn't match the ACTUAL subject, the certificate will never be selected
  * as valid client certificates.
  *
- * I spun my wheels for a while on the problem; I thought about parsing the
- * ASN.1 sequence by hand (ugh) or constructing the encoded name based
- * on info returned by SecCertificateCopyValues (that doesn't preserve the
- * string information).  But then I realized that the Security framework
- * decoder routines could stash the DER encoded Name in a buffer, and
- * that seemed the more robust solution.  It was just a pain to figure out
- * how the DER routines work.
+ * We used to use the Security framework ASN.1 decoder (SecAsn1Decode())
+ * to save the raw DER bytes of the fields we wanted.  That works fine,
+ * but it meant creating a decoder, running a full template decode, and
+ * then copying everything into new CFData objects for every single
+ * certificate, and then decoding the certificate again (in a different
+ * way) to see if it was a CA.  For the certificate slot that was most of
+ * the time we spent on each certificate.  So now I parse the ASN.1 by
+ * hand after all (ugh).  But DER is simple enough if all you want to do
+ * is walk it: everything is a tag, a length, and then the contents.  We
+ * make a single pass over the certificate and just record where the
+ * fields we care about are; nothing is allocated and nothing is copied.
+ *
+ * We only handle what DER allows (definite lengths) and single byte tags
+ * (none of the fields we look at need anything else).  Every length is
+ * checked against the end of the enclosing element, so a garbage
+ * certificate gets us a failure rather than a crash.
  */
 
+#define DER_BOOLEAN		0x01
+#define DER_INTEGER		0x02
+#define DER_BIT_STRING		0x03
+#define DER_OCTET_STRING	0x04
+#define DER_OID			0x06
+#define DER_SEQUENCE		0x30
+#define DER_SET			0x31
+#define DER_CONTEXT(n)		(0xa0 | (n))	/* Constructed, context tag */
+
 /*
- * Our ASN.1 template array; each entry in the template corresponds to
- * another field in the ASN.1 structure.
- *
- * Since all we care about is the issuer and subject, we skip the actual
- * decoding of most fields with SEC_ASN1_SKIP.  The version is a bit weird,
- * so we have to specify the explict tag and use kSecAsn1SkipTemplate.
- *
- * Using SEC_ASN1_SAVE saves the raw DER bytes into a SecAsn1Item structure.
- * But because of the way the ASN.1 decoder works, you need to still run it
- * through the parser, so you need the SEC_ASN1_SKIP after SEC_ASN1_SAVE.
- * SEC_ASN1_SKIP_REST terminates the decoding immediately.
- *
- * The fields of SecAsn1Template are, in order:
- *
- * kind		- The tag of this field.  We use SEQUENCE to indicate the start
- *		  of a new sequence, SKIP to skip over this field (this will
- *		  prevent any data from being decoded/saved) and SAVE (which
- *		  saves the raw DER bytes without decoding).
- * offset	- Offset into the passed-in structure to store this data.
- * sub		- A sub-template for nested structures; we don't use this
- *		  (except for the version, because it was the easiest way
- *		  to make it work).
- * size		- For some cases (SEC_ASN1_GROUP, SEC_ASN1_INLINE, and a few
- *		  others) the ASN.1 decoder can allocate a sub-structure for
- *		  you; this is how big it would be.
- *
- * We don't do much verification of the fields of the certificate, but I
- * figure that the Security framework probably wouldn't have it available
- * if it was unparseable.
+ * One element of DER: the element as a whole (tag and length included)
+ * and just the contents.
  */
 
-struct certinfo {
-	SecAsn1Item	serialnumber;	/* Certificate serial number */
-	SecAsn1Item	issuer;		/* Certificate issuer */
-	SecAsn1Item	subject;	/* Certificate subject */
+struct der_elem {
+	unsigned int		tag;		/* Tag byte */
+	const unsigned char *	start;		/* Start of the element */
+	size_t			len;		/* Total length */
+	const unsigned char *	data;		/* Start of the contents */
+	size_t			datalen;	/* Length of the contents */
 };
 
 /*
- * This is where the magic happens!  Basically a description of an X.509
- * certificate, with most of the fields skipped
+ * The encoded OIDs we look for
  */
 
-static const SecAsn1Template cert_template[] = {
-	{ SEC_ASN1_SEQUENCE, 0, NULL, 0 },	/* Certificate sequence */
-	{ SEC_ASN1_SEQUENCE, 0, NULL, 0 },	/* TBCertificate sequence */
-	{ SEC_ASN1_EXPLICIT | SEC_ASN1_OPTIONAL | SEC_ASN1_CONSTRUCTED |
-		SEC_ASN1_CONTEXT_SPECIFIC | 0, 0, kSecAsn1SkipTemplate, 0 },
-					/* Version (explicit tag 0) */
-	{ SEC_ASN1_SAVE, offsetof(struct certinfo, serialnumber), NULL, 0 },
-	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* CertificateSerialNumber */
-	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* AlgorithmIdentifier */
-	{ SEC_ASN1_SAVE, offsetof(struct certinfo, issuer), NULL, 0 },
-	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Issuer */
-	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Validity */
-	{ SEC_ASN1_SAVE, offsetof(struct certinfo, subject), NULL, 0 },
-	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Subject */
-	{ SEC_ASN1_SKIP_REST, 0, NULL, 0 },	/* Stop decoding here */
-	{ 0, 0, NULL, 0 }		/* Dunno if needed, but just in case */
-};
+static const unsigned char cn_oid[] = { 0x55, 0x04, 0x03 };	/* 2.5.4.3 */
+static const unsigned char bc_oid[] = { 0x55, 0x1d, 0x13 };	/* 2.5.29.19 */
+static const unsigned char rsa_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d,
+					 0x01, 0x01, 0x01 };
+						/* 1.2.840.113549.1.1.1 */
+
+#define OID_EQUAL(e, oid) ((e)->datalen == sizeof(oid) && \
+			   memcmp((e)->data, oid, sizeof(oid)) == 0)
+
+static bool der_next(const unsigned char **, const unsigned char *,
+		     struct der_elem *);
+static bool der_expect(const unsigned char **, const unsigned char *,
+		       unsigned int, struct der_elem *);
+static bool parse_name_cn(const unsigned char *, size_t,
+			  const unsigned char **, size_t *);
+static bool parse_rsa_spki(const struct der_elem *, const unsigned char *,
+			   struct cert_parts *);
+static void parse_extensions(const struct der_elem *, struct cert_parts *);
+
+#define SLICE(slice, base, ptr, length) \
+do { \
+	(slice).offset = (ptr) - (base); \
+	(slice).len = (length); \
+} while (0)
+
+#define SLICE_ELEM(slice, base, e) SLICE(slice, base, (e)->start, (e)->len)
 
 /*
- * More code to extract out the common name from an DER-encoded Name
- * field; we need this for dumping out things like a CKA_ISSUER when it
- * is passed down in FindObject search parameters
- *
- * A Name is a (ignoring first CHOICE, which is invisible to us):
- *
- * SEQUENCE OF RelativeDistinguisedNames
+ * Walk the certificate and find all of the pieces we need.  The X.509
+ * structure we care about is:
  *
- * RelativeDistinguishedNames are a SET OF ATVs (Attribute Type and Values)
+ * Certificate ::= SEQUENCE {
+ *	tbsCertificate		SEQUENCE {
+ *		version		[0] EXPLICIT INTEGER OPTIONAL,
+ *		serialNumber	INTEGER,
+ *		signature	AlgorithmIdentifier,
+ *		issuer		Name,
+ *		validity	SEQUENCE,
+ *		subject		Name,
+ *		subjectPublicKeyInfo SEQUENCE,
+ *		issuerUniqueID	[1] IMPLICIT BIT STRING OPTIONAL,
+ *		subjectUniqueID	[2] IMPLICIT BIT STRING OPTIONAL,
+ *		extensions	[3] EXPLICIT SEQUENCE OF Extension OPTIONAL
+ *	}
+ *	... (signature stuff we don't care about)
+ * }
  *
- * ATVs are a SEQUENCE { OID, VALUE } where VALUE is a CHOICE of String types.
+ * Only the required fields have to parse for this to succeed; if the
+ * extensions or the subject common name are garbled they are just
+ * treated as missing.
  */
 
-struct atv {
-	SecAsn1Oid	oid;	/* AttributeType */
-	SecAsn1Item	value;	/* AttributeValue */
-};
+bool
+cert_parse(const unsigned char *der, size_t len, struct cert_parts *parts)
+{
+	const unsigned char *p = der, *end = der + len, *tbsend;
+	struct der_elem e;
+	const unsigned char *cn;
+	size_t cnlen;
 
-struct rdn {
-	struct atv	**atvs;	/* AttributeTypeAndValue */
-};
+	memset(parts, 0, sizeof(*parts));
 
-struct name {
-	struct rdn	**rdns;	/* RelativeDistinguishedName */
-};
+	if (! der_expect(&p, end, DER_SEQUENCE, &e))
+		goto bad;
 
-static const SecAsn1Template atv_template[] = {
-	{ SEC_ASN1_SEQUENCE, 0, NULL, sizeof(struct atv) },
-	{ SEC_ASN1_OBJECT_ID, offsetof(struct atv, oid), NULL, 0 },
-	{ SEC_ASN1_ANY_CONTENTS, offsetof(struct atv, value), NULL, 0 },
-	{ 0, 0, NULL, 0 },
-};
+	p = e.data;
+	end = e.data + e.datalen;
 
-static const SecAsn1Template rdn_template[] = {
-	{ SEC_ASN1_SET_OF, offsetof(struct rdn, atvs), atv_template,
-							sizeof(struct rdn) },
-};
+	if (! der_expect(&p, end, DER_SEQUENCE, &e))
+		goto bad;
 
-/*
- * We probably don't need the sizeof(struct name) at the end of this one,
- * but we included it in case we ever nest it in something else
- */
+	p = e.data;
+	tbsend = e.data + e.datalen;
 
-static const SecAsn1Template name_template[] = {
-	{ SEC_ASN1_SEQUENCE_OF, offsetof(struct name, rdns), rdn_template,
-						sizeof(struct name) },
-};
+	if (! der_next(&p, tbsend, &e))
+		goto bad;
 
-/*
- * The encoded OID for a commonName
- */
+	/*
+	 * Version is optional (v1 certificates don't have it)
+	 */
 
-static const unsigned char cn_oid[] = { 0x55, 0x04, 0x03 };	/* 2.5.4.3 */
+	if (e.tag == DER_CONTEXT(0) && ! der_next(&p, tbsend, &e))
+		goto bad;
 
-/*
- * A decoding template to extract the modulus and public exponent from
- * RSAPublicKey encoded data.  Again, we don't need the size in the first
- * template marking the sequence, but we include it just in case we embed
- * that in something else later.
- *
- * A RSAPublicKey is a SEQUENCE of
- *
- * INTEGER (modulus)
- * INTEGER (publicExponent)
- */
+	if (e.tag != DER_INTEGER)
+		goto bad;
 
-struct rsa_pubkey {
-	SecAsn1Item	modulus;
-	SecAsn1Item	public_exponent;
-};
+	SLICE_ELEM(parts->serial, der, &e);
 
-static const SecAsn1Template rsapubkey_template[] = {
-	{ SEC_ASN1_SEQUENCE, 0, NULL, sizeof(struct rsa_pubkey) },
-	{ SEC_ASN1_INTEGER, offsetof(struct rsa_pubkey, modulus), NULL, 0 },
-	{ SEC_ASN1_INTEGER, offsetof(struct rsa_pubkey, public_exponent),
-								NULL, 0 },
-	{ 0, 0, NULL, 0 },
-};
+	if (! der_expect(&p, tbsend, DER_SEQUENCE, &e))	/* signature */
+		goto bad;
 
-/*
- * Extract out the DER-encoded certificate subject
- */
+	if (! der_expect(&p, tbsend, DER_SEQUENCE, &e))
+		goto bad;
 
-bool
-get_certificate_info(CFDataRef certdata, CFDataRef *serialnumber,
-		     CFDataRef *issuer, CFDataRef *subject)
-{
-	SecAsn1CoderRef coder;
-	struct certinfo cinfo;
-	OSStatus ret;
+	SLICE_ELEM(parts->issuer, der, &e);
 
-	/*
-	 * We have to allocate a SecAsn1CoderRef before we call the decoder
-	 * function; when we free it, it will release all of the allocated
-	 * memory from the ASN.1 decoder, so make sure we copied everything.
-	 */
+	if (! der_expect(&p, tbsend, DER_SEQUENCE, &e))	/* validity */
+		goto bad;
 
-	ret = SecAsn1CoderCreate(&coder);
+	if (! der_expect(&p, tbsend, DER_SEQUENCE, &e))
+		goto bad;
 
-	if (ret) {
-		LOG_SEC_ERR("SecAsn1CreateCoder failed: %{public}@", ret);
-		return false;
-	}
-
-	memset(&cinfo, 0, sizeof(cinfo));
+	SLICE_ELEM(parts->subject, der, &e);
 
-	/*
-	 * Perform the actual decoding, based on our template.  The
-	 * DER bytes should end up in our cinfo structure.
-	 */
+	if (parse_name_cn(e.start, e.len, &cn, &cnlen))
+		SLICE(parts->cn, der, cn, cnlen);
 
-	ret = SecAsn1Decode(coder, CFDataGetBytePtr(certdata),
-			    CFDataGetLength(certdata), cert_template, &cinfo);
+	if (! der_expect(&p, tbsend, DER_SEQUENCE, &e))
+		goto bad;
 
-	if (ret) {
-		SecAsn1CoderRelease(coder);
-		LOG_SEC_ERR("SecAsn1Decode failed: %{public}@", ret);
-		return false;
-	}
+	SLICE_ELEM(parts->spki, der, &e);
+	parse_rsa_spki(&e, der, parts);
 
 	/*
-	 * Looks like it all worked!  Return those in CFData structures
+	 * Everything else is optional; skip the unique IDs and look for
+	 * extensions.
 	 */
 
-	*serialnumber = CFDataCreate(kCFAllocatorDefault,
-				     cinfo.serialnumber.Data,
-				     cinfo.serialnumber.Length);
-	*issuer = CFDataCreate(kCFAllocatorDefault, cinfo.issuer.Data,
-			       cinfo.issuer.Length);
-	*subject = CFDataCreate(kCFAllocatorDefault, cinfo.subject.Data,
-				cinfo.subject.Length);
-
-	SecAsn1CoderRelease(coder);
+	while (p < tbsend && der_next(&p, tbsend, &e)) {
+		if (e.tag == DER_CONTEXT(3)) {
+			parse_extensions(&e, parts);
+			break;
+		}
+	}
 
 	return true;
+
+bad:
+	os_log_debug(logsys, "Unable to parse certificate DER (%lu bytes)",
+		     (unsigned long) len);
+	memset(parts, 0, sizeof(*parts));
+	return false;
 }
 
 /*
@@ -244,272 +207,264 @@ get_certificate_info(CFDataRef certdata, CFDataRef *serialnumber,
 char *
 get_common_name(unsigned char *name, unsigned int namelen)
 {
-	SecAsn1CoderRef coder = NULL;
-	struct name cname;
-	OSStatus ret;
-	int i, j;
+	const unsigned char *cn;
+	size_t cnlen;
 	char *str;
 
-	ret = SecAsn1CoderCreate(&coder);
+	if (! parse_name_cn(name, namelen, &cn, &cnlen))
+		return strdup("No Common Name Found");
 
-	if (ret) {
-		LOG_SEC_ERR("SecAsn1CreateCoder failed: %{public}@", ret);
-		str = strdup("Unknown Name");
-		goto out;
-	}
+	str = malloc(cnlen + 1);
+	memcpy(str, cn, cnlen);
+	str[cnlen] = '\0';
+
+	return str;
+}
+
+/*
+ * Return the next DER element starting at *p (and move *p past it)
+ */
 
-	memset(&cname, 0, sizeof(cname));
+static bool
+der_next(const unsigned char **p, const unsigned char *end,
+	 struct der_elem *e)
+{
+	const unsigned char *q = *p;
+	size_t len;
+	unsigned int i, n;
 
-	ret = SecAsn1Decode(coder, name, namelen, name_template, &cname);
+	if (end - q < 2)
+		return false;
 
-	if (ret) {
-		LOG_SEC_ERR("SecAsn1Decode failed: %{public}@", ret);
-		str = strdup("Unparsable Name");
-		goto out;
-	}
+	e->start = q;
+	e->tag = *q++;
 
 	/*
-	 * Look through each rdns/atv for the first common name we find
+	 * High tag numbers are multi-byte tags; none of the stuff we look
+	 * at uses them, so just fail.
 	 */
 
-	for (i = 0; cname.rdns[i] != NULL; i++) {
-		struct rdn *rdn = cname.rdns[i];
+	if ((e->tag & 0x1f) == 0x1f)
+		return false;
 
-		for (j = 0; rdn->atvs[j] != NULL; j++) {
-			struct atv *atv = rdn->atvs[j];
+	len = *q++;
 
-			if (atv->oid.Length == sizeof(cn_oid) &&
-			    memcmp(atv->oid.Data, cn_oid,
-				   sizeof(cn_oid)) == 0) {
-				/*
-				 * A match!
-				 */
+	if (len & 0x80) {
+		n = len & 0x7f;
 
-				size_t len = atv->value.Length;
+		/*
+		 * 0x80 is an indefinite length, which isn't DER.  And nothing
+		 * in a certificate is more than 4 gigabytes.
+		 */
 
-				str = malloc(len + 1);
+		if (n == 0 || n > 4 || end - q < n)
+			return false;
 
-				strncpy(str, (char *) atv->value.Data, len);
-				str[len] = '\0';
-				goto out;
-			}
-		}
+		for (i = 0, len = 0; i < n; i++)
+			len = (len << 8) | *q++;
 	}
 
-	str = strdup("No Common Name Found");
+	if (len > (size_t) (end - q))
+		return false;
+
+	e->data = q;
+	e->datalen = len;
+	e->len = (q - e->start) + len;
 
-out:
-	if (coder)
-		SecAsn1CoderRelease(coder);
+	*p = q + len;
 
-	return str;
+	return true;
 }
 
 /*
- * Extract out the modulus and public exponent from a RSAPublicKey
+ * Like der_next(), but the element has to have a particular tag
  */
 
-bool
-get_pubkey_info(CFDataRef pubkeydata, CFDataRef *modulus, CFDataRef *exponent)
+static bool
+der_expect(const unsigned char **p, const unsigned char *end,
+	   unsigned int tag, struct der_elem *e)
 {
-	SecAsn1CoderRef coder = NULL;
-	struct rsa_pubkey pubkey;
-	OSStatus ret;
+	return der_next(p, end, e) && e->tag == tag;
+}
 
-	ret = SecAsn1CoderCreate(&coder);
+/*
+ * Find the contents of the first commonName in a Name.  A Name is (ignoring
+ * the first CHOICE, which is invisible to us):
+ *
+ * SEQUENCE OF RelativeDistinguisedNames
+ *
+ * RelativeDistinguishedNames are a SET OF ATVs (Attribute Type and Values)
+ *
+ * ATVs are a SEQUENCE { OID, VALUE } where VALUE is a CHOICE of String types.
+ */
 
-	if (ret) {
-		LOG_SEC_ERR("SecAsn1CreateCoder failed: %{public}@", ret);
+static bool
+parse_name_cn(const unsigned char *name, size_t namelen,
+	      const unsigned char **cn, size_t *cnlen)
+{
+	const unsigned char *p = name, *end = name + namelen, *rp, *ap;
+	struct der_elem seq, rdn, atv, oid, value;
+
+	if (! der_expect(&p, end, DER_SEQUENCE, &seq))
 		return false;
-	}
 
-	memset(&pubkey, 0, sizeof(pubkey));
+	p = seq.data;
+	end = seq.data + seq.datalen;
 
-	ret = SecAsn1Decode(coder, CFDataGetBytePtr(pubkeydata),
-			    CFDataGetLength(pubkeydata),
-			    rsapubkey_template, &pubkey);
+	while (p < end) {
+		if (! der_expect(&p, end, DER_SET, &rdn))
+			return false;
 
-	if (ret) {
-		SecAsn1CoderRelease(coder);
-		LOG_SEC_ERR("SecAsn1Decode failed: %{public}@", ret);
-		return false;
-	}
+		for (rp = rdn.data; rp < rdn.data + rdn.datalen; ) {
+			if (! der_expect(&rp, rdn.data + rdn.datalen,
+					 DER_SEQUENCE, &atv))
+				return false;
 
-	/*
-	 * Looks like it all worked!  Return those in CFData structures
-	 */
+			ap = atv.data;
 
-	*modulus = CFDataCreate(kCFAllocatorDefault, pubkey.modulus.Data,
-				pubkey.modulus.Length);
+			if (! der_expect(&ap, atv.data + atv.datalen,
+					 DER_OID, &oid))
+				return false;
 
-	*exponent = CFDataCreate(kCFAllocatorDefault,
-				 pubkey.public_exponent.Data,
-				 pubkey.public_exponent.Length);
+			if (! OID_EQUAL(&oid, cn_oid))
+				continue;
 
-	SecAsn1CoderRelease(coder);
+			if (! der_next(&ap, atv.data + atv.datalen, &value))
+				return false;
 
-	return true;
+			*cn = value.data;
+			*cnlen = value.datalen;
+			return true;
+		}
+	}
+
+	return false;
 }
 
 /*
- * Return 'true' if the given certificate is a CA.
+ * If this SubjectPublicKeyInfo is an RSA key, find the modulus and public
+ * exponent.
  *
- * The following things have to be true for a cert to be a CA:
+ * SubjectPublicKeyInfo ::= SEQUENCE {
+ *	algorithm		SEQUENCE { OID, parameters },
+ *	subjectPublicKey	BIT STRING
+ * }
  *
- * - It has to have a Basic Constraints section (OID - 2.5.29.19)
- * - It has to have the cA boolean field set to TRUE
+ * And for RSA keys, the BIT STRING (after the "unused bits" byte) is:
  *
- * Because right now we are only dealing with SecCertificateRefs, we
- * can get away with not having to parse the ASN.1 ourselves.  Just call
- * SecCertificateCopyValues() with the correct OIDs.
+ * RSAPublicKey ::= SEQUENCE {
+ *	modulus			INTEGER,
+ *	publicExponent		INTEGER
+ * }
  */
 
-bool
-is_cert_ca(SecCertificateRef cert)
+static bool
+parse_rsa_spki(const struct der_elem *spki, const unsigned char *der,
+	       struct cert_parts *parts)
 {
-	CFDictionaryRef mdict = NULL, valdict;
-	CFArrayRef query = NULL, valarray;
-	CFErrorRef err = NULL;
-	CFTypeRef result;
-	bool is_ca = false;
-	CFIndex i;
+	const unsigned char *p = spki->data, *end = spki->data + spki->datalen;
+	const unsigned char *q;
+	struct der_elem alg, oid, bits, key, mod, exp;
 
-	/*
-	 * Create a (single) array with our Basic Constraints OID.
-	 */
+	if (! der_expect(&p, end, DER_SEQUENCE, &alg))
+		return false;
 
-	const void *keys[] = {
-		kSecOIDBasicConstraints,
-	};
+	q = alg.data;
 
-	query = CFArrayCreate(kCFAllocatorDefault, keys,
-			      sizeof(keys)/sizeof(keys[0]),
-			      &kCFTypeArrayCallBacks);
+	if (! der_expect(&q, alg.data + alg.datalen, DER_OID, &oid) ||
+	    ! OID_EQUAL(&oid, rsa_oid))
+		return false;
 
-	if (! query) {
-		os_log_debug(logsys, "Unable to create cert query array");
-		goto out;
-	}
+	if (! der_expect(&p, end, DER_BIT_STRING, &bits) ||
+	    bits.datalen < 1 || bits.data[0] != 0)
+		return false;
 
-	mdict = SecCertificateCopyValues(cert, query, &err);
+	q = bits.data + 1;
+	end = bits.data + bits.datalen;
 
-	/*
-	 * The dictionary should always be returned, even if it is empty;
-	 * report an error if it is not.
-	 */
+	if (! der_expect(&q, end, DER_SEQUENCE, &key))
+		return false;
 
-	if (! mdict) {
-		os_log_debug(logsys, "SecCertificateCopyValues failed: "
-			     "%{public}@", err);
-		goto out;
-	}
+	q = key.data;
+	end = key.data + key.datalen;
 
-	/*
-	 * Make sure that our key exists in the dictionary; if it does
-	 * not we can exit early (NULL is not valid for this entry).
-	 */
+	if (! der_expect(&q, end, DER_INTEGER, &mod) ||
+	    ! der_expect(&q, end, DER_INTEGER, &exp))
+		return false;
 
-	valdict = CFDictionaryGetValue(mdict, kSecOIDBasicConstraints);
+	SLICE(parts->modulus, der, mod.data, mod.datalen);
+	SLICE(parts->exponent, der, exp.data, exp.datalen);
 
-	if (! valdict)
-		goto out;
+	return true;
+}
 
-	/*
-	 * The TYPE should be a "section" (which should mean an array).
-	 * Make sure that is correct.
-	 */
+/*
+ * Look through the extensions for Basic Constraints, and see if the cA
+ * flag is set.  For a cert to be a CA:
+ *
+ * - It has to have a Basic Constraints section (OID - 2.5.29.19)
+ * - It has to have the cA boolean field set to TRUE
+ *
+ * Extension ::= SEQUENCE {
+ *	extnID			OID,
+ *	critical		BOOLEAN DEFAULT FALSE,
+ *	extnValue		OCTET STRING
+ * }
+ *
+ * BasicConstraints ::= SEQUENCE {
+ *	cA			BOOLEAN DEFAULT FALSE,
+ *	pathLenConstraint	INTEGER OPTIONAL
+ * }
+ */
 
-	result = CFDictionaryGetValue(valdict, kSecPropertyKeyType);
+static void
+parse_extensions(const struct der_elem *exts, struct cert_parts *parts)
+{
+	const unsigned char *p = exts->data, *end = exts->data + exts->datalen;
+	const unsigned char *q, *extend;
+	struct der_elem seq, ext, oid, value, bc, ca;
 
-	if (! result) {
-		os_log_debug(logsys, "Unable to find kSecPropertyKeyType "
-			     "in certificate dictionary");
-		goto out;
-	}
+	if (! der_expect(&p, end, DER_SEQUENCE, &seq))
+		return;
 
-	if (! CFEqual(result, kSecPropertyTypeSection)) {
-		os_log_debug(logsys, "Expected a value of TypeSection, but "
-			     "instead got: %{public}@", result);
-		goto out;
-	}
+	p = seq.data;
+	end = seq.data + seq.datalen;
 
-	valarray = CFDictionaryGetValue(valdict, kSecPropertyKeyValue);
+	while (p < end) {
+		if (! der_expect(&p, end, DER_SEQUENCE, &ext))
+			return;
 
-	if (! valarray) {
-		os_log_debug(logsys, "Unable to retrieve value for "
-			     "Basic Constraints extenstion");
-		goto out;
-	}
+		q = ext.data;
+		extend = ext.data + ext.datalen;
 
-	if (CFGetTypeID(valarray) != CFArrayGetTypeID()) {
-		logtype("Was expecting a CFArray for Basic Constraints, "
-			"but got", valarray);
-		goto out;
-	}
+		if (! der_expect(&q, extend, DER_OID, &oid))
+			return;
 
-	/*
-	 * Iterate through the list of array elements until we hit one
-	 * that has the label, "Certificate Authority".
-	 */
+		if (! OID_EQUAL(&oid, bc_oid))
+			continue;
 
-	for (i = 0; i < CFArrayGetCount(valarray); i++) {
-		valdict = CFArrayGetValueAtIndex(valarray, i);
+		if (! der_next(&q, extend, &value))
+			return;
 
-		if (CFGetTypeID(valdict) != CFDictionaryGetTypeID()) {
-			logtype("Was expecting CFDict for Basic Constraints "
-				"element, but got", valdict);
-			continue;
-		}
+		if (value.tag == DER_BOOLEAN && ! der_next(&q, extend, &value))
+			return;
 
-		result = CFDictionaryGetValue(valdict, kSecPropertyKeyLabel);
+		if (value.tag != DER_OCTET_STRING)
+			return;
 
-		if (! result) {
-			os_log_debug(logsys, "Cannot find label for Basic "
-				     "Constraints array element");
-			continue;
-		}
+		q = value.data;
 
-		if (CFStringCompare(result, CFSTR("Certificate Authority"),
-				    kCFCompareCaseInsensitive) ==
-							kCFCompareEqualTo) {
-			/*
-			 * This is the cA Boolean field.  I guess the way
-			 * this works is that if it is true, it is set to
-			 * the string "Yes" ... so I guess we'll go with that?
-			 * At least do a case insensitive match.
-			 */
-
-			result = CFDictionaryGetValue(valdict,
-						      kSecPropertyKeyValue);
-
-			if (! result) {
-				os_log_debug(logsys, "Unable to find value "
-					     "for cA boolean");
-				goto out;
-			}
-
-			if (CFGetTypeID(result) != CFStringGetTypeID()) {
-				logtype("Expected a CFString, but got", result);
-				goto out;
-			}
-
-			if (CFStringCompare(result, CFSTR("Yes"),
-					    kCFCompareCaseInsensitive) ==
-							kCFCompareEqualTo) {
-				is_ca = true;
-			}
+		if (! der_expect(&q, value.data + value.datalen, DER_SEQUENCE,
+				 &bc))
+			return;
 
-			break;
-		}
-	}
+		q = bc.data;
 
-out:
-	if (query)
-		CFRelease(query);
-	if (mdict)
-		CFRelease(mdict);
-	if (err)
-		CFRelease(err);
+		if (bc.datalen > 0 &&
+		    der_expect(&q, bc.data + bc.datalen, DER_BOOLEAN, &ca) &&
+		    ca.datalen == 1 && ca.data[0] != 0)
+			parts->is_ca = true;
 
-	return is_ca;
+		return;
+	}
 }
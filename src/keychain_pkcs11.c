@@ -29,20 +29,29 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <Security/Security.h>
 #include <dispatch/dispatch.h>
+#include <CommonCrypto/CommonCrypto.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 #include <stdatomic.h>
 
 #include "mypkcs11.h"
 #include "keychain_pkcs11.h"
+#include "keychain_pkcs11_ext.h"
 #include "tokenwatcher.h"
 #include "localauth.h"
 #include "certutil.h"
 #include "ccglue.h"
+#include "mdstream.h"
+#include "objindex.h"
+#include "blobstore.h"
+#include "certcache.h"
+#include "stats.h"
 #include "debug.h"
 #include "tables.h"
 #include "config.h"
@@ -59,21 +68,24 @@
  * Return CKR_SLOT_ID_INVALID if we aren't using a valid slot or we aren't
  * given CERTIFICATE_SLOT.
  *
- * Note: must be called with slot_mutex locked.
+ * Note: "st" is the slot table reference from slot_table_get(); we drop
+ * it if we return an error.
  */
 
-#define CHECKSLOT(slot, present) \
+#define CHECKSLOT(st, slot, present) \
 do { \
-	if (slot != CERTIFICATE_SLOT && slot >= slot_count) { \
+	if (slot != CERTIFICATE_SLOT && slot >= st->count) { \
 		os_log_debug(logsys, "Slot %lu is invalid, returning " \
 			     "CKR_SLOT_ID_INVALID", slot); \
-		UNLOCK_MUTEX(slot_mutex); \
+		slot_table_put(st); \
+		ENTRYRV(CKR_SLOT_ID_INVALID); \
 		return CKR_SLOT_ID_INVALID; \
 	} \
 	if (slot == CERTIFICATE_SLOT && ! cert_slot_enabled) { \
 		os_log_debug(logsys, "Requested cert slot (%lu) but is " \
 			     "disabled, returning CKR_SLOT_ID_INVALID", slot); \
-		UNLOCK_MUTEX(slot_mutex); \
+		slot_table_put(st); \
+		ENTRYRV(CKR_SLOT_ID_INVALID); \
 		return CKR_SLOT_ID_INVALID; \
 	} \
 	if (present) { \
@@ -83,16 +95,18 @@ do { \
 					     "slot, but certificate list " \
 					     "not initialized yet, returning" \
 					     " CKR_TOKEN_NOT_PRESENT"); \
-				UNLOCK_MUTEX(slot_mutex); \
+				slot_table_put(st); \
+				ENTRYRV(CKR_TOKEN_NOT_PRESENT); \
 				return CKR_TOKEN_NOT_PRESENT; \
 			} \
 		} else { \
-			if (slot_list[slot] == NULL) { \
+			if (st->slots[slot] == NULL) { \
 				os_log_debug(logsys, "Requested token slot " \
 					     "but no token present, " \
 					     "returning " \
 					     "CKR_TOKEN_NOT_PRESENT"); \
-				UNLOCK_MUTEX(slot_mutex); \
+				slot_table_put(st); \
+				ENTRYRV(CKR_TOKEN_NOT_PRESENT); \
 				return CKR_TOKEN_NOT_PRESENT; \
 			} \
 		} \
@@ -149,12 +163,15 @@ do { \
 #define LOCK_MUTEX(mutex) \
 do { \
 	int rc; \
+	os_signpost_id_t spid; \
 	if (use_mutex) { \
+		SP_BEGIN(spid, "LOCK_MUTEX(" #mutex ")"); \
 		if (lockmutex) { \
 			rc = (*lockmutex)(&mutex.ck); \
 		} else { \
 			rc = pthread_mutex_lock(&mutex.pt); \
 		} \
+		SP_END(spid, "LOCK_MUTEX(" #mutex ")"); \
 		if (rc) { \
 			os_log_debug(logsys, "lock_mutex returned %d", rc); \
 		} \
@@ -203,34 +220,146 @@ struct slot_entry {
 	struct id_info ** 	id_list;	/* Array of slot identities */
 	unsigned int		id_count;	/* Array count */
 	unsigned int		id_size;	/* Array size */
-	struct obj_info *	obj_list;	/* Object list */
-	unsigned int		obj_count;	/* Object count */
-	unsigned int		obj_size;	/* Object array size */
+	struct obj_set *	objs;		/* Token objects */
 	bool			logged_in;	/* Are we logged into card? */
 	char *			label;		/* Slot label */
 	void *			lacontext; 	/* LocalAuth context */
 	kc_mutex		entry_mutex;	/* Lock for slot entry */
 	unsigned int		refcount;	/* Slot reference count */
+	dispatch_semaphore_t	op_sem;		/* Limit on concurrent ops */
+	bool			removed;	/* Token has been removed */
+	CK_MECHANISM_TYPE *	mech_list;	/* Token mechanism list */
+	unsigned int		mech_count;	/* Mechanism list count */
+	CK_MECHANISM_INFO *	mech_info;	/* Info, by mechmap index */
+	atomic_bool		bound;		/* Identities resolved? */
+	kc_mutex		bind_mutex;	/* Lock for token_bind() */
+	CFTypeRef		id_result;	/* Identity attributes, for
+						   token_bind() */
+};
+
+/*
+ * The slot list itself is an immutable snapshot.  Everything that just
+ * wants to look at the slots (C_GetSlotList(), C_GetTokenInfo(),
+ * CHECKSLOT, and so on) gets a reference to the current table with
+ * slot_table_get() and drops it with slot_table_put(); nobody ever holds
+ * a lock while looking at a table, so readers never wait for each other
+ * or for a token insertion.  slot_table_lock is only held long enough to
+ * load the table pointer and bump its reference count.
+ *
+ * Changing the slot list (adding or removing a token) is done with
+ * slot_mutex held, which only keeps writers from running at the same
+ * time.  The writer makes a copy of the current table, changes the copy,
+ * and publishes it with slot_table_publish().
+ *
+ * The current table owns one reference to each entry in it (that is the
+ * "1" in slot_entry.refcount; sessions hold the rest).  When a token is
+ * removed that reference moves to the table we replaced ("retired"), so
+ * the entry lives as long as someone might still be looking at a table
+ * with it in it.  Each table also holds a reference to the table that
+ * replaced it, so tables are always freed oldest first; that means once
+ * a table is freed, no older table can still be pointing at its retired
+ * entry.
+ */
+
+struct slot_table {
+	atomic_uint		refcount;	/* Table reference count */
+	struct slot_table *	next;		/* Table that replaced us */
+	struct slot_entry *	retired;	/* Entry to free with us */
+	unsigned int		count;		/* Number of slots */
+	struct slot_entry *	slots[];	/* Slots (NULL if empty) */
 };
 
 /* These should get filled in at library start-up time */
-static struct slot_entry **slot_list = NULL;
-static unsigned int slot_count = 0;
+static struct slot_table *slot_table = NULL;
+static pthread_mutex_t slot_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slot_table *slot_table_get(void);
+static void slot_table_put(struct slot_table *);
+static struct slot_table *slot_table_copy(struct slot_table *, unsigned int);
+static void slot_table_publish(struct slot_table *, struct slot_entry *);
 static void slot_entry_free(struct slot_entry *, bool);
+static void slot_entry_destroy(struct slot_entry *);
+
+/*
+ * Normally all of the tokens that are already inserted get added inside
+ * of C_Initialize() (see tokenwatcher.m), which can take a while.  With
+ * the asyncTokenScan preference set, that happens on a background queue
+ * instead, so C_Initialize() returns right away; entry points that need
+ * to look at the slots call slot_table_wait() rather than
+ * slot_table_get(), which waits (for up to TOKEN_SCAN_WAIT seconds) for
+ * that first scan to finish.  Applications that never look at a slot
+ * never wait at all.  If we time out once we don't wait again; if the
+ * scan is stuck, we don't want every call to take another ten seconds.
+ */
+
+#define TOKEN_SCAN_WAIT 10
+static dispatch_group_t token_scan_group = NULL;
+static atomic_bool token_scan_done = ATOMIC_VAR_INIT(true);
+static atomic_bool token_scan_timedout = ATOMIC_VAR_INIT(false);
+static struct slot_table *slot_table_wait(void);
+static void token_scan(void *);
+
+/*
+ * When a token is removed we keep the last few slot entries around (once
+ * nobody is using them) so if the same card comes back we don't have to
+ * redo all of the work to build the identities and objects.  People pull
+ * out and put back their CAC all day long.  A snapshot only holds public
+ * information; the identity and private key references (and the
+ * LAContext) are thrown away when the snapshot is saved, and replaced
+ * with new ones when the snapshot is reused.  The list is kept in most
+ * recently used order.
+ */
+
+#define TOKEN_SNAPSHOTS 4
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct slot_entry *token_snapshots[TOKEN_SNAPSHOTS];
+static unsigned int snapshot_count = 0;
+static bool snapshots_enabled = false;		/* Cleared by C_Finalize() */
+static bool token_snapshot_save(struct slot_entry *);
+static struct slot_entry *token_snapshot_find(CFStringRef, CFTypeRef,
+					      unsigned int, struct id_info **);
+static void token_snapshot_flush(void);
+
+/*
+ * Our slot event queue, used by C_WaitForSlotEvent().  Token insertion
+ * and removal add the slot ID to the queue; a slot is only queued once
+ * no matter how many events happened, since all PKCS#11 says is that
+ * "an event occurred" in that slot.  This has its own pthread mutex and
+ * condition variable because we can't wait on an application-supplied
+ * mutex.
+ */
+
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static CK_SLOT_ID *event_queue = NULL;		/* Slots with events */
+static unsigned int event_count = 0;		/* Queue count */
+static unsigned int event_size = 0;		/* Queue array size */
+static unsigned int event_waiters = 0;		/* Threads waiting */
+static bool event_shutdown = false;		/* C_Finalize() called */
+static void slot_event(CK_SLOT_ID);
+static void slot_event_shutdown(void);
 
 /*
  * Our list of identities that is stored on our smartcard
  */
 
+#define ID_FPRINT_LEN CC_SHA256_DIGEST_LENGTH	/* identity_fingerprint() */
+
 struct id_info {
 	SecIdentityRef		ident;		/* Identity reference */
 	SecCertificateRef	cert;		/* Identity certificate */
 	SecKeyRef		privkey;	/* Identity private key */
 	SecKeyRef		pubkey;		/* Identity public key */
+	SecKeyRef		hostkey;	/* Local copy of pubkey */
+	dispatch_once_t		hostkey_once;	/* hostkey has been built */
+	pthread_mutex_t		warm_mutex;	/* Lock for warm-up */
+	atomic_bool		warmed;		/* key_warmup() has run */
+	size_t			privsize;	/* Private key block size */
 	CFDataRef		pkeyhash;	/* Public key hash */
 	CK_KEY_TYPE		keytype;	/* Key type */
 	SecAccessControlRef	secaccess;	/* Access control reference */
 	char *			label;		/* Printable label for id */
+	char *			keylabel;	/* Private key label, if known */
+	unsigned char		fprint[ID_FPRINT_LEN]; /* Fingerprint */
 	bool			privcansign;	/* Can privkey sign data? */
 	bool			privcandecrypt;	/* Can privkey decrypt? */
 	bool			pubcanverify;	/* Can pubkey verify? */
@@ -240,8 +369,107 @@ struct id_info {
 
 static bool ask_pin = false;			/* Should we ask for a PIN? */
 
-static int add_identity(struct slot_entry *, CFDictionaryRef);
-static SecAccessControlRef getaccesscontrol(CFDictionaryRef);
+/*
+ * Public key operations don't need the token at all, so by default we
+ * make a local copy of each public key (out of its external
+ * representation) the first time it is used, and do verification and
+ * encryption with that.  Set by the "hostPublicKey" preference.
+ */
+
+static bool host_pubkey = true;
+static SecKeyRef id_pubkey(struct id_info *, SecKeyOperationType,
+			   SecKeyAlgorithm, SecKeyAlgorithm);
+static void hostkey_create(void *);
+
+/*
+ * The first private key operation after a login has to set up the
+ * connection to the token extension and find the key on the token,
+ * which is a very noticeable delay (the first TLS handshake is the usual
+ * victim).  If the "keyWarmup" preference is set, C_Login() kicks off
+ * token_warmup() in the background to do that work for every identity
+ * ahead of time.  None of what it does needs the PIN, so it can't cause
+ * a prompt; the PIN credential itself is already kept in the token's
+ * LAContext until logout, and the warm-up holds a token reference so
+ * that can't go away underneath it.  Anyone who needs a private key
+ * before the warm-up gets to it just does the same work themselves (see
+ * id_privsize()).
+ *
+ * Whether a key has been warmed up is a flag in the identity rather than
+ * a dispatch_once_t, because when a token snapshot drops its private
+ * keys (see token_snapshot_save()) it has to go back to cold.  The flag
+ * and the private key are protected by warm_mutex, which is a plain
+ * pthread mutex since warm-ups always happen on our own threads.
+ */
+
+static bool key_warmup_enabled = false;
+static dispatch_group_t warmup_group = NULL;
+static void token_warmup(void *);
+static void warmup_identity(void *, size_t);
+static void id_warm(struct id_info *);
+static void key_warmup(struct id_info *);
+static bool token_logged_in(struct slot_entry *);
+static size_t id_privsize(struct id_info *);
+
+/*
+ * The maximum number of private key operations we allow to be in flight
+ * to a single token at once (across all sessions).  Operations on a
+ * smartcard all end up going through ctkd and the card itself, so
+ * letting every thread in a busy application hit it at once doesn't
+ * buy us anything.  Set by the "maxTokenRequests" preference; zero
+ * means no limit.
+ */
+
+#define DEFAULT_TOKEN_REQUESTS 4
+static int max_token_requests = DEFAULT_TOKEN_REQUESTS;
+static void token_op_begin(struct slot_entry *);
+static void token_op_end(struct slot_entry *);
+
+/*
+ * What we need to resolve a token's identities in parallel
+ */
+
+struct id_scan {
+	struct slot_entry *	token;		/* Token we're adding */
+	void *			lacontext;	/* LocalAuth context to use */
+	CFTypeRef		result;		/* Identity attribute list */
+	CFDictionaryRef		keys;		/* Private key attributes */
+	struct id_info **	ids;		/* Resolved identities */
+};
+
+/*
+ * With the tokenCache preference set, the objects we build for a token
+ * are also written out to a cache file of their own (see certcache.h),
+ * keyed on the token identifier and the identity fingerprints.  When a
+ * process sees the same card, it maps that file and uses the object list
+ * as is.  Everything public about the identities can be recovered from
+ * the objects themselves, so on a cache hit we don't look at the
+ * identities at all; the identity and private key references and the
+ * access control for each key stay NULL until token_bind() is called,
+ * which is the first time someone logs in or uses a private key.
+ * Cache files are written to a temporary file and renamed into place,
+ * so processes sharing them never need a lock.
+ */
+
+#define TOKEN_CACHE_VERSION 1
+#define TOKEN_CACHE_NAMELEN 32
+static bool token_cache_enabled = false;
+static bool load_token_cache(struct slot_entry *, CFTypeRef, unsigned int);
+static void write_token_cache(struct slot_entry *);
+static void token_cache_key(CFStringRef, const unsigned char *, unsigned int,
+			    char *, unsigned char *);
+static bool token_bind(struct slot_entry *);
+static bool token_bind_with(struct slot_entry *, void *);
+static void bind_identity(void *, size_t);
+
+static struct id_info *add_identity(struct slot_entry *, CFDictionaryRef,
+				     CFDictionaryRef);
+static CFDictionaryRef token_key_attrs(CFStringRef);
+static SecIdentityRef copy_identity(CFDictionaryRef, void *);
+static void resolve_identity(void *, size_t);
+static bool token_snapshot_rebind(struct slot_entry *, struct id_scan *);
+static void rebind_identity(void *, size_t);
+static void identity_fingerprint(CFDictionaryRef, unsigned char *);
+static SecAccessControlRef getaccesscontrol(CFDictionaryRef, CFDictionaryRef);
 static unsigned int cflistcount(CFTypeRef);	/* Count of list entries */
 static CFDictionaryRef cfgetindex(CFTypeRef, unsigned int);/* Entry in list */
 static void id_info_free(struct id_info *);
@@ -250,7 +478,6 @@ static CK_KEY_TYPE convert_keytype(CFNumberRef);
 static void token_logout(struct slot_entry *);
 static void get_index_bytes(unsigned int, unsigned char **, unsigned int *);
 static bool add_dict(CFMutableDictionaryRef *, const void *, const void *);
-static const struct mechanism_map *get_mechmap(CK_MECHANISM_TYPE);
 static bool mech_param_validate(CK_MECHANISM_PTR, const struct mechanism_map *,
 				SecKeyAlgorithm *, SecKeyAlgorithm *,
 				SecKeyAlgorithm *, CK_MECHANISM_TYPE *);
@@ -276,8 +503,31 @@ static bool mech_param_validate(CK_MECHANISM_PTR, const struct mechanism_map *,
  *
  * Since the object list contains pointers into the id list, we are using
  * the id mutex to lock the object list as well.
+ *
+ * Attributes (both the CK_ATTRIBUTE array for each object and the
+ * attribute values) are all allocated out of a single arena for each
+ * object list, so freeing an object list is just releasing the arena.
+ * Once an object is complete the attribute array is sorted by type, so
+ * find_attribute() can do a binary search.
+ *
+ * Some attributes are expensive to generate (they require copying out
+ * the certificate DER and decoding it, or exporting the public key) and
+ * most applications never look at most of them.  So those are "lazy"
+ * attributes; the "lazy" field has a bit for each group of attributes
+ * this object will have, and the first time someone asks for one of
+ * them (via find_attribute()) we create the whole group and keep it in
+ * lazy_attrs.  That happens under dispatch_once_f() since object lists
+ * are shared between sessions.  The lazy attributes are a single malloc()
+ * block per object, since the arena isn't thread-safe.
  */
 
+struct attr_block {
+	struct attr_block *	next;		/* Next block in arena */
+	size_t			used;		/* Bytes used in this block */
+	size_t			size;		/* Size of data[] */
+	unsigned char		data[];		/* Attribute storage */
+};
+
 struct obj_info {
 	struct id_info *	id;
 	/* unsigned char		id_value[sizeof(CK_ULONG)]; */
@@ -285,14 +535,74 @@ struct obj_info {
 	CK_ATTRIBUTE_PTR	attrs;
 	unsigned int		attr_count;
 	unsigned int		attr_size;
+	unsigned int		lazy;		/* LAZY_* groups */
+	SecCertificateRef	cert;		/* Cert (if no identity) */
+	dispatch_once_t		lazy_once;	/* Lazy attributes built */
+	CK_ATTRIBUTE_PTR	lazy_attrs;	/* Lazy attributes */
+	unsigned int		lazy_count;	/* Count of lazy attributes */
+	bool			interned;	/* attrs values are interned */
+};
+
+#define LAZY_CERT	0x01	/* CKA_VALUE, SUBJECT, ISSUER, SERIAL_NUMBER */
+#define LAZY_SUBJECT	0x02	/* CKA_SUBJECT */
+#define LAZY_KEY	0x04	/* CKA_MODULUS, CKA_PUBLIC_EXPONENT */
+#define LAZY_TRUST	0x08	/* CKA_ISSUER, SERIAL_NUMBER, CERT_SHA1_HASH,
+				   and the CKA_TRUST_* attributes */
+#define LAZY_MAX_ATTRS	8	/* Maximum attributes from lazy groups */
+
+/*
+ * When a certificate goes away, a refresh of the certificate slot leaves
+ * its objects in place (so every other object keeps the same handle) but
+ * with no attributes at all.  Every real object has at least CKA_CLASS.
+ */
+
+#define OBJ_REMOVED(obj) ((obj)->attr_count == 0 && ! (obj)->lazy)
+
+/*
+ * A complete object list for a token (or the certificate slot).  Once an
+ * object set is built it never changes (other than lazy attributes, which
+ * are thread-safe), so anyone holding a reference can read it without
+ * any locks.  Sessions take a reference when they are opened, so when a
+ * token is removed or the certificate objects are replaced, sessions that
+ * still have the old set just keep using it until they are closed.  The
+ * version is just to tell sets apart in the logs.
+ */
+
+struct obj_set {
+	atomic_uint		refcount;	/* Reference count */
+	unsigned int		version;	/* Object set version */
+	struct obj_info *	list;		/* Object list */
+	unsigned int		count;		/* Object count */
+	unsigned int		size;		/* Object array size */
+	struct attr_block *	arena;		/* Attribute storage */
+	obj_index		idx;		/* Attribute index */
+	cert_cache		cache;		/* Cache contents, if any */
 };
 
+static struct obj_set *obj_set_new(struct obj_info *, unsigned int,
+				   unsigned int, struct attr_block *);
+static struct obj_set *obj_set_get(struct obj_set *);
+static void obj_set_put(struct obj_set *);
+static void obj_set_index_fill(obj_index, void *);
+
 #define LOG_DEBUG_OBJECT(obj, se) \
-	os_log_debug(logsys, "Object %lu (%s)", obj, \
-		     getCKOName(se->obj_list[obj].class));
+	LOG_VERBOSE("Object %lu (%s)", obj, \
+		    getCKOName(se->obj_list[obj].class))
 
 static void build_id_objects(struct slot_entry *);
-static void obj_free(struct obj_info **, unsigned int *, unsigned int *);
+static void build_mech_list(struct slot_entry *);
+static void obj_free(struct obj_info **, unsigned int *, unsigned int *,
+		     struct attr_block **);
+static void obj_seal(struct obj_info *, unsigned int, struct attr_block **);
+static void obj_copy(struct obj_info *, struct obj_info *);
+static void obj_remove(struct obj_info *);
+static void *arena_alloc(struct attr_block **, size_t);
+static void arena_free(struct attr_block **);
+static obj_index build_obj_index(struct obj_info *, unsigned int);
+static void index_lazy_attrs(obj_index, struct obj_info *, unsigned int);
+static unsigned int lazy_group(CK_ATTRIBUTE_TYPE);
+static void obj_materialize(void *);
+static CK_ATTRIBUTE_PTR obj_all_attrs(struct obj_info *, unsigned int *);
 
 #if 0
 static struct obj_info *id_obj_list = NULL;	/* Identity object list */
@@ -332,16 +642,15 @@ static unsigned int id_obj_size = 0;		/* Size of identity obj_list */
  */
 
 enum s_state { NO_PENDING, E_INIT, E_UPDATE, D_INIT, D_UPDATE, S_INIT,
-               S_UPDATE, V_INIT, V_UPDATE };
+               S_UPDATE, V_INIT, V_UPDATE, DG_INIT, DG_UPDATE };
 
 /*
  * Our session information.  Anything that modifies a session will need to
- * lock that particular session.  We keep an array of pointers to sessions
- * available; if we need more then reallocate the array.
+ * lock that particular session.  Sessions live in a handle table (see
+ * below); looking up a session handle doesn't take any locks.
  *
- * Note that "sess_mutex" is for locking the overall session array,
- * but each session also has a mutex.  Sigh.  Is this overkill?  I have
- * no idea.
+ * Note that "sess_mutex" is only used when adding or removing sessions
+ * from the handle table, but each session also has a mutex.
  *
  * SecKeyAlgorithms are currently constant CFStringRef so we shouldn't
  * have to worry about maintaing references to it using CFRetain/CFRelease().
@@ -349,13 +658,21 @@ enum s_state { NO_PENDING, E_INIT, E_UPDATE, D_INIT, D_UPDATE, S_INIT,
 
 struct session {
 	kc_mutex 	mutex;			/* Session mutex */
+	atomic_uint	refcount;		/* Session reference count */
 	CK_SLOT_ID	slot_id;		/* Slot identifier */
 	struct slot_entry *token;		/* Token pointer */
-	struct obj_info *obj_list;		/* Pointer to object list */
-	unsigned int	obj_list_count;		/* Copy of object count */
+	_Atomic(struct obj_set *) objs;		/* Our object set reference */
+	struct obj_set	*old_objs;		/* Set we switched from, if any */
+	atomic_uint	objs_readers;		/* Unlocked readers of objs */
+	struct obj_info *obj_list;		/* Copy of objs->list */
+	unsigned int	obj_list_count;		/* Copy of objs->count */
+	obj_index	obj_idx;		/* Copy of objs->idx */
 	unsigned int	obj_search_index;	/* Current search index */
 	CK_ATTRIBUTE_PTR search_attrs;		/* Search attributes */
+	const void **	search_blobs;		/* Interned search values */
 	unsigned int	search_attrs_count;	/* Search attribute count */
+	CK_OBJECT_HANDLE *search_list;		/* Candidate objects, if any */
+	unsigned int	search_list_count;	/* Candidate object count */
 	enum s_state	state;			/* Session operation state */
 	SecKeyRef	key;			/* Key for in-progress op */
 	size_t		outsize;		/* Op output size, 0 unknown */
@@ -363,12 +680,97 @@ struct session {
 	SecKeyAlgorithm dalg;			/* Algorithm, takes digest */
 	CK_MECHANISM_TYPE hash_alg;		/* Hash algorithm */
 	md_context	mdc;			/* Message digest context */
+	md_stream	mdstream;		/* Pipelined digest, if any */
+	bool		streaming;		/* mdc is being streamed */
+	enum s_state	digest_state;		/* C_Digest* operation state */
+	CK_MECHANISM_TYPE digest_alg;		/* C_Digest* algorithm */
+	md_context	digest_mdc;		/* C_Digest* context */
 };
 
-static struct session **sess_list = NULL;	/* Yes, array of pointers */
-static unsigned int sess_list_count = 0;
-static unsigned int sess_list_size = 0;
 static void sess_free(struct session *);
+static void sess_objs_update(struct session *);
+static CFDataRef input_cfdata(const unsigned char *, CK_ULONG);
+static void input_allocator_init(void *);
+static void *input_alloc(CFIndex, CFOptionFlags, void *);
+static void *input_realloc(void *, CFIndex, CFOptionFlags, void *);
+static void input_dealloc(void *, void *);
+static int input_slot(void *);
+
+/*
+ * Multi-part signature and verification operations hash the data
+ * themselves.  For large updates (signing a big file, say) we hash in the
+ * background with a digest stream (see mdstream.h), so the application
+ * can read the next chunk while we hash the last one.  A session gets a
+ * stream the first time an update is at least STREAM_MIN_UPDATE bytes,
+ * and once an operation has started streaming the rest of its updates
+ * are streamed too, so everything is hashed in order.  Small updates
+ * aren't worth copying; they are hashed right away.  This can be turned
+ * off with the "hashStreaming" preference.
+ */
+
+#define STREAM_MIN_UPDATE (256 * 1024)
+static bool hash_streaming = true;
+static void sess_md_update(struct session *, CK_BYTE_PTR, CK_ULONG);
+static void sess_md_wait(struct session *);
+
+/*
+ * Our session handle table.
+ *
+ * The table is made up of fixed-size chunks of slots; chunks are only
+ * ever added (and only released in C_Finalize()), so a slot never moves
+ * once it exists and readers can look up a handle without a lock.
+ *
+ * A session handle encodes both the slot index (plus one, since handles
+ * can't be zero) in the low bits and the slot generation in the next 16
+ * bits.  Every time a session is closed the generation for that slot is
+ * bumped, so a stale handle for a reused slot will no longer match.
+ *
+ * Free slots are kept on a freelist so opening and closing a session
+ * doesn't require a search.  Changes to the freelist (which only happen
+ * in C_OpenSession() and when closing sessions) are protected by
+ * sess_mutex.
+ *
+ * When removing a session we bump the generation BEFORE clearing the
+ * session pointer, and readers load the session pointer BEFORE the
+ * generation; that means a reader can never pair an old handle with a
+ * new session.
+ *
+ * Since lookups don't take a lock, a session can be closed by another
+ * thread while someone is still using it.  So sessions are reference
+ * counted: the table owns one reference, and sess_lookup() gives the
+ * caller another one (CHECKSESSION hands it to entry_end(), which drops
+ * it when the function returns).  The session is freed when the last
+ * reference goes away.  That leaves the window between loading the
+ * session pointer and taking the reference; each slot counts the
+ * lookups that are in that window, and sess_remove() waits for them to
+ * finish before the table's reference can be dropped.
+ */
+
+#define SESS_INDEX_BITS	16
+#define SESS_INDEX_MASK	((1UL << SESS_INDEX_BITS) - 1)
+#define SESS_GEN_MASK	0xffffU
+#define SESS_CHUNK	64
+#define SESS_MAX_CHUNKS	(SESS_INDEX_MASK / SESS_CHUNK)
+#define SESS_NO_FREE	(~0U)
+
+struct sess_slot {
+	_Atomic(struct session *) sess;		/* Session, NULL if free */
+	_Atomic unsigned int	gen;		/* Slot generation */
+	_Atomic unsigned int	readers;	/* Lookups in progress */
+	unsigned int		next_free;	/* Next free slot index */
+};
+
+static _Atomic(struct sess_slot *) sess_chunks[SESS_MAX_CHUNKS];
+static unsigned int sess_chunk_count = 0;	/* Allocated chunks */
+static unsigned int sess_free_head = SESS_NO_FREE; /* Freelist head */
+
+static struct sess_slot *sess_slot_get(unsigned int);
+static struct session *sess_lookup(CK_SESSION_HANDLE);
+static void sess_put(struct session *);
+static CK_SESSION_HANDLE sess_insert(struct session *);
+static struct session *sess_remove(CK_SESSION_HANDLE);
+static CK_SESSION_HANDLE sess_handle(unsigned int, struct sess_slot *);
+static void sess_table_free(void);
 
 /*
  * Return CKR_SESSION_HANDLE_INVALID if we don't have a valid session
@@ -377,24 +779,25 @@ static void sess_free(struct session *);
 
 #define CHECKSESSION(session, var) \
 do { \
-	LOCK_MUTEX(sess_mutex); \
-	session--; \
-	if (session >= sess_list_count || sess_list[session] == NULL) { \
+	if ((var = sess_lookup(session)) == NULL) { \
 		os_log_debug(logsys, "Session handle %lu is invalid, " \
 			     "returning CKR_SESSION_HANDLE_INVALID", session); \
-		UNLOCK_MUTEX(sess_mutex); \
+		ENTRYRV(CKR_SESSION_HANDLE_INVALID); \
 		return CKR_SESSION_HANDLE_INVALID; \
 	} \
-	var = sess_list[session]; \
-	UNLOCK_MUTEX(sess_mutex); \
+	__entry.se = var; \
 } while (0)
 
 /*
  * Our attribute list used for searching
  */
 
-static bool search_object(struct obj_info *, CK_ATTRIBUTE_PTR, unsigned int);
+static bool search_object(struct obj_info *, CK_ATTRIBUTE_PTR, const void **,
+			  unsigned int);
 static CK_ATTRIBUTE_PTR find_attribute(struct obj_info *, CK_ATTRIBUTE_TYPE);
+static CK_ATTRIBUTE_PTR attr_bsearch(CK_ATTRIBUTE_PTR, unsigned int,
+				     CK_ATTRIBUTE_TYPE);
+static struct id_info *cached_identity(struct obj_info *, CFDictionaryRef);
 static void dump_attribute(const char *, CK_ATTRIBUTE_PTR);
 
 /*
@@ -414,9 +817,29 @@ enum certstate { uninitialized, initializing, initialized };
 _Atomic static enum certstate cert_list_status = ATOMIC_VAR_INIT(uninitialized);
 static bool cert_slot_enabled = false;
 
-static struct obj_info *cert_obj_list = NULL;	/* Cert object list */
-static unsigned int cert_obj_count = 0;		/* Cert object list count */
-static unsigned int cert_obj_size = 0;		/* Size of identity obj_list */
+static struct obj_set *cert_objs = NULL;	/* Cert slot objects */
+static pthread_mutex_t cert_objs_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool cert_cache_enabled = true;		/* Use cert cache? */
+static dispatch_queue_t cert_queue;		/* Cert scan queue */
+static dispatch_once_t cert_queue_init;
+static dispatch_once_t cache_init;
+static bool cache_keyed = false;
+static bool cert_refresh_enabled = true;	/* Watch for changes? */
+static atomic_bool cert_refresh_pending = ATOMIC_VAR_INIT(false);
+static bool cert_watching = false;		/* Keychain callback added */
+static bool cert_watch_wanted = false;		/* Should it be? */
+static pthread_mutex_t cert_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Keychain changes tend to come in bunches (importing a CA and setting
+ * its trust is several events), so wait this long after the first one
+ * before we rescan.
+ */
+
+#define CERT_REFRESH_DELAY	2	/* seconds */
+
+static struct obj_set *cert_objs_get(void);
+static void cert_objs_publish(struct obj_set *);
 
 /*
  * Various structures/functions we need for Keychain certificate import
@@ -449,16 +872,63 @@ struct certcontext {
 	const void		*match;
 };
 
+/*
+ * State we carry around while chasing down certificate chains.
+ * "certs" is the set of certificates we have not yet added;
+ * "issuers" maps an issuer name (the normalized DER from kSecAttrIssuer)
+ * to an array of certificate dictionaries issued by that name; "pkeys"
+ * is the set of public key hashes we've already added.
+ */
+
+struct certscan {
+	CFMutableSetRef		certs;
+	CFMutableDictionaryRef	issuers;
+	CFMutableSetRef		pkeys;
+};
+
+/*
+ * What build_cert_object() needs: the object list, the certificates to
+ * build objects for, and the certificate number of the first one (or,
+ * if index is set, the certificate number of each one).
+ */
+
+struct cert_build {
+	struct obj_info *	list;
+	struct certinfo *	certs;
+	unsigned int		first;
+	unsigned int *		index;
+};
+
 static void background_cert_scan(void *);
+static void background_cert_revalidate(void *);
+static void background_cert_refresh(void *);
+static void cert_refresh(const unsigned char *);
+static void cert_watch_start(void *);
+static void cert_watch_stop(void);
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+static OSStatus keychain_event(SecKeychainEvent, SecKeychainCallbackInfo *,
+			       void *);
+#pragma clang diagnostic pop
+static void cert_queue_create(void *);
+static bool cache_ready(void);
+static void cache_setup(void *);
+static void cert_cache_getkey(unsigned char *);
+static bool load_cert_cache(void);
+static void write_cert_cache(struct obj_info *, unsigned int,
+			     const unsigned char *);
+static void cert_objects_release(void *);
 static void scan_certificates(void);
-static void add_certificate(CFDictionaryRef, CFMutableSetRef);
+static void add_certificate(CFDictionaryRef, struct certscan *);
 static void cert_list_free(void);
-static struct certlist *search_certs(CFMutableSetRef, CFArrayRef, CFDataRef);
+static struct certlist *search_certs(CFMutableSetRef, CFArrayRef);
+static void index_issuer(const void *, void *);
 static void cn_match(const void *, void *);
-static void issuer_match(const void *, void *);
 static void add_cert_to_list(CFDictionaryRef, struct certcontext *);
 static void free_certlist(struct certlist *);
-static void build_cert_objects(void);
+static void build_cert_objects(struct obj_info **, unsigned int *,
+			       unsigned int *, struct attr_block **);
+static void build_cert_object(void *, size_t);
 
 /*
  * Various other utility functions we need
@@ -466,9 +936,12 @@ static void build_cert_objects(void);
 
 static void sprintfpad(unsigned char *, size_t, const char *, ...);
 static bool boolfromdict(const char *, CFDictionaryRef, CFTypeRef);
+static bool dict_value_equal(CFDictionaryRef, CFTypeRef, CFTypeRef);
 static char *getkeylabel(SecKeyRef);
+static char *getprivlabel(CFDictionaryRef, CFDictionaryRef);
 static char *getstrcopy(CFStringRef);
 static bool prefkey_found(const char *, const char *, const char **);
+static int prefkey_intget(const char *, int);
 static char **prefkey_arrayget(const char *, const char **);
 static void array_free(char **);
 #ifdef KEYCHAIN_DEBUG
@@ -485,8 +958,57 @@ void dumpdict(const char *, CFDictionaryRef);
 
 static void log_init(void *);
 os_log_t logsys;
+os_log_t logsp = NULL;
+int log_level = LOG_LEVEL_DEBUG;
 static dispatch_once_t loginit;
 
+/*
+ * Every entry point gets a signpost interval and has its statistics
+ * recorded (see FUNCINIT()).  The signpost intervals all have the same
+ * name, since the end of the interval happens in entry_end() (it's a
+ * cleanup function, so we catch every return); the function name is in
+ * the interval start message.  Our return value only gets recorded if
+ * we return via RET() or one of our checking macros, but that's
+ * everything we do.
+ */
+
+struct entry_info {
+	os_signpost_id_t	spid;		/* Signpost interval */
+	enum stat_id		stat;		/* Our statistics entry */
+	uint64_t		start;		/* From stats_start() */
+	CK_RV			rv;		/* Our return value */
+	struct session *	se;		/* Session from CHECKSESSION */
+};
+
+static inline struct entry_info
+entry_begin(enum stat_id stat, const char *func)
+{
+	struct entry_info e = { OS_SIGNPOST_ID_NULL, stat, stats_start(),
+				CK_UNAVAILABLE_INFORMATION, NULL };
+
+	SP_NOWARN_BEGIN
+	if (logsp && os_signpost_enabled(logsp)) {
+		e.spid = os_signpost_id_generate(logsp);
+		os_signpost_interval_begin(logsp, e.spid, "PKCS11",
+					   "%{public}s", func);
+	}
+	SP_NOWARN_END
+
+	return e;
+}
+
+static inline void
+entry_end(struct entry_info *e)
+{
+	SP_END(e->spid, "PKCS11");
+	stats_record(e->stat, e->start, e->rv);
+
+	if (e->se)
+		sess_put(e->se);
+}
+
+static bool dump_stats = false;			/* Log stats at C_Finalize() */
+
 /*
  * Declarations for our list of exported PKCS11 functions that we return
  * using C_GetFunctionList()
@@ -506,16 +1028,23 @@ static CK_FUNCTION_LIST function_list = {
  */
 
 #define FUNCINIT(func) \
-do { \
 	dispatch_once_f(&loginit, NULL, log_init); \
-	os_log_debug(logsys, #func " called"); \
-} while (0)
+	struct entry_info __entry __attribute__((cleanup(entry_end))) = \
+					entry_begin(STAT_ ## func, #func); \
+	os_log_debug(logsys, #func " called")
+
+/*
+ * Save our return value for entry_end()
+ */
+
+#define ENTRYRV(val) __entry.rv = (val)
 
 #define FUNCINITCHK(func) \
 	FUNCINIT(func); \
 do { \
 	if (! module_initialized) { \
 		os_log_debug(logsys, #func " returning NOT_INITIALIZED"); \
+		ENTRYRV(CKR_CRYPTOKI_NOT_INITIALIZED); \
 		return CKR_CRYPTOKI_NOT_INITIALIZED; \
 	} \
 } while (0)
@@ -524,12 +1053,14 @@ do { \
 CK_RV name args { \
 	FUNCINITCHK(name); \
 	os_log_debug(logsys, "Function " #name " returning NOT SUPPORTED!"); \
+	ENTRYRV(CKR_FUNCTION_NOT_SUPPORTED); \
 	return CKR_FUNCTION_NOT_SUPPORTED; \
 }
 
 #define RET(name, val) \
 do { \
 	os_log_debug(logsys, #name " returning %s", getCKRName(val)); \
+	ENTRYRV(val); \
 	return val; \
 } while (0)
 
@@ -601,14 +1132,16 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 	CREATE_MUTEX(slot_mutex);
 	CREATE_MUTEX(sess_mutex);
 
+	pthread_mutex_lock(&event_mutex);
+	event_shutdown = false;
+	pthread_mutex_unlock(&event_mutex);
+
 	/*
-	 * Allocate the initial slot array and set the count correctly.
+	 * Allocate the initial slot table and set the count correctly.
 	 * We always have a minimum count of "1".
 	 */
 
-	slot_list = malloc(sizeof(*slot_list) * 1);
-	slot_count = 1;
-	slot_list[0] = NULL;
+	slot_table = slot_table_copy(NULL, 1);
 
 	/*
 	 * By default we let the Security framework pop up a dialog box
@@ -670,16 +1203,87 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 		 * to fix this, and since this is really only useful for
 		 * Firefox (which is typically long-running) I decided to
 		 * not deal with it.  Maybe I will address it later.
+		 *
+		 * If we have a valid on-disk cache of the certificate
+		 * objects we use that right away, and then rescan the
+		 * Keychain in the background to see if the cache needs
+		 * to be updated.  All certificate scans run on a serial
+		 * queue so a rescan can never overlap another scan.  We
+		 * also rescan when the Keychain changes (unless the
+		 * certificateRefresh preference is off).
 		 */
 
 		if (atomic_compare_exchange_strong(&cert_list_status,
-						   &status, initializing))
-			dispatch_async_f(dispatch_get_global_queue(
-					  DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
-					 NULL, background_cert_scan);
+						   &status, initializing)) {
+			dispatch_once_f(&cert_queue_init, NULL,
+					cert_queue_create);
+
+			cert_cache_enabled = prefkey_intget("certificateCache",
+							    1) != 0;
+			cert_refresh_enabled = prefkey_intget(
+						"certificateRefresh", 1) != 0;
+
+			if (cert_refresh_enabled) {
+				pthread_mutex_lock(&cert_watch_lock);
+				cert_watch_wanted = true;
+				pthread_mutex_unlock(&cert_watch_lock);
+				dispatch_async_f(dispatch_get_main_queue(),
+						 NULL, cert_watch_start);
+			}
+
+			if (cert_cache_enabled && load_cert_cache()) {
+				atomic_store(&cert_list_status, initialized);
+				dispatch_async_f(cert_queue, NULL,
+						 background_cert_revalidate);
+			} else {
+				dispatch_async_f(cert_queue, NULL,
+						 background_cert_scan);
+			}
+		}
 	}
 
-	start_token_watcher();
+	/*
+	 * How many concurrent private key operations do we allow per token?
+	 */
+
+	max_token_requests = prefkey_intget("maxTokenRequests",
+					    DEFAULT_TOKEN_REQUESTS);
+
+	host_pubkey = prefkey_intget("hostPublicKey", 1) != 0;
+
+	token_cache_enabled = prefkey_intget("tokenCache", 0) != 0;
+
+	key_warmup_enabled = prefkey_intget("keyWarmup", 0) != 0;
+
+	hash_streaming = prefkey_intget("hashStreaming", 1) != 0;
+
+	if (key_warmup_enabled && ! warmup_group)
+		warmup_group = dispatch_group_create();
+
+	dump_stats = prefkey_intget("dumpStatistics", 0) != 0;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshots_enabled = true;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	os_log_debug(logsys, "Maximum concurrent token requests: %d%s",
+		     max_token_requests,
+		     max_token_requests > 0 ? "" : " (unlimited)");
+
+	mechmap_init();
+
+	if (prefkey_intget("asyncTokenScan", 0)) {
+		if (! token_scan_group)
+			token_scan_group = dispatch_group_create();
+		atomic_store(&token_scan_done, false);
+		atomic_store(&token_scan_timedout, false);
+		dispatch_group_async_f(token_scan_group,
+				       dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				       NULL, token_scan);
+	} else {
+		start_token_watcher();
+	}
 
 	module_initialized = 1;
 
@@ -692,6 +1296,7 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 
 CK_RV C_Finalize(CK_VOID_PTR p)
 {
+	struct slot_table *st;
 	int i;
 
 	FUNCINITCHK(C_Finalize);
@@ -703,35 +1308,84 @@ CK_RV C_Finalize(CK_VOID_PTR p)
 
 	/*
 	 * Before anything else happens, stop receiving token watcher
-	 * events
+	 * events (and if we are still adding the tokens we found at
+	 * startup, let that finish first).
 	 */
 
+	if (! atomic_load(&token_scan_done))
+		dispatch_group_wait(token_scan_group, DISPATCH_TIME_FOREVER);
+
 	stop_token_watcher();
 
+	/*
+	 * Key warm-ups hold token references, so let them finish
+	 */
+
+	if (warmup_group)
+		dispatch_group_wait(warmup_group, DISPATCH_TIME_FOREVER);
+
+	/*
+	 * Wake up anyone waiting in C_WaitForSlotEvent()
+	 */
+
+	slot_event_shutdown();
+
 	LOCK_MUTEX(slot_mutex);
 	LOCK_MUTEX(sess_mutex);
 
-	for (i = 0; i < slot_count; i++)
-		if (slot_list[i])
-			slot_entry_free(slot_list[i], true);
+	/*
+	 * Close any sessions the application left open; this has to
+	 * happen first since sessions hold references to slot entries.
+	 */
+
+	sess_table_free();
 
-	free(slot_list);
+	pthread_mutex_lock(&slot_table_lock);
+	st = slot_table;
+	slot_table = NULL;
+	pthread_mutex_unlock(&slot_table_lock);
+
+	for (i = 0; i < st->count; i++)
+		if (st->slots[i])
+			slot_entry_free(st->slots[i], false);
+
+	slot_table_put(st);
 
 	UNLOCK_MUTEX(sess_mutex);
 	UNLOCK_MUTEX(slot_mutex);
 
+	token_snapshot_flush();
+
 	DESTROY_MUTEX(sess_mutex);
 	DESTROY_MUTEX(slot_mutex);
 
+	cert_watch_stop();
+
 	if (atomic_load(&cert_list_status) == initialized) {
-		obj_free(&cert_obj_list, &cert_obj_count, &cert_obj_size);
-		cert_list_free();
+		struct obj_set *objs;
+
+		/*
+		 * A cache write or revalidation might still be using our
+		 * certificate objects or cert_list, so free them from the
+		 * certificate queue.
+		 */
+
+		pthread_mutex_lock(&cert_objs_lock);
+		objs = cert_objs;
+		cert_objs = NULL;
+		pthread_mutex_unlock(&cert_objs_lock);
+
+		dispatch_async_f(cert_queue, objs, cert_objects_release);
+		atomic_store(&cert_list_status, uninitialized);
 	}
 
 	use_mutex = 0;
 	module_initialized = 0;
 	cert_slot_enabled = 0;
 
+	if (dump_stats)
+		stats_dump();
+
 	RET(C_Finalize, CKR_OK);
 }
 
@@ -765,13 +1419,14 @@ CK_RV C_GetInfo(CK_INFO_PTR p)
 CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR ret_slot_list,
 		    CK_ULONG_PTR slot_num)
 {
+	struct slot_table *st;
 	CK_RV rv = CKR_OK;
 	unsigned int i, count, sindex;
 
 	FUNCINITCHK(C_GetSlotList);
 
 	os_log_debug(logsys, "tokens_present = %{bool}d, slot_list = %p, "
-		     "slot_num = %d", token_present, slot_list,
+		     "slot_num = %d", token_present, ret_slot_list,
 		     (int) *slot_num);
 
 	/*
@@ -789,7 +1444,7 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR ret_slot_list,
 	 * it always counts as "present".
 	 */
 
-	LOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
 
 	/*
 	 * Count up how many tokens we have,  If token_present is true,
@@ -797,11 +1452,11 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR ret_slot_list,
 	 */
 
 	if (token_present) {
-		for (i = 0, count = 0; i < slot_count; i++)
-			if (slot_list[i])
+		for (i = 0, count = 0; i < st->count; i++)
+			if (st->slots[i])
 				count++;
 	} else {
-		count = slot_count;
+		count = st->count;
 	}
 
 	if (cert_slot_enabled)
@@ -827,8 +1482,8 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR ret_slot_list,
 	 * if it has a token), which is just an index into our slot list.
 	 */
 
-	for (i = 0, sindex = 0; i < slot_count; i++)
-		if (! token_present || slot_list[i] != NULL)
+	for (i = 0, sindex = 0; i < st->count; i++)
+		if (! token_present || st->slots[i] != NULL)
 			ret_slot_list[sindex++] = i;
 
 	/*
@@ -848,7 +1503,7 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR ret_slot_list,
 
 
 out:
-	UNLOCK_MUTEX(slot_mutex);
+	slot_table_put(st);
 	*slot_num = count;
 
 	RET(C_GetSlotList, rv);
@@ -860,6 +1515,7 @@ out:
 
 CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 {
+	struct slot_table *st;
 	CK_RV rv = CKR_OK;
 
 	FUNCINITCHK(C_GetSlotInfo);
@@ -867,9 +1523,9 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 	os_log_debug(logsys, "slot_id = %d, slot_info = %p", (int) slot_id,
 		     slot_info);
 
-	LOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
 
-	CHECKSLOT(slot_id, false);
+	CHECKSLOT(st, slot_id, false);
 
 	if (! slot_info) {
 		rv = CKR_ARGUMENTS_BAD;
@@ -902,10 +1558,10 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 			slot_info->flags |= CKF_TOKEN_PRESENT;
 	} else {
 		slot_info->flags = CKF_HW_SLOT | CKF_REMOVABLE_DEVICE;
-		if (slot_list[slot_id]) {
+		if (st->slots[slot_id]) {
 			sprintfpad(slot_info->slotDescription,
 				   sizeof(slot_info->slotDescription), "%s",
-				   slot_list[slot_id]->label);
+				   st->slots[slot_id]->label);
 			slot_info->flags |= CKF_TOKEN_PRESENT;
 		} else {
 			sprintfpad(slot_info->slotDescription,
@@ -921,7 +1577,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 	slot_info->firmwareVersion.minor = 0;
 
 out:
-	UNLOCK_MUTEX(slot_mutex);
+	slot_table_put(st);
 	RET(C_GetSlotInfo, rv);
 }
 
@@ -932,6 +1588,7 @@ out:
 
 CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 {
+	struct slot_table *st;
 	CK_RV rv = CKR_OK;
 
 	FUNCINITCHK(C_GetTokenInfo);
@@ -939,9 +1596,9 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 	os_log_debug(logsys, "slot_id = %d, token_info = %p", (int) slot_id,
 		     token_info);
 
-	LOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
 
-	CHECKSLOT(slot_id, true);
+	CHECKSLOT(st, slot_id, true);
 
 	if (! token_info) {
 		rv = CKR_ARGUMENTS_BAD;
@@ -973,12 +1630,13 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 		 * summary as the token label.
 		 */
 
-		LOCK_MUTEX(slot_list[slot_id]->entry_mutex);
+		LOCK_MUTEX(st->slots[slot_id]->entry_mutex);
 
 		CFStringRef summary;
 		char *label;
 
-		summary = SecCertificateCopySubjectSummary(slot_list[slot_id]->id_list[0]->cert);
+		summary = SP_CALL(SecCertificateCopySubjectSummary,
+				  st->slots[slot_id]->id_list[0]->cert);
 
 		if (summary) {
 			label = getstrcopy(summary);
@@ -993,7 +1651,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 		if (summary)
 			CFRelease(summary);
 
-		UNLOCK_MUTEX(slot_list[slot_id]->entry_mutex);
+		UNLOCK_MUTEX(st->slots[slot_id]->entry_mutex);
 
 		token_info->flags |= CKF_LOGIN_REQUIRED;
 
@@ -1039,7 +1697,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 		   "%s", "1970010100000000");
 
 out:
-	UNLOCK_MUTEX(slot_mutex);
+	slot_table_put(st);
 	RET(C_GetTokenInfo, rv);
 }
 
@@ -1050,80 +1708,107 @@ out:
 CK_RV C_GetMechanismList(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE_PTR mechlist,
 			 CK_ULONG_PTR mechnum)
 {
-	int i;
+	const CK_MECHANISM_TYPE *list = NULL;
+	unsigned int i, count = keychain_mechmap_size;
+	struct slot_table *st;
+	CK_RV rv = CKR_OK;
 
 	FUNCINITCHK(C_GetMechanismList);
 
 	os_log_debug(logsys, "slot_id = %lu, mechlist = %p, mechnum = %lu",
 		     slot_id, mechlist, *mechnum);
 
-	LOCK_MUTEX(slot_mutex);
-	CHECKSLOT(slot_id, true);
-	UNLOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
+	CHECKSLOT(st, slot_id, true);
 
 	/*
-	 * It's hard to know exactly what all mechanisms are supported by
-	 * a particular token, but we can probably safely return all of the
-	 * RSA ones at least (since those should work with any RSA key)
+	 * Tokens have their own mechanism list, based on the keys they
+	 * have (see build_mech_list()).  The certificate slot doesn't have
+	 * any keys, but we've always returned everything for that one.
+	 * The list for a token doesn't change, and the token can't go
+	 * away while we hold a reference to the slot table.
 	 */
 
+	if (slot_id != CERTIFICATE_SLOT && st->slots[slot_id]->mech_list) {
+		list = st->slots[slot_id]->mech_list;
+		count = st->slots[slot_id]->mech_count;
+	}
+
 	/*
 	 * Return the list count (and CKR_OK) if mechlist was NULL
 	 */
 
 	if (!mechlist) {
-		*mechnum = keychain_mechmap_size;
-		RET(C_GetMechanismList, CKR_OK);
+		*mechnum = count;
+		goto out;
 	}
 
 	/*
 	 * Return our mechanisms (or CKR_BUFFER_TOO_SMALL)
 	 */
 
-	if (*mechnum < keychain_mechmap_size) {
-		*mechnum = keychain_mechmap_size;
-		RET(C_GetMechanismList, CKR_BUFFER_TOO_SMALL);
+	if (*mechnum < count) {
+		*mechnum = count;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto out;
 	}
 
-	*mechnum = keychain_mechmap_size;
+	*mechnum = count;
 
-	for (i = 0; i < keychain_mechmap_size; i++)
-		mechlist[i] = keychain_mechmap[i].cki_mech;
+	for (i = 0; i < count; i++)
+		mechlist[i] = list ? list[i] : keychain_mechmap[i].cki_mech;
 
-	RET(C_GetMechanismList, CKR_OK);
+out:
+	slot_table_put(st);
+	RET(C_GetMechanismList, rv);
 }
 
 /*
  * Return information on a particular mechanism.
  *
  * It's not clear how important this information is, at least for
- * callers of our library.  Return some stuff that seems reasonable.
+ * callers of our library.  For tokens we return what we worked out
+ * from the keys on the token; otherwise return the information from
+ * our mechanism table.
  */
 
 CK_RV C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE mechtype,
 			 CK_MECHANISM_INFO_PTR mechinfo)
 {
-	int i;
+	const struct mechanism_map *mm;
+	const CK_MECHANISM_INFO *info;
+	struct slot_table *st;
+	CK_RV rv = CKR_OK;
 
 	FUNCINITCHK(C_GetMechanismInfo);
 
 	os_log_debug(logsys, "slot_id = %lu, mechtype = %s, mechinfo = %p",
 		     slot_id, getCKMName(mechtype), mechinfo);
 
-	LOCK_MUTEX(slot_mutex);
-	CHECKSLOT(slot_id, true);
-	UNLOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
+	CHECKSLOT(st, slot_id, true);
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mechtype == keychain_mechmap[i].cki_mech) {
-			mechinfo->ulMinKeySize = keychain_mechmap[i].min_keylen;
-			mechinfo->ulMaxKeySize = keychain_mechmap[i].max_keylen;
-			mechinfo->flags = keychain_mechmap[i].usage_flags;
-			RET(C_GetMechanismInfo, CKR_OK);
+	if (! (mm = mechmap_lookup(mechtype))) {
+		rv = CKR_MECHANISM_INVALID;
+		goto out;
+	}
+
+	if (slot_id != CERTIFICATE_SLOT && st->slots[slot_id]->mech_info) {
+		info = &st->slots[slot_id]->mech_info[mm - keychain_mechmap];
+		if (info->flags == 0) {
+			rv = CKR_MECHANISM_INVALID;
+			goto out;
 		}
+		*mechinfo = *info;
+	} else {
+		mechinfo->ulMinKeySize = mm->min_keylen;
+		mechinfo->ulMaxKeySize = mm->max_keylen;
+		mechinfo->flags = mm->usage_flags;
 	}
 
-	RET(C_GetMechanismInfo, CKR_MECHANISM_INVALID);
+out:
+	slot_table_put(st);
+	RET(C_GetMechanismInfo, rv);
 }
 
 NOTSUPPORTED(C_InitToken, (CK_SLOT_ID slot_id, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen, CK_UTF8CHAR_PTR label))
@@ -1138,8 +1823,8 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 		    CK_VOID_PTR app_callback, CK_NOTIFY notify_callback,
 		    CK_SESSION_HANDLE_PTR session)
 {
+	struct slot_table *st;
 	struct session *sess;
-	int i;
 
 	FUNCINITCHK(C_OpenSession);
 
@@ -1147,16 +1832,25 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 		     "notify_callback = %p, session_handle = %p", (int) slot_id,
 		     flags, app_callback, notify_callback, session);
 
-	LOCK_MUTEX(slot_mutex);
-	CHECKSLOT(slot_id, true);
+	st = slot_table_wait();
+	CHECKSLOT(st, slot_id, true);
+
+	/*
+	 * PKCS#11 v2 requires CKF_SERIAL_SESSION; "serial" only means that
+	 * a single session can't have more than one operation running at
+	 * once.  Different sessions on the same token (even in different
+	 * threads) can all have operations in progress; private key
+	 * operations are limited by token_op_begin().
+	 */
 
 	if (! (flags & CKF_SERIAL_SESSION)) {
-		UNLOCK_MUTEX(slot_mutex);
+		slot_table_put(st);
 		RET(C_OpenSession, CKR_SESSION_PARALLEL_NOT_SUPPORTED);
 	}
 
 	sess = malloc(sizeof(*sess));
 	CREATE_MUTEX(sess->mutex);
+	atomic_init(&sess->refcount, 1);
 
 	/*
 	 * Pick the right object list depending if we are using the
@@ -1164,63 +1858,62 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 	 */
 
 	if (slot_id == CERTIFICATE_SLOT) {
-		if (atomic_load(&cert_list_status) == initialized) {
-			sess->obj_list = cert_obj_list;
-			sess->obj_list_count = cert_obj_count;
-		} else {
-			sess->obj_list = NULL;
-			sess->obj_list_count = 0;;
-		}
+		sess->objs = cert_objs_get();
 		sess->token = NULL;
 	} else {
-		sess->obj_list = slot_list[slot_id]->obj_list;
-		sess->obj_list_count = slot_list[slot_id]->obj_count;
-		sess->token = slot_list[slot_id];
+		sess->objs = obj_set_get(st->slots[slot_id]->objs);
+		sess->token = st->slots[slot_id];
 		LOCK_MUTEX(sess->token->entry_mutex);
 		sess->token->refcount++;
 		UNLOCK_MUTEX(sess->token->entry_mutex);
 	}
 
+	sess->old_objs = NULL;
+	atomic_init(&sess->objs_readers, 0);
+
+	if (sess->objs) {
+		sess->obj_list = sess->objs->list;
+		sess->obj_list_count = sess->objs->count;
+		sess->obj_idx = sess->objs->idx;
+		os_log_debug(logsys, "Using object set version %u (%u objects)",
+			     sess->objs->version, sess->objs->count);
+	} else {
+		sess->obj_list = NULL;
+		sess->obj_list_count = 0;
+		sess->obj_idx = NULL;
+	}
+
 	sess->slot_id = slot_id;
 	sess->search_attrs = NULL;
+	sess->search_blobs = NULL;
 	sess->search_attrs_count = 0;
+	sess->search_list = NULL;
+	sess->search_list_count = 0;
 	sess->state = NO_PENDING;
 	sess->key = NULL;
-	sess->mdc = NULL;
+	sess->mdstream = NULL;
+	sess->streaming = false;
+	sess->digest_state = NO_PENDING;
 
 	LOCK_MUTEX(sess_mutex);
 
 	/*
-	 * See if we can find a free slot in our session list
+	 * Grab a free slot in our session handle table.  If we're out
+	 * of space, undo everything.
 	 */
 
-	for (i = 0; i < sess_list_size; i++) {
-		if (sess_list[i] == NULL) {
-			sess_list[i] = sess;
-			*session = i + 1;
-			if (i >= sess_list_count)
-				sess_list_count = i + 1;
-			goto out;
-		}
+	if ((*session = sess_insert(sess)) == 0) {
+		UNLOCK_MUTEX(sess_mutex);
+		slot_table_put(st);
+		os_log_debug(logsys, "Session table is full");
+		sess_put(sess);
+		RET(C_OpenSession, CKR_SESSION_COUNT);
 	}
 
-	/*
-	 * Looks like we need to grow the session list
-	 */
-
-	sess_list_size += 5;
-
-	sess_list = realloc(sess_list, sess_list_size * sizeof(*sess_list));
-
-	for (i = sess_list_count + 1; i < sess_list_size; i++)
-		sess_list[i] = NULL;
-
-	sess_list[sess_list_count] = sess;
-
-	*session = ++sess_list_count;
-out:
 	UNLOCK_MUTEX(sess_mutex);
-	UNLOCK_MUTEX(slot_mutex);
+	slot_table_put(st);
+
+	os_log_debug(logsys, "New session handle is %#lx", *session);
 
 	RET(C_OpenSession, CKR_OK);
 }
@@ -1237,17 +1930,20 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE session)
 
 	LOCK_MUTEX(sess_mutex);
 
-	sess_free(se);
+	/*
+	 * If someone else closed this session between our lookup and now,
+	 * sess_remove() will tell us.  This drops the table's reference;
+	 * the session actually goes away when we (and anyone else still
+	 * using it) return.
+	 */
 
-	sess_list[session] = NULL;
+	if (sess_remove(session) != se) {
+		UNLOCK_MUTEX(sess_mutex);
+		RET(C_CloseSession, CKR_SESSION_HANDLE_INVALID);
+	}
 
-#if 0
-	for (i = 0; i < sess_list_count; i++)
-		if (sess_list[i] != NULL)
-			goto cont;
+	sess_put(se);
 
-cont:
-#endif
 	UNLOCK_MUTEX(sess_mutex);
 
 	RET(C_CloseSession, CKR_OK);
@@ -1255,15 +1951,18 @@ cont:
 
 CK_RV C_CloseAllSessions(CK_SLOT_ID slot_id)
 {
-	int i;
+	struct slot_table *st;
+	struct sess_slot *ss;
+	struct session *se;
+	unsigned int i;
 
 	FUNCINITCHK(C_CloseAllSessions);
 
 	os_log_debug(logsys, "slot_id = %d", (int) slot_id);
 
-	LOCK_MUTEX(slot_mutex);
-	CHECKSLOT(slot_id, true);
-	UNLOCK_MUTEX(slot_mutex);
+	st = slot_table_wait();
+	CHECKSLOT(st, slot_id, true);
+	slot_table_put(st);
 
 	LOCK_MUTEX(sess_mutex);
 
@@ -1271,11 +1970,12 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slot_id)
 	 * Only close sessions assigned to this slot
 	 */
 
-	for (i = 0; i < sess_list_count; i++) {
-		if (sess_list[i] && sess_list[i]->slot_id == slot_id) {
-			os_log_debug(logsys, "Closing session %d", i);
-			sess_free(sess_list[i]);
-			sess_list[i] = NULL;
+	for (i = 0; (ss = sess_slot_get(i)) != NULL; i++) {
+		se = atomic_load(&ss->sess);
+		if (se && se->slot_id == slot_id) {
+			os_log_debug(logsys, "Closing session %u", i + 1);
+			sess_remove(sess_handle(i, ss));
+			sess_put(se);
 		}
 	}
 
@@ -1321,7 +2021,9 @@ CK_RV C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE usertype,
 	      CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
 {
 	struct session *se;
-	int i;
+	int i, j, count = 0;
+	void **acl;
+	enum la_keyusage *usage;
 	CK_RV rv = CKR_OK;
 	FUNCINITCHK(C_Login);
 
@@ -1363,31 +2065,82 @@ CK_RV C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE usertype,
 			goto out;
 		}
 
+		/*
+		 * We need the access control for each key; if the
+		 * objects came from the token cache, we don't have
+		 * those yet.
+		 */
+
+		if (! token_bind_with(se->token, se->token->lacontext)) {
+			rv = CKR_DEVICE_ERROR;
+			UNLOCK_MUTEX(se->token->entry_mutex);
+			goto out;
+		}
+
+		/*
+		 * Most identities on a card share the same access control
+		 * (and key usage), so only authenticate once for each
+		 * distinct combination.  lacontext_auth() does as many
+		 * of those at once as it safely can.
+		 */
+
+		acl = malloc(se->token->id_count * sizeof(*acl));
+		usage = malloc(se->token->id_count * sizeof(*usage));
+
 		for (i = 0; i < se->token->id_count; i++) {
-			enum la_keyusage usage;
-
-			os_log_debug(logsys, "Setting PIN for identity %d, "
-				     "slot %d", i, (int) se->slot_id);
-
-			usage = se->token->id_list[i]->privcansign ?
-						USAGE_SIGN : USAGE_DECRYPT;
-
-			if ((rv = lacontext_auth(se->token->lacontext, pin,
-						 pinlen,
-						 se->token->id_list[i]->secaccess,
-						 usage)) != CKR_OK) {
-				/*
-				 * The real error should have been logged
-				 * in lacontext_auth().
-				 */
-				UNLOCK_MUTEX(se->token->entry_mutex);
-				goto out;
+			struct id_info *id = se->token->id_list[i];
+			enum la_keyusage u;
+
+			u = id->privcansign ? USAGE_SIGN : USAGE_DECRYPT;
+
+			for (j = 0; j < count; j++)
+				if (usage[j] == u && CFEqual(acl[j],
+							     id->secaccess))
+					break;
+
+			if (j == count) {
+				acl[count] = (void *) id->secaccess;
+				usage[count++] = u;
 			}
 		}
+
+		os_log_debug(logsys, "Setting PIN for %d identities (%d "
+			     "distinct access controls), slot %d",
+			     (int) se->token->id_count, count,
+			     (int) se->slot_id);
+
+		rv = lacontext_auth(se->token->lacontext, pin, pinlen, acl,
+				    usage, count);
+
+		free(acl);
+		free(usage);
+
+		if (rv != CKR_OK) {
+			/*
+			 * The real error should have been logged
+			 * in lacontext_auth().
+			 */
+			UNLOCK_MUTEX(se->token->entry_mutex);
+			goto out;
+		}
 	} else {
 		os_log_debug(logsys, "We are NOT setting the PIN");
 	}
 
+	/*
+	 * The warm-up gets its own reference to the token; it drops it
+	 * with slot_entry_free() when it is done.
+	 */
+
+	if (key_warmup_enabled && ! se->token->logged_in &&
+	    ! se->token->removed) {
+		se->token->refcount++;
+		dispatch_group_async_f(warmup_group,
+				       dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_LOW, 0),
+				       se->token, token_warmup);
+	}
+
 	se->token->logged_in = true;
 	UNLOCK_MUTEX(se->token->entry_mutex);
 
@@ -1437,6 +2190,8 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 			  CK_ATTRIBUTE_PTR template, CK_ULONG count)
 {
 	struct session *se;
+	struct obj_set *objs;
+	struct obj_info *obj;
 	CK_RV rv = CKR_OK;
 	int i;
 	CK_ATTRIBUTE_PTR attr;
@@ -1449,56 +2204,68 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 
 	CHECKSESSION(session, se);
 
-	LOCK_MUTEX(se->mutex);
+	/*
+	 * We don't lock the session here; the object list belongs to our
+	 * object set, which never changes.  The session can switch to a
+	 * newer set (see sess_objs_update()), but it won't let go of the
+	 * old one while anyone is counted in objs_readers.  So any number
+	 * of threads can be reading attributes at the same time; we just
+	 * have to get the list and the count from the same set (and count
+	 * ourselves in before we look at it).
+	 */
+
+	atomic_fetch_add(&se->objs_readers, 1);
+	objs = atomic_load(&se->objs);
 
 	object--;
 
-	if (object >= se->obj_list_count) {
-		UNLOCK_MUTEX(se->mutex);
-		RET(C_GetAttributeValue, CKR_OBJECT_HANDLE_INVALID);
+	if (! objs || object >= objs->count ||
+	    OBJ_REMOVED(&objs->list[object])) {
+		rv = CKR_OBJECT_HANDLE_INVALID;
+		goto out;
 	}
 
-	LOG_DEBUG_OBJECT(object, se);
+	obj = &objs->list[object];
+
+	LOG_VERBOSE("Object %lu (%s)", object, getCKOName(obj->class));
 
 	for (i = 0; i < count; i++) {
-		os_log_debug(logsys, "Retrieving attribute: %s",
-			     getCKAName(template[i].type));
-		if ((attr = find_attribute(&se->obj_list[object],
-					   template[i].type))) {
+		LOG_VERBOSE("Retrieving attribute: %s",
+			    getCKAName(template[i].type));
+		if ((attr = find_attribute(obj, template[i].type))) {
 			if (! template[i].pValue) {
 				template[i].ulValueLen = attr->ulValueLen;
-				os_log_debug(logsys, "pValue was NULL, just "
-					     "returning length (%lu)",
-					     attr->ulValueLen);
+				LOG_VERBOSE("pValue was NULL, just returning "
+					    "length (%lu)", attr->ulValueLen);
 			} else {
 				if (template[i].ulValueLen < attr->ulValueLen) {
-					os_log_debug(logsys, "Attribute: "
-						     "buffer too small "
-						     "(%lu, %lu)",
-						     template[i].ulValueLen,
-						     attr->ulValueLen);
+					LOG_VERBOSE("Attribute: buffer too "
+						    "small (%lu, %lu)",
+						    template[i].ulValueLen,
+						    attr->ulValueLen);
 					template[i].ulValueLen =
 							attr->ulValueLen;
 					rv = CKR_BUFFER_TOO_SMALL;
 				} else {
 					memcpy(template[i].pValue, attr->pValue,
 					       attr->ulValueLen);
-					os_log_debug(logsys, "Copied over "
-						     "attribute (%lu, %lu)",
-						     template[i].ulValueLen,
-						     attr->ulValueLen);
+					LOG_VERBOSE("Copied over attribute "
+						    "(%lu, %lu)",
+						    template[i].ulValueLen,
+						    attr->ulValueLen);
 					template[i].ulValueLen =
 							attr->ulValueLen;
 				}
 			}
 		} else {
-			os_log_debug(logsys, "Attribute not found");
+			LOG_VERBOSE("Attribute not found");
 			template[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
 			rv = CKR_ATTRIBUTE_TYPE_INVALID;
 		}
 	}
 
-	UNLOCK_MUTEX(se->mutex);
+out:
+	atomic_fetch_sub(&se->objs_readers, 1);
 
 	RET(C_GetAttributeValue, rv);
 }
@@ -1509,6 +2276,9 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
 			CK_ULONG count)
 {
 	struct session *se;
+	bool verbose = LOG_VERBOSE_ENABLED();
+	unsigned char *values;
+	size_t size;
 	int i;
 
 	FUNCINITCHK(C_FindObjectsInit);
@@ -1520,14 +2290,35 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
 
 	LOCK_MUTEX(se->mutex);
 
+	if (! se->search_attrs)
+		sess_objs_update(se);
+
 	se->obj_search_index = 0;
+	free(se->search_list);
+	se->search_list = NULL;
+	se->search_list_count = 0;
 
 	/*
-	 * Copy all of our attributes to search against later
+	 * Copy all of our attributes to search against later.  The
+	 * template, the values, and the blob store pointers for the values
+	 * (if they are already in there) all go in one allocation.  Search
+	 * templates are short-lived, so we don't add them to the blob
+	 * store; blob_find() just gives us something to compare pointers
+	 * against in search_object().
 	 */
 
-	se->search_attrs = count ? malloc(sizeof(CK_ATTRIBUTE) * count) : NULL;
+	free(se->search_attrs);
+
+	size = count * (sizeof(CK_ATTRIBUTE) + sizeof(const void *));
+
+	for (i = 0; i < count; i++)
+		if (template[i].ulValueLen != CK_UNAVAILABLE_INFORMATION)
+			size += template[i].ulValueLen;
+
+	se->search_attrs = malloc(size ? size : 1);
+	se->search_blobs = (const void **) (se->search_attrs + count);
 	se->search_attrs_count = count;
+	values = (unsigned char *) (se->search_blobs + count);
 
 	for (i = 0; i < count; i++) {
 		se->search_attrs[i].type = template[i].type;
@@ -1535,15 +2326,32 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
 		if (se->search_attrs[i].ulValueLen ==
 					CK_UNAVAILABLE_INFORMATION) {
 			se->search_attrs[i].pValue = NULL;
+			se->search_blobs[i] = NULL;
 		} else {
-			se->search_attrs[i].pValue =
-					malloc(se->search_attrs[i].ulValueLen);
-			memcpy(se->search_attrs[i].pValue, template[i].pValue,
-			       se->search_attrs[i].ulValueLen);
+			memcpy(values, template[i].pValue,
+			       template[i].ulValueLen);
+			se->search_attrs[i].pValue = values;
+			se->search_blobs[i] = blob_find(values,
+							template[i].ulValueLen);
+			values += template[i].ulValueLen;
 		}
-		dump_attribute("Search template", &se->search_attrs[i]);
+		if (verbose)
+			dump_attribute("Search template", &se->search_attrs[i]);
 	}
 
+	/*
+	 * If we can use our attribute index, then get our list of
+	 * candidate objects now; C_FindObjects() only has to check those.
+	 * Otherwise (nothing in the template is indexed) leave the
+	 * candidate list as NULL and we'll check every object.
+	 */
+
+	if (objidx_lookup(se->obj_idx, se->search_attrs, se->search_attrs_count,
+			  &se->search_list, &se->search_list_count))
+		os_log_debug(logsys, "Index lookup returned %u candidate "
+			     "object%s", se->search_list_count,
+			     se->search_list_count == 1 ? "" : "s");
+
 	UNLOCK_MUTEX(se->mutex);
 
 	RET(C_FindObjectsInit, CKR_OK);
@@ -1571,10 +2379,44 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
 
 	LOCK_MUTEX(se->mutex);
 
+	/*
+	 * If we have a candidate list from the index, page through that.
+	 * Our candidate objects still have to match the whole template.
+	 */
+
+	if (se->search_list) {
+		for (; se->obj_search_index < se->search_list_count;
+						se->obj_search_index++) {
+			CK_OBJECT_HANDLE h =
+				se->search_list[se->obj_search_index];
+
+			if (h < 1 || h > se->obj_list_count ||
+			    ! search_object(&se->obj_list[h - 1],
+					    se->search_attrs,
+					    se->search_blobs,
+					    se->search_attrs_count))
+				continue;
+
+			object[rc++] = h;
+			if (rc >= maxcount) {
+				se->obj_search_index++;
+				break;
+			}
+		}
+
+		os_log_debug(logsys, "Found %u object%s", rc,
+			     rc == 1 ? "" : "s");
+		*count = rc;
+
+		UNLOCK_MUTEX(se->mutex);
+		RET(C_FindObjects, CKR_OK);
+	}
+
 	for (; se->obj_search_index < se->obj_list_count;
 						se->obj_search_index++) {
 		if (search_object(&se->obj_list[se->obj_search_index],
-				  se->search_attrs, se->search_attrs_count)) {
+				  se->search_attrs, se->search_blobs,
+				  se->search_attrs_count)) {
 			object[rc++] = se->obj_search_index + 1;
 			if (rc >= maxcount) {
 				*count = rc;
@@ -1597,7 +2439,6 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
 CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE session)
 {
 	struct session *se;
-	int i;
 
 	FUNCINITCHK(C_FindObjectsFinal);
 
@@ -1607,13 +2448,15 @@ CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE session)
 
 	os_log_debug(logsys, "session = %d", (int) session);
 
-	for (i = 0; i < se->search_attrs_count; i++)
-		free(se->search_attrs[i].pValue);
-
 	free(se->search_attrs);
 	se->search_attrs = NULL;
+	se->search_blobs = NULL;
 	se->search_attrs_count = 0;
 
+	free(se->search_list);
+	se->search_list = NULL;
+	se->search_list_count = 0;
+
 	UNLOCK_MUTEX(se->mutex);
 
 	RET(C_FindObjectsFinal, CKR_OK);
@@ -1682,7 +2525,7 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * we need.
 	 */
 
-	mm = get_mechmap(mech->mechanism);
+	mm = mechmap_lookup(mech->mechanism);
 
 	/*
 	 * Make sure we got a valid mechanism and that we can use it for
@@ -1715,10 +2558,15 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	if (se->key)
 		CFRelease(se->key);
 
-	LOCK_MUTEX(se->token->entry_mutex);
-	se->key = se->obj_list[object].id->pubkey;
+	/*
+	 * The identity list for a token is never changed once the token
+	 * is added to the slot list, and our session holds a reference
+	 * to the token, so we don't need the token lock to read it.
+	 */
+
+	se->key = id_pubkey(se->obj_list[object].id,
+			    kSecKeyOperationTypeEncrypt, se->alg, NULL);
 	CFRetain(se->key);
-	UNLOCK_MUTEX(se->token->entry_mutex);
 
 	if (mm->blocksize_out)
 		se->outsize = SecKeyGetBlockSize(se->key);
@@ -1790,11 +2638,10 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		RET(C_Encrypt, CKR_BUFFER_TOO_SMALL);
 	}
 
-	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
-					    kCFAllocatorNull);
+	inref = input_cfdata(indata, indatalen);
 
-	outref = SecKeyCreateEncryptedData(se->key, se->alg, inref,
-					   &err);
+	outref = SP_CALL(SecKeyCreateEncryptedData, se->key, se->alg, inref,
+			 &err);
 
 	CFRelease(inref);
 
@@ -1902,7 +2749,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * See the comments in C_EncryptInit() for what is going on here
 	 */
 
-	mm = get_mechmap(mech->mechanism);
+	mm = mechmap_lookup(mech->mechanism);
 
 	if (! mm || (mm->usage_flags & CKF_DECRYPT) == 0) {
 		rv = CKR_MECHANISM_INVALID;
@@ -1915,16 +2762,19 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 		goto out;
 	}
 
+	if (! token_bind(se->token)) {
+		rv = CKR_DEVICE_ERROR;
+		goto out;
+	}
+
 	if (se->key)
 		CFRelease(se->key);
 
-	LOCK_MUTEX(se->token->entry_mutex);
 	se->key = se->obj_list[key].id->privkey;
 	CFRetain(se->key);
-	UNLOCK_MUTEX(se->token->entry_mutex);
 
 	if (mm->blocksize_out)
-		se->outsize = SecKeyGetBlockSize(se->key);
+		se->outsize = id_privsize(se->obj_list[key].id);
 	else
 		se->outsize = 0;
 
@@ -2002,11 +2852,12 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		RET(C_Decrypt, CKR_BUFFER_TOO_SMALL);
 	}
 
-	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
-					    kCFAllocatorNull);
+	inref = input_cfdata(indata, indatalen);
 
-	outref = SecKeyCreateDecryptedData(se->key, se->alg, inref,
-					   &err);
+	token_op_begin(se->token);
+	outref = SP_CALL(SecKeyCreateDecryptedData, se->key, se->alg, inref,
+			 &err);
+	token_op_end(se->token);
 
 	CFRelease(inref);
 
@@ -2048,11 +2899,281 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 
 NOTSUPPORTED(C_DecryptUpdate, (CK_SESSION_HANDLE session, CK_BYTE_PTR inpart, CK_ULONG inpartlen, CK_BYTE_PTR outpart, CK_ULONG_PTR outpartlen))
 NOTSUPPORTED(C_DecryptFinal, (CK_SESSION_HANDLE session, CK_BYTE_PTR lastpart, CK_ULONG_PTR lastpartlen))
-NOTSUPPORTED(C_DigestInit, (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech))
-NOTSUPPORTED(C_Digest, (CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen, CK_BYTE_PTR digest, CK_ULONG_PTR digestlen))
-NOTSUPPORTED(C_DigestUpdate, (CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen))
-NOTSUPPORTED(C_DigestKey, (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key))
-NOTSUPPORTED(C_DigestFinal, (CK_SESSION_HANDLE session, CK_BYTE_PTR digest, CK_ULONG_PTR digestlen))
+
+/*
+ * Start a message digest operation.  These are done entirely in software
+ * using CommonCrypto (via our ccglue routines), so they don't need a key
+ * or even a token.  A digest has its own state in the session, so it can
+ * be in progress at the same time as another operation.
+ */
+
+CK_RV C_DigestInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech)
+{
+	struct session *se;
+	const struct mechanism_map *mm;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_DigestInit);
+
+	os_log_debug(logsys, "session = %d, mechanism = %s", (int) session,
+		     mech ? getCKMName(mech->mechanism) : "NULL");
+
+	if (! mech)
+		RET(C_DigestInit, CKR_ARGUMENTS_BAD);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	if (se->digest_state != NO_PENDING) {
+		os_log_debug(logsys, "Digest operation already active");
+		rv = CKR_OPERATION_ACTIVE;
+		goto out;
+	}
+
+	mm = mechmap_lookup(mech->mechanism);
+
+	if (! mm || (mm->usage_flags & CKF_DIGEST) == 0) {
+		os_log_debug(logsys, "Mechanism %s not valid for digests",
+			     getCKMName(mech->mechanism));
+		rv = CKR_MECHANISM_INVALID;
+		goto out;
+	}
+
+	if (! cc_md_init(mm->sec_digest, &se->digest_mdc)) {
+		os_log_debug(logsys, "Unable to initialize digest "
+			     "algorithm %s", getCKMName(mm->sec_digest));
+		rv = CKR_MECHANISM_INVALID;
+		goto out;
+	}
+
+	se->digest_alg = mm->sec_digest;
+	se->digest_state = DG_INIT;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_DigestInit, rv);
+}
+
+/*
+ * Digest some data in a single part.  Like everything else, if digest
+ * is NULL or too small we return the digest length and leave the
+ * operation active.
+ */
+
+CK_RV C_Digest(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
+	       CK_ULONG indatalen, CK_BYTE_PTR digest, CK_ULONG_PTR digestlen)
+{
+	struct session *se;
+	unsigned int mdlen;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_Digest);
+
+	os_log_debug(logsys, "session = %d, indata = %p, inlen = %d, "
+		     "digest = %p, digestlen = %p", (int) session, indata,
+		     (int) indatalen, digest, digestlen);
+
+	if (! digestlen || (! indata && indatalen))
+		RET(C_Digest, CKR_ARGUMENTS_BAD);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	/*
+	 * C_Digest() can't be used to finish a multi-part digest
+	 */
+
+	if (se->digest_state != DG_INIT) {
+		os_log_debug(logsys, "Not in DG_INIT state");
+		rv = se->digest_state == DG_UPDATE ? CKR_OPERATION_ACTIVE :
+					CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+
+	mdlen = cc_md_len(se->digest_alg);
+
+	if (! digest) {
+		*digestlen = mdlen;
+		os_log_debug(logsys, "digest is NULL, returning an output "
+			     "size of %u", mdlen);
+		goto out;
+	}
+
+	if (*digestlen < mdlen) {
+		os_log_debug(logsys, "Digest size is %u, but our output "
+			     "buffer is %d", mdlen, (int) *digestlen);
+		*digestlen = mdlen;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	cc_md_update(&se->digest_mdc, indata, indatalen);
+	*digestlen = cc_md_final(&se->digest_mdc, digest);
+	se->digest_state = NO_PENDING;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_Digest, rv);
+}
+
+/*
+ * Add more data to a multi-part digest.  The data goes straight from the
+ * caller's buffer into the digest state; we never copy it.
+ */
+
+CK_RV C_DigestUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
+		     CK_ULONG indatalen)
+{
+	struct session *se;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_DigestUpdate);
+
+	os_log_debug(logsys, "session = %d, indata = %p, inlen = %d",
+		     (int) session, indata, (int) indatalen);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	if (se->digest_state != DG_INIT && se->digest_state != DG_UPDATE) {
+		os_log_debug(logsys, "Not in DG_INIT or DG_UPDATE state");
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+
+	/*
+	 * Any error ends the digest operation
+	 */
+
+	if (! indata && indatalen) {
+		se->digest_state = NO_PENDING;
+		rv = CKR_ARGUMENTS_BAD;
+		goto out;
+	}
+
+	cc_md_update(&se->digest_mdc, indata, indatalen);
+	se->digest_state = DG_UPDATE;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_DigestUpdate, rv);
+}
+
+/*
+ * Digest the value of a "key".  We don't have any secret keys (and we
+ * couldn't get at the value of a private key even if we wanted to), but
+ * the spec doesn't prevent us from digesting other objects, so we
+ * digest the value of certificates, which is actually useful.
+ */
+
+CK_RV C_DigestKey(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object)
+{
+	struct session *se;
+	CK_ATTRIBUTE_PTR attr;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_DigestKey);
+
+	os_log_debug(logsys, "session = %d, object = %d", (int) session,
+		     (int) object);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	if (se->digest_state != DG_INIT && se->digest_state != DG_UPDATE) {
+		os_log_debug(logsys, "Not in DG_INIT or DG_UPDATE state");
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+
+	object--;
+
+	if (object >= se->obj_list_count) {
+		se->digest_state = NO_PENDING;
+		rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	LOG_DEBUG_OBJECT(object, se);
+
+	if (se->obj_list[object].class != CKO_CERTIFICATE ||
+	    ! (attr = find_attribute(&se->obj_list[object], CKA_VALUE))) {
+		os_log_debug(logsys, "Object has no value we can digest");
+		se->digest_state = NO_PENDING;
+		rv = CKR_KEY_INDIGESTIBLE;
+		goto out;
+	}
+
+	cc_md_update(&se->digest_mdc, attr->pValue, attr->ulValueLen);
+	se->digest_state = DG_UPDATE;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_DigestKey, rv);
+}
+
+/*
+ * Finish a multi-part digest; the same buffer rules as C_Digest() apply.
+ */
+
+CK_RV C_DigestFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR digest,
+		    CK_ULONG_PTR digestlen)
+{
+	struct session *se;
+	unsigned int mdlen;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_DigestFinal);
+
+	os_log_debug(logsys, "session = %d, digest = %p, digestlen = %p",
+		     (int) session, digest, digestlen);
+
+	if (! digestlen)
+		RET(C_DigestFinal, CKR_ARGUMENTS_BAD);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	if (se->digest_state != DG_INIT && se->digest_state != DG_UPDATE) {
+		os_log_debug(logsys, "Not in DG_INIT or DG_UPDATE state");
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+
+	mdlen = cc_md_len(se->digest_alg);
+
+	if (! digest) {
+		*digestlen = mdlen;
+		os_log_debug(logsys, "digest is NULL, returning an output "
+			     "size of %u", mdlen);
+		goto out;
+	}
+
+	if (*digestlen < mdlen) {
+		os_log_debug(logsys, "Digest size is %u, but our output "
+			     "buffer is %d", mdlen, (int) *digestlen);
+		*digestlen = mdlen;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	*digestlen = cc_md_final(&se->digest_mdc, digest);
+	se->digest_state = NO_PENDING;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_DigestFinal, rv);
+}
 
 /*
  * Start a signature operation.  Our global assumption is that the signature
@@ -2117,7 +3238,7 @@ CK_RV C_SignInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * See the comments in C_EncryptInit() for what is going on here
 	 */
 
-	mm = get_mechmap(mech->mechanism);
+	mm = mechmap_lookup(mech->mechanism);
 
 	if (! mm || (mm->usage_flags & CKF_SIGN) == 0) {
 		rv = CKR_MECHANISM_INVALID;
@@ -2134,16 +3255,19 @@ CK_RV C_SignInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * Map our mechanism onto what we need for signing
 	 */
 
+	if (! token_bind(se->token)) {
+		rv = CKR_DEVICE_ERROR;
+		goto out;
+	}
+
 	if (se->key)
 		CFRelease(se->key);
 
-	LOCK_MUTEX(se->token->entry_mutex);
 	se->key = se->obj_list[object].id->privkey;
 	CFRetain(se->key);
-	UNLOCK_MUTEX(se->token->entry_mutex);
 
 	if (mm->blocksize_out) {
-		se->outsize = SecKeyGetBlockSize(se->key);
+		se->outsize = id_privsize(se->obj_list[object].id);
 	} else {
 		se->outsize = 0;
 	}
@@ -2230,10 +3354,11 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 		goto out;
 	}
 
-	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
-					    kCFAllocatorNull);
+	inref = input_cfdata(indata, indatalen);
 
-	outref = SecKeyCreateSignature(se->key, se->alg, inref, &err);
+	token_op_begin(se->token);
+	outref = SP_CALL(SecKeyCreateSignature, se->key, se->alg, inref, &err);
+	token_op_end(se->token);
 
 	CFRelease(inref);
 
@@ -2287,37 +3412,202 @@ out:
 }
 
 /*
- * Support a multi-part signature operation
+ * Our batch signing extension (see keychain_pkcs11_ext.h).  This uses the
+ * key and algorithm that C_SignInit() set up, and runs the signatures
+ * in parallel with dispatch_apply_f(); the per-token semaphore still
+ * limits how many go to the card at once.
  */
 
-CK_RV C_SignUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
-		   CK_ULONG indatalen)
+struct batch_sign {
+	struct session *	se;
+	CK_BYTE_PTR *		indata;
+	CK_ULONG_PTR		indatalen;
+	CK_BYTE_PTR		sigbuf;
+	CK_ULONG		sigstride;
+	CK_ULONG_PTR		siglen;
+	_Atomic CK_RV		rv;		/* First failure */
+};
+
+static void
+batch_sign_one(void *context, size_t i)
+{
+	struct batch_sign *bs = (struct batch_sign *) context;
+	CFDataRef inref, outref;
+	CFErrorRef err = NULL;
+	CK_RV rv = CKR_OK, expected = CKR_OK;
+
+	inref = CFDataCreateWithBytesNoCopy(NULL, bs->indata[i],
+					    bs->indatalen[i], kCFAllocatorNull);
+
+	token_op_begin(bs->se->token);
+	outref = SP_CALL(SecKeyCreateSignature, bs->se->key, bs->se->alg, inref,
+			 &err);
+	token_op_end(bs->se->token);
+
+	CFRelease(inref);
+
+	if (! outref) {
+		os_log_debug(logsys, "SecKeyCreateSignature failed for batch "
+			     "entry %zu: %{public}@", i, err);
+		CFRelease(err);
+		rv = CKR_GENERAL_ERROR;
+	} else if (CFDataGetLength(outref) > bs->sigstride) {
+		os_log_debug(logsys, "Batch entry %zu signature is %ld bytes, "
+			     "stride is %lu", i, CFDataGetLength(outref),
+			     bs->sigstride);
+		rv = CKR_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(bs->sigbuf + i * bs->sigstride,
+		       CFDataGetBytePtr(outref), CFDataGetLength(outref));
+		bs->siglen[i] = CFDataGetLength(outref);
+	}
+
+	if (outref)
+		CFRelease(outref);
+
+	if (rv != CKR_OK) {
+		bs->siglen[i] = CK_UNAVAILABLE_INFORMATION;
+		atomic_compare_exchange_strong(&bs->rv, &expected, rv);
+	}
+}
+
+CK_RV C_KeychainSignBatch(CK_SESSION_HANDLE session, CK_ULONG count,
+			  CK_BYTE_PTR *indata, CK_ULONG_PTR indatalen,
+			  CK_BYTE_PTR sigbuf, CK_ULONG sigstride,
+			  CK_ULONG_PTR siglen)
 {
 	struct session *se;
+	struct batch_sign bs;
 	CK_RV rv = CKR_OK;
 
-	FUNCINITCHK(C_SignUpdate);
+	FUNCINITCHK(C_KeychainSignBatch);
 
-	os_log_debug(logsys, "session = %d, indata = %p, inlen = %d",
-		     (int) session, indata, (int) indatalen);
+	os_log_debug(logsys, "session = %d, count = %lu, sigbuf = %p, "
+		     "sigstride = %lu", (int) session, count, sigbuf,
+		     sigstride);
 
 	CHECKSESSION(session, se);
 
-	LOCK_MUTEX(se->mutex);
+	if (count == 0 || ! indata || ! indatalen || ! siglen)
+		RET(C_KeychainSignBatch, CKR_ARGUMENTS_BAD);
 
-	/*
-	 * Make sure we are either in S_INIT or S_UPDATE
-	 */
+	LOCK_MUTEX(se->mutex);
 
-	if (se->state != S_INIT && se->state != S_UPDATE) {
-		os_log_debug(logsys, "Not in S_INIT or S_UPDATE state");
+	if (se->state != S_INIT) {
+		os_log_debug(logsys, "Sign operation not initialized");
 		rv = CKR_OPERATION_NOT_INITIALIZED;
 		goto out;
 	}
 
 	/*
-	 * There are some signature operations that cannot take a
-	 * multi-part operation.  The big one is CKM_RSA_PKCS, but
+	 * Same as C_Sign(): with no output buffer just return the size
+	 */
+
+	if (! sigbuf) {
+		if (! se->outsize) {
+			rv = CKR_BUFFER_TOO_SMALL;
+			goto out;
+		}
+		siglen[0] = se->outsize;
+		goto out;
+	}
+
+	if (se->outsize && se->outsize > sigstride) {
+		os_log_debug(logsys, "Output size is %d, but our signature "
+			     "stride is %d", (int) se->outsize, (int) sigstride);
+		siglen[0] = se->outsize;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	bs.se = se;
+	bs.indata = indata;
+	bs.indatalen = indatalen;
+	bs.sigbuf = sigbuf;
+	bs.sigstride = sigstride;
+	bs.siglen = siglen;
+	atomic_init(&bs.rv, CKR_OK);
+
+	dispatch_apply_f(count, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			 &bs, batch_sign_one);
+
+	rv = atomic_load(&bs.rv);
+
+	CFRelease(se->key);
+	se->key = NULL;
+	se->outsize = 0;
+	se->state = NO_PENDING;
+
+out:
+	UNLOCK_MUTEX(se->mutex);
+
+	RET(C_KeychainSignBatch, rv);
+}
+
+/*
+ * Return our performance statistics.  This doesn't need the library to
+ * be initialized, since the statistics are kept from the time we're
+ * loaded.
+ */
+
+CK_RV C_KeychainGetStats(CK_KEYCHAIN_STAT_PTR stats, CK_ULONG_PTR count,
+			 CK_KEYCHAIN_ERROR_STAT_PTR errors,
+			 CK_ULONG_PTR errcount)
+{
+	unsigned int n, errn;
+	CK_RV rv = CKR_OK;
+
+	FUNCINIT(C_KeychainGetStats);
+
+	if (! count || ! errcount)
+		RET(C_KeychainGetStats, CKR_ARGUMENTS_BAD);
+
+	errn = errors ? *errcount : 0;
+
+	n = stats_get(stats, stats ? *count : 0, errors, &errn);
+
+	if ((stats && *count < n) || (errors && *errcount < errn))
+		rv = CKR_BUFFER_TOO_SMALL;
+
+	*count = n;
+	*errcount = errn;
+
+	RET(C_KeychainGetStats, rv);
+}
+
+/*
+ * Support a multi-part signature operation
+ */
+
+CK_RV C_SignUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
+		   CK_ULONG indatalen)
+{
+	struct session *se;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_SignUpdate);
+
+	os_log_debug(logsys, "session = %d, indata = %p, inlen = %d",
+		     (int) session, indata, (int) indatalen);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(se->mutex);
+
+	/*
+	 * Make sure we are either in S_INIT or S_UPDATE
+	 */
+
+	if (se->state != S_INIT && se->state != S_UPDATE) {
+		os_log_debug(logsys, "Not in S_INIT or S_UPDATE state");
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+
+	/*
+	 * There are some signature operations that cannot take a
+	 * multi-part operation.  The big one is CKM_RSA_PKCS, but
 	 * there are others.
 	 *
 	 * For these, there is no "digest" algorithm available.  So if
@@ -2349,6 +3639,13 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		 * when the key is on a smartcard.
 		 */
 
+		/*
+		 * If an earlier operation was abandoned while it was
+		 * streaming, make sure it's done with our context.
+		 */
+
+		sess_md_wait(se);
+
 		if (! cc_md_init(se->hash_alg, &se->mdc)) {
 			os_log_debug(logsys, "Unable to initialize digest "
 				     "function for %s",
@@ -2360,7 +3657,7 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		se->state = S_UPDATE;
 	}
 
-	cc_md_update(se->mdc, indata, indatalen);
+	sess_md_update(se, indata, indatalen);
 
 out:
 	UNLOCK_MUTEX(se->mutex);
@@ -2377,7 +3674,7 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 {
 	struct session *se;
 	CFErrorRef err = NULL;
-	unsigned char *digest = NULL;
+	unsigned char digest[CC_MD_MAX_LEN];
 	unsigned int digest_len;
 	CFDataRef sigout = NULL, datain = NULL;
 	CK_RV rv = CKR_OK;
@@ -2437,16 +3734,15 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 	 * Finalize the digest operation.
 	 */
 
-	cc_md_final(se->mdc, &digest, &digest_len);
-	se->mdc = NULL;
+	sess_md_wait(se);
+	digest_len = cc_md_final(&se->mdc, digest);
 
 	/*
 	 * Pass the digested data into the SecKeyCreateSignature
 	 * function.  Note that we use the "digest" algorithm
 	 */
 
-	datain = CFDataCreateWithBytesNoCopy(NULL, digest, digest_len,
-					     kCFAllocatorNull);
+	datain = input_cfdata(digest, digest_len);
 
 	if (! datain) {
 		os_log_debug(logsys, "Unable to create digest CFData");
@@ -2457,7 +3753,9 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 	 * Create the actual signature based on the digested data
 	 */
 
-	sigout = SecKeyCreateSignature(se->key, se->dalg, datain, &err);
+	token_op_begin(se->token);
+	sigout = SP_CALL(SecKeyCreateSignature, se->key, se->dalg, datain, &err);
+	token_op_end(se->token);
 
 	if (! sigout) {
 		os_log_debug(logsys, "SecKeyCreateSignature failed: "
@@ -2484,8 +3782,6 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 	CFDataGetBytes(sigout, CFRangeMake(0, *siglen), sig);
 
 outfinish:
-	if (digest)
-		free(digest);
 	if (datain)
 		CFRelease(datain);
 	if (sigout)
@@ -2558,7 +3854,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * See the comments in C_EncryptInit() for what is going on here
 	 */
 
-	mm = get_mechmap(mech->mechanism);
+	mm = mechmap_lookup(mech->mechanism);
 
 	if (! mm || (mm->usage_flags & CKF_VERIFY) == 0) {
 		rv = CKR_MECHANISM_INVALID;
@@ -2578,7 +3874,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	if (se->key)
 		CFRelease(se->key);
 
-	se->key = se->obj_list[key].id->pubkey;
+	se->key = id_pubkey(se->obj_list[key].id, kSecKeyOperationTypeVerify,
+			    se->alg, se->dalg);
 	CFRetain(se->key);
 
 	if (mm->blocksize_out) {
@@ -2619,13 +3916,11 @@ CK_RV C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		goto out;
 	}
 
-	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
-					    kCFAllocatorNull);
-	sigref = CFDataCreateWithBytesNoCopy(NULL, sig, siglen,
-					     kCFAllocatorNull);
+	inref = input_cfdata(indata, indatalen);
+	sigref = input_cfdata(sig, siglen);
 
-	if (!SecKeyVerifySignature(se->key, se->alg, inref, sigref,
-				   &err)) {
+	if (!SP_CALL(SecKeyVerifySignature, se->key, se->alg, inref, sigref,
+		     &err)) {
 		os_log_debug(logsys, "VerifySignature failed: %{public}@", err);
 		CFRelease(err);
 		rv = CKR_SIGNATURE_INVALID;
@@ -2688,6 +3983,13 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		 * in this section.
 		 */
 
+		/*
+		 * If an earlier operation was abandoned while it was
+		 * streaming, make sure it's done with our context.
+		 */
+
+		sess_md_wait(se);
+
 		if (! cc_md_init(se->hash_alg, &se->mdc)) {
 			os_log_debug(logsys, "Unable to initialize digest "
 				     "function for %s",
@@ -2699,7 +4001,7 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		se->state = V_UPDATE;
 	}
 
-	cc_md_update(se->mdc, indata, indatalen);
+	sess_md_update(se, indata, indatalen);
 
 out:
 	UNLOCK_MUTEX(se->mutex);
@@ -2714,7 +4016,7 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 	struct session *se;
 	CFDataRef sigdata = NULL, digest_data = NULL;
 	CFErrorRef err = NULL;
-	unsigned char *digest = NULL;
+	unsigned char digest[CC_MD_MAX_LEN];
 	unsigned int digest_len;
 	CK_RV rv = CKR_OK;
 
@@ -2733,8 +4035,7 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 		goto out;
 	}
 
-	sigdata = CFDataCreateWithBytesNoCopy(NULL, sig, siglen,
-					      kCFAllocatorNull);
+	sigdata = input_cfdata(sig, siglen);
 
 	/*
 	 * At least this is simpler than C_SignFinal.  Finalize the
@@ -2742,14 +4043,13 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR sig,
 	 * algorithm).
 	 */
 
-	cc_md_final(se->mdc, &digest, &digest_len);
-	se->mdc = NULL;
+	sess_md_wait(se);
+	digest_len = cc_md_final(&se->mdc, digest);
 
-	digest_data = CFDataCreateWithBytesNoCopy(NULL, digest, digest_len,
-						  kCFAllocatorNull);
+	digest_data = input_cfdata(digest, digest_len);
 
-	if (!SecKeyVerifySignature(se->key, se->dalg, digest_data, sigdata,
-				   &err)) {
+	if (!SP_CALL(SecKeyVerifySignature, se->key, se->dalg, digest_data,
+		     sigdata, &err)) {
 		os_log_debug(logsys, "VerifySignature failed: %{public}@", err);
 		CFRelease(err);
 		rv = CKR_SIGNATURE_INVALID;
@@ -2760,8 +4060,6 @@ out:
 		CFRelease(sigdata);
 	if (digest_data)
 		CFRelease(digest_data);
-	if (digest)
-		free(digest);
 
 	UNLOCK_MUTEX(se->mutex);
 
@@ -2782,7 +4080,115 @@ NOTSUPPORTED(C_SeedRandom, (CK_SESSION_HANDLE session, CK_BYTE_PTR seed, CK_ULON
 NOTSUPPORTED(C_GenerateRandom, (CK_SESSION_HANDLE session, CK_BYTE_PTR randomdata, CK_ULONG randomlen))
 NOTSUPPORTED(C_GetFunctionStatus, (CK_SESSION_HANDLE session))
 NOTSUPPORTED(C_CancelFunction, (CK_SESSION_HANDLE session))
-NOTSUPPORTED(C_WaitForSlotEvent, (CK_SESSION_HANDLE session, CK_SLOT_ID_PTR slot_id, CK_VOID_PTR reserved))
+
+/*
+ * Wait for a token to be inserted or removed.  We return the first slot
+ * in our event queue; if there isn't one, either return CKR_NO_EVENT
+ * (if CKF_DONT_BLOCK is set) or wait until there is.  If C_Finalize()
+ * is called while we're waiting, return CKR_CRYPTOKI_NOT_INITIALIZED.
+ */
+
+CK_RV C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR slot_id,
+			 CK_VOID_PTR reserved)
+{
+	FUNCINITCHK(C_WaitForSlotEvent);
+
+	os_log_debug(logsys, "flags = %#lx, slot_id = %p, reserved = %p",
+		     flags, slot_id, reserved);
+
+	if (reserved || ! slot_id)
+		RET(C_WaitForSlotEvent, CKR_ARGUMENTS_BAD);
+
+	pthread_mutex_lock(&event_mutex);
+
+	while (event_count == 0 && ! event_shutdown) {
+		if (flags & CKF_DONT_BLOCK) {
+			pthread_mutex_unlock(&event_mutex);
+			RET(C_WaitForSlotEvent, CKR_NO_EVENT);
+		}
+
+		event_waiters++;
+		pthread_cond_wait(&event_cond, &event_mutex);
+		event_waiters--;
+	}
+
+	if (event_shutdown) {
+		/*
+		 * C_Finalize() waits for all of the waiters to leave, so
+		 * let it know when we're the last one.
+		 */
+		if (event_waiters == 0)
+			pthread_cond_broadcast(&event_cond);
+		pthread_mutex_unlock(&event_mutex);
+		RET(C_WaitForSlotEvent, CKR_CRYPTOKI_NOT_INITIALIZED);
+	}
+
+	*slot_id = event_queue[0];
+	memmove(event_queue, event_queue + 1,
+		--event_count * sizeof(*event_queue));
+
+	pthread_mutex_unlock(&event_mutex);
+
+	os_log_debug(logsys, "Returning event for slot %lu", *slot_id);
+
+	RET(C_WaitForSlotEvent, CKR_OK);
+}
+
+/*
+ * Add a slot to our event queue (if it isn't already there) and wake
+ * up anyone waiting for an event.
+ */
+
+static void
+slot_event(CK_SLOT_ID slot)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&event_mutex);
+
+	if (event_shutdown)
+		goto out;
+
+	for (i = 0; i < event_count; i++)
+		if (event_queue[i] == slot)
+			goto out;
+
+	if (event_count >= event_size) {
+		event_size += 5;
+		event_queue = realloc(event_queue,
+				      sizeof(*event_queue) * event_size);
+	}
+
+	event_queue[event_count++] = slot;
+
+	pthread_cond_broadcast(&event_cond);
+
+out:
+	pthread_mutex_unlock(&event_mutex);
+}
+
+/*
+ * Wake up all threads waiting in C_WaitForSlotEvent() and wait for them
+ * to return; then throw away any events left in the queue.
+ */
+
+static void
+slot_event_shutdown(void)
+{
+	pthread_mutex_lock(&event_mutex);
+
+	event_shutdown = true;
+	pthread_cond_broadcast(&event_cond);
+
+	while (event_waiters > 0)
+		pthread_cond_wait(&event_cond, &event_mutex);
+
+	free(event_queue);
+	event_queue = NULL;
+	event_count = event_size = 0;
+
+	pthread_mutex_unlock(&event_mutex);
+}
 
 /*
  * Use the Security framework to scan for any identities that are provided
@@ -2807,6 +4213,10 @@ add_token_id(CFStringRef tokenid)
 	unsigned int i, count;
 	OSStatus ret;
 	struct slot_entry *token;
+	struct slot_table *st;
+	struct id_scan scan;
+	uint64_t start = stats_start();
+	CK_RV rv = CKR_OK;
 
 	/*
 	 * Our keys to create our query dictionary.
@@ -2865,8 +4275,10 @@ add_token_id(CFStringRef tokenid)
 	 * If the first call to add_dict succeeds then all of the rest will.
 	 */
 
-	if (! add_dict(&query, kSecClass, kSecClassIdentity))
-		return;
+	if (! add_dict(&query, kSecClass, kSecClassIdentity)) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
 	add_dict(&query, kSecMatchLimit, kSecMatchLimitAll);
 	add_dict(&query, kSecAttrAccessGroup, kSecAttrAccessGroupToken);
 	add_dict(&query, kSecAttrTokenID, tokenid);
@@ -2877,7 +4289,7 @@ add_token_id(CFStringRef tokenid)
 	 * This is where the actual query happens
 	 */
 
-	ret = SecItemCopyMatching(query, &result);
+	ret = SP_CALL(SecItemCopyMatching, query, &result);
 
 	CFRelease(query);
 
@@ -2898,12 +4310,34 @@ add_token_id(CFStringRef tokenid)
 		} else {
 			LOG_SEC_ERR("SecItemCopyMatching failed: "
 				    "%{public}@", ret);
+			rv = CKR_GENERAL_ERROR;
 		}
 		goto out;
 	}
 
 	count = cflistcount(result);
 
+	scan.result = result;
+	scan.ids = calloc(count, sizeof(*scan.ids));
+
+	/*
+	 * If this card was removed recently then we might still have the
+	 * slot entry we built for it; if so, all we need are new identity
+	 * references.
+	 */
+
+	if ((token = token_snapshot_find(tokenid, result, count, scan.ids))) {
+		if (token_snapshot_rebind(token, &scan)) {
+			os_log_debug(logsys, "Reusing token snapshot");
+			free(scan.ids);
+			goto add_slot;
+		}
+
+		os_log_debug(logsys, "Unable to reuse token snapshot");
+		slot_entry_destroy(token);
+		memset(scan.ids, 0, count * sizeof(*scan.ids));
+	}
+
 	/*
 	 * Allocate our slot entry now and allocate a new
 	 * LocalAuthentication context for it.
@@ -2918,22 +4352,66 @@ add_token_id(CFStringRef tokenid)
 	token->id_list = NULL;
 	token->id_count = 0;
 	token->id_size = 0;
+	token->objs = NULL;
 	token->logged_in = false;
 	token->label = NULL;
 	token->lacontext = lacontext_new();
 	CREATE_MUTEX(token->entry_mutex);
 	token->refcount = 1;
+	token->op_sem = max_token_requests > 0 ?
+			dispatch_semaphore_create(max_token_requests) : NULL;
+	CREATE_MUTEX(token->bind_mutex);
+	atomic_init(&token->bound, true);
 
 	os_log_debug(logsys, "%u identities found", count);
 
-	for (i = 0; i < count; i++)  {
-		os_log_debug(logsys, "Copying identity %u", i + 1);
+	if (token_cache_enabled && load_token_cache(token, result, count)) {
+		os_log_debug(logsys, "Loaded token objects from cache");
+		free(scan.ids);
+		goto add_slot;
+	}
+
+	/*
+	 * Turning each identity into something useful takes a couple
+	 * of trips through the Security framework, so fetch all of the
+	 * private key attributes we need in one query, and then resolve
+	 * all of the identities at once.  They go into the identity list
+	 * in the same order we found them, so the object handles are
+	 * stable.
+	 */
+
+	scan.token = token;
+	scan.keys = token_key_attrs(tokenid);
 
-		if (add_identity(token, cfgetindex(result, i)) == -1)
+	dispatch_apply_f(count, dispatch_get_global_queue(
+				DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			 &scan, resolve_identity);
+
+	for (i = 0; i < count; i++) {
+		if (! scan.ids[i]) {
 			os_log_debug(logsys, "Adding identity %u "
 				     "failed", i + 1);
+			continue;
+		}
+
+		/*
+		 * If we don't have enough id entries, allocate some more.
+		 */
+
+		if (++token->id_count > token->id_size) {
+			token->id_size += 5;
+			token->id_list = realloc(token->id_list,
+						 sizeof(*(token->id_list)) *
+								token->id_size);
+		}
+
+		token->id_list[token->id_count - 1] = scan.ids[i];
 	}
 
+	free(scan.ids);
+	if (scan.keys)
+		CFRelease(scan.keys);
+
 	/*
 	 * If we didn't have any identities added, then this token
 	 * isn't valid.  Just free it.
@@ -2950,6 +4428,12 @@ add_token_id(CFStringRef tokenid)
 	 */
 
 	build_id_objects(token);
+	token->objs->idx = build_obj_index(token->objs->list,
+					   token->objs->count);
+	objidx_defer(token->objs->idx, obj_set_index_fill, token->objs);
+
+	if (token_cache_enabled)
+		write_token_cache(token);
 
 	/*
 	 * Now that we have a valid entry, time to add it to our slot list.
@@ -2957,1858 +4441,4398 @@ add_token_id(CFStringRef tokenid)
 	 * slot list a little bigger and add one
 	 */
 
-	LOCK_MUTEX(slot_mutex);
-	for (i = 0; i < slot_count; i++) {
-		if (slot_list[i] == NULL) {
-			goto got_slot;
-		}
-	}
+add_slot:
+	/*
+	 * Bring over the token label, which is just going to be the
+	 * first identity label (a snapshot already has one).
+	 */
 
-	slot_count++;
+	if (! token->label)
+		token->label = strdup(token->id_list[0]->label);
 
-	slot_list = realloc(slot_list, sizeof(*slot_list) * slot_count);
+	LOCK_MUTEX(slot_mutex);
+	st = slot_table;
+	for (i = 0; i < st->count; i++) {
+		if (st->slots[i] == NULL)
+			break;
+	}
 
-got_slot:
 	/*
-	 * Bring over the token label, which is just going to be the
-	 * first identity label.
+	 * If i == st->count there wasn't a free slot, so the new table
+	 * gets one more slot
 	 */
 
-	token->label = strdup(token->id_list[0]->label);
+	st = slot_table_copy(st, i == st->count ? st->count + 1 : st->count);
 
 	os_log_debug(logsys, "Adding new token at slot %u", i);
-	slot_list[i] = token;
+	st->slots[i] = token;
+	slot_table_publish(st, NULL);
+	slot_event(i);
 
 	UNLOCK_MUTEX(slot_mutex);
 
 out:
 	if (result)
 		CFRelease(result);
+
+	stats_record(STAT_TOKEN_INSERT, start, rv);
 	return;
 }
 
 /*
- * Add an identity to our identity list.  Takes a CFDictionaryRef with
- * all of the identity attributes (and persistent reference) in it.
+ * Fetch the attributes for all of the private keys on a token with one
+ * query, and return them in a dictionary keyed by the application label
+ * (which is how getaccesscontrol() and getkeylabel() find a private key).
+ * Returns NULL if we can't get them; in that case we just fall back to
+ * looking up each key separately.
  */
 
-static int
-add_identity(struct slot_entry *entry, CFDictionaryRef dict)
+static CFDictionaryRef
+token_key_attrs(CFStringRef tokenid)
 {
-	CFStringRef label;
-	CFNumberRef keytype;
-	CFTypeRef refresult;
-	CFMutableDictionaryRef refquery = NULL;
-	CFDictionaryRef keydict;
-	CFDataRef p_ref;
+	CFMutableDictionaryRef query = NULL, keys;
+	CFTypeRef result = NULL;
+	CFDictionaryRef attrs;
+	CFDataRef applabel;
+	unsigned int i, count;
 	OSStatus ret;
-	struct id_info *id;
 
-	/*
-	 * Just in case ...
-	 */
+	if (! add_dict(&query, kSecClass, kSecClassKey))
+		return NULL;
+	add_dict(&query, kSecAttrKeyClass, kSecAttrKeyClassPrivate);
+	add_dict(&query, kSecMatchLimit, kSecMatchLimitAll);
+	add_dict(&query, kSecAttrAccessGroup, kSecAttrAccessGroupToken);
+	add_dict(&query, kSecAttrTokenID, tokenid);
+	add_dict(&query, kSecReturnAttributes, kCFBooleanTrue);
 
-	if (dict == NULL) {
-		os_log_debug(logsys, "Identity dictionary is NULL, returning!");
-		return -1;
+	ret = SP_CALL(SecItemCopyMatching, query, &result);
+
+	CFRelease(query);
+
+	if (ret) {
+		LOG_SEC_ERR("Private key SecItemCopyMatching failed: "
+			    "%{public}@", ret);
+		return NULL;
 	}
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValuePersistentRef,
-					    (const void **)&p_ref)) {
-		os_log_debug(logsys, "Persistent id reference not found");
-		return -1;
+	keys = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+					 &kCFTypeDictionaryKeyCallBacks,
+					 &kCFTypeDictionaryValueCallBacks);
+
+	count = cflistcount(result);
+
+	for (i = 0; i < count; i++) {
+		attrs = cfgetindex(result, i);
+
+		if (attrs && CFGetTypeID(attrs) == CFDictionaryGetTypeID() &&
+		    CFDictionaryGetValueIfPresent(attrs,
+						  kSecAttrApplicationLabel,
+						  (const void **) &applabel))
+			CFDictionarySetValue(keys, applabel, attrs);
 	}
 
-	/*
-	 * Our query dictionary for SecItemCopyMatching.  Here are the
-	 * components of our query dictionary:
-	 *
-	 * kSecClass = kSecClassIdentity
-	 *	See scan_identities() for more details, but this limits us to
-	 *	only retrieving identities.
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 *	Because we're using the persistent reference (see below)
-	 *	we really only want one response (and we should only get one)
-	 *	so set the match limit to one so we only get back a single
-	 *	response.
-	 * kSecReturnRef = kCFBooleanTrue
-	 *	We set this to indicate that we want an identity reference
-	 *	back (SecIdentityRef); this should be the only thing returned
-	 *	because we set no other return keys and we are requesting
-	 *	only one.
-	 * kSecUseAuthenticationContext = LAContext
-	 *	This is covered in more detail in localauth.m, but the idea
-	 *	here is this is a Local Authentication context created by
-	 *	the LAContext class.  When converting from a persistent ref
-	 *	to a SecIdentityRef and an auth context is passed in via
-	 *	kSecUseAuthenticationContext, it is converted by the Security
-	 *	framework internally to an ACM context and we can then later
-	 *	use the LAContext methods to authentication to the token.
-	 * kSecValuePersistentRef = persistent reference
-	 *	This is the persistent reference generated in the attribute
-	 *	dictionary when we did the search for all identities in
-	 *	scan_identities().  The reason we get a persistent reference
-	 *	in scan_identities() and then convert it to a "real" reference
-	 *	(e.g., SecIdentityRef) is so we can bind the LAContext
-	 *	to the identity so we have the ability to input the PIN
-	 *	via the PKCS#11 API (rather than let the Security framework
-	 *	ask for it).  It is worth noting that there is ALSO an
-	 *	attribute key called "kSecAttrPersistentReference"; as far
-	 *	as I can tell, that key is not used for anything.  The
-	 *	Apple documentation says to convert a persistent reference
-	 *	to a normal reference you should pass in the persistent
-	 *	reference in a CFArray using the kSecMatchItemList, but
-	 *	I can definitely say that at least for me, this did not work.
-	 */
+	CFRelease(result);
 
-	/*
-	 * Build up our query dictionary (see above comments).  Feed in
-	 * the persistent reference to extract the REAL identity reference
-	 * (SecIdentityRef).  If we also pass in the LAContext this will
-	 * attach the LAContext to the identity.
-	 */
+	os_log_debug(logsys, "Found attributes for %ld private keys",
+		     (long) CFDictionaryGetCount(keys));
 
-	if (! add_dict(&refquery, kSecClass, kSecClassIdentity))
-		return -1;
-	add_dict(&refquery, kSecMatchLimit, kSecMatchLimitOne);
-	add_dict(&refquery, kSecReturnRef, kCFBooleanTrue);
-	add_dict(&refquery, kSecValuePersistentRef, p_ref);
+	return keys;
+}
 
-	/*
-	 * It turns out that in some cases (if you are running under
-	 * 32 bit mode, for example), you won't be able to allocate a
-	 * lacontext.  So if that happens we need to be sure not to
-	 * put the lacontext into our dictionary.  We can't use kCFNull
-	 * because that will cause the SecItemCopyMatching call later
-	 * to fail, so if we don't have a lacontext then don't add it to
-	 * the query dictionary.
-	 */
+/*
+ * Resolve a single identity from add_token_id() (called via
+ * dispatch_apply_f(), so this runs concurrently with the other identities
+ * on the token).  Each identity gets its own result slot, so we don't
+ * need any locking.
+ */
 
-	if (entry->lacontext)
-		add_dict(&refquery, kSecUseAuthenticationContext,
-			 entry->lacontext);
+static void
+resolve_identity(void *context, size_t i)
+{
+	struct id_scan *scan = (struct id_scan *) context;
 
-	ret = SecItemCopyMatching(refquery, &refresult);
+	os_log_debug(logsys, "Copying identity %u", (unsigned int) i + 1);
 
-	CFRelease(refquery);
+	scan->ids[i] = add_identity(scan->token, cfgetindex(scan->result, i),
+				    scan->keys);
+}
 
-	if (ret) {
-		LOG_SEC_ERR("Persistent ref SecItemCopyMatching "
-			    "failed: %{public}@", ret);
-		return -1;
-	}
+/*
+ * Get a token snapshot ready to use again.  scan->ids has the identity
+ * from the snapshot that goes with each entry in scan->result (from
+ * token_snapshot_find()); all we need is a new LAContext and new identity
+ * and private key references, since everything else is public and
+ * hasn't changed.  Returns false if any identity couldn't be rebound.
+ */
 
-	if (CFGetTypeID(refresult) != SecIdentityGetTypeID()) {
-		logtype("Was expecting a SecIdentityRef, but got", refresult);
-		CFRelease(refresult);
-		return -1;
-	}
+static bool
+token_snapshot_rebind(struct slot_entry *token, struct id_scan *scan)
+{
+	unsigned int i;
 
-	id = malloc(sizeof(*id));
-	memset(id, 0, sizeof(*id));
+	token->lacontext = lacontext_new();
+	token->logged_in = false;
+	token->removed = false;
+	token->refcount = 1;
 
-	id->ident = NULL;
-	id->cert = NULL;
-	id->privkey = NULL;
-	id->pubkey = NULL;
-	id->label = NULL;
-	id->secaccess = NULL;
-	id->pkeyhash = NULL;
+	scan->token = token;
+	scan->keys = NULL;
 
-	/*
-	 * No need to retain; we own this as a result of it coming out of
-	 * SecItemCopyMatching
-	 */
+	dispatch_apply_f(token->id_count, dispatch_get_global_queue(
+				DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			 scan, rebind_identity);
 
-	id->ident = (SecIdentityRef) refresult;
+	for (i = 0; i < token->id_count; i++)
+		if (! scan->ids[i])
+			return false;
 
 	/*
-	 * Extract out of the dictionary all of the things we need.
-	 * Note that since we are following the "Get Rule" and this
-	 * dictionary should be de-allocated soon, we need to CFRetain()
-	 * everything we want for later.
-	 *
-	 * Key items:
-	 *
-	 * Attribute label (display string for the identity)
-	 * SecIdentityRef (used by Security Framework)
-	 * Various attribute flags (we use those for returning
-	 * object information)
-	 *
-	 * To make things easier, we extract the private key object
-	 * and the certificate from the identity.  Those are copies and
-	 * we don't need to retain those objects.
+	 * If the objects came from the token cache and were never bound,
+	 * token_bind() still has work to do; it needs the new identity
+	 * attributes, with the identities in the same order.
 	 */
 
-	if (CFDictionaryGetValueIfPresent(dict, kSecAttrLabel,
-					  (const void **) &label)) {
-		id->label = getstrcopy(label);
-		os_log_debug(logsys, "Identity label: %{public}@", label);
-	} else {
-		id->label = strdup("Hardware token");
-		os_log_debug(logsys, "No label, using default");
+	if (! atomic_load(&token->bound)) {
+		memcpy(token->id_list, scan->ids,
+		       token->id_count * sizeof(*scan->ids));
+		if (token->id_result)
+			CFRelease(token->id_result);
+		token->id_result = CFRetain(scan->result);
 	}
-	
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrKeyType,
-					    (const void **) &keytype)) {
-		os_log_debug(logsys, "Key type not found");
-		ret = -1;
-		goto out;
+
+	return true;
+}
+
+/*
+ * Rebind a single identity from a token snapshot (called via
+ * dispatch_apply_f(), like resolve_identity()).  If this fails we
+ * clear out the entry in scan->ids; the identity itself still belongs
+ * to the token.
+ */
+
+static void
+rebind_identity(void *context, size_t i)
+{
+	struct id_scan *scan = (struct id_scan *) context;
+	struct id_info *id = scan->ids[i];
+	OSStatus ret;
+
+	id->ident = copy_identity(cfgetindex(scan->result, i),
+				  scan->token->lacontext);
+
+	if (! id->ident) {
+		scan->ids[i] = NULL;
+		return;
 	}
 
-	id->keytype = convert_keytype(keytype);
+	ret = SP_CALL(SecIdentityCopyPrivateKey, id->ident, &id->privkey);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
-					    (const void **) &id->pkeyhash)) {
-		os_log_debug(logsys, "Public key hash not found");
-		ret = -1;
-		goto out;
+	if (ret) {
+		LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
+		scan->ids[i] = NULL;
 	}
+}
 
-	CFRetain(id->pkeyhash);
+/*
+ * Make sure we have the identity and private key references (and the
+ * access control) for every identity on a token.  This is only ever
+ * something to do if the token objects came out of the token cache;
+ * otherwise add_identity() got all of them already.  If we can't
+ * resolve every identity we return false, and try again next time.
+ *
+ * The identities are copied with the token's LAContext, which
+ * token_logout() can get rid of at any time; so we take our own
+ * reference to it (under the entry mutex) first.  If the caller already
+ * holds the entry mutex, it should call token_bind_with() instead.
+ */
 
-	id->privcansign = boolfromdict("Can-Sign", dict, kSecAttrCanSign);
-	id->privcandecrypt = boolfromdict("Can-Decrypt", dict,
-					  kSecAttrCanDecrypt);
+static bool
+token_bind(struct slot_entry *token)
+{
+	void *lacontext;
+	bool bound;
 
-	ret = SecIdentityCopyCertificate(id->ident, &id->cert);
+	if (! token)
+		return false;
 
-	if (ret)
-		LOG_SEC_ERR("CopyCertificate failed: %{public}@", ret);
+	if (atomic_load_explicit(&token->bound, memory_order_acquire))
+		return true;
 
-	if (! ret) {
-		ret = SecIdentityCopyPrivateKey(id->ident, &id->privkey);
-		if (ret)
-			LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
-		else {
-			if (! (id->secaccess = getaccesscontrol(dict))) {
-				ret = -1;
-				goto out;
-			}
-		}
-	}
+	LOCK_MUTEX(token->entry_mutex);
+	lacontext = lacontext_retain(token->lacontext);
+	UNLOCK_MUTEX(token->entry_mutex);
 
-	if ( !ret) {
-		ret = SecCertificateCopyPublicKey(id->cert, &id->pubkey);
-		if (ret)
-			LOG_SEC_ERR("CopyPublicKey failed: %{public}@", ret);
-	}
+	bound = token_bind_with(token, lacontext);
 
-	/*
-	 * Get our public key attributes
-	 */
+	if (lacontext)
+		lacontext_free(lacontext);
 
-	if (! ret) {
-		keydict = SecKeyCopyAttributes(id->pubkey);
+	return bound;
+}
 
-		id->pubcanverify = boolfromdict("Can-Verify", keydict,
-						kSecAttrCanVerify);
-		id->pubcanencrypt = boolfromdict("Can-Encrypt", keydict,
-						 kSecAttrCanEncrypt);
-		id->pubcanwrap = boolfromdict("Can-Wrap", keydict,
-					      kSecAttrCanWrap);
-		/*
-		 * We're going to cheat here JUST a bit.  It turns out
-		 * if a public key is set to allow wrapping, it can also
-		 * do generic encryption.  So if we have wrapping set, also
-		 * set encryption.
-		 */
+/*
+ * The rest of token_bind(); the caller makes sure lacontext stays valid
+ * until we return (by holding a reference, or the entry mutex)
+ */
 
-		if (id->pubcanwrap)
-			id->pubcanencrypt = true;
+static bool
+token_bind_with(struct slot_entry *token, void *lacontext)
+{
+	struct id_scan scan;
+	unsigned int i;
+	bool bound = true;
 
-		CFRelease(keydict);
-	}
+	if (atomic_load_explicit(&token->bound, memory_order_acquire))
+		return true;
 
-out:
-	if (ret) {
-		id_info_free(id);
-		return -1;
+	LOCK_MUTEX(token->bind_mutex);
+
+	if (atomic_load_explicit(&token->bound, memory_order_relaxed))
+		goto out;
+
+	os_log_debug(logsys, "Resolving %u cached identities for token "
+		     "%{public}@", token->id_count, token->tokenid);
+
+	scan.token = token;
+	scan.lacontext = lacontext;
+	scan.result = token->id_result;
+	scan.keys = token_key_attrs(token->tokenid);
+	scan.ids = malloc(token->id_count * sizeof(*scan.ids));
+	memcpy(scan.ids, token->id_list, token->id_count * sizeof(*scan.ids));
+
+	dispatch_apply_f(token->id_count, dispatch_get_global_queue(
+				DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			 &scan, bind_identity);
+
+	for (i = 0; i < token->id_count; i++) {
+		if (! scan.ids[i]) {
+			os_log_debug(logsys, "Resolving identity %u failed",
+				     i + 1);
+			bound = false;
+		}
 	}
 
-	/*
-	 * If we don't have enough id entries, allocate some more.
-	 */
+	free(scan.ids);
+	if (scan.keys)
+		CFRelease(scan.keys);
 
-	if (++entry->id_count > entry->id_size) {
-		entry->id_size += 5;
-		entry->id_list = realloc(entry->id_list,
-					 sizeof(*(entry->id_list)) *
-					 		entry->id_size);
+	if (bound) {
+		CFRelease(token->id_result);
+		token->id_result = NULL;
+		atomic_store_explicit(&token->bound, true,
+				      memory_order_release);
 	}
 
-	entry->id_list[entry->id_count - 1] = id;
+out:
+	UNLOCK_MUTEX(token->bind_mutex);
 
-	return 0;
+	return bound;
 }
 
 /*
- * Remove a token from a slot
+ * Resolve whatever is missing from a single cached identity (called via
+ * dispatch_apply_f() from token_bind_with()).  On failure we clear out the
+ * entry in scan->ids; anything we did get stays in the identity, so a
+ * later try only does the rest.
  */
 
-void
-remove_token_id(CFStringRef tokenid)
+static void
+bind_identity(void *context, size_t i)
 {
-	int i;
-
-	os_log_debug(logsys, "Received removal event for token %{public}@",
-		     tokenid);
-
-	LOCK_MUTEX(slot_mutex);
+	struct id_scan *scan = (struct id_scan *) context;
+	struct id_info *id = scan->ids[i];
+	CFDictionaryRef dict = cfgetindex(scan->result, i);
+	OSStatus ret;
 
-	/*
-	 * Go through the list and remove whatever token we match on.
-	 * Because we're doing refcounting we shouldn't free any memory
-	 * that is being used by a session.
-	 */
+	if (! id->ident &&
+	    ! (id->ident = copy_identity(dict, scan->lacontext)))
+		goto fail;
 
-	for (i = 0; i < slot_count; i++) {
-		if (slot_list[i] && CFEqual(tokenid, slot_list[i]->tokenid)) {
-			os_log_debug(logsys, "Removing token from slot %d", i);
-			slot_entry_free(slot_list[i], false);
-			slot_list[i] = NULL;
-			break;
+	if (! id->privkey) {
+		ret = SP_CALL(SecIdentityCopyPrivateKey, id->ident,
+			      &id->privkey);
+		if (ret) {
+			LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
+			goto fail;
 		}
 	}
 
-	if (i == slot_count)
-		os_log_debug(logsys, "No matching slot found for token!");
+	if (! id->secaccess &&
+	    ! (id->secaccess = getaccesscontrol(dict, scan->keys)))
+		goto fail;
 
-	UNLOCK_MUTEX(slot_mutex);
+	return;
+
+fail:
+	scan->ids[i] = NULL;
 }
 
 /*
- * This function is called by the dispatch system and will call
- * scan_certificates() and build_cert_objects() and the appropriate
- * memory barrier functions
+ * Compute the fingerprint of an identity, used to tell if a token
+ * snapshot is for the same card.  This is a SHA-256 hash of the public
+ * key hash and the certificate issuer and serial number (which are all
+ * in the identity attribute dictionary, so we don't need to look at the
+ * identity itself).  If an attribute is missing we just hash an empty
+ * value for it.
  */
 
 static void
-background_cert_scan(void *dummy)
+identity_fingerprint(CFDictionaryRef dict, unsigned char *fprint)
 {
-	scan_certificates();
-	build_cert_objects();
+	CFTypeRef keys[] = { kSecAttrPublicKeyHash, kSecAttrIssuer,
+			     kSecAttrSerialNumber };
+	md_context mdc;
+	CFDataRef value;
+	uint32_t len;
+	unsigned int i;
 
-	atomic_store(&cert_list_status, initialized);
+	memset(fprint, 0, ID_FPRINT_LEN);
+
+	if (! cc_md_init(CKM_SHA256, &mdc))
+		return;
+
+	for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+		if (! CFDictionaryGetValueIfPresent(dict, keys[i],
+						    (const void **) &value) ||
+		    CFGetTypeID(value) != CFDataGetTypeID()) {
+			len = 0;
+			cc_md_update(&mdc, (unsigned char *) &len, sizeof(len));
+			continue;
+		}
+
+		len = CFDataGetLength(value);
+		cc_md_update(&mdc, (unsigned char *) &len, sizeof(len));
+		cc_md_update(&mdc, CFDataGetBytePtr(value), len);
+	}
+
+	cc_md_final(&mdc, fprint);
 }
 
 /*
- * Scan the Keychain for certificates and add them to our object database
- *
- * This uses SecItemCopyMatching, but searches for certificates that
- * have a subject name that matches one of our match strings.  Once we
- * find that certificate then we chase down all certificates issued
- * by that certificate; this means you should only need to list Root CAs
- * in your match string list.
+ * Try to build a token's identities and objects from the token cache.
+ * The cache has to have exactly the objects build_id_objects() would
+ * make for these identities (a certificate, public key, and private key
+ * for each identity, in that order); the identity attributes from
+ * SecItemCopyMatching() are kept for token_bind().  Returns false on a
+ * miss, in which case the token is untouched.
  */
 
-static void
-scan_certificates(void)
+static bool
+load_token_cache(struct slot_entry *token, CFTypeRef result,
+		 unsigned int count)
 {
-	char **certs = NULL, **p;
-	CFMutableArrayRef cmatch = NULL;
-	CFMutableSetRef certset = NULL;
-	CFMutableDictionaryRef query = NULL;
-	CFTypeRef result = NULL;
-	OSStatus ret;
-	unsigned int i, count;
-	struct certlist *cl;
+	unsigned char key[CERTCACHE_KEYLEN], *fprints;
+	char name[TOKEN_CACHE_NAMELEN];
+	struct attr_block *head = NULL, **arena = &head;
+	struct obj_info *list = NULL;
+	struct id_info **ids = NULL;
+	unsigned int i, n;
+	cert_cache cache;
+
+	if (count == 0 || ! cache_ready())
+		return false;
 
-	/*
-	 * I tried, at first, to use the built-in searching features
-	 * available in SecItemCopyMatching(), but that turned out to be
-	 * a failure for two reasons:
-	 *
-	 * Matching on the subject name (using kSecMatchSubjectContains)
-	 * SORT-of worked, except if you have a hardware token you will
-	 * get certificates on the hardware token included in the list
-	 * EVEN THOUGH the subject names don't match.
-	 *
-	 * Matching based on issuer (using kSecMatchIssuers) only works
-	 * for IDENTITIES, for some strange reason (really, there is no
-	 * good reason for this that I can tell).
-	 *
-	 * Because SecItemCopyMatching is kind of expensive, what I finally
-	 * decided on was this:
-	 *
-	 * Get a list of ALL certificates.
-	 *
-	 * Generate a CFMutableSet from the original certificate array.
-	 *
-	 * As we add each certificate, remove it from the CFSet
-	 * (to improve on later searching).
-	 *
-	 * Sigh.  Apple, why did you have to make this so hard?
-	 */
+	fprints = malloc(count * ID_FPRINT_LEN);
 
-	/*
-	 * We need to retrieve all valid certificates from our Keychains.
-	 *
-	 * Our query dictionary:
-	 *
-	 * kSecClass = kSecClassCertificate
-	 *	This means we're searching for certificates only,
-	 *	and we don't need private key objects
-	 * kSecMatchLimit = kSecMatchLimitAll
-	 *	Return all matching certificates
-	 * kSecMatchTrustedOnly = kCFBooleanTrue
-	 *	Only match trusted certificates
-	 * kSecReturnRef = kCFBooleanTrue
-	 *	This means return a reference to the certificate
-	 *	object (a SecCertificateRef).  Because we also use
-	 *	kSecReturnAttributes that means the certificate
-	 *	reference ends up in the attribute dictionary.
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 *	This means we return all of the attributes for each 
-	 *	certificate.
-	 */
-
-	/*
-	 * Short circuit the search if "none" is the first entry
-	 */
+	for (i = 0; i < count; i++)
+		identity_fingerprint(cfgetindex(result, i),
+				     fprints + i * ID_FPRINT_LEN);
 
-	certs = prefkey_arrayget("certificateList", default_cert_search);
+	token_cache_key(token->tokenid, fprints, count, name, key);
 
-	if (certs[0] && strcasecmp(certs[0], "none") == 0) {
-		os_log_debug(logsys, "Special entry \"none\" found, not "
-			     "importing Keychain certificates");
-		goto out;
+	if (! (cache = certcache_open_named(name, key))) {
+		free(fprints);
+		return false;
 	}
 
-	cmatch = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	n = certcache_count(cache);
 
-	if (! cmatch) {
-		os_log_debug(logsys, "Unable to create match array!");
-		goto out;
+	if (n != count * 3) {
+		os_log_debug(logsys, "Token cache has %u objects, expected %u",
+			     n, count * 3);
+		goto fail;
 	}
 
-	for (p = certs; *p != NULL; p++) {
-		CFStringRef cm = CFStringCreateWithCString(NULL, *p,
-						   kCFStringEncodingUTF8);
-		CFArrayAppendValue(cmatch, cm);
-		CFRelease(cm);
-	}
+	list = calloc(n, sizeof(*list));
+	ids = calloc(count, sizeof(*ids));
 
-	/*
-	 * This shouldn't be 0, but JUST in case ...
-	 */
+	for (i = 0; i < n; i++) {
+		struct obj_info *obj = &list[i];
 
-	if (CFArrayGetCount(cmatch) == 0) {
-		os_log_debug(logsys, "No certificate match strings found, "
-			     "not importing certificates");
-		goto out;
+		obj->attr_count = certcache_object(cache, i, &obj->class);
+		obj->attr_size = obj->attr_count;
+		obj->attrs = arena_alloc(arena, sizeof(CK_ATTRIBUTE) *
+						obj->attr_count);
+		certcache_attrs(cache, i, obj->attrs);
 	}
 
-	/*
-	 * Get a list of all certificates
-	 */
-
-	if (! add_dict(&query, kSecClass, kSecClassCertificate))
-		goto out;
-	add_dict(&query, kSecMatchLimit, kSecMatchLimitAll);
-	add_dict(&query, kSecMatchTrustedOnly, kCFBooleanTrue);
-	add_dict(&query, kSecReturnRef, kCFBooleanTrue);
-	add_dict(&query, kSecReturnAttributes, kCFBooleanTrue);
+	for (i = 0; i < count; i++) {
+		if (! (ids[i] = cached_identity(&list[i * 3],
+						cfgetindex(result, i)))) {
+			os_log_debug(logsys, "Cached identity %u is invalid",
+				     i + 1);
+			goto fail;
+		}
 
-	os_log_debug(logsys, "About to call SecItemCopyMatching");
+		memcpy(ids[i]->fprint, fprints + i * ID_FPRINT_LEN,
+		       ID_FPRINT_LEN);
+		list[i * 3].id = list[i * 3 + 1].id = list[i * 3 + 2].id =
+									ids[i];
+	}
 
-	ret = SecItemCopyMatching(query, &result);
+	free(fprints);
 
-	os_log_debug(logsys, "SecItemCopyMatching finished");
+	token->id_list = ids;
+	token->id_count = token->id_size = count;
 
-	/*
-	 * If we didn't find ANY certificates at all (really? None?)
-	 * then return.
-	 */
+	token->objs = obj_set_new(list, n, n, head);
+	token->objs->idx = build_obj_index(list, n);
+	token->objs->cache = cache;
 
-	if (ret) {
-		if (ret == errSecItemNotFound) {
-			os_log_debug(logsys, "No valid certificates found; "
-				     "that doesn't seem right!");
-			goto out;
-		} else {
-			LOG_SEC_ERR("Certificate SecItemCopyMatching "
-				    "failed: %{public}@", ret);
-			goto out;
-		}
-	}
+	build_mech_list(token);
 
-	count = cflistcount(result);
+	token->id_result = CFRetain(result);
+	atomic_store(&token->bound, false);
 
-	os_log_debug(logsys, "Searching %u certificates", count);
-	
-	/*
-	 * Before we do anything else, add all of the certificates
-	 * entries to our set.
-	 */
+	return true;
 
-	certset = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+fail:
+	if (ids)
+		id_list_free(ids, count);
+	arena_free(arena);
+	free(list);
+	certcache_close(cache);
+	free(fprints);
 
-	if (! certset) {
-		os_log_debug(logsys, "Unable to create certificate set!");
-		goto out;
-	}
+	return false;
+}
 
-	for (i = 0; i < count; i++)
-		CFSetAddValue(certset, cfgetindex(result, i));
+/*
+ * Recover an identity from its three cached objects (certificate, public
+ * key, private key).  The certificate and public key references are
+ * local ones made from the certificate contents, so none of this goes
+ * near the token.  The public key hash isn't in any object, so that comes
+ * from the identity attributes.
+ *
+ * We don't take the cache's word for any of this: the certificate has to
+ * have the issuer, serial number, and public key hash in the identity
+ * attributes, and the label, key type, and key usage have to be what
+ * the identity attributes say they are.  Anything that doesn't match
+ * is a miss.
+ */
 
-	/*
-	 * Search all of our certificate for matches, and add the
-	 * results.
-	 */
+static struct id_info *
+cached_identity(struct obj_info *objs, CFDictionaryRef dict)
+{
+	unsigned char hash[CC_SHA1_DIGEST_LENGTH];
+	struct id_info *id;
+	CK_ATTRIBUTE_PTR a;
+	CFDictionaryRef keydict;
+	CFDataRef der, value;
+	CFErrorRef err = NULL;
+	CFStringRef label;
+	CFNumberRef keytype;
+	char *livelabel;
+	bool match;
+	OSStatus ret;
 
-	cl = search_certs(certset, cmatch, NULL);
+#define CACHED_ATTR(obj, type) \
+	attr_bsearch((obj)->attrs, (obj)->attr_count, type)
+#define CACHED_BOOL(obj, type) \
+	((a = CACHED_ATTR(obj, type)) && a->ulValueLen == sizeof(CK_BBOOL) && \
+	 *(CK_BBOOL *) a->pValue)
 
-	if (! cl) {
-		os_log_debug(logsys, "No matching certificates found");
-	} else {
-		struct certlist *c;
+	if (! dict || objs[0].class != CKO_CERTIFICATE ||
+	    objs[1].class != CKO_PUBLIC_KEY ||
+	    objs[2].class != CKO_PRIVATE_KEY)
+		return NULL;
 
-		for (c = cl; c != NULL; c = c->next)
-			add_certificate(c->certdict, certset);
+	id = calloc(1, sizeof(*id));
+	pthread_mutex_init(&id->warm_mutex, NULL);
 
-		free_certlist(cl);
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+					    (const void **) &id->pkeyhash)) {
+		os_log_debug(logsys, "Public key hash not found");
+		goto fail;
 	}
 
-	os_log_debug(logsys, "%u certificates added", cert_list_count);
+	CFRetain(id->pkeyhash);
 
-out:
-	if (certs)
-		array_free(certs);
-	if (cmatch)
-		CFRelease(cmatch);
-	if (certset)
-		CFRelease(certset);
-	if (query)
-		CFRelease(query);
-	if (result)
-		CFRelease(result);
-}
+	if (! (a = CACHED_ATTR(&objs[0], CKA_LABEL)))
+		goto fail;
 
-/*
- * Free our cert_list
- */
+	id->label = strndup(a->pValue, a->ulValueLen);
 
-static void
-cert_list_free(void)
-{
-	unsigned int i;
+	/*
+	 * add_identity() uses the same default label
+	 */
 
-	for (i = 0; i < cert_list_count; i++) {
-		if (cert_list[i].cert)
-			CFRelease(cert_list[i].cert);
-		if (cert_list[i].pkeyhash)
-			CFRelease(cert_list[i].pkeyhash);
-	}
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrLabel,
+					  (const void **) &label))
+		livelabel = getstrcopy(label);
+	else
+		livelabel = strdup("Hardware token");
 
-	free(cert_list);
+	match = strcmp(id->label, livelabel) == 0;
+	free(livelabel);
 
-	cert_list = NULL;
+	if (! match) {
+		os_log_debug(logsys, "Cached label does not match");
+		goto fail;
+	}
 
-	atomic_store(&cert_list_status, uninitialized);
-}
+	if (! (a = CACHED_ATTR(&objs[0], CKA_VALUE)))
+		goto fail;
 
-/*
- * Search our set of certificates, either based on the common name
- * or the issuer.  If we get passed in cnmatch then match based on
- * a substring search of the common names, otherwise match on an
- * identical issuer.
- *
- * We return a pointer to the head of a certlist.
- */
+	der = CFDataCreate(kCFAllocatorDefault, a->pValue, a->ulValueLen);
+	id->cert = SecCertificateCreateWithData(kCFAllocatorDefault, der);
+	CFRelease(der);
 
-static struct certlist *
-search_certs(CFMutableSetRef certs, CFArrayRef cnmatch, CFDataRef issuer)
-{
-	struct certcontext cc;
-	CFSetApplierFunction fn;
+	if (! id->cert) {
+		os_log_debug(logsys, "Unable to create cached certificate");
+		goto fail;
+	}
 
-	cc.head = NULL;
-	cc.tail = NULL;
+	value = SP_CALL(SecCertificateCopyNormalizedIssuerSequence, id->cert);
+	match = dict_value_equal(dict, kSecAttrIssuer, value);
+	if (value)
+		CFRelease(value);
 
-	if (cnmatch) {
-		fn = &cn_match;
-		cc.match = cnmatch;
-	} else if (issuer) {
-		fn = &issuer_match;
-		cc.match = issuer;
-	} else {
-		os_log_debug(logsys, "Internal error: cnmatch and issuer "
-			     "are both NULL");
-		return NULL;
+	if (! match) {
+		os_log_debug(logsys, "Cached certificate issuer does not "
+			     "match");
+		goto fail;
 	}
 
-	CFSetApplyFunction(certs, fn, &cc);
+	value = SP_CALL(SecCertificateCopySerialNumberData, id->cert, NULL);
+	match = dict_value_equal(dict, kSecAttrSerialNumber, value);
+	if (value)
+		CFRelease(value);
 
-	return cc.head;
-}
+	if (! match) {
+		os_log_debug(logsys, "Cached certificate serial number does "
+			     "not match");
+		goto fail;
+	}
 
-/*
- * Our matching function when we are matching based on the certificate
- * common name.
- */
+	ret = SP_CALL(SecCertificateCopyPublicKey, id->cert, &id->pubkey);
 
-static void
-cn_match(const void *value, void *context)
-{
-	struct certcontext *cc = (struct certcontext *) context;
-	CFDictionaryRef dict = (CFDictionaryRef) value;
-	CFArrayRef cnmatch = (CFArrayRef) cc->match;
-	CFStringRef cn = NULL;
-	SecCertificateRef cert;
-	unsigned int i, count;
-	OSStatus ret;
+	if (ret) {
+		LOG_SEC_ERR("CopyPublicKey failed: %{public}@", ret);
+		goto fail;
+	}
 
 	/*
-	 * Extract out our common name from the certificate.  Get the
-	 * certificate ref and then use SecCertificateCopyCommonName()
+	 * The public key hash is the SHA-1 of the key data (like
+	 * CKA_ID is in most PKCS#11 modules)
 	 */
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
-					    (const void **) &cert)) {
-		os_log_debug(logsys, "Warning: unable to retrieve certificate "
-			     "from dictionary");
-		return;
+	if (! (value = SP_CALL(SecKeyCopyExternalRepresentation, id->pubkey,
+			       &err))) {
+		os_log_debug(logsys, "Unable to get cached public key data: "
+			     "%{public}@", err);
+		CFRelease(err);
+		goto fail;
 	}
 
-	ret = SecCertificateCopyCommonName(cert, &cn);
+	CC_SHA1(CFDataGetBytePtr(value), CFDataGetLength(value), hash);
+	CFRelease(value);
 
-	if (ret) {
-		LOG_SEC_ERR("CopyCommonName failed: %{public}@", ret);
-		return;
+	if (CFGetTypeID(id->pkeyhash) != CFDataGetTypeID() ||
+	    CFDataGetLength(id->pkeyhash) != sizeof(hash) ||
+	    memcmp(CFDataGetBytePtr(id->pkeyhash), hash, sizeof(hash)) != 0) {
+		os_log_debug(logsys, "Cached public key does not match");
+		goto fail;
 	}
 
-	if (! cn) {
-		os_log_debug(logsys, "SecCertificateCopyCommonName "
-			     "returned NULL");
-		return;
+	if (! (a = CACHED_ATTR(&objs[1], CKA_KEY_TYPE)) ||
+	    a->ulValueLen != sizeof(CK_KEY_TYPE) ||
+	    ! CFDictionaryGetValueIfPresent(dict, kSecAttrKeyType,
+					    (const void **) &keytype) ||
+	    *(CK_KEY_TYPE *) a->pValue != convert_keytype(keytype)) {
+		os_log_debug(logsys, "Cached key type does not match");
+		goto fail;
 	}
 
-	count = CFArrayGetCount(cnmatch);
+	id->keytype = *(CK_KEY_TYPE *) a->pValue;
 
-	for (i = 0; i < count; i++) {
-		CFStringRef str = CFArrayGetValueAtIndex(cnmatch, i);
-		CFRange range;
+	/*
+	 * Key usage comes from the same places add_identity() gets it,
+	 * and the cached objects have to agree.
+	 */
 
-		range = CFStringFind(cn, str, 0);
+	id->privcansign = boolfromdict("Can-Sign", dict, kSecAttrCanSign);
+	id->privcandecrypt = boolfromdict("Can-Decrypt", dict,
+					  kSecAttrCanDecrypt);
 
-		if (range.length > 0) {
-			/*
-			 * We have a match!
-			 */
-			add_cert_to_list(dict, cc);
-			break;
-		}
+	if (! (keydict = SP_CALL(SecKeyCopyAttributes, id->pubkey)))
+		goto fail;
+
+	id->pubcanverify = boolfromdict("Can-Verify", keydict,
+					kSecAttrCanVerify);
+	id->pubcanencrypt = boolfromdict("Can-Encrypt", keydict,
+					 kSecAttrCanEncrypt);
+	id->pubcanwrap = boolfromdict("Can-Wrap", keydict, kSecAttrCanWrap);
+
+	if (id->pubcanwrap)
+		id->pubcanencrypt = true;
+
+	CFRelease(keydict);
+
+	if (id->pubcanverify != CACHED_BOOL(&objs[1], CKA_VERIFY) ||
+	    id->pubcanencrypt != CACHED_BOOL(&objs[1], CKA_ENCRYPT) ||
+	    id->privcansign != CACHED_BOOL(&objs[2], CKA_SIGN) ||
+	    id->privcandecrypt != CACHED_BOOL(&objs[2], CKA_DECRYPT)) {
+		os_log_debug(logsys, "Cached key usage does not match");
+		goto fail;
 	}
 
-	CFRelease(cn);
+	if ((a = CACHED_ATTR(&objs[2], CKA_LABEL)))
+		id->keylabel = strndup(a->pValue, a->ulValueLen);
 
-	return;
+#undef CACHED_ATTR
+#undef CACHED_BOOL
+
+	return id;
+
+fail:
+	id_info_free(id);
+	return NULL;
 }
 
 /*
- * Match a certificate based on the issuer, and add it to our linked list
- * if it matches.
+ * Write a token's objects out to the token cache.  Any lazy attributes
+ * get built here, so the cache has everything.
  */
 
 static void
-issuer_match(const void *value, void *context)
+write_token_cache(struct slot_entry *token)
 {
-	struct certcontext *cc = (struct certcontext *) context;
-	CFDictionaryRef dict = (CFDictionaryRef) value;
-	CFDataRef match_issuer = (CFDataRef) cc->match;
-	CFDataRef issuer;
-
-	/*
-	 * Get the issuer out of our certificate dictionary
-	 */
+	unsigned char key[CERTCACHE_KEYLEN], *fprints;
+	char name[TOKEN_CACHE_NAMELEN];
+	struct obj_set *set = token->objs;
+	struct cache_obj *objs;
+	unsigned int i;
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrIssuer,
-					    (const void **) &issuer)) {
-		os_log_debug(logsys, "Warning: cannot retrieve issuer from "
-			     "certificate");
+	if (! cache_ready())
 		return;
-	}
 
-	if (CFEqual(issuer, match_issuer))
-		add_cert_to_list(dict, cc);
+	fprints = malloc(token->id_count * ID_FPRINT_LEN);
 
-}
+	for (i = 0; i < token->id_count; i++)
+		memcpy(fprints + i * ID_FPRINT_LEN, token->id_list[i]->fprint,
+		       ID_FPRINT_LEN);
 
-/*
- * Add a certificate dictionary to our linked list.
- *
- * Note that to prevent the dictionary from getting reclaimed underneath
- * us, we CFRetain() it; that means when you free the linked list you need
- * to release those objects.
- */
+	token_cache_key(token->tokenid, fprints, token->id_count, name, key);
 
-static void
-add_cert_to_list(CFDictionaryRef dict, struct certcontext *cc)
-{
-	struct certlist *cl = malloc(sizeof(*cl));
+	free(fprints);
 
-	cl->certdict = dict;
-	CFRetain(cl->certdict);
-	cl->next = NULL;
+	objs = malloc(sizeof(*objs) * (set->count ? set->count : 1));
 
-	if (! cc->head) {
-		cc->head = cc->tail = cl;
-	} else {
-		cc->tail->next = cl;
-		cc->tail = cl;
+	for (i = 0; i < set->count; i++) {
+		objs[i].class = set->list[i].class;
+		objs[i].attrs = obj_all_attrs(&set->list[i],
+					      &objs[i].attr_count);
 	}
+
+	certcache_write_named(name, key, objs, set->count);
+
+	for (i = 0; i < set->count; i++)
+		free(objs[i].attrs);
+	free(objs);
 }
 
 /*
- * Free a certificate list
+ * Work out the token cache file name and key.  The name only depends on
+ * the token identifier, so each token has one cache file (which gets
+ * replaced if the identities on it change).  The key is a SHA-256 hash
+ * over our version, the token identifier, and the fingerprint of each
+ * identity (in order).  If we can't hash anything, the name is empty,
+ * which the cache code will refuse.
  */
 
 static void
-free_certlist(struct certlist *cl)
+token_cache_key(CFStringRef tokenid, const unsigned char *fprints,
+		unsigned int count, char *name, unsigned char *key)
 {
-	struct certlist *cl2;
+	char *tid = getstrcopy(tokenid);
+	unsigned char digest[CC_MD_MAX_LEN];
+	uint32_t version = TOKEN_CACHE_VERSION;
+	md_context mdc;
+	unsigned int i, len;
 
-	while (cl != NULL) {
-		cl2 = cl->next;
-		CFRelease(cl->certdict);
-		free(cl);
-		cl = cl2;
-	}
+	name[0] = '\0';
+	memset(key, 0, CERTCACHE_KEYLEN);
+
+	if (! cc_md_init(CKM_SHA256, &mdc))
+		goto out;
+
+	cc_md_update(&mdc, (unsigned char *) tid, strlen(tid));
+	cc_md_final(&mdc, digest);
+
+	len = snprintf(name, TOKEN_CACHE_NAMELEN, "token-");
+	for (i = 0; i < 8; i++)
+		len += snprintf(name + len, TOKEN_CACHE_NAMELEN - len, "%02x",
+				digest[i]);
+	snprintf(name + len, TOKEN_CACHE_NAMELEN - len, ".cache");
+
+	cc_md_init(CKM_SHA256, &mdc);
+	cc_md_update(&mdc, (unsigned char *) &version, sizeof(version));
+	cc_md_update(&mdc, (unsigned char *) tid, strlen(tid) + 1);
+	cc_md_update(&mdc, fprints, count * ID_FPRINT_LEN);
+	len = cc_md_final(&mdc, digest);
+
+	memcpy(key, digest, len < CERTCACHE_KEYLEN ? len : CERTCACHE_KEYLEN);
+
+out:
+	free(tid);
 }
 
 /*
- * Add a certificate to our internal list that ends up on the list of
- * trusted certificates we present from our certificate slot.
+ * Convert the persistent reference in an identity attribute dictionary
+ * into an identity reference, binding our LAContext (if we have one) to
+ * it.  Returns NULL on failure.
  */
 
-static void
-add_certificate(CFDictionaryRef dict, CFMutableSetRef certs)
+static SecIdentityRef
+copy_identity(CFDictionaryRef dict, void *lacontext)
 {
-	SecCertificateRef cert;
-	CFStringRef val;
-	CFDataRef pkey, subject;
-	struct certlist *cl, *ce;
-	unsigned int i, c = cert_list_count;
+	CFTypeRef refresult;
+	CFMutableDictionaryRef refquery = NULL;
+	CFDataRef p_ref;
+	OSStatus ret;
 
-#if 0
-	if (os_log_debug_enabled(logsys)) {
-		CFStringRef label = CFDictionaryGetValue(dict, kSecAttrLabel);
-		os_log_debug(logsys, "Adding certificate \"%{public}@\"",
-			     label ? label : CFSTR("Unknown certificate"));
+	if (! CFDictionaryGetValueIfPresent(dict, kSecValuePersistentRef,
+					    (const void **)&p_ref)) {
+		os_log_debug(logsys, "Persistent id reference not found");
+		return NULL;
 	}
-#endif
 
 	/*
-	 * Before we do anything else, remove us from the certificate
-	 * set so we don't try to match on us again.
+	 * Our query dictionary for SecItemCopyMatching.  Here are the
+	 * components of our query dictionary:
+	 *
+	 * kSecClass = kSecClassIdentity
+	 *	See scan_identities() for more details, but this limits us to
+	 *	only retrieving identities.
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 *	Because we're using the persistent reference (see below)
+	 *	we really only want one response (and we should only get one)
+	 *	so set the match limit to one so we only get back a single
+	 *	response.
+	 * kSecReturnRef = kCFBooleanTrue
+	 *	We set this to indicate that we want an identity reference
+	 *	back (SecIdentityRef); this should be the only thing returned
+	 *	because we set no other return keys and we are requesting
+	 *	only one.
+	 * kSecUseAuthenticationContext = LAContext
+	 *	This is covered in more detail in localauth.m, but the idea
+	 *	here is this is a Local Authentication context created by
+	 *	the LAContext class.  When converting from a persistent ref
+	 *	to a SecIdentityRef and an auth context is passed in via
+	 *	kSecUseAuthenticationContext, it is converted by the Security
+	 *	framework internally to an ACM context and we can then later
+	 *	use the LAContext methods to authentication to the token.
+	 * kSecValuePersistentRef = persistent reference
+	 *	This is the persistent reference generated in the attribute
+	 *	dictionary when we did the search for all identities in
+	 *	scan_identities().  The reason we get a persistent reference
+	 *	in scan_identities() and then convert it to a "real" reference
+	 *	(e.g., SecIdentityRef) is so we can bind the LAContext
+	 *	to the identity so we have the ability to input the PIN
+	 *	via the PKCS#11 API (rather than let the Security framework
+	 *	ask for it).  It is worth noting that there is ALSO an
+	 *	attribute key called "kSecAttrPersistentReference"; as far
+	 *	as I can tell, that key is not used for anything.  The
+	 *	Apple documentation says to convert a persistent reference
+	 *	to a normal reference you should pass in the persistent
+	 *	reference in a CFArray using the kSecMatchItemList, but
+	 *	I can definitely say that at least for me, this did not work.
 	 */
 
-	CFSetRemoveValue(certs, dict);
-
 	/*
-	 * We never want hardware tokens in this list
+	 * Build up our query dictionary (see above comments).  Feed in
+	 * the persistent reference to extract the REAL identity reference
+	 * (SecIdentityRef).  If we also pass in the LAContext this will
+	 * attach the LAContext to the identity.
 	 */
 
-	if (CFDictionaryGetValueIfPresent(dict, kSecAttrAccessGroup,
-					  (const void **) &val)) {
-		if (CFEqual(val, kSecAttrAccessGroupToken)) {
-			os_log_debug(logsys, "Certificate is on hardware "
-				     "token, skipping");
-			return;
-		}
-	}
+	if (! add_dict(&refquery, kSecClass, kSecClassIdentity))
+		return NULL;
+	add_dict(&refquery, kSecMatchLimit, kSecMatchLimitOne);
+	add_dict(&refquery, kSecReturnRef, kCFBooleanTrue);
+	add_dict(&refquery, kSecValuePersistentRef, p_ref);
 
 	/*
-	 * Extract our the certificate reference and public key hash; use
-	 * the public key hash to see if we have it already
+	 * It turns out that in some cases (if you are running under
+	 * 32 bit mode, for example), you won't be able to allocate a
+	 * lacontext.  So if that happens we need to be sure not to
+	 * put the lacontext into our dictionary.  We can't use kCFNull
+	 * because that will cause the SecItemCopyMatching call later
+	 * to fail, so if we don't have a lacontext then don't add it to
+	 * the query dictionary.
 	 */
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
-					    (const void **) &cert)) {
-		os_log_debug(logsys, "No certificate reference found, "
-			     "skipping!");
-		return;
-	}
+	if (lacontext)
+		add_dict(&refquery, kSecUseAuthenticationContext,
+			 lacontext);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
-					   (const void **) &pkey)) {
-		os_log_debug(logsys, "No public key hash found, skipping!");
-		return;
-	}
+	ret = SP_CALL(SecItemCopyMatching, refquery, &refresult);
 
-	/*
-	 * Search to see if we have this already.  I realize this will
-	 * start to perform poorly if we get a lot of certificates, but
-	 * we only do this once.
-	 */
+	CFRelease(refquery);
 
-	for (i = 0; i < cert_list_count; i++) {
-		if (CFEqual(pkey, cert_list[i].pkeyhash)) {
-			os_log_debug(logsys, "Certificate is already in list, "
-				     "skipping");
-			return;
-		}
+	if (ret) {
+		LOG_SEC_ERR("Persistent ref SecItemCopyMatching "
+			    "failed: %{public}@", ret);
+		return NULL;
 	}
 
-	/*
-	 * Add this to our certificate list.
-	 */
-
-	if (++cert_list_count > cert_list_size) {
-		cert_list_size += 5;
-
-		cert_list = realloc(cert_list,
-				    sizeof(*cert_list) * cert_list_size);
+	if (CFGetTypeID(refresult) != SecIdentityGetTypeID()) {
+		logtype("Was expecting a SecIdentityRef, but got", refresult);
+		CFRelease(refresult);
+		return NULL;
 	}
 
-	cert_list[c].cert = cert;
-	CFRetain(cert_list[c].cert);
-	cert_list[c].pkeyhash = pkey;
-	CFRetain(cert_list[c].pkeyhash);
-
 	/*
-	 * Generate a list of certificates ISSUED by this certificate,
-	 * and add them.
+	 * No need to retain; the caller owns this as a result of it coming
+	 * out of SecItemCopyMatching
 	 */
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrSubject,
-					    (const void **) &subject)) {
-		os_log_debug(logsys, "Unable to retrieve subject, returning");
-		return;
-	}
-
-	cl = search_certs(certs, NULL, subject);
-
-	for (ce = cl; ce != NULL; ce = ce->next)
-		add_certificate(ce->certdict, certs);
-
-	free_certlist(cl);
-
-	return;
+	return (SecIdentityRef) refresult;
 }
 
 /*
- * Get the SecAccessControl object from the identity.
- *
- * This is a little subtle; we don't actually want the SecAccessControl
- * object for the IDENTITY, we want it for the private key (as it turns
- * out, they are different).  So what we need to do is get the attributes
- * for the key using SecItemCopyMatching(); the SecAccessControl object
- * will be in there.
+ * Create an identity entry.  Takes a CFDictionaryRef with all of the
+ * identity attributes (and persistent reference) in it, and the private
+ * key attributes from token_key_attrs() (which can be NULL).  Returns
+ * NULL on failure.  This doesn't change the token at all, so it's safe
+ * to call for several identities on the same token at once.
  */
 
-static SecAccessControlRef
-getaccesscontrol(CFDictionaryRef dict)
+static struct id_info *
+add_identity(struct slot_entry *entry, CFDictionaryRef dict,
+	     CFDictionaryRef keys)
 {
-	SecAccessControlRef accret;
-	CFMutableDictionaryRef accquery = NULL;
-	CFDictionaryRef attrdict;
-	CFDataRef label;
+	CFStringRef label;
+	CFNumberRef keytype;
+	CFTypeRef refresult;
+	CFDictionaryRef keydict;
 	OSStatus ret;
+	struct id_info *id;
 
 	/*
-	 * Our keys for our query dictionary for SecItemCopyMaching().
-	 *
-	 * kSecClass = kSecClassKey
-	 *	This means we're searching for keys (instead of identities
-	 *	or certificates)
-	 * kSecAttrKeyClass = kSecAttrKeyClassPrivate
-	 *	We want to match on the private key
-	 * kSecAttrApplicationLabel
-	 *	This is the "application label" of the key.  We get this
-	 *	from the identity dictionary, and it makes sure we get the
-	 *	private key associated with this identity.
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 *	We only want one match (really, we should only have one
-	 *	match, but let's be safe)
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 *	We want to get all of the attributes so we can find the
-	 *	SecAccessControlRef
-	 */
-
-	/*
-	 * Build our query dictionary to retrieve the key attributes.  We
-	 * need the application label from the original identity (this is
-	 * passed down in "dict")
+	 * Just in case ...
 	 */
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrApplicationLabel,
-				    (const void **) &label)) {
-		os_log_debug(logsys, "Application Label object not found");
+	if (dict == NULL) {
+		os_log_debug(logsys, "Identity dictionary is NULL, returning!");
 		return NULL;
 	}
 
-	if (! add_dict(&accquery, kSecClass, kSecClassKey))
-		return NULL;
-	add_dict(&accquery, kSecAttrKeyClass, kSecAttrKeyClassPrivate);
-	add_dict(&accquery, kSecAttrApplicationLabel, label);
-	add_dict(&accquery, kSecMatchLimit, kSecMatchLimitOne);
-	add_dict(&accquery, kSecReturnAttributes, kCFBooleanTrue);
+	refresult = copy_identity(dict, entry->lacontext);
 
-	/*
-	 * Perform the actual query
-	 */
+	if (! refresult)
+		return NULL;
 
-	ret = SecItemCopyMatching(accquery, (CFTypeRef *) &attrdict);
+	id = malloc(sizeof(*id));
+	memset(id, 0, sizeof(*id));
+	pthread_mutex_init(&id->warm_mutex, NULL);
 
-	CFRelease(accquery);
+	id->ident = NULL;
+	id->cert = NULL;
+	id->privkey = NULL;
+	id->pubkey = NULL;
+	id->label = NULL;
+	id->secaccess = NULL;
+	id->pkeyhash = NULL;
 
-	if (ret) {
-		LOG_SEC_ERR("Access control ref SecItemCopyMatching "
-			    "failed: %{public}@", ret);
-		return NULL;
-	}
+	id->ident = (SecIdentityRef) refresult;
 
 	/*
-	 * Just in case, make sure we got a CFDictionaryRef
+	 * Extract out of the dictionary all of the things we need.
+	 * Note that since we are following the "Get Rule" and this
+	 * dictionary should be de-allocated soon, we need to CFRetain()
+	 * everything we want for later.
+	 *
+	 * Key items:
+	 *
+	 * Attribute label (display string for the identity)
+	 * SecIdentityRef (used by Security Framework)
+	 * Various attribute flags (we use those for returning
+	 * object information)
+	 *
+	 * To make things easier, we extract the private key object
+	 * and the certificate from the identity.  Those are copies and
+	 * we don't need to retain those objects.
 	 */
 
-	if (CFGetTypeID(attrdict) != CFDictionaryGetTypeID()) {
-		logtype("Was expecting a CFDictionary, but got", attrdict);
-		CFRelease(attrdict);
-		return NULL;
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrLabel,
+					  (const void **) &label)) {
+		id->label = getstrcopy(label);
+		os_log_debug(logsys, "Identity label: %{public}@", label);
+	} else {
+		id->label = strdup("Hardware token");
+		os_log_debug(logsys, "No label, using default");
+	}
+	
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrKeyType,
+					    (const void **) &keytype)) {
+		os_log_debug(logsys, "Key type not found");
+		ret = -1;
+		goto out;
 	}
 
-	if (! CFDictionaryGetValueIfPresent(attrdict, kSecAttrAccessControl,
-					    (const void **) &accret)) {
-		os_log_debug(logsys, "Access Control object not found");
-		CFRelease(attrdict);
+	id->keytype = convert_keytype(keytype);
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+					    (const void **) &id->pkeyhash)) {
+		os_log_debug(logsys, "Public key hash not found");
+		ret = -1;
+		goto out;
+	}
+
+	CFRetain(id->pkeyhash);
+
+	identity_fingerprint(dict, id->fprint);
+
+	id->privcansign = boolfromdict("Can-Sign", dict, kSecAttrCanSign);
+	id->privcandecrypt = boolfromdict("Can-Decrypt", dict,
+					  kSecAttrCanDecrypt);
+
+	ret = SP_CALL(SecIdentityCopyCertificate, id->ident, &id->cert);
+
+	if (ret)
+		LOG_SEC_ERR("CopyCertificate failed: %{public}@", ret);
+
+	if (! ret) {
+		ret = SP_CALL(SecIdentityCopyPrivateKey, id->ident,
+			      &id->privkey);
+		if (ret)
+			LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
+		else {
+			if (! (id->secaccess = getaccesscontrol(dict, keys))) {
+				ret = -1;
+				goto out;
+			}
+			id->keylabel = getprivlabel(dict, keys);
+		}
+	}
+
+	if ( !ret) {
+		ret = SP_CALL(SecCertificateCopyPublicKey, id->cert,
+			      &id->pubkey);
+		if (ret)
+			LOG_SEC_ERR("CopyPublicKey failed: %{public}@", ret);
+	}
+
+	/*
+	 * Get our public key attributes
+	 */
+
+	if (! ret) {
+		keydict = SP_CALL(SecKeyCopyAttributes, id->pubkey);
+
+		id->pubcanverify = boolfromdict("Can-Verify", keydict,
+						kSecAttrCanVerify);
+		id->pubcanencrypt = boolfromdict("Can-Encrypt", keydict,
+						 kSecAttrCanEncrypt);
+		id->pubcanwrap = boolfromdict("Can-Wrap", keydict,
+					      kSecAttrCanWrap);
+		/*
+		 * We're going to cheat here JUST a bit.  It turns out
+		 * if a public key is set to allow wrapping, it can also
+		 * do generic encryption.  So if we have wrapping set, also
+		 * set encryption.
+		 */
+
+		if (id->pubcanwrap)
+			id->pubcanencrypt = true;
+
+		CFRelease(keydict);
+	}
+
+out:
+	if (ret) {
+		id_info_free(id);
 		return NULL;
 	}
 
-	CFRetain(accret);
-	CFRelease(attrdict);
+	return id;
+}
 
-	return accret;
+/*
+ * Remove a token from a slot
+ */
+
+void
+remove_token_id(CFStringRef tokenid)
+{
+	struct slot_table *st;
+	struct slot_entry *entry;
+	int i;
+
+	os_log_debug(logsys, "Received removal event for token %{public}@",
+		     tokenid);
+
+	LOCK_MUTEX(slot_mutex);
+
+	/*
+	 * Go through the list and remove whatever token we match on.
+	 * Because we're doing refcounting we shouldn't free any memory
+	 * that is being used by a session; the slot list reference goes
+	 * away when nobody is looking at the old slot table anymore.
+	 */
+
+	st = slot_table;
+
+	for (i = 0; i < st->count; i++) {
+		entry = st->slots[i];
+		if (entry && CFEqual(tokenid, entry->tokenid)) {
+			os_log_debug(logsys, "Removing token from slot %d", i);
+			entry->removed = true;
+			st = slot_table_copy(st, st->count);
+			st->slots[i] = NULL;
+			slot_table_publish(st, entry);
+			slot_event(i);
+			break;
+		}
+	}
+
+	if (i == st->count)
+		os_log_debug(logsys, "No matching slot found for token!");
+
+	UNLOCK_MUTEX(slot_mutex);
 }
 
 /*
- * Return the user-printable label for a key.
+ * This function is called by the dispatch system and will call
+ * scan_certificates() and build_cert_objects() and the appropriate
+ * memory barrier functions
+ */
+
+static void
+background_cert_scan(void *dummy)
+{
+	unsigned char key[CERTCACHE_KEYLEN];
+	struct obj_info *list;
+	unsigned int count, size = 0;
+	struct attr_block *arena = NULL;
+	struct obj_set *objs;
+	uint64_t start = stats_start();
+
+	/*
+	 * Get the cache key BEFORE we scan, so if the Keychain changes
+	 * out from under us the cache won't match next time.
+	 */
+
+	if (cert_cache_enabled)
+		cert_cache_getkey(key);
+
+	scan_certificates();
+	build_cert_objects(&list, &count, &size, &arena);
+	stats_record(STAT_CERT_SCAN, start, CKR_OK);
+
+	objs = obj_set_new(list, count, size, arena);
+	objs->idx = build_obj_index(list, count);
+	objidx_defer(objs->idx, obj_set_index_fill, objs);
+	cert_objs_publish(objs);
+
+	atomic_store(&cert_list_status, initialized);
+	slot_event(CERTIFICATE_SLOT);
+
+	/*
+	 * Writing the cache means generating all of the lazy attributes,
+	 * so do that after the slot is available.  C_Finalize() releases
+	 * the object set on our queue, so it can't go away while we're
+	 * here.
+	 */
+
+	if (cert_cache_enabled)
+		write_cert_cache(list, count, key);
+}
+
+/*
+ * We started up using the on-disk cache, so now do a full scan and see
+ * if the cache is still correct.  If anything changed, the certificate
+ * slot gets the changes (and we rewrite the cache).
+ */
+
+static void
+background_cert_revalidate(void *dummy)
+{
+	unsigned char key[CERTCACHE_KEYLEN];
+
+	cert_cache_getkey(key);
+	cert_refresh(key);
+}
+
+/*
+ * Something changed in the Keychain (see keychain_event()), so refresh
+ * the certificate slot.
+ */
+
+static void
+background_cert_refresh(void *dummy)
+{
+	unsigned char key[CERTCACHE_KEYLEN];
+
+	/*
+	 * Clear this first; anything that changes after this point gets
+	 * another refresh.
+	 */
+
+	atomic_store(&cert_refresh_pending, false);
+
+	if (atomic_load(&cert_list_status) != initialized)
+		return;
+
+	os_log_debug(logsys, "Keychain changed, refreshing certificates");
+
+	if (cert_cache_enabled)
+		cert_cache_getkey(key);
+
+	cert_refresh(cert_cache_enabled ? key : NULL);
+}
+
+/*
+ * Rescan the Keychain and apply whatever changed to the certificate slot
+ * (runs on the certificate queue).  Certificates are matched up on their
+ * contents; ones we already have are just copied over to the new object
+ * list in the same place, so they keep the same object handles and the
+ * same CKA_ID.  Certificates that are gone leave removed objects behind
+ * (hence the same handles), and new certificates are added at the end.
+ * If nothing changed we leave the current objects alone.
  *
- * Sigh.  It turns out some applications REALLY want a printable label
- * associated with a key; we'll fetch the key label from the attribute
- * dictionary.  Returns string that must always be free()d.
+ * This depends on the layout build_cert_objects() gives us (two objects
+ * per certificate, the certificate first); if the current list doesn't
+ * look like that, just replace it.
+ *
+ * If key is non-NULL, the cache is written out with that key.
  */
 
-static char *
-getkeylabel(SecKeyRef key)
+static void
+cert_refresh(const unsigned char *key)
 {
-	CFMutableDictionaryRef query = NULL;
-	CFDictionaryRef keyattr = NULL, result = NULL;
-	CFStringRef label, class;
-	CFDataRef applabel;
-	OSStatus ret;
-	char *retstr;
+	struct obj_set *old = cert_objs_get(), *objs;
+	struct obj_info *list = NULL;
+	unsigned int i, pairs, added = 0, removed = 0, count = 0, size = 0;
+	unsigned int *match = NULL, *reindex = NULL, rebuilt = 0, cached = 0;
+	struct certinfo *newcerts = NULL, *recerts = NULL;
+	struct attr_block *arena = NULL;
+	CFMutableDictionaryRef certs = NULL;
+	CK_ATTRIBUTE_PTR attr;
+	bool *used = NULL;
+	uint64_t start = stats_start();
 
 	/*
-	 * Slightly more complicated than I would like, but we're trying to
-	 * conform to the Security framework APIs as I understand them.
-	 *
-	 * Fetch the key attributes using SecKeyCopyAttributes (the label
-	 * isn't one of the supported attributes that SecKeyCopyAttributes
-	 * is supposed to return).
-	 *
-	 * Use the KeyClass and application label in a query dictionary
-	 * to retrieve the complete attribute dictionary, and return the
-	 * kSecAttrLabel value.
+	 * If there are no certificate objects then C_Finalize() has been
+	 * called, so there's nothing to refresh.
 	 */
 
+	if (! old)
+		return;
+
+	cert_list_free();
+	scan_certificates();
+
+	if (old->count % 2)
+		goto rebuild;
+
 	/*
-	 * Our query dictionary; see above for greater detail
-	 *
-	 * kSecClass = kSecClassKey
-	 * kSecAttrKeyClass (from key)
-	 * kSecAttrApplicationLabel (from key)
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 * kSecReturnAttributes = kCFBooleanTrue
+	 * Index our new certificates by their contents.  The dictionary
+	 * values are the index into cert_list, plus one (so they aren't
+	 * NULL).
 	 */
 
-	keyattr = SecKeyCopyAttributes(key);
+	certs = CFDictionaryCreateMutable(NULL, cert_list_count,
+					  &kCFTypeDictionaryKeyCallBacks, NULL);
+	used = calloc(cert_list_count ? cert_list_count : 1, sizeof(*used));
 
-	if (! keyattr) {
-		os_log_debug(logsys, "SecKeyCopyAttr returned NULL");
-		retstr = strdup("Unknown key");
-		goto out;
+	for (i = 0; i < cert_list_count; i++) {
+		CFDataRef d = SP_CALL(SecCertificateCopyData,
+				      cert_list[i].cert);
+
+		if (d) {
+			CFDictionarySetValue(certs, d, (void *) (uintptr_t)
+								(i + 1));
+			CFRelease(d);
+		}
 	}
 
-	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrKeyClass,
-					    (const void **) &class)) {
-		os_log_debug(logsys, "Cannot find KeyClass in dict");
-		retstr = strdup("Unknown key");
-		goto out;
+	/*
+	 * Now see which of our current certificates are still there
+	 */
+
+	pairs = old->count / 2;
+	match = calloc(pairs ? pairs : 1, sizeof(*match));
+
+	for (i = 0; i < pairs; i++) {
+		struct obj_info *o = &old->list[i * 2];
+		uintptr_t n;
+		CFDataRef d;
+
+		if (OBJ_REMOVED(o))
+			continue;
+
+		if (o->class != CKO_CERTIFICATE ||
+		    ! (attr = find_attribute(o, CKA_VALUE)))
+			goto rebuild;
+
+		d = CFDataCreateWithBytesNoCopy(NULL, attr->pValue,
+						attr->ulValueLen,
+						kCFAllocatorNull);
+		n = (uintptr_t) CFDictionaryGetValue(certs, d);
+		CFRelease(d);
+
+		if (n && ! used[n - 1]) {
+			used[n - 1] = true;
+			match[i] = n;
+			if (! o->cert)
+				cached++;
+		} else {
+			removed++;
+		}
 	}
 
-	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrApplicationLabel,
-					    (const void **) &applabel)) {
-		os_log_debug(logsys, "Cannot find AppLabel in dict");
-		retstr = strdup("Unknown key");
+	newcerts = malloc(sizeof(*newcerts) * (cert_list_count ?
+							cert_list_count : 1));
+
+	for (i = 0; i < cert_list_count; i++)
+		if (! used[i])
+			newcerts[added++] = cert_list[i];
+
+	/*
+	 * Certificates that came from the cache still need their trust
+	 * objects (see load_cert_cache()), so those don't count as
+	 * unchanged.
+	 */
+
+	if (added == 0 && removed == 0 && cached == 0) {
+		os_log_debug(logsys, "No certificate changes found");
 		goto out;
 	}
 
-	if (! add_dict(&query, kSecClass, kSecClassKey)) {
-		retstr = strdup("Unknown key");
-		goto out;
+	os_log_debug(logsys, "Certificate refresh: %u added, %u removed",
+		     added, removed);
+
+	/*
+	 * Build our new list: copies of everything that is still there,
+	 * placeholders for everything that is gone, and new objects for
+	 * the new certificates.
+	 *
+	 * Objects that came from the cache have no certificate, so all of
+	 * their attributes are regular ones, which would leave the new list
+	 * with some objects that have (say) CKA_SUBJECT as a regular
+	 * attribute and some where it is lazy; the object index can't cope
+	 * with that.  So rather than copying those, build them again (in
+	 * the same place) from the certificate we just found.
+	 */
+
+	count = size = (pairs + added) * 2;
+	list = malloc(sizeof(*list) * count);
+	recerts = malloc(sizeof(*recerts) * (pairs ? pairs : 1));
+	reindex = malloc(sizeof(*reindex) * (pairs ? pairs : 1));
+
+	for (i = 0; i < pairs; i++) {
+		if (match[i] && ! old->list[i * 2].cert) {
+			recerts[rebuilt] = cert_list[match[i] - 1];
+			reindex[rebuilt++] = i;
+		} else if (match[i]) {
+			obj_copy(&list[i * 2], &old->list[i * 2]);
+			obj_copy(&list[i * 2 + 1], &old->list[i * 2 + 1]);
+		} else {
+			obj_remove(&list[i * 2]);
+			obj_remove(&list[i * 2 + 1]);
+		}
 	}
-	add_dict(&query, kSecAttrKeyClass, class);
-	add_dict(&query, kSecAttrApplicationLabel, applabel);
-	add_dict(&query, kSecMatchLimit, kSecMatchLimitOne);
-	add_dict(&query, kSecReturnAttributes, kCFBooleanTrue);
 
-	ret = SecItemCopyMatching(query, (CFTypeRef *) &result);
+	if (rebuilt) {
+		struct cert_build cb = { list, recerts, 0, reindex };
 
-	if (ret) {
-		LOG_SEC_ERR("SecItemCopyMatching failed: %{public}@", ret);
-		retstr = strdup("Unknown key");
-		goto out;
+		os_log_debug(logsys, "Rebuilding %u cached certificate%s",
+			     rebuilt, rebuilt == 1 ? "" : "s");
+
+		dispatch_apply_f(rebuilt, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				 &cb, build_cert_object);
 	}
 
-	if (CFGetTypeID(result) != CFDictionaryGetTypeID()) {
-		logtype("Was expecting a CFDictionaryRef, but got", result);
-		retstr = strdup("Unknown key");
+	if (added) {
+		struct cert_build cb = { list, newcerts, pairs, NULL };
+
+		dispatch_apply_f(added, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				 &cb, build_cert_object);
+	}
+
+	obj_seal(list, count, &arena);
+	goto publish;
+
+rebuild:
+	os_log_debug(logsys, "Replacing all certificate objects");
+	build_cert_objects(&list, &count, &size, &arena);
+
+publish:
+	objs = obj_set_new(list, count, size, arena);
+	objs->idx = build_obj_index(list, count);
+
+	if (atomic_load(&cert_list_status) != initialized) {
+		obj_set_put(objs);
 		goto out;
 	}
 
-	if (! CFDictionaryGetValueIfPresent(result, kSecAttrLabel,
-					    (const void **) &label)) {
-		os_log_debug(logsys, "Unable to find key label");
-		retstr = strdup("Unknown key");
-	} else {
-		retstr = getstrcopy(label);
-	}
+	objidx_defer(objs->idx, obj_set_index_fill, objs);
+	cert_objs_publish(objs);
+	slot_event(CERTIFICATE_SLOT);
+
+	/*
+	 * Like background_cert_scan(), C_Finalize() releases the object
+	 * set on our queue, so it's safe to use it here.
+	 */
+
+	if (key)
+		write_cert_cache(list, count, key);
+
+out:
+	stats_record(STAT_CERT_SCAN, start, CKR_OK);
+
+	if (certs)
+		CFRelease(certs);
+	free(used);
+	free(match);
+	free(newcerts);
+	free(recerts);
+	free(reindex);
+	obj_set_put(old);
+	cert_list_free();
+}
+
+/*
+ * The Keychain callback functions (and their types) are deprecated, but
+ * nothing in the SecItem API will tell us when certificates are added or
+ * removed, so we don't have much choice.  Keep the warnings quiet for
+ * just these functions so the rest of the file stays warning-free.
+ */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+/*
+ * Watch for Keychain changes (so we can refresh the certificate slot).
+ * Keychain callbacks are delivered on the main run loop, so this is
+ * called from the main queue.  If C_Finalize() got there first then
+ * don't bother.
+ */
+
+static void
+cert_watch_start(void *dummy)
+{
+	OSStatus ret;
+
+	pthread_mutex_lock(&cert_watch_lock);
+
+	if (cert_watch_wanted && ! cert_watching) {
+		ret = SecKeychainAddCallback(keychain_event,
+					     kSecAddEventMask |
+					     kSecDeleteEventMask |
+					     kSecUpdateEventMask |
+					     kSecTrustSettingsChangedEventMask |
+					     kSecKeychainListChangedMask,
+					     NULL);
+		if (ret)
+			LOG_SEC_ERR("SecKeychainAddCallback failed: "
+				    "%{public}@", ret);
+		else
+			cert_watching = true;
+	}
+
+	pthread_mutex_unlock(&cert_watch_lock);
+}
+
+/*
+ * Stop watching for Keychain changes (called from C_Finalize())
+ */
+
+static void
+cert_watch_stop(void)
+{
+	pthread_mutex_lock(&cert_watch_lock);
+
+	cert_watch_wanted = false;
+
+	if (cert_watching) {
+		SecKeychainRemoveCallback(keychain_event);
+		cert_watching = false;
+	}
+
+	pthread_mutex_unlock(&cert_watch_lock);
+}
+
+/*
+ * Our Keychain callback.  We don't care what changed; just schedule a
+ * refresh a little while from now, unless one is already scheduled.
+ */
+
+static OSStatus
+keychain_event(SecKeychainEvent event, SecKeychainCallbackInfo *info,
+	       void *context)
+{
+	bool expected = false;
+
+	if (atomic_load(&cert_list_status) != initialized)
+		return errSecSuccess;
+
+	if (atomic_compare_exchange_strong(&cert_refresh_pending, &expected,
+					   true))
+		dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW,
+					CERT_REFRESH_DELAY * NSEC_PER_SEC),
+				 cert_queue, NULL, background_cert_refresh);
+
+	return errSecSuccess;
+}
+
+#pragma clang diagnostic pop
+
+/*
+ * Create our serial certificate scanning queue
+ */
+
+static void
+cert_queue_create(void *dummy)
+{
+	cert_queue = dispatch_queue_create(APPIDENTIFIER ".certscan",
+					   DISPATCH_QUEUE_SERIAL);
+}
+
+/*
+ * Make sure the cache code has its HMAC key (see cache_setup()); if we
+ * couldn't get one, we don't use the caches at all.
+ */
+
+static bool
+cache_ready(void)
+{
+	dispatch_once_f(&cache_init, NULL, cache_setup);
+
+	return cache_keyed;
+}
+
+/*
+ * Get the HMAC key for our caches out of the Keychain, or make a new one
+ * and store it there if we don't have one yet.  The cache files live in
+ * a directory anything running as the user can write to, so the key is
+ * what keeps someone from just handing us their own certificate slot
+ * (with trusted roots of their choosing).
+ *
+ * The key is a generic password item for each program; the Keychain
+ * will only give it back without asking to the program that created it.
+ * We never want to prompt for this, so if the Keychain wants to ask,
+ * we just go without a cache.
+ */
+
+static void
+cache_setup(void *dummy)
+{
+	CFMutableDictionaryRef query;
+	CFStringRef account;
+	CFDataRef data = NULL;
+	unsigned char mackey[CERTCACHE_MACLEN];
+	OSStatus ret;
+
+	account = CFStringCreateWithCString(NULL, getprogname(),
+					    kCFStringEncodingUTF8);
+
+	query = CFDictionaryCreateMutable(NULL, 0,
+					  &kCFTypeDictionaryKeyCallBacks,
+					  &kCFTypeDictionaryValueCallBacks);
+	add_dict(query, kSecClass, kSecClassGenericPassword);
+	add_dict(query, kSecAttrService, CFSTR(APPIDENTIFIER ".cache"));
+	add_dict(query, kSecAttrAccount, account);
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	add_dict(query, kSecUseAuthenticationUI, kSecUseAuthenticationUIFail);
+#pragma clang diagnostic pop
+	add_dict(query, kSecReturnData, kCFBooleanTrue);
+	add_dict(query, kSecMatchLimit, kSecMatchLimitOne);
+
+	ret = SecItemCopyMatching(query, (CFTypeRef *) &data);
+
+	if (ret == errSecItemNotFound) {
+		if (SecRandomCopyBytes(kSecRandomDefault, sizeof(mackey),
+				       mackey) != 0) {
+			os_log_debug(logsys, "Unable to generate cache key, "
+				     "not using caches");
+			goto out;
+		}
+
+		data = CFDataCreate(NULL, mackey, sizeof(mackey));
+
+		CFDictionaryRemoveValue(query, kSecReturnData);
+		CFDictionaryRemoveValue(query, kSecMatchLimit);
+		add_dict(query, kSecValueData, data);
+
+		ret = SecItemAdd(query, NULL);
+
+		if (ret) {
+			LOG_SEC_ERR("Unable to save cache key, not using "
+				    "caches: %{public}@", ret);
+			goto out;
+		}
+	} else if (ret) {
+		LOG_SEC_ERR("Unable to get cache key, not using caches: "
+			    "%{public}@", ret);
+		goto out;
+	}
+
+	if (CFGetTypeID(data) != CFDataGetTypeID() ||
+	    CFDataGetLength(data) != CERTCACHE_MACLEN) {
+		os_log_debug(logsys, "Cache key is the wrong size, not "
+			     "using caches");
+		goto out;
+	}
+
+	certcache_setup(CFDataGetBytePtr(data));
+	cache_keyed = true;
+
+out:
+	if (data)
+		CFRelease(data);
+	CFRelease(query);
+	CFRelease(account);
+	memset(mackey, 0, sizeof(mackey));
+}
+
+/*
+ * Compute the cache key for our current certificateList preference
+ */
+
+static void
+cert_cache_getkey(unsigned char *key)
+{
+	char **certs = prefkey_arrayget("certificateList", default_cert_search);
+
+	certcache_key(certs, key);
+
+	array_free(certs);
+}
+
+/*
+ * Try to load our certificate objects from the on-disk cache.  Attribute
+ * values point into our copy of the cache, so we have to keep it open
+ * until we free the object list.
+ *
+ * The cache only has the certificate objects.  Trust is the one thing
+ * we really don't want to take from a file, so each certificate gets a
+ * removed placeholder where its trust object goes (which keeps the
+ * handles and the layout cert_refresh() wants), and the trust objects
+ * show up once background_cert_revalidate() has rebuilt them from the
+ * Keychain.
+ */
+
+static bool
+load_cert_cache(void)
+{
+	unsigned char key[CERTCACHE_KEYLEN];
+	struct attr_block *head = NULL, **arena = &head;
+	struct obj_info *list;
+	struct obj_set *objs;
+	unsigned int i, n, count;
+	cert_cache cache;
+
+	if (! cache_ready())
+		return false;
+
+	cert_cache_getkey(key);
+
+	if (! (cache = certcache_open(key)))
+		return false;
+
+	n = certcache_count(cache);
+	count = n * 2;
+
+	list = malloc(sizeof(*list) * (count ? count : 1));
+
+	for (i = 0; i < n; i++) {
+		struct obj_info *obj = &list[i * 2];
+
+		memset(obj, 0, sizeof(*obj));
+		obj->attr_count = certcache_object(cache, i, &obj->class);
+
+		if (obj->class != CKO_CERTIFICATE) {
+			os_log_debug(logsys, "Certificate cache has a "
+				     "non-certificate object, ignoring it");
+			arena_free(arena);
+			free(list);
+			certcache_close(cache);
+			return false;
+		}
+
+		obj->attr_size = obj->attr_count;
+		obj->attrs = arena_alloc(arena, sizeof(CK_ATTRIBUTE) *
+						obj->attr_count);
+		certcache_attrs(cache, i, obj->attrs);
+
+		obj_remove(&list[i * 2 + 1]);
+	}
+
+	objs = obj_set_new(list, count, count, head);
+	objs->idx = build_obj_index(list, count);
+	objs->cache = cache;
+	cert_objs_publish(objs);
+
+	os_log_debug(logsys, "Loaded %u certificate objects from cache",
+		     count);
+
+	return true;
+}
+
+/*
+ * Write out our certificate objects to the on-disk cache, unless the
+ * cache already has exactly the same contents.
+ */
+
+static void
+write_cert_cache(struct obj_info *list, unsigned int count,
+		 const unsigned char *key)
+{
+	struct cache_obj *objs;
+	cert_cache cache;
+	unsigned int i, n = 0;
+
+	if (! cache_ready())
+		return;
+
+	objs = malloc(sizeof(*objs) * (count ? count : 1));
+
+	/*
+	 * Objects that were removed by a refresh don't need to be in the
+	 * cache; the next process has no handles to keep the same.  Only
+	 * the certificates go in; see load_cert_cache().
+	 */
+
+	for (i = 0; i < count; i++) {
+		if (OBJ_REMOVED(&list[i]) || list[i].class != CKO_CERTIFICATE)
+			continue;
+		objs[n].class = list[i].class;
+		objs[n].attrs = obj_all_attrs(&list[i], &objs[n].attr_count);
+		n++;
+	}
+
+	if ((cache = certcache_open(key)) != NULL &&
+	    certcache_same(cache, objs, n)) {
+		os_log_debug(logsys, "Certificate cache is up to date");
+	} else {
+		certcache_write(key, objs, n);
+	}
+
+	certcache_close(cache);
+
+	for (i = 0; i < n; i++)
+		free(objs[i].attrs);
+	free(objs);
+}
+
+/*
+ * Scan the Keychain for certificates and add them to our object database
+ *
+ * This uses SecItemCopyMatching, but searches for certificates that
+ * have a subject name that matches one of our match strings.  Once we
+ * find that certificate then we chase down all certificates issued
+ * by that certificate; this means you should only need to list Root CAs
+ * in your match string list.
+ */
+
+static void
+scan_certificates(void)
+{
+	char **certs = NULL, **p;
+	CFMutableArrayRef cmatch = NULL;
+	CFMutableSetRef certset = NULL;
+	CFMutableDictionaryRef query = NULL;
+	CFTypeRef result = NULL;
+	OSStatus ret;
+	unsigned int i, count;
+	struct certlist *cl;
+	struct certscan cs = { NULL, NULL, NULL };
+
+	/*
+	 * I tried, at first, to use the built-in searching features
+	 * available in SecItemCopyMatching(), but that turned out to be
+	 * a failure for two reasons:
+	 *
+	 * Matching on the subject name (using kSecMatchSubjectContains)
+	 * SORT-of worked, except if you have a hardware token you will
+	 * get certificates on the hardware token included in the list
+	 * EVEN THOUGH the subject names don't match.
+	 *
+	 * Matching based on issuer (using kSecMatchIssuers) only works
+	 * for IDENTITIES, for some strange reason (really, there is no
+	 * good reason for this that I can tell).
+	 *
+	 * Because SecItemCopyMatching is kind of expensive, what I finally
+	 * decided on was this:
+	 *
+	 * Get a list of ALL certificates.
+	 *
+	 * Generate a CFMutableSet from the original certificate array.
+	 *
+	 * Build an index of that set keyed by issuer name, so finding
+	 * the certificates issued by a CA is a single lookup.
+	 *
+	 * Search the set once for certificates whose common name matches,
+	 * then walk down from each match using the issuer index.  As we
+	 * add each certificate, remove it from the CFSet so we never add
+	 * it twice.
+	 *
+	 * Sigh.  Apple, why did you have to make this so hard?
+	 */
+
+	/*
+	 * We need to retrieve all valid certificates from our Keychains.
+	 *
+	 * Our query dictionary:
+	 *
+	 * kSecClass = kSecClassCertificate
+	 *	This means we're searching for certificates only,
+	 *	and we don't need private key objects
+	 * kSecMatchLimit = kSecMatchLimitAll
+	 *	Return all matching certificates
+	 * kSecMatchTrustedOnly = kCFBooleanTrue
+	 *	Only match trusted certificates
+	 * kSecReturnRef = kCFBooleanTrue
+	 *	This means return a reference to the certificate
+	 *	object (a SecCertificateRef).  Because we also use
+	 *	kSecReturnAttributes that means the certificate
+	 *	reference ends up in the attribute dictionary.
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 *	This means we return all of the attributes for each 
+	 *	certificate.
+	 */
+
+	/*
+	 * Short circuit the search if "none" is the first entry
+	 */
+
+	certs = prefkey_arrayget("certificateList", default_cert_search);
+
+	if (certs[0] && strcasecmp(certs[0], "none") == 0) {
+		os_log_debug(logsys, "Special entry \"none\" found, not "
+			     "importing Keychain certificates");
+		goto out;
+	}
+
+	cmatch = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+	if (! cmatch) {
+		os_log_debug(logsys, "Unable to create match array!");
+		goto out;
+	}
+
+	for (p = certs; *p != NULL; p++) {
+		CFStringRef cm = CFStringCreateWithCString(NULL, *p,
+						   kCFStringEncodingUTF8);
+		CFArrayAppendValue(cmatch, cm);
+		CFRelease(cm);
+	}
+
+	/*
+	 * This shouldn't be 0, but JUST in case ...
+	 */
+
+	if (CFArrayGetCount(cmatch) == 0) {
+		os_log_debug(logsys, "No certificate match strings found, "
+			     "not importing certificates");
+		goto out;
+	}
+
+	/*
+	 * Get a list of all certificates
+	 */
+
+	if (! add_dict(&query, kSecClass, kSecClassCertificate))
+		goto out;
+	add_dict(&query, kSecMatchLimit, kSecMatchLimitAll);
+	add_dict(&query, kSecMatchTrustedOnly, kCFBooleanTrue);
+	add_dict(&query, kSecReturnRef, kCFBooleanTrue);
+	add_dict(&query, kSecReturnAttributes, kCFBooleanTrue);
+
+	os_log_debug(logsys, "About to call SecItemCopyMatching");
+
+	ret = SP_CALL(SecItemCopyMatching, query, &result);
+
+	os_log_debug(logsys, "SecItemCopyMatching finished");
+
+	/*
+	 * If we didn't find ANY certificates at all (really? None?)
+	 * then return.
+	 */
+
+	if (ret) {
+		if (ret == errSecItemNotFound) {
+			os_log_debug(logsys, "No valid certificates found; "
+				     "that doesn't seem right!");
+			goto out;
+		} else {
+			LOG_SEC_ERR("Certificate SecItemCopyMatching "
+				    "failed: %{public}@", ret);
+			goto out;
+		}
+	}
+
+	count = cflistcount(result);
+
+	os_log_debug(logsys, "Searching %u certificates", count);
+	
+	/*
+	 * Before we do anything else, add all of the certificates
+	 * entries to our set.
+	 */
+
+	certset = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+
+	if (! certset) {
+		os_log_debug(logsys, "Unable to create certificate set!");
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		CFSetAddValue(certset, cfgetindex(result, i));
+
+	/*
+	 * Build our issuer index, which maps issuer names to the list
+	 * of certificates issued under that name.
+	 */
+
+	cs.certs = certset;
+	cs.issuers = CFDictionaryCreateMutable(NULL, 0,
+					&kCFTypeDictionaryKeyCallBacks,
+					&kCFTypeDictionaryValueCallBacks);
+	cs.pkeys = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+
+	if (! cs.issuers || ! cs.pkeys) {
+		os_log_debug(logsys, "Unable to create certificate index!");
+		goto out;
+	}
+
+	CFSetApplyFunction(certset, index_issuer, cs.issuers);
+
+	/*
+	 * Search all of our certificate for matches, and add the
+	 * results.
+	 */
+
+	cl = search_certs(certset, cmatch);
+
+	if (! cl) {
+		os_log_debug(logsys, "No matching certificates found");
+	} else {
+		struct certlist *c;
+
+		for (c = cl; c != NULL; c = c->next)
+			add_certificate(c->certdict, &cs);
+
+		free_certlist(cl);
+	}
+
+	os_log_debug(logsys, "%u certificates added", cert_list_count);
+
+out:
+	if (certs)
+		array_free(certs);
+	if (cmatch)
+		CFRelease(cmatch);
+	if (certset)
+		CFRelease(certset);
+	if (cs.issuers)
+		CFRelease(cs.issuers);
+	if (cs.pkeys)
+		CFRelease(cs.pkeys);
+	if (query)
+		CFRelease(query);
+	if (result)
+		CFRelease(result);
+}
+
+/*
+ * Free our cert_list
+ */
+
+static void
+cert_list_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < cert_list_count; i++) {
+		if (cert_list[i].cert)
+			CFRelease(cert_list[i].cert);
+		if (cert_list[i].pkeyhash)
+			CFRelease(cert_list[i].pkeyhash);
+	}
+
+	free(cert_list);
+
+	cert_list = NULL;
+	cert_list_count = cert_list_size = 0;
+}
+
+/*
+ * Release the certificate object set (and free our cert_list); runs on
+ * the certificate queue.
+ */
+
+static void
+cert_objects_release(void *context)
+{
+	obj_set_put((struct obj_set *) context);
+
+	cert_list_free();
+}
+
+/*
+ * Get a reference to the current certificate slot objects (or NULL if
+ * the certificate scan hasn't finished yet)
+ */
+
+static struct obj_set *
+cert_objs_get(void)
+{
+	struct obj_set *objs;
+
+	pthread_mutex_lock(&cert_objs_lock);
+	objs = obj_set_get(cert_objs);
+	pthread_mutex_unlock(&cert_objs_lock);
+
+	return objs;
+}
+
+/*
+ * Make a new set of certificate objects the current one; sessions using
+ * the old set keep it until they are closed.
+ */
+
+static void
+cert_objs_publish(struct obj_set *objs)
+{
+	struct obj_set *old;
+
+	pthread_mutex_lock(&cert_objs_lock);
+	old = cert_objs;
+	cert_objs = objs;
+	pthread_mutex_unlock(&cert_objs_lock);
+
+	obj_set_put(old);
+}
+
+/*
+ * Search our set of certificates based on a substring search of the
+ * common names.  Certificates issued by those matches are found using
+ * the issuer index, so this is the only full pass we make over the set.
+ *
+ * We return a pointer to the head of a certlist.
+ */
+
+static struct certlist *
+search_certs(CFMutableSetRef certs, CFArrayRef cnmatch)
+{
+	struct certcontext cc;
+
+	cc.head = NULL;
+	cc.tail = NULL;
+	cc.match = cnmatch;
+
+	CFSetApplyFunction(certs, cn_match, &cc);
+
+	return cc.head;
+}
+
+/*
+ * Our matching function when we are matching based on the certificate
+ * common name.
+ */
+
+static void
+cn_match(const void *value, void *context)
+{
+	struct certcontext *cc = (struct certcontext *) context;
+	CFDictionaryRef dict = (CFDictionaryRef) value;
+	CFArrayRef cnmatch = (CFArrayRef) cc->match;
+	CFStringRef cn = NULL;
+	SecCertificateRef cert;
+	unsigned int i, count;
+	OSStatus ret;
+
+	/*
+	 * Extract out our common name from the certificate.  Get the
+	 * certificate ref and then use SecCertificateCopyCommonName()
+	 */
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
+					    (const void **) &cert)) {
+		os_log_debug(logsys, "Warning: unable to retrieve certificate "
+			     "from dictionary");
+		return;
+	}
+
+	ret = SP_CALL(SecCertificateCopyCommonName, cert, &cn);
+
+	if (ret) {
+		LOG_SEC_ERR("CopyCommonName failed: %{public}@", ret);
+		return;
+	}
+
+	if (! cn) {
+		os_log_debug(logsys, "SecCertificateCopyCommonName "
+			     "returned NULL");
+		return;
+	}
+
+	count = CFArrayGetCount(cnmatch);
+
+	for (i = 0; i < count; i++) {
+		CFStringRef str = CFArrayGetValueAtIndex(cnmatch, i);
+		CFRange range;
+
+		range = CFStringFind(cn, str, 0);
+
+		if (range.length > 0) {
+			/*
+			 * We have a match!
+			 */
+			add_cert_to_list(dict, cc);
+			break;
+		}
+	}
+
+	CFRelease(cn);
+
+	return;
+}
+
+/*
+ * Add a certificate to our issuer index.  This is a CFSetApplierFunction,
+ * called on each certificate dictionary in our set.
+ */
+
+static void
+index_issuer(const void *value, void *context)
+{
+	CFMutableDictionaryRef issuers = (CFMutableDictionaryRef) context;
+	CFDictionaryRef dict = (CFDictionaryRef) value;
+	CFMutableArrayRef children;
+	CFDataRef issuer;
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrIssuer,
+					    (const void **) &issuer)) {
+		os_log_debug(logsys, "Warning: cannot retrieve issuer from "
+			     "certificate");
+		return;
+	}
+
+	children = (CFMutableArrayRef) CFDictionaryGetValue(issuers, issuer);
+
+	if (! children) {
+		children = CFArrayCreateMutable(NULL, 0,
+						&kCFTypeArrayCallBacks);
+		CFDictionarySetValue(issuers, issuer, children);
+		CFRelease(children);
+	}
+
+	CFArrayAppendValue(children, dict);
+}
+
+/*
+ * Add a certificate dictionary to our linked list.
+ *
+ * Note that to prevent the dictionary from getting reclaimed underneath
+ * us, we CFRetain() it; that means when you free the linked list you need
+ * to release those objects.
+ */
+
+static void
+add_cert_to_list(CFDictionaryRef dict, struct certcontext *cc)
+{
+	struct certlist *cl = malloc(sizeof(*cl));
+
+	cl->certdict = dict;
+	CFRetain(cl->certdict);
+	cl->next = NULL;
+
+	if (! cc->head) {
+		cc->head = cc->tail = cl;
+	} else {
+		cc->tail->next = cl;
+		cc->tail = cl;
+	}
+}
+
+/*
+ * Free a certificate list
+ */
+
+static void
+free_certlist(struct certlist *cl)
+{
+	struct certlist *cl2;
+
+	while (cl != NULL) {
+		cl2 = cl->next;
+		CFRelease(cl->certdict);
+		free(cl);
+		cl = cl2;
+	}
+}
+
+/*
+ * Add a certificate to our internal list that ends up on the list of
+ * trusted certificates we present from our certificate slot.
+ */
+
+static void
+add_certificate(CFDictionaryRef dict, struct certscan *cs)
+{
+	SecCertificateRef cert;
+	CFStringRef val;
+	CFDataRef pkey, subject;
+	CFArrayRef children;
+	unsigned int i, count, c = cert_list_count;
+
+#if 0
+	if (os_log_debug_enabled(logsys)) {
+		CFStringRef label = CFDictionaryGetValue(dict, kSecAttrLabel);
+		os_log_debug(logsys, "Adding certificate \"%{public}@\"",
+			     label ? label : CFSTR("Unknown certificate"));
+	}
+#endif
+
+	/*
+	 * Before we do anything else, remove us from the certificate
+	 * set so we don't try to match on us again.  If we're not in the
+	 * set then we've already been here (self-signed certificates are
+	 * in their own issuer list, for example).
+	 */
+
+	if (! CFSetContainsValue(cs->certs, dict))
+		return;
+
+	CFSetRemoveValue(cs->certs, dict);
+
+	/*
+	 * We never want hardware tokens in this list
+	 */
+
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrAccessGroup,
+					  (const void **) &val)) {
+		if (CFEqual(val, kSecAttrAccessGroupToken)) {
+			os_log_debug(logsys, "Certificate is on hardware "
+				     "token, skipping");
+			return;
+		}
+	}
+
+	/*
+	 * Extract our the certificate reference and public key hash; use
+	 * the public key hash to see if we have it already
+	 */
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
+					    (const void **) &cert)) {
+		os_log_debug(logsys, "No certificate reference found, "
+			     "skipping!");
+		return;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+					   (const void **) &pkey)) {
+		os_log_debug(logsys, "No public key hash found, skipping!");
+		return;
+	}
+
+	/*
+	 * Check to see if we have this already
+	 */
+
+	if (CFSetContainsValue(cs->pkeys, pkey)) {
+		os_log_debug(logsys, "Certificate is already in list, "
+			     "skipping");
+		return;
+	}
+
+	CFSetAddValue(cs->pkeys, pkey);
+
+	/*
+	 * Add this to our certificate list.
+	 */
+
+	if (++cert_list_count > cert_list_size) {
+		cert_list_size += 5;
+
+		cert_list = realloc(cert_list,
+				    sizeof(*cert_list) * cert_list_size);
+	}
+
+	cert_list[c].cert = cert;
+	CFRetain(cert_list[c].cert);
+	cert_list[c].pkeyhash = pkey;
+	CFRetain(cert_list[c].pkeyhash);
+
+	/*
+	 * Look up the certificates ISSUED by this certificate, and add them.
+	 */
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrSubject,
+					    (const void **) &subject)) {
+		os_log_debug(logsys, "Unable to retrieve subject, returning");
+		return;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(cs->issuers, subject,
+					    (const void **) &children))
+		return;
+
+	count = CFArrayGetCount(children);
+
+	for (i = 0; i < count; i++)
+		add_certificate(CFArrayGetValueAtIndex(children, i), cs);
+
+	return;
+}
+
+/*
+ * Get the SecAccessControl object from the identity.
+ *
+ * This is a little subtle; we don't actually want the SecAccessControl
+ * object for the IDENTITY, we want it for the private key (as it turns
+ * out, they are different).  So what we need to do is get the attributes
+ * for the key using SecItemCopyMatching(); the SecAccessControl object
+ * will be in there.
+ */
+
+static SecAccessControlRef
+getaccesscontrol(CFDictionaryRef dict, CFDictionaryRef keys)
+{
+	SecAccessControlRef accret;
+	CFMutableDictionaryRef accquery = NULL;
+	CFDictionaryRef attrdict;
+	CFDataRef label;
+	OSStatus ret;
+
+	/*
+	 * Our keys for our query dictionary for SecItemCopyMaching().
+	 *
+	 * kSecClass = kSecClassKey
+	 *	This means we're searching for keys (instead of identities
+	 *	or certificates)
+	 * kSecAttrKeyClass = kSecAttrKeyClassPrivate
+	 *	We want to match on the private key
+	 * kSecAttrApplicationLabel
+	 *	This is the "application label" of the key.  We get this
+	 *	from the identity dictionary, and it makes sure we get the
+	 *	private key associated with this identity.
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 *	We only want one match (really, we should only have one
+	 *	match, but let's be safe)
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 *	We want to get all of the attributes so we can find the
+	 *	SecAccessControlRef
+	 */
+
+	/*
+	 * Build our query dictionary to retrieve the key attributes.  We
+	 * need the application label from the original identity (this is
+	 * passed down in "dict")
+	 */
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrApplicationLabel,
+				    (const void **) &label)) {
+		os_log_debug(logsys, "Application Label object not found");
+		return NULL;
+	}
+
+	/*
+	 * If we already fetched the key attributes, use those.
+	 */
+
+	if (keys && CFDictionaryGetValueIfPresent(keys, label,
+						  (const void **) &attrdict)) {
+		CFRetain(attrdict);
+		goto gotattrs;
+	}
+
+	if (! add_dict(&accquery, kSecClass, kSecClassKey))
+		return NULL;
+	add_dict(&accquery, kSecAttrKeyClass, kSecAttrKeyClassPrivate);
+	add_dict(&accquery, kSecAttrApplicationLabel, label);
+	add_dict(&accquery, kSecMatchLimit, kSecMatchLimitOne);
+	add_dict(&accquery, kSecReturnAttributes, kCFBooleanTrue);
+
+	/*
+	 * Perform the actual query
+	 */
+
+	ret = SP_CALL(SecItemCopyMatching, accquery, (CFTypeRef *) &attrdict);
+
+	CFRelease(accquery);
+
+	if (ret) {
+		LOG_SEC_ERR("Access control ref SecItemCopyMatching "
+			    "failed: %{public}@", ret);
+		return NULL;
+	}
+
+gotattrs:
+	/*
+	 * Just in case, make sure we got a CFDictionaryRef
+	 */
+
+	if (CFGetTypeID(attrdict) != CFDictionaryGetTypeID()) {
+		logtype("Was expecting a CFDictionary, but got", attrdict);
+		CFRelease(attrdict);
+		return NULL;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(attrdict, kSecAttrAccessControl,
+					    (const void **) &accret)) {
+		os_log_debug(logsys, "Access Control object not found");
+		CFRelease(attrdict);
+		return NULL;
+	}
+
+	CFRetain(accret);
+	CFRelease(attrdict);
+
+	return accret;
+}
+
+/*
+ * Return the label of an identity's private key from the attributes that
+ * token_key_attrs() fetched, or NULL if we don't have it (in which case
+ * getkeylabel() will look it up later).
+ */
+
+static char *
+getprivlabel(CFDictionaryRef dict, CFDictionaryRef keys)
+{
+	CFDictionaryRef attrs;
+	CFStringRef label;
+	CFDataRef applabel;
+
+	if (keys &&
+	    CFDictionaryGetValueIfPresent(dict, kSecAttrApplicationLabel,
+					  (const void **) &applabel) &&
+	    CFDictionaryGetValueIfPresent(keys, applabel,
+					  (const void **) &attrs) &&
+	    CFDictionaryGetValueIfPresent(attrs, kSecAttrLabel,
+					  (const void **) &label))
+		return getstrcopy(label);
+
+	return NULL;
+}
+
+/*
+ * Return the user-printable label for a key.
+ *
+ * Sigh.  It turns out some applications REALLY want a printable label
+ * associated with a key; we'll fetch the key label from the attribute
+ * dictionary.  Returns string that must always be free()d.
+ */
+
+static char *
+getkeylabel(SecKeyRef key)
+{
+	CFMutableDictionaryRef query = NULL;
+	CFDictionaryRef keyattr = NULL, result = NULL;
+	CFStringRef label, class;
+	CFDataRef applabel;
+	OSStatus ret;
+	char *retstr;
+
+	/*
+	 * Slightly more complicated than I would like, but we're trying to
+	 * conform to the Security framework APIs as I understand them.
+	 *
+	 * Fetch the key attributes using SecKeyCopyAttributes (the label
+	 * isn't one of the supported attributes that SecKeyCopyAttributes
+	 * is supposed to return).
+	 *
+	 * Use the KeyClass and application label in a query dictionary
+	 * to retrieve the complete attribute dictionary, and return the
+	 * kSecAttrLabel value.
+	 */
+
+	/*
+	 * Our query dictionary; see above for greater detail
+	 *
+	 * kSecClass = kSecClassKey
+	 * kSecAttrKeyClass (from key)
+	 * kSecAttrApplicationLabel (from key)
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 */
+
+	keyattr = SP_CALL(SecKeyCopyAttributes, key);
+
+	if (! keyattr) {
+		os_log_debug(logsys, "SecKeyCopyAttr returned NULL");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrKeyClass,
+					    (const void **) &class)) {
+		os_log_debug(logsys, "Cannot find KeyClass in dict");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrApplicationLabel,
+					    (const void **) &applabel)) {
+		os_log_debug(logsys, "Cannot find AppLabel in dict");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! add_dict(&query, kSecClass, kSecClassKey)) {
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+	add_dict(&query, kSecAttrKeyClass, class);
+	add_dict(&query, kSecAttrApplicationLabel, applabel);
+	add_dict(&query, kSecMatchLimit, kSecMatchLimitOne);
+	add_dict(&query, kSecReturnAttributes, kCFBooleanTrue);
+
+	ret = SP_CALL(SecItemCopyMatching, query, (CFTypeRef *) &result);
+
+	if (ret) {
+		LOG_SEC_ERR("SecItemCopyMatching failed: %{public}@", ret);
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (CFGetTypeID(result) != CFDictionaryGetTypeID()) {
+		logtype("Was expecting a CFDictionaryRef, but got", result);
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(result, kSecAttrLabel,
+					    (const void **) &label)) {
+		os_log_debug(logsys, "Unable to find key label");
+		retstr = strdup("Unknown key");
+	} else {
+		retstr = getstrcopy(label);
+	}
+
+out:
+	if (keyattr)
+		CFRelease(keyattr);
+	if (query)
+		CFRelease(query);
+	if (result)
+		CFRelease(result);
+
+	return retstr;
+}
+
+/*
+ * A "safe" version of CFArrayGetCount().
+ *
+ * SecItemCopyMatching can sometimes return a single entry or a CFArrayRef
+ * with multiple entries.  So to be as robust as possible, handle this case
+ * here.  If we have something OTHER than a CFArrayRef, then just return a
+ * count of "1".  Otherwise return the real array count.
+ */
+
+static unsigned int
+cflistcount(CFTypeRef ref)
+{
+	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
+		return CFArrayGetCount((CFArrayRef) ref);
+	} else {
+		return 1;
+	}
+}
+
+/*
+ * A "safe" version of CFArrayGetValueAtIndex
+ *
+ * If the passed-in type is a CFArray, then return the appropriate value
+ * at the passed-in index.  If it is a CFDictionaryRef, then just return
+ * passed-in value if the index is 0; anything else, return a NULL.
+ */
+
+static CFDictionaryRef
+cfgetindex(CFTypeRef ref, unsigned int index)
+{
+	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
+		return CFArrayGetValueAtIndex((CFArrayRef) ref, index);
+	} else if (CFGetTypeID(ref) == CFDictionaryGetTypeID() && index == 0) {
+		return ref;
+	} else {
+		return NULL;
+	}
+}
+
+/*
+ * Make sure the our custom logging system is enabled
+ */
+
+static void
+log_init(void *context)
+{
+	logsys = os_log_create(APPIDENTIFIER, "general");
+
+	/*
+	 * This is only read once (we run before C_Initialize(), and from
+	 * every entry point), so changing it requires restarting the
+	 * application.
+	 */
+
+	log_level = prefkey_intget("logLevel", LOG_LEVEL_DEBUG);
+
+	if (log_level <= LOG_LEVEL_NONE)
+		logsys = OS_LOG_DISABLED;
+
+	stats_init();
+
+	/*
+	 * Signposts are new in 10.14; if we don't have them, logsp
+	 * stays NULL and the SP_ macros don't do anything.
+	 */
+
+	if (__builtin_available(macOS 10.14, *))
+		logsp = os_log_create(APPIDENTIFIER, "signpost");
+}
+
+/*
+ * Get a reference to the current slot table
+ */
+
+static struct slot_table *
+slot_table_get(void)
+{
+	struct slot_table *st;
+
+	pthread_mutex_lock(&slot_table_lock);
+	st = slot_table;
+	atomic_fetch_add_explicit(&st->refcount, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&slot_table_lock);
+
+	return st;
+}
+
+/*
+ * Get a reference to the current slot table, but first wait for the
+ * startup token scan if it is still running (see asyncTokenScan).  If
+ * it takes too long we just go with whatever slots we have so far (and
+ * after that, we stop waiting).
+ */
+
+static struct slot_table *
+slot_table_wait(void)
+{
+	if (! atomic_load(&token_scan_done) &&
+	    ! atomic_load(&token_scan_timedout) &&
+	    dispatch_group_wait(token_scan_group,
+				dispatch_time(DISPATCH_TIME_NOW,
+					      TOKEN_SCAN_WAIT * NSEC_PER_SEC))) {
+		os_log_debug(logsys, "Timed out waiting for token scan");
+		atomic_store(&token_scan_timedout, true);
+	}
+
+	return slot_table_get();
+}
+
+/*
+ * Add the tokens that are already inserted, in the background (see
+ * asyncTokenScan)
+ */
+
+static void
+token_scan(void *dummy)
+{
+	start_token_watcher();
+
+	atomic_store(&token_scan_done, true);
+
+	os_log_debug(logsys, "Background token scan finished");
+}
+
+/*
+ * Release a slot table reference.  When the last reference to a table
+ * goes away, we release its retired entry (if any) and our reference to
+ * the table that replaced us (which might let that one be freed as well).
+ */
+
+static void
+slot_table_put(struct slot_table *st)
+{
+	struct slot_table *next;
+
+	while (st && atomic_fetch_sub_explicit(&st->refcount, 1,
+					       memory_order_acq_rel) == 1) {
+		if (st->retired)
+			slot_entry_free(st->retired, false);
+		next = st->next;
+		free(st);
+		st = next;
+	}
+}
+
+/*
+ * Make a new (unpublished) slot table with "count" slots, with the
+ * entries copied from an existing table (which can be NULL).  The new
+ * table doesn't take any entry references of its own; it inherits the
+ * ones owned by the current table when it is published.
+ */
+
+static struct slot_table *
+slot_table_copy(struct slot_table *old, unsigned int count)
+{
+	struct slot_table *st;
+	unsigned int i;
+
+	st = malloc(sizeof(*st) + sizeof(st->slots[0]) * count);
+
+	atomic_init(&st->refcount, 1);
+	st->next = NULL;
+	st->retired = NULL;
+	st->count = count;
+
+	for (i = 0; i < count; i++)
+		st->slots[i] = old && i < old->count ? old->slots[i] : NULL;
+
+	return st;
+}
+
+/*
+ * Replace the current slot table with a new one made by slot_table_copy().
+ * The reference from slot_table_copy() becomes the "current table"
+ * reference.  If an entry was removed, pass it in as "retired"; the
+ * slot list reference to it is released when the old table is freed.
+ * Must be called with slot_mutex locked.
+ */
+
+static void
+slot_table_publish(struct slot_table *st, struct slot_entry *retired)
+{
+	struct slot_table *old;
+
+	pthread_mutex_lock(&slot_table_lock);
+	old = slot_table;
+	slot_table = st;
+	pthread_mutex_unlock(&slot_table_lock);
+
+	atomic_fetch_add_explicit(&st->refcount, 1, memory_order_relaxed);
+	old->next = st;
+	old->retired = retired;
+
+	slot_table_put(old);
+}
+
+/*
+ * Free a slot entry
+ */
+
+static void
+slot_entry_free(struct slot_entry *entry, bool logout)
+{
+	os_log_debug(logsys, "slot_entry_free for slot %{public}@ "
+		    "(refcount %d)", entry->tokenid, (int) entry->refcount);
+
+	LOCK_MUTEX(entry->entry_mutex);
+
+	if (--entry->refcount > 0) {
+		/*
+		 * If refcount == 1, that means there are no more open
+                 * sessions (assuming we didn't have an open session and
+                 * our card got removed).  So if logout == true (called
+                 * be C_CloseSession or similar functions) then logout
+                 * of the token as well.
+		 *
+		 * If the refcount == 0 then the lacontext is completety
+		 * released which does the same thing.
+		 */
+		if (entry->refcount == 1)
+			token_logout(entry);
+		UNLOCK_MUTEX(entry->entry_mutex);
+		return;
+	}
+
+	UNLOCK_MUTEX(entry->entry_mutex);
+
+	/*
+	 * Nobody is using this entry anymore.  If the token was removed,
+	 * hang onto it in case it comes back.
+	 */
+
+	if (entry->removed && token_snapshot_save(entry))
+		return;
+
+	slot_entry_destroy(entry);
+}
+
+/*
+ * Actually free all of the memory associated with a slot entry
+ */
+
+static void
+slot_entry_destroy(struct slot_entry *entry)
+{
+	if (entry->tokenid)
+		CFRelease(entry->tokenid);
+
+	if (entry->id_list)
+		id_list_free(entry->id_list, entry->id_count);
+
+	obj_set_put(entry->objs);
+
+	if (entry->label)
+		free(entry->label);
+
+	if (entry->lacontext)
+		lacontext_free(entry->lacontext);
+
+	if (entry->op_sem)
+		dispatch_release(entry->op_sem);
+
+	free(entry->mech_list);
+	free(entry->mech_info);
+
+	if (entry->id_result)
+		CFRelease(entry->id_result);
+
+	DESTROY_MUTEX(entry->entry_mutex);
+	DESTROY_MUTEX(entry->bind_mutex);
+
+	free(entry);
+}
+
+/*
+ * Save a removed slot entry in our snapshot list, after getting rid of
+ * everything that is tied to the token being present.  If the list is
+ * full, the least recently used snapshot gets thrown out.  Returns false
+ * if we aren't keeping snapshots (the caller should free the entry).
+ */
+
+static bool
+token_snapshot_save(struct slot_entry *entry)
+{
+	struct slot_entry *old = NULL;
+	unsigned int i;
+
+	for (i = 0; i < entry->id_count; i++) {
+		struct id_info *id = entry->id_list[i];
+
+		if (id->ident) {
+			CFRelease(id->ident);
+			id->ident = NULL;
+		}
+
+		/*
+		 * The warm-up was for the key we're releasing; the next
+		 * key has to be warmed up (and asked for its size) again
+		 */
+
+		pthread_mutex_lock(&id->warm_mutex);
+		if (id->privkey) {
+			CFRelease(id->privkey);
+			id->privkey = NULL;
+		}
+		atomic_store(&id->warmed, false);
+		id->privsize = 0;
+		pthread_mutex_unlock(&id->warm_mutex);
+	}
+
+	if (entry->lacontext) {
+		lacontext_free(entry->lacontext);
+		entry->lacontext = NULL;
+	}
+
+	entry->logged_in = false;
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	if (! snapshots_enabled) {
+		pthread_mutex_unlock(&snapshot_mutex);
+		return false;
+	}
+
+	if (snapshot_count == TOKEN_SNAPSHOTS)
+		old = token_snapshots[--snapshot_count];
+
+	memmove(&token_snapshots[1], &token_snapshots[0],
+		snapshot_count * sizeof(token_snapshots[0]));
+	token_snapshots[0] = entry;
+	snapshot_count++;
+
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	os_log_debug(logsys, "Saved snapshot for token %{public}@",
+		     entry->tokenid);
+
+	if (old)
+		slot_entry_destroy(old);
+
+	return true;
+}
+
+/*
+ * Find a snapshot for this token.  It has to have the same token
+ * identifier, and every identity in "result" (the identity attribute
+ * dictionaries from SecItemCopyMatching()) has to match an identity in
+ * the snapshot.  If we find one, it is removed from the snapshot list
+ * and returned, and ids is filled in with the snapshot identity for each
+ * entry in result.  Otherwise returns NULL (and ids may contain junk).
+ */
+
+static struct slot_entry *
+token_snapshot_find(CFStringRef tokenid, CFTypeRef result, unsigned int count,
+		    struct id_info **ids)
+{
+	struct slot_entry *entry = NULL;
+	unsigned char fprint[ID_FPRINT_LEN];
+	unsigned int i, j, k;
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	for (i = 0; i < snapshot_count; i++) {
+		entry = token_snapshots[i];
+
+		if (! CFEqual(tokenid, entry->tokenid) ||
+		    entry->id_count != count)
+			goto next;
+
+		for (j = 0; j < count; j++) {
+			identity_fingerprint(cfgetindex(result, j), fprint);
+
+			ids[j] = NULL;
+
+			for (k = 0; k < entry->id_count; k++) {
+				if (memcmp(fprint, entry->id_list[k]->fprint,
+					   ID_FPRINT_LEN) == 0) {
+					ids[j] = entry->id_list[k];
+					break;
+				}
+			}
+
+			/*
+			 * Don't let two identities match the same
+			 * snapshot identity
+			 */
+
+			if (! ids[j])
+				goto next;
+
+			for (k = 0; k < j; k++)
+				if (ids[k] == ids[j])
+					goto next;
+		}
+
+		memmove(&token_snapshots[i], &token_snapshots[i + 1],
+			(snapshot_count - i - 1) * sizeof(token_snapshots[0]));
+		snapshot_count--;
+		goto out;
+next:
+		entry = NULL;
+	}
+
+out:
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return entry;
+}
+
+/*
+ * Free all of our token snapshots and stop saving new ones (we do this
+ * in C_Finalize())
+ */
+
+static void
+token_snapshot_flush(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	snapshots_enabled = false;
+
+	for (i = 0; i < snapshot_count; i++)
+		slot_entry_destroy(token_snapshots[i]);
+
+	snapshot_count = 0;
+
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+ * Free our identity list
+ */
+
+static void
+id_list_free(struct id_info **id_list, unsigned int id_list_count)
+{
+	int i;
+
+	for (i = 0; i < id_list_count; i++)
+		if (id_list[i])
+			id_info_free(id_list[i]);
+
+	if (id_list)
+		free(id_list);
+}
+
+/*
+ * Return the public key to use for an operation.  If we can, this is our
+ * local copy of the public key (see host_pubkey), otherwise it's the
+ * public key we got from the Keychain.  Either way the reference isn't
+ * retained.
+ */
+
+static SecKeyRef
+id_pubkey(struct id_info *id, SecKeyOperationType op, SecKeyAlgorithm alg,
+	  SecKeyAlgorithm dalg)
+{
+	if (! host_pubkey)
+		return id->pubkey;
+
+	dispatch_once_f(&id->hostkey_once, id, hostkey_create);
+
+	/*
+	 * Just in case; if our copy of the key can't do this, then let
+	 * the original key handle it.
+	 */
+
+	if (! id->hostkey || (alg && ! SecKeyIsAlgorithmSupported(id->hostkey,
+								 op, alg)) ||
+	    (dalg && ! SecKeyIsAlgorithmSupported(id->hostkey, op, dalg)))
+		return id->pubkey;
+
+	return id->hostkey;
+}
+
+/*
+ * Warm up all of the private keys on a token after a login (called via
+ * dispatch_group_async_f() from C_Login(), with a token reference).
+ * If the token came from the token cache, this is also where the keys
+ * get resolved.  The token reference keeps the token (and its keys)
+ * around, but not the LAContext; token_bind() takes care of that.  If
+ * the token has been logged out by the time we get here (or while we
+ * are working), there's no point in carrying on.
+ */
+
+static void
+token_warmup(void *context)
+{
+	struct slot_entry *token = (struct slot_entry *) context;
+
+	if (token_logged_in(token) && token_bind(token)) {
+		os_log_debug(logsys, "Warming up %u keys for token %{public}@",
+			     token->id_count, token->tokenid);
+
+		dispatch_apply_f(token->id_count, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_LOW, 0),
+				 token, warmup_identity);
+	}
+
+	slot_entry_free(token, false);
+}
+
+/*
+ * Check whether a token is still logged in
+ */
+
+static bool
+token_logged_in(struct slot_entry *token)
+{
+	bool logged_in;
+
+	LOCK_MUTEX(token->entry_mutex);
+	logged_in = token->logged_in;
+	UNLOCK_MUTEX(token->entry_mutex);
+
+	return logged_in;
+}
+
+/*
+ * Warm up one identity (called via dispatch_apply_f())
+ */
+
+static void
+warmup_identity(void *context, size_t i)
+{
+	struct slot_entry *token = (struct slot_entry *) context;
+
+	if (token_logged_in(token))
+		id_warm(token->id_list[i]);
+}
+
+/*
+ * Warm up an identity's private key if nobody has yet.  If someone else
+ * is warming it up right now, we wait for them.
+ */
+
+static void
+id_warm(struct id_info *id)
+{
+	if (atomic_load(&id->warmed))
+		return;
+
+	pthread_mutex_lock(&id->warm_mutex);
+
+	if (! atomic_load(&id->warmed) && id->privkey) {
+		key_warmup(id);
+		atomic_store(&id->warmed, true);
+	}
+
+	pthread_mutex_unlock(&id->warm_mutex);
+}
+
+/*
+ * Do everything for a private key that a first operation would (called
+ * from id_warm()).  Asking for the block size and whether the key
+ * supports an algorithm both go to the token, which sets up the
+ * connection to the token extension and finds the key there; neither of
+ * them is a key operation, so they don't need the PIN.  We keep the
+ * block size, since every C_SignInit() and C_DecryptInit() wants it.
+ * The algorithms we ask about depend on the key type; for a key type we
+ * don't know, the block size is all we do.  The private key must
+ * already be resolved (see token_bind()).
+ */
+
+static void
+key_warmup(struct id_info *id)
+{
+	SecKeyAlgorithm signalg = NULL, decalg = NULL;
+	SecKeyOperationType decop = kSecKeyOperationTypeDecrypt;
+	os_signpost_id_t spid;
+
+	SP_BEGIN(spid, "Private key warm-up");
+
+	id->privsize = SecKeyGetBlockSize(id->privkey);
+
+	switch (id->keytype) {
+	case CKK_RSA:
+		signalg = kSecKeyAlgorithmRSASignatureDigestPKCS1v15Raw;
+		decalg = kSecKeyAlgorithmRSAEncryptionPKCS1;
+		break;
+	case CKK_EC:
+		/*
+		 * EC keys don't decrypt, but a "decrypt" key on a card is
+		 * one for key agreement
+		 */
+		signalg = kSecKeyAlgorithmECDSASignatureDigestX962;
+		decalg = kSecKeyAlgorithmECDHKeyExchangeStandard;
+		decop = kSecKeyOperationTypeKeyExchange;
+		break;
+	}
+
+	if (id->privcansign && signalg)
+		SecKeyIsAlgorithmSupported(id->privkey,
+					   kSecKeyOperationTypeSign, signalg);
+
+	if (id->privcandecrypt && decalg)
+		SecKeyIsAlgorithmSupported(id->privkey, decop, decalg);
+
+	SP_END(spid, "Private key warm-up");
+}
+
+/*
+ * Return the block size of an identity's private key, warming it up
+ * first if nobody has yet.  This can only be used once token_bind()
+ * has succeeded.
+ */
+
+static size_t
+id_privsize(struct id_info *id)
+{
+	id_warm(id);
+
+	return id->privsize;
+}
+
+/*
+ * Create our local copy of an identity's public key (called via
+ * dispatch_once_f()).  The external representation of an RSA public
+ * key is the PKCS#1 RSAPublicKey, which SecKeyCreateWithData() will
+ * happily take back.
+ */
+
+static void
+hostkey_create(void *context)
+{
+	struct id_info *id = (struct id_info *) context;
+	CFMutableDictionaryRef attrs = NULL;
+	CFErrorRef err = NULL;
+	CFDataRef keydata;
+
+	if (id->keytype != CKK_RSA)
+		return;
+
+	keydata = SP_CALL(SecKeyCopyExternalRepresentation, id->pubkey, &err);
+
+	if (! keydata) {
+		os_log_debug(logsys, "Unable to get public key data: "
+			     "%{public}@", err);
+		CFRelease(err);
+		return;
+	}
+
+	add_dict(&attrs, kSecAttrKeyType, kSecAttrKeyTypeRSA);
+	add_dict(&attrs, kSecAttrKeyClass, kSecAttrKeyClassPublic);
+
+	id->hostkey = SP_CALL(SecKeyCreateWithData, keydata, attrs, &err);
+
+	if (! id->hostkey) {
+		os_log_debug(logsys, "Unable to create local public key: "
+			     "%{public}@", err);
+		CFRelease(err);
+	}
+
+	CFRelease(attrs);
+	CFRelease(keydata);
+}
+
+/*
+ * Free a single identity entry
+ */
+
+static void
+id_info_free(struct id_info *id)
+{
+	if (id->label)
+		free(id->label);
+	if (id->keylabel)
+		free(id->keylabel);
+	if (id->ident)
+		CFRelease(id->ident);
+	if (id->privkey)
+		CFRelease(id->privkey);
+	if (id->pubkey)
+		CFRelease(id->pubkey);
+	if (id->hostkey)
+		CFRelease(id->hostkey);
+	if (id->cert)
+		CFRelease(id->cert);
+	if (id->secaccess)
+		CFRelease(id->secaccess);
+	if (id->pkeyhash)
+		CFRelease(id->pkeyhash);
+
+	pthread_mutex_destroy(&id->warm_mutex);
+	free(id);
+}
+
+/*
+ * A version of snprintf() which does space-padding
+ */
+
+static void
+sprintfpad(unsigned char *dest, size_t destsize, const char *fmt, ...)
+{
+	char *s;
+	va_list ap;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = vasprintf(&s, fmt, ap);
+	va_end(ap);
+
+	if (rc < 1) {
+		memset(dest, ' ', destsize);
+	} else {
+		/* We are relying on strncpy not doing \0 at end for trunc */
+		strncpy((char *) dest, s, destsize);
+		if (rc < destsize)
+			memset(dest + rc, ' ', destsize - rc);
+		free(s);
+	}
+}
+
+/*
+ * Return a boolean value based on a dictionary key.  If the key is not
+ * set then return false.
+ */
+
+bool
+boolfromdict(const char *keyname, CFDictionaryRef dict, CFTypeRef key)
+{
+	CFTypeRef val;
+
+	if (! CFDictionaryGetValueIfPresent(dict, key, &val)) {
+		os_log_debug(logsys, "No value for %s in dictionary, "
+			     "returning FALSE", keyname);
+		return false;
+	}
+
+	if (CFGetTypeID(val) != CFBooleanGetTypeID() &&
+	    CFGetTypeID(val) != CFNumberGetTypeID()) {
+		os_log_debug(logsys, "%s was not a boolean, but exists, so "
+			     "returning TRUE", keyname);
+		return true;
+	}
+
+	os_log_debug(logsys, "%s is set to %{bool}d", keyname,
+		     CFBooleanGetValue(val));
+
+	return CFBooleanGetValue(val);
+}
+
+/*
+ * Return true if a dictionary has a value for a key and it's the same as
+ * the one we have (value may be NULL, which never matches)
+ */
+
+static bool
+dict_value_equal(CFDictionaryRef dict, CFTypeRef key, CFTypeRef value)
+{
+	CFTypeRef val;
+
+	return value && CFDictionaryGetValueIfPresent(dict, key, &val) &&
+	       CFEqual(val, value);
+}
+
+/*
+ * Get a C string from a CFStringRef (assumes UTF-8 encoding).
+ * Allocates memory that must be free()d.
+ */
+
+static char *
+getstrcopy(CFStringRef string)
+{
+	const char *s = CFStringGetCStringPtr(string, kCFStringEncodingUTF8);
+
+	if (! s) {
+		CFIndex len = CFStringGetLength(string);
+		CFIndex size = CFStringGetMaximumSizeForEncoding(len,
+						 kCFStringEncodingUTF8) + 1;
+		char *p = malloc(size);
+
+		if (! CFStringGetCString(string, p, size,
+					 kCFStringEncodingUTF8)) {
+			free(p);
+			return strdup("Unknown string");
+		}
+
+		return p;
+	} else {
+		return strdup(s);
+	}
+}
+
+/*
+ * Log this object's type
+ */
+
+void
+logtype(const char *string, CFTypeRef ref)
+{
+	CFStringRef str;
+
+	if (! os_log_debug_enabled(logsys))
+		return;
+
+	str = CFCopyTypeIDDescription(CFGetTypeID(ref));
+
+	os_log_debug(logsys, "%s: %{public}@", string, str);
+
+	CFRelease(str);
+}
+
+#if defined(KEYCHAIN_DEBUG)
+/*
+ * Dump the contents of a dictionary
+ */
+
+void
+dumpdict(const char *string, CFDictionaryRef dict)
+{
+	unsigned int i, count;
+	const void **keys, **values;
+
+	if (! LOG_VERBOSE_ENABLED())
+		return;
+
+	count = CFDictionaryGetCount(dict);
+
+	os_log_debug(logsys, "Dumping dictionary for %s", string);
+	os_log_debug(logsys, "Dictionary contains %u key/value pairs", count);
+
+	keys = malloc(sizeof(void *) * count);
+	values = malloc(sizeof(void *) * count);
+
+	CFDictionaryGetKeysAndValues(dict, keys, values);
+
+	for (i = 0; i < count; i++) {
+		os_log_debug(logsys, "Dictionary entry %d", (int) i);
+		os_log_debug(logsys, "Key value: %{public}@", keys[i]);
+		logtype("Value type", values[i]);
+		os_log_debug(logsys, "Value value: %{public}@", values[i]);
+	}
+
+	free(keys);
+	free(values);
+}
+#endif /* KEYCHAIN_DEBUG */
+
+/*
+ * Convert Security framework key types to PKCS#11 key types.
+ *
+ * Sigh.  This is a lot harder than I would like.  The Apple API is in flux;
+ * what the attribute dictionary returns is a CFNumber, but the constants
+ * you use are actually CFStrings which happen to have string values which
+ * correspond to the CFNumbers.  The numbers correspond to the values of
+ * CSSM_ALGORITHMS in cssmtype.h.  So that means a RSA key, for example,
+ * shows up in the attribute dictionary as a CFNumber with a value of 42,
+ * but the constant kSecAttrKeyTypeRSA is a CFString with the value of "42".
+ * (There is magic in the Security framework that lets you use things like
+ * kSecAttrKeyTypeRSA as an input key for kSecAttrKeyType).
+ *
+ * I am hesitant to include cssmtype.h, so what I have decided to do is
+ * convert the dictionary number we are given to a string and compare it
+ * against the relevant "new" API constants.  Hopefully we don't have that
+ * many.
+ */
+
+static CK_KEY_TYPE
+convert_keytype(CFNumberRef type)
+{
+	int i;
+	CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@"),
+						   type);
+
+	for (i = 0; keytype_map[i].keyname; i++) {
+		if (CFEqual(str, *keytype_map[i].sec_keytype)) {
+			os_log_debug(logsys, "This is a %s",
+				     keytype_map[i].keyname);
+			CFRelease(str);
+			return keytype_map[i].pkcs11_keytype;
+		}
+	}
+
+	CFRelease(str);
+
+	os_log_debug(logsys, "Keytype is unknown, returning VENDOR_DEFINED");
+
+	return CKK_VENDOR_DEFINED;
+}
+
+/*
+ * Build our list of objects based on our identities.
+ *
+ * Attribute values are interned in the blob store (so identical values
+ * on different objects, or in different slots, share one copy).  The
+ * per-object attribute array is only temporary; obj_seal() sorts it and
+ * moves it into the arena (the macros expect a variable called "arena",
+ * a struct attr_block **, to be in scope) when we are done building
+ * objects.
+ */
+
+#define ADD_ATTR_SIZE(objlist, objcount, attribute, var, size) \
+	ADD_ATTR_VALUE(objlist, objcount, attribute, \
+		       blob_intern(var, size), size)
+
+#define ADD_ATTR_VALUE(objlist, objcount, attribute, value, size) \
+do { \
+	const void *p = value; \
+	if ( objlist [ objcount ].attr_count >= \
+	    objlist [ objcount ].attr_size) { \
+		objlist [ objcount ].attr_size += 5; \
+		objlist [ objcount ].attrs = realloc( objlist [ objcount ].attrs, \
+			objlist [ objcount ].attr_size * sizeof(CK_ATTRIBUTE)); \
+	} \
+	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].type = attribute; \
+	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].pValue = \
+							(void *) p; \
+	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].ulValueLen = size; \
+	objlist [ objcount ].attr_count++; \
+} while (0)
+
+#define ADD_ATTR(objlist, objcount, attr, var) \
+		ADD_ATTR_SIZE(objlist, objcount, attr, &var, sizeof(var))
+
+#define NEW_OBJECT(objlist, objcount, objsize) \
+do { \
+	if (++ objcount >= objsize ) { \
+		objsize += 5; \
+		objlist = realloc( objlist, objsize * sizeof(* objlist )); \
+	} \
+} while (0)
+
+#define OBJINIT(objlist, objcount, idptr) \
+do { \
+	objlist [ objcount ].id = idptr; \
+	objlist [ objcount ].attrs = NULL; \
+	objlist [ objcount ].attr_count = 0; \
+	objlist [ objcount ].attr_size = 0; \
+	objlist [ objcount ].lazy = 0; \
+	objlist [ objcount ].cert = NULL; \
+	objlist [ objcount ].lazy_once = 0; \
+	objlist [ objcount ].lazy_attrs = NULL; \
+	objlist [ objcount ].lazy_count = 0; \
+	objlist [ objcount ].interned = true; \
+} while (0)
+
+/*
+ * Build up a list of objects based on our identity list
+ */
+
+static void
+build_id_objects(struct slot_entry *entry)
+{
+	int i;
+	CK_OBJECT_CLASS cl;
+	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
+	CK_ULONG t;
+	CK_BBOOL b;
+	char *label;
+	struct obj_info *list = NULL;
+	unsigned int count = 0, size = 0;
+	struct attr_block *head = NULL, **arena = &head;
+
+	if (entry->id_count > 0) {
+		/* Prime the pump */
+		NEW_OBJECT(list, count, size);
+		count--;
+	}
+
+	for (i = 0; i < entry->id_count; i++) {
+		unsigned char *objid = NULL;
+		unsigned int objidlen;
+
+		OBJINIT(list, count, entry->id_list[i]);
+
+		/*
+		 * Add in the object for each identity; cert, public key,
+		 * private key.  Add in attributes we need.  Anything that
+		 * needs the certificate contents or the public key data is
+		 * a lazy attribute (see obj_materialize()).
+		 */
+
+		get_index_bytes(i, &objid, &objidlen);
+
+		cl = CKO_CERTIFICATE;
+		list[count].class = cl;
+		ADD_ATTR(list, count, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(list, count, CKA_ID,
+			      objid, objidlen);
+		ADD_ATTR(list, count,
+			 CKA_CERTIFICATE_TYPE, ct);
+		b = CK_TRUE;
+		ADD_ATTR(list, count, CKA_TOKEN, b);
+		ADD_ATTR_SIZE(list, count, CKA_LABEL,
+			      entry->id_list[i]->label,
+			      strlen(entry->id_list[i]->label));
+		list[count].lazy = LAZY_CERT;
+
+		NEW_OBJECT(list, count, size);
+		OBJINIT(list, count, entry->id_list[i]);
+
+		cl = CKO_PUBLIC_KEY;
+		list[count].class = cl;
+		ADD_ATTR(list, count, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(list, count, CKA_ID,
+			      objid, objidlen);
+		ADD_ATTR(list, count, CKA_KEY_TYPE,
+			 entry->id_list[i]->keytype);
+		b = CK_TRUE;
+		ADD_ATTR(list, count, CKA_TOKEN, b);
+		ADD_ATTR(list, count, CKA_LOCAL, b);
+		b = entry->id_list[i]->pubcanencrypt;
+		ADD_ATTR(list, count, CKA_ENCRYPT, b);
+		b = entry->id_list[i]->pubcanverify;
+		ADD_ATTR(list, count, CKA_VERIFY, b);
+
+		/*
+		 * Sigh.  It seems like the public part of an identity
+		 * doesn't actually get a label attribute, at least with
+		 * the release I tested.  So for now, get the label from
+		 * the identity label, and maybe check later if this
+		 * changes; keep the code around here if it does.
+		 *
+		 * label = getkeylabel(entry->id_list[i]->pubkey);
+		 * ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
+		 * free(label);
+		 */
+
+		ADD_ATTR_SIZE(list, count, CKA_LABEL,
+			      entry->id_list[i]->label,
+			      strlen(entry->id_list[i]->label));
+
+		/*
+		 * It turns out some implementations want CKA_MODULUS_BITS,
+		 * and the modulus and public exponent.  For RSA keys the
+		 * modulus size is equal to the block size, and we can get
+		 * modulus and public exponent from the "external
+		 * representation" of the public key.  Note that the block
+		 * size is returned in bytes, and we need bits.  The modulus
+		 * and exponent are lazy attributes.
+		 */
+
+		t = SecKeyGetBlockSize(entry->id_list[i]->pubkey) * 8;
+		ADD_ATTR(list, count,
+			 CKA_MODULUS_BITS, t);
+		list[count].lazy = LAZY_SUBJECT |
+							 LAZY_KEY;
+
+		b = CK_FALSE;
+		ADD_ATTR(list, count, CKA_WRAP, b);
+		ADD_ATTR(list, count, CKA_DERIVE, b);
+
+		NEW_OBJECT(list, count, size);
+		OBJINIT(list, count, entry->id_list[i]);
+
+		cl = CKO_PRIVATE_KEY;
+		list[count].class = cl;
+		ADD_ATTR(list, count, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(list, count, CKA_ID,
+			      objid, objidlen);
+		ADD_ATTR(list, count, CKA_KEY_TYPE,
+			 entry->id_list[i]->keytype);
+		b = CK_TRUE;
+		ADD_ATTR(list, count, CKA_TOKEN, b);
+		ADD_ATTR(list, count, CKA_PRIVATE, b);
+		b = entry->id_list[i]->privcandecrypt;
+		ADD_ATTR(list, count, CKA_DECRYPT, b);
+		b = entry->id_list[i]->privcansign;
+		ADD_ATTR(list, count, CKA_SIGN, b);
+
+		if (entry->id_list[i]->keylabel) {
+			label = entry->id_list[i]->keylabel;
+			ADD_ATTR_SIZE(list, count,
+				      CKA_LABEL, label, strlen(label));
+		} else {
+			label = getkeylabel(entry->id_list[i]->privkey);
+			ADD_ATTR_SIZE(list, count,
+				      CKA_LABEL, label, strlen(label));
+			free(label);
+		}
+
+		/*
+		 * I guess some applications want the modulus and public
+		 * exponent as attributes in the private key object.
+		 * These come from the public key, same as above.
+		 */
+
+		list[count].lazy = LAZY_SUBJECT |
+							 LAZY_KEY;
+
+		b = CK_TRUE;
+		ADD_ATTR(list, count, CKA_SENSITIVE, b);
+		ADD_ATTR(list, count,
+			 CKA_ALWAYS_SENSITIVE, b);
+		ADD_ATTR(list, count,
+			 CKA_NEVER_EXTRACTABLE, b);
+		ADD_ATTR(list, count, CKA_LOCAL, b);
+		b = CK_FALSE;
+		ADD_ATTR(list, count,
+			 CKA_ALWAYS_AUTHENTICATE, b);
+		ADD_ATTR(list, count, CKA_UNWRAP, b);
+		ADD_ATTR(list, count, CKA_DERIVE, b);
+		ADD_ATTR(list, count, CKA_EXTRACTABLE, b);
+
+		NEW_OBJECT(list, count, size);
+
+		if (objid)
+			free(objid);
+	}
+
+	obj_seal(list, count, arena);
 
-out:
-	if (keyattr)
-		CFRelease(keyattr);
-	if (query)
-		CFRelease(query);
-	if (result)
-		CFRelease(result);
+	entry->objs = obj_set_new(list, count, size, head);
 
-	return retstr;
+	build_mech_list(entry);
 }
 
 /*
- * A "safe" version of CFArrayGetCount().
- *
- * SecItemCopyMatching can sometimes return a single entry or a CFArrayRef
- * with multiple entries.  So to be as robust as possible, handle this case
- * here.  If we have something OTHER than a CFArrayRef, then just return a
- * count of "1".  Otherwise return the real array count.
+ * Work out which mechanisms a token supports, based on the keys it has.
+ * Applications call C_GetMechanismList() and C_GetMechanismInfo() a lot
+ * (some before every operation), so we do this once when we build the
+ * objects for the token.  The digest mechanisms don't need a key so are
+ * always there; everything else in our table is an RSA mechanism, so we
+ * only include those if there is an RSA key, and only with the usage
+ * flags that at least one of the keys can actually do.  The key sizes are
+ * the range of the RSA keys on the token.  If we can't allocate memory
+ * then the token just gets our full mechanism table.
  */
 
-static unsigned int
-cflistcount(CFTypeRef ref)
+static void
+build_mech_list(struct slot_entry *entry)
 {
-	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
-		return CFArrayGetCount((CFArrayRef) ref);
-	} else {
-		return 1;
+	const struct mechanism_map *mm;
+	CK_MECHANISM_INFO *info;
+	CK_FLAGS caps = 0;
+	CK_ULONG minbits = 0, maxbits = 0, bits;
+	unsigned int i;
+
+	for (i = 0; i < entry->id_count; i++) {
+		struct id_info *id = entry->id_list[i];
+
+		if (id->keytype != CKK_RSA)
+			continue;
+
+		bits = SecKeyGetBlockSize(id->pubkey) * 8;
+		if (minbits == 0 || bits < minbits)
+			minbits = bits;
+		if (bits > maxbits)
+			maxbits = bits;
+
+		if (id->privcansign)
+			caps |= CKF_SIGN;
+		if (id->privcandecrypt)
+			caps |= CKF_DECRYPT;
+		if (id->pubcanverify)
+			caps |= CKF_VERIFY;
+		if (id->pubcanencrypt)
+			caps |= CKF_ENCRYPT;
+	}
+
+	entry->mech_info = calloc(keychain_mechmap_size,
+				  sizeof(*entry->mech_info));
+	entry->mech_list = malloc(keychain_mechmap_size *
+				  sizeof(*entry->mech_list));
+	entry->mech_count = 0;
+
+	if (! entry->mech_info || ! entry->mech_list) {
+		free(entry->mech_info);
+		free(entry->mech_list);
+		entry->mech_info = NULL;
+		entry->mech_list = NULL;
+		return;
 	}
-}
 
-/*
- * A "safe" version of CFArrayGetValueAtIndex
- *
- * If the passed-in type is a CFArray, then return the appropriate value
- * at the passed-in index.  If it is a CFDictionaryRef, then just return
- * passed-in value if the index is 0; anything else, return a NULL.
- */
+	for (i = 0; i < keychain_mechmap_size; i++) {
+		mm = &keychain_mechmap[i];
+		info = &entry->mech_info[i];
 
-static CFDictionaryRef
-cfgetindex(CFTypeRef ref, unsigned int index)
-{
-	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
-		return CFArrayGetValueAtIndex((CFArrayRef) ref, index);
-	} else if (CFGetTypeID(ref) == CFDictionaryGetTypeID() && index == 0) {
-		return ref;
-	} else {
-		return NULL;
+		if (mm->usage_flags & CKF_DIGEST) {
+			info->flags = mm->usage_flags;
+			info->ulMinKeySize = mm->min_keylen;
+			info->ulMaxKeySize = mm->max_keylen;
+		} else {
+			if (! (mm->usage_flags & caps))
+				continue;
+			info->flags = mm->usage_flags & (caps | CKF_HW);
+			info->ulMinKeySize = minbits > mm->min_keylen ?
+						minbits : mm->min_keylen;
+			info->ulMaxKeySize = maxbits < mm->max_keylen ?
+						maxbits : mm->max_keylen;
+		}
+
+		entry->mech_list[entry->mech_count++] = mm->cki_mech;
 	}
+
+	os_log_debug(logsys, "Token supports %u of our %u mechanisms",
+		     entry->mech_count, keychain_mechmap_size);
 }
 
 /*
- * Make sure the our custom logging system is enabled
+ * Build up a list of certificate objects from our cert_list.  The
+ * object list is returned to the caller; attribute storage comes out
+ * of the passed-in arena.
  */
 
 static void
-log_init(void *context)
+build_cert_objects(struct obj_info **ret_list, unsigned int *ret_count,
+		   unsigned int *ret_size, struct attr_block **arena)
 {
-	logsys = os_log_create(APPIDENTIFIER, "general");
+	struct obj_info *list = NULL;
+	unsigned int count = cert_list_count * 2;
+
+	/*
+	 * Every certificate turns into exactly two objects, so each
+	 * certificate already knows where its objects go in the list (and
+	 * what their handles are).  That means we can build all of them at
+	 * once without any locking, and the list comes out in the same
+	 * order as if we did them one at a time.  The workers intern
+	 * their values as they go; the blob store is sharded, so they
+	 * mostly don't wait on each other there.  The only thing left
+	 * after that is obj_seal().
+	 */
+
+	if (count > 0) {
+		struct cert_build cb = { NULL, cert_list, 0, NULL };
+
+		cb.list = list = malloc(sizeof(*list) * count);
+		dispatch_apply_f(cert_list_count, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				 &cb, build_cert_object);
+	}
+
+	obj_seal(list, count, arena);
+
+	*ret_list = list;
+	*ret_count = count;
+	*ret_size = count;
 }
 
 /*
- * Free a slot entry
+ * Build the objects for a single certificate (called via
+ * dispatch_apply_f() from build_cert_objects() or cert_refresh()).
+ * Certificate "n" (first + i, or index[i]) gets objects 2 * n and
+ * 2 * n + 1.
  */
 
 static void
-slot_entry_free(struct slot_entry *entry, bool logout)
+build_cert_object(void *context, size_t i)
 {
-	os_log_debug(logsys, "slot_entry_free for slot %{public}@ "
-		    "(refcount %d)", entry->tokenid, (int) entry->refcount);
+	struct cert_build *cb = (struct cert_build *) context;
+	struct obj_info *list = cb->list;
+	unsigned int index = cb->index ? cb->index[i] : cb->first + i;
+	unsigned int count = index * 2;
+	SecCertificateRef cert = cb->certs[i].cert;
+	CK_OBJECT_CLASS cl;
+	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
+	CK_BBOOL b;
+	CFStringRef subjstr;
+	char *subjc;
+	unsigned char *objid = NULL;
+	unsigned int objidlen;
 
-	LOCK_MUTEX(entry->entry_mutex);
+	OBJINIT(list, count, NULL);
 
-	if (--entry->refcount > 0) {
-		/*
-		 * If refcount == 1, that means there are no more open
-                 * sessions (assuming we didn't have an open session and
-                 * our card got removed).  So if logout == true (called
-                 * be C_CloseSession or similar functions) then logout
-                 * of the token as well.
-		 *
-		 * If the refcount == 0 then the lacontext is completety
-		 * released which does the same thing.
-		 */
-		if (entry->refcount == 1)
-			token_logout(entry);
-		UNLOCK_MUTEX(entry->entry_mutex);
-		return;
-	}
+	/*
+	 * Add in an object for each certificate.  Everything that comes
+	 * from the certificate contents is lazy, and each object keeps a
+	 * reference to the certificate for when we need it.
+	 */
 
-	if (entry->tokenid)
-		CFRelease(entry->tokenid);
+	get_index_bytes(index, &objid, &objidlen);
 
-	if (entry->id_list)
-		id_list_free(entry->id_list, entry->id_count);
+	cl = CKO_CERTIFICATE;
+	list[count].class = cl;
+	ADD_ATTR(list, count, CKA_CLASS, cl);
+	ADD_ATTR_SIZE(list, count, CKA_ID, objid, objidlen);
+	ADD_ATTR(list, count, CKA_CERTIFICATE_TYPE, ct);
+	b = CK_TRUE;
+	ADD_ATTR(list, count, CKA_TOKEN, b);
 
-	if (entry->label)
-		free(entry->label);
+	subjstr = SP_CALL(SecCertificateCopySubjectSummary, cert);
+	subjc = getstrcopy(subjstr);
 
-	if (entry->lacontext)
-		lacontext_free(entry->lacontext);
+	ADD_ATTR_SIZE(list, count, CKA_LABEL, subjc, strlen(subjc));
 
-	UNLOCK_MUTEX(entry->entry_mutex);
-	DESTROY_MUTEX(entry->entry_mutex);
+	free(subjc);
+	CFRelease(subjstr);
 
-	free(entry);
-}
+	list[count].lazy = LAZY_CERT;
+	list[count].cert = cert;
+	CFRetain(cert);
 
-/*
- * Free our identity list
- */
+	count++;
+	OBJINIT(list, count, NULL);
 
-static void
-id_list_free(struct id_info **id_list, unsigned int id_list_count)
-{
-	int i;
+	cl = CKO_NSS_TRUST;
+	list[count].class = cl;
+	ADD_ATTR(list, count, CKA_CLASS, cl);
+	b = CK_TRUE;
+	ADD_ATTR(list, count, CKA_TOKEN, b);
 
-	for (i = 0; i < id_list_count; i++)
-		if (id_list[i])
-			id_info_free(id_list[i]);
+	list[count].lazy = LAZY_TRUST;
+	list[count].cert = cert;
+	CFRetain(cert);
 
-	if (id_list)
-		free(id_list);
+	if (objid)
+		free(objid);
 }
 
 /*
- * Free a single identity entry
+ * Wrap a finished object list up in an object set; the caller gets the
+ * first reference.  The index (and cache contents) get filled in by the
+ * caller before the set is shared.
  */
 
-static void
-id_info_free(struct id_info *id)
+static struct obj_set *
+obj_set_new(struct obj_info *list, unsigned int count, unsigned int size,
+	    struct attr_block *arena)
 {
-	if (id->label)
-		free(id->label);
-	if (id->ident)
-		CFRelease(id->ident);
-	if (id->privkey)
-		CFRelease(id->privkey);
-	if (id->pubkey)
-		CFRelease(id->pubkey);
-	if (id->cert)
-		CFRelease(id->cert);
-	if (id->secaccess)
-		CFRelease(id->secaccess);
-	if (id->pkeyhash)
-		CFRelease(id->pkeyhash);
+	static atomic_uint version = ATOMIC_VAR_INIT(0);
+	struct obj_set *objs = malloc(sizeof(*objs));
+
+	atomic_init(&objs->refcount, 1);
+	objs->version = atomic_fetch_add(&version, 1) + 1;
+	objs->list = list;
+	objs->count = count;
+	objs->size = size;
+	objs->arena = arena;
+	objs->idx = NULL;
+	objs->cache = NULL;
+
+	return objs;
+}
 
-	free(id);
+static struct obj_set *
+obj_set_get(struct obj_set *objs)
+{
+	if (objs)
+		atomic_fetch_add_explicit(&objs->refcount, 1,
+					  memory_order_relaxed);
+	return objs;
 }
 
 /*
- * A version of snprintf() which does space-padding
+ * Release an object set reference, and free it if this was the last one.
+ * Attributes from the cache point into the cache contents, so that has to
+ * be closed after the object list is gone.
  */
 
 static void
-sprintfpad(unsigned char *dest, size_t destsize, const char *fmt, ...)
+obj_set_put(struct obj_set *objs)
 {
-	char *s;
-	va_list ap;
-	int rc;
+	if (! objs || atomic_fetch_sub_explicit(&objs->refcount, 1,
+						memory_order_acq_rel) != 1)
+		return;
 
-	va_start(ap, fmt);
-	rc = vasprintf(&s, fmt, ap);
-	va_end(ap);
+	os_log_debug(logsys, "Freeing object set version %u", objs->version);
 
-	if (rc < 1) {
-		memset(dest, ' ', destsize);
-	} else {
-		/* We are relying on strncpy not doing \0 at end for trunc */
-		strncpy((char *) dest, s, destsize);
-		if (rc < destsize)
-			memset(dest + rc, ' ', destsize - rc);
-		free(s);
-	}
+	obj_free(&objs->list, &objs->count, &objs->size, &objs->arena);
+	objidx_free(objs->idx);
+	certcache_close(objs->cache);
+	free(objs);
 }
 
 /*
- * Return a boolean value based on a dictionary key.  If the key is not
- * set then return false.
+ * Free our object list and all associated data
  */
 
-bool
-boolfromdict(const char *keyname, CFDictionaryRef dict, CFTypeRef key)
+static void
+obj_free(struct obj_info **obj, unsigned int *count, unsigned int *size,
+	 struct attr_block **arena)
 {
-	CFTypeRef val;
+	unsigned int i, j;
 
-	if (! CFDictionaryGetValueIfPresent(dict, key, &val)) {
-		os_log_debug(logsys, "No value for %s in dictionary, "
-			     "returning FALSE", keyname);
-		return false;
-	}
+	for (i = 0; i < *count; i++) {
+		struct obj_info *o = &(*obj)[i];
 
-	if (CFGetTypeID(val) != CFBooleanGetTypeID() &&
-	    CFGetTypeID(val) != CFNumberGetTypeID()) {
-		os_log_debug(logsys, "%s was not a boolean, but exists, so "
-			     "returning TRUE", keyname);
-		return true;
+		/*
+		 * Objects loaded from the certificate cache point into the
+		 * cache file rather than the blob store (but lazy attributes
+		 * are always interned).
+		 */
+
+		if (o->interned)
+			for (j = 0; j < o->attr_count; j++)
+				blob_release(o->attrs[j].pValue);
+		for (j = 0; j < o->lazy_count; j++)
+			blob_release(o->lazy_attrs[j].pValue);
+
+		free((*obj)[i].lazy_attrs);
+		if ((*obj)[i].cert)
+			CFRelease((*obj)[i].cert);
 	}
 
-	os_log_debug(logsys, "%s is set to %{bool}d", keyname,
-		     CFBooleanGetValue(val));
+	free(*obj);
+	arena_free(arena);
 
-	return CFBooleanGetValue(val);
+	*obj = NULL;
+	*count = *size = 0;
 }
 
 /*
- * Get a C string from a CFStringRef (assumes UTF-8 encoding).
- * Allocates memory that must be free()d.
+ * Make a copy of an object for a new object list.  Every value in the
+ * copy is interned, so it doesn't depend on anything in the original
+ * object's set (like the cache contents).  If the object has a certificate
+ * to generate its lazy attributes from, the copy does too; otherwise
+ * (objects from the cache) all of the attributes are copied.  Like a
+ * freshly built object, the attribute array is temporary until
+ * obj_seal() is called.
  */
 
-static char *
-getstrcopy(CFStringRef string)
+static void
+obj_copy(struct obj_info *dst, struct obj_info *src)
 {
-	const char *s = CFStringGetCStringPtr(string, kCFStringEncodingUTF8);
-
-	if (! s) {
-		CFIndex len = CFStringGetLength(string);
-		CFIndex size = CFStringGetMaximumSizeForEncoding(len,
-						 kCFStringEncodingUTF8) + 1;
-		char *p = malloc(size);
+	unsigned int i;
 
-		if (! CFStringGetCString(string, p, size,
-					 kCFStringEncodingUTF8)) {
-			free(p);
-			return strdup("Unknown string");
-		}
+	dst->id = src->id;
+	dst->class = src->class;
 
-		return p;
+	if (src->lazy && src->cert) {
+		dst->attr_count = src->attr_count;
+		dst->attrs = malloc(sizeof(CK_ATTRIBUTE) *
+				    (src->attr_count ? src->attr_count : 1));
+		memcpy(dst->attrs, src->attrs,
+		       sizeof(CK_ATTRIBUTE) * src->attr_count);
+		dst->lazy = src->lazy;
 	} else {
-		return strdup(s);
+		dst->attrs = obj_all_attrs(src, &dst->attr_count);
+		dst->lazy = 0;
 	}
+
+	dst->attr_size = dst->attr_count;
+	dst->cert = src->cert;
+	dst->lazy_once = 0;
+	dst->lazy_attrs = NULL;
+	dst->lazy_count = 0;
+	dst->interned = true;
+
+	if (dst->cert)
+		CFRetain(dst->cert);
+
+	for (i = 0; i < dst->attr_count; i++)
+		dst->attrs[i].pValue =
+			(void *) blob_intern(dst->attrs[i].pValue,
+					     dst->attrs[i].ulValueLen);
 }
 
 /*
- * Log this object's type
+ * Set up an object as a placeholder for one that was removed (see
+ * OBJ_REMOVED())
  */
 
-void
-logtype(const char *string, CFTypeRef ref)
+static void
+obj_remove(struct obj_info *obj)
 {
-	CFTypeID id = CFGetTypeID(ref);
-	CFStringRef str = CFCopyTypeIDDescription(id);
-
-	os_log_debug(logsys, "%s: %{public}@", string, str);
-
-	CFRelease(str);
+	memset(obj, 0, sizeof(*obj));
+	obj->class = CK_UNAVAILABLE_INFORMATION;
 }
 
-#if defined(KEYCHAIN_DEBUG)
 /*
- * Dump the contents of a dictionary
+ * Sort the attributes in each object by type and move the attribute
+ * array into the arena.
  */
 
-void
-dumpdict(const char *string, CFDictionaryRef dict)
+static int
+attr_compare(const void *a, const void *b)
 {
-	unsigned int i, count = CFDictionaryGetCount(dict);
-	const void **keys, **values;
-
-	os_log_debug(logsys, "Dumping dictionary for %s", string);
-	os_log_debug(logsys, "Dictionary contains %u key/value pairs", count);
+	CK_ATTRIBUTE_TYPE ta = ((const CK_ATTRIBUTE *) a)->type;
+	CK_ATTRIBUTE_TYPE tb = ((const CK_ATTRIBUTE *) b)->type;
 
-	keys = malloc(sizeof(void *) * count);
-	values = malloc(sizeof(void *) * count);
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
 
-	CFDictionaryGetKeysAndValues(dict, keys, values);
+static void
+obj_seal(struct obj_info *obj, unsigned int count, struct attr_block **arena)
+{
+	unsigned int i;
 
 	for (i = 0; i < count; i++) {
-		os_log_debug(logsys, "Dictionary entry %d", (int) i);
-		os_log_debug(logsys, "Key value: %{public}@", keys[i]);
-		logtype("Value type", values[i]);
-		os_log_debug(logsys, "Value value: %{public}@", values[i]);
-	}
+		CK_ATTRIBUTE_PTR attrs;
 
-	free(keys);
-	free(values);
-}
-#endif /* KEYCHAIN_DEBUG */
+		if (obj[i].attr_count == 0) {
+			free(obj[i].attrs);
+			obj[i].attrs = NULL;
+			obj[i].attr_size = 0;
+			continue;
+		}
 
-/*
- * Convert Security framework key types to PKCS#11 key types.
- *
- * Sigh.  This is a lot harder than I would like.  The Apple API is in flux;
- * what the attribute dictionary returns is a CFNumber, but the constants
- * you use are actually CFStrings which happen to have string values which
- * correspond to the CFNumbers.  The numbers correspond to the values of
- * CSSM_ALGORITHMS in cssmtype.h.  So that means a RSA key, for example,
- * shows up in the attribute dictionary as a CFNumber with a value of 42,
- * but the constant kSecAttrKeyTypeRSA is a CFString with the value of "42".
- * (There is magic in the Security framework that lets you use things like
- * kSecAttrKeyTypeRSA as an input key for kSecAttrKeyType).
- *
- * I am hesitant to include cssmtype.h, so what I have decided to do is
- * convert the dictionary number we are given to a string and compare it
- * against the relevant "new" API constants.  Hopefully we don't have that
- * many.
+		qsort(obj[i].attrs, obj[i].attr_count, sizeof(CK_ATTRIBUTE),
+		      attr_compare);
+
+		attrs = arena_alloc(arena, obj[i].attr_count *
+					   sizeof(CK_ATTRIBUTE));
+		memcpy(attrs, obj[i].attrs, obj[i].attr_count *
+					    sizeof(CK_ATTRIBUTE));
+		free(obj[i].attrs);
+		obj[i].attrs = attrs;
+		obj[i].attr_size = obj[i].attr_count;
+	}
+}
+
+/*
+ * Allocate storage out of an attribute arena.  We never move a block
+ * once it has been allocated (since we hand out pointers into it); when
+ * the current block fills up, add a new block that is at least twice
+ * the size of the previous one so a large object list only ends up with
+ * a handful of blocks.
  */
 
-static CK_KEY_TYPE
-convert_keytype(CFNumberRef type)
+#define ARENA_MIN_BLOCK	16384
+#define ARENA_ALIGN	16
+
+static void *
+arena_alloc(struct attr_block **arena, size_t size)
 {
-	int i;
-	CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@"),
-						   type);
+	struct attr_block *b = *arena;
+	void *p;
 
-	for (i = 0; keytype_map[i].keyname; i++) {
-		if (CFEqual(str, *keytype_map[i].sec_keytype)) {
-			os_log_debug(logsys, "This is a %s",
-				     keytype_map[i].keyname);
-			CFRelease(str);
-			return keytype_map[i].pkcs11_keytype;
-		}
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+	if (! b || b->size - b->used < size) {
+		size_t bsize = b ? b->size * 2 : ARENA_MIN_BLOCK;
+
+		while (bsize < size)
+			bsize *= 2;
+
+		b = malloc(sizeof(*b) + bsize);
+		b->next = *arena;
+		b->used = 0;
+		b->size = bsize;
+		*arena = b;
 	}
 
-	CFRelease(str);
+	p = b->data + b->used;
+	b->used += size;
 
-	os_log_debug(logsys, "Keytype is unknown, returning VENDOR_DEFINED");
+	return p;
+}
 
-	return CKK_VENDOR_DEFINED;
+/*
+ * Release an entire arena
+ */
+
+static void
+arena_free(struct attr_block **arena)
+{
+	struct attr_block *b, *next;
+
+	for (b = *arena; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	*arena = NULL;
 }
 
 /*
- * Build our list of objects based on our identities
+ * Build an attribute index for an object list.  Object handles are
+ * the list index + 1.
  */
 
-#define ADD_ATTR_SIZE(objlist, objcount, attribute, var, size) \
-do { \
-	void *p = malloc(size); \
-	memcpy(p, var, size); \
-	if ( objlist [ objcount ].attr_count >= \
-	    objlist [ objcount ].attr_size) { \
-		objlist [ objcount ].attr_size += 5; \
-		objlist [ objcount ].attrs = realloc( objlist [ objcount ].attrs, \
-			objlist [ objcount ].attr_size * sizeof(CK_ATTRIBUTE)); \
-	} \
-	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].type = attribute; \
-	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].pValue = p; \
-	objlist [ objcount ].attrs[ objlist [ objcount ].attr_count].ulValueLen = size; \
-	objlist [ objcount ].attr_count++; \
-} while (0)
+static obj_index
+build_obj_index(struct obj_info *obj, unsigned int count)
+{
+	obj_index index = objidx_create();
+	unsigned int i, j;
 
-#define ADD_ATTR(objlist, objcount, attr, var) \
-		ADD_ATTR_SIZE(objlist, objcount, attr, &var, sizeof(var))
+	for (i = 0; i < count; i++)
+		for (j = 0; j < obj[i].attr_count; j++)
+			objidx_add(index, &obj[i].attrs[j], i + 1);
 
-#define NEW_OBJECT(objlist, objcount, objsize) \
-do { \
-	if (++ objcount >= objsize ) { \
-		objsize += 5; \
-		objlist = realloc( objlist, objsize * sizeof(* objlist )); \
-	} \
-} while (0)
+	os_log_debug(logsys, "Built attribute index for %u object%s", count,
+		     count == 1 ? "" : "s");
 
-#define OBJINIT(objlist, objcount, idptr) \
-do { \
-	objlist [ objcount ].id = idptr; \
-	objlist [ objcount ].attrs = NULL; \
-	objlist [ objcount ].attr_count = 0; \
-	objlist [ objcount ].attr_size = 0; \
-} while (0)
+	return index;
+}
 
 /*
- * Build up a list of objects based on our identity list
+ * Add the indexed lazy attributes for an object list to an index.  This
+ * is our fill function for the deferred part of an index, so this only
+ * happens when a search first needs one of these attributes.
  */
 
 static void
-build_id_objects(struct slot_entry *entry)
+index_lazy_attrs(obj_index index, struct obj_info *obj, unsigned int count)
 {
-	int i;
-	CK_OBJECT_CLASS cl;
-	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
-	CK_ULONG t;
-	CK_BBOOL b;
-	CFDataRef d;
-	char *label;
-
+	static const CK_ATTRIBUTE_TYPE types[] = { CKA_SUBJECT, CKA_ISSUER,
+						   CKA_SERIAL_NUMBER };
+	CK_ATTRIBUTE_PTR attr;
+	unsigned int i, j;
 
-	if (entry->id_count > 0) {
-		/* Prime the pump */
-		NEW_OBJECT(entry->obj_list, entry->obj_count, entry->obj_size);
-		entry->obj_count--;
+	for (i = 0; i < count; i++) {
+		if (! obj[i].lazy)
+			continue;
+		for (j = 0; j < sizeof(types)/sizeof(types[0]); j++)
+			if ((obj[i].lazy & lazy_group(types[j])) &&
+			    (attr = find_attribute(&obj[i], types[j])))
+				objidx_add(index, attr, i + 1);
 	}
 
-	for (i = 0; i < entry->id_count; i++) {
-		SecCertificateRef cert = entry->id_list[i]->cert;
-		CFDataRef subject = NULL, issuer = NULL, serial = NULL;
-		CFDataRef keydata = NULL, modulus = NULL, exponent = NULL;
-		CFErrorRef error;
-		unsigned char *objid = NULL;
-		unsigned int objidlen;
+	os_log_debug(logsys, "Built deferred attribute index for %u object%s",
+		     count, count == 1 ? "" : "s");
+}
 
-		OBJINIT(entry->obj_list, entry->obj_count, entry->id_list[i]);
+static void
+obj_set_index_fill(obj_index index, void *context)
+{
+	struct obj_set *objs = (struct obj_set *) context;
 
-		/*
-		 * Add in the object for each identity; cert, public key,
-		 * private key.  Add in attributes we need.
-		 */
+	index_lazy_attrs(index, objs->list, objs->count);
+}
 
-		get_index_bytes(i, &objid, &objidlen);
+/*
+ * Search an object to see if our attributes match.  If we have no
+ * attributes then that counts as a match.  blobs has the blob store
+ * copy of each template value (if there was one when the search
+ * started; see C_FindObjectsInit()).
+ */
 
-		cl = CKO_CERTIFICATE;
-		entry->obj_list[entry->obj_count].class = cl;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_CLASS, cl);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_ID,
-			      objid, objidlen);
-		ADD_ATTR(entry->obj_list, entry->obj_count,
-			 CKA_CERTIFICATE_TYPE, ct);
-		b = CK_TRUE;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_TOKEN, b);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_LABEL,
-			      entry->id_list[i]->label,
-			      strlen(entry->id_list[i]->label));
-		d = SecCertificateCopyData(cert);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_VALUE,
-			      CFDataGetBytePtr(d), CFDataGetLength(d));
-		get_certificate_info(d, &serial, &issuer, &subject);
-		CFRelease(d);
+static bool
+search_object(struct obj_info *obj, CK_ATTRIBUTE_PTR attrs,
+	      const void **blobs, unsigned int attrcount)
+{
+	CK_ATTRIBUTE_PTR a;
+	int i;
 
-		if (subject)
-			ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-				      CKA_SUBJECT, CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
-		if (issuer)
-			ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-				      CKA_ISSUER, CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-				      CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
-
-		NEW_OBJECT(entry->obj_list, entry->obj_count, entry->obj_size);
-		OBJINIT(entry->obj_list, entry->obj_count, entry->id_list[i]);
+	if (OBJ_REMOVED(obj))
+		return false;
 
-		cl = CKO_PUBLIC_KEY;
-		entry->obj_list[entry->obj_count].class = cl;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_CLASS, cl);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_ID,
-			      objid, objidlen);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_KEY_TYPE,
-			 entry->id_list[i]->keytype);
-		b = CK_TRUE;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_TOKEN, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_LOCAL, b);
-		b = entry->id_list[i]->pubcanencrypt;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_ENCRYPT, b);
-		b = entry->id_list[i]->pubcanverify;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_VERIFY, b);
-		if (subject)
-			ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-				      CKA_SUBJECT, CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
+	/*
+	 * Every attribute in the template has to be present in the object.
+	 * We are assuming that we only have one copy of an attribute in an
+	 * object, so as soon as one doesn't match we can return false.
+	 */
+
+	for (i = 0; i < attrcount; i++) {
+		if (! (a = find_attribute(obj, attrs[i].type)))
+			return false;
 
 		/*
-		 * Sigh.  It seems like the public part of an identity
-		 * doesn't actually get a label attribute, at least with
-		 * the release I tested.  So for now, get the label from
-		 * the identity label, and maybe check later if this
-		 * changes; keep the code around here if it does.
-		 *
-		 * label = getkeylabel(entry->id_list[i]->pubkey);
-		 * ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
-		 * free(label);
+		 * For a match both have to have the same length, and either
+		 * both are NULL pointers or both have the same contents
 		 */
 
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_LABEL,
-			      entry->id_list[i]->label,
-			      strlen(entry->id_list[i]->label));
+		if (a->ulValueLen != attrs[i].ulValueLen)
+			return false;
+
+		if (a->pValue == NULL || attrs[i].pValue == NULL) {
+			if (a->pValue != attrs[i].pValue)
+				return false;
+			continue;
+		}
 
 		/*
-		 * It turns out some implementations want CKA_MODULUS_BITS,
-		 * and the modulus and public exponent.  For RSA keys the
-		 * modulus size is equal to the block size, and we can get
-		 * modulus and public exponent from the "external
-		 * representation" of the public key.  Note that the block
-		 * size is returned in bytes, and we need bits.
+		 * If the object's value came from the blob store and it's
+		 * the same blob as the template value, then this is all the
+		 * comparison we need.  We only hold the object set, not the
+		 * blob, so only trust this for the object's regular
+		 * attributes; those were interned before the search started,
+		 * so a blob at that address can't have been freed and
+		 * replaced since.  (Lazy attributes could have been.)
 		 */
 
-		t = SecKeyGetBlockSize(entry->id_list[i]->pubkey) * 8;
-		ADD_ATTR(entry->obj_list, entry->obj_count,
-			 CKA_MODULUS_BITS, t);
+		if (blobs[i] && obj->interned && a >= obj->attrs &&
+		    a < obj->attrs + obj->attr_count && a->pValue == blobs[i])
+			continue;
 
-		keydata = SecKeyCopyExternalRepresentation(entry->id_list[i]->pubkey,
-							   &error);
-
-		if (keydata) {
-			if (get_pubkey_info(keydata, &modulus, &exponent)) {
-				ADD_ATTR_SIZE(entry->obj_list,
-					      entry->obj_count, CKA_MODULUS,
-					      CFDataGetBytePtr(modulus),
-					      CFDataGetLength(modulus));
-				ADD_ATTR_SIZE(entry->obj_list,
-					      entry->obj_count,
-					      CKA_PUBLIC_EXPONENT,
-					      CFDataGetBytePtr(exponent),
-					      CFDataGetLength(exponent));
-			}
-		} else {
-			os_log_debug(logsys, "SecKeyCopyExternalRepresentation "
-				     "failed: %{public}@", error);
-			CFRelease(error);
-		}
+		if (memcmp(a->pValue, attrs[i].pValue, attrs[i].ulValueLen) != 0)
+			return false;
+	}
 
-		b = CK_FALSE;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_WRAP, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_DERIVE, b);
+	return true;
+}
 
-		NEW_OBJECT(entry->obj_list, entry->obj_count, entry->obj_size);
-		OBJINIT(entry->obj_list, entry->obj_count, entry->id_list[i]);
+/*
+ * Search a sorted attribute array for a particular attribute
+ */
 
-		cl = CKO_PRIVATE_KEY;
-		entry->obj_list[entry->obj_count].class = cl;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_CLASS, cl);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_ID,
-			      objid, objidlen);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_KEY_TYPE,
-			 entry->id_list[i]->keytype);
-		b = CK_TRUE;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_TOKEN, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_PRIVATE, b);
-		b = entry->id_list[i]->privcandecrypt;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_DECRYPT, b);
-		b = entry->id_list[i]->privcansign;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_SIGN, b);
-		if (subject)
-			ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-				      CKA_SUBJECT, CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
-
-		label = getkeylabel(entry->id_list[i]->privkey);
-		ADD_ATTR_SIZE(entry->obj_list, entry->obj_count, CKA_LABEL,
-			      label, strlen(label));
-		free(label);
+static CK_ATTRIBUTE_PTR
+attr_bsearch(CK_ATTRIBUTE_PTR attrs, unsigned int count, CK_ATTRIBUTE_TYPE type)
+{
+	unsigned int lo = 0, hi = count;
 
-		/*
-		 * I guess some applications want the modulus and public
-		 * exponent as attributes in the private key object.
-		 * Use this information we extracted previously.
-		 */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
 
-		if (keydata) {
-			if (modulus)
-				ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-						CKA_MODULUS, CFDataGetBytePtr(modulus),
-						CFDataGetLength(modulus));
-			if (exponent)
-				ADD_ATTR_SIZE(entry->obj_list, entry->obj_count,
-						CKA_PUBLIC_EXPONENT,
-						CFDataGetBytePtr(exponent),
-						CFDataGetLength(exponent));
-		}
+		if (attrs[mid].type == type)
+			return &attrs[mid];
+		if (attrs[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-		b = CK_TRUE;
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_SENSITIVE, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count,
-			 CKA_ALWAYS_SENSITIVE, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count,
-			 CKA_NEVER_EXTRACTABLE, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_LOCAL, b);
-		b = CK_FALSE;
-		ADD_ATTR(entry->obj_list, entry->obj_count,
-			 CKA_ALWAYS_AUTHENTICATE, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_UNWRAP, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_DERIVE, b);
-		ADD_ATTR(entry->obj_list, entry->obj_count, CKA_EXTRACTABLE, b);
+	return NULL;
+}
 
-		NEW_OBJECT(entry->obj_list, entry->obj_count, entry->obj_size);
+/*
+ * Search an object for a particular attribute; return NULL if not found.
+ * Attributes are sorted by type (see obj_seal()) so this is a binary
+ * search.  If the attribute is one of our lazy attributes, generate
+ * them now.
+ */
 
-		if (objid)
-			free(objid);
+static CK_ATTRIBUTE_PTR
+find_attribute(struct obj_info *obj, CK_ATTRIBUTE_TYPE type)
+{
+	CK_ATTRIBUTE_PTR attr;
 
-		if (subject)
-			CFRelease(subject);
-		if (issuer)
-			CFRelease(issuer);
-		if (serial)
-			CFRelease(serial);
+	if ((attr = attr_bsearch(obj->attrs, obj->attr_count, type)))
+		return attr;
 
-		if (keydata)
-			CFRelease(keydata);
-		if (modulus)
-			CFRelease(modulus);
-		if (exponent)
-			CFRelease(exponent);
-	}
+	if (! (obj->lazy & lazy_group(type)))
+		return NULL;
+
+	dispatch_once_f(&obj->lazy_once, obj, obj_materialize);
+
+	return attr_bsearch(obj->lazy_attrs, obj->lazy_count, type);
 }
 
 /*
- * Build up a list of certificate objects
+ * Return the lazy attribute groups that contain this attribute type
  */
 
-static void
-build_cert_objects(void)
+static unsigned int
+lazy_group(CK_ATTRIBUTE_TYPE type)
 {
-	int i;
-	CK_OBJECT_CLASS cl;
-	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
-	CK_TRUST trust = CKT_NSS_TRUSTED_DELEGATOR;
-	CK_BBOOL b;
-	CFDataRef d;
-
-	if (cert_list_count > 0) {
-		/* Prime the pump */
-		NEW_OBJECT(cert_obj_list, cert_obj_count, cert_obj_size);
-		cert_obj_count--;
+	switch (type) {
+	case CKA_VALUE:
+		return LAZY_CERT;
+	case CKA_SUBJECT:
+		return LAZY_CERT | LAZY_SUBJECT;
+	case CKA_ISSUER:
+	case CKA_SERIAL_NUMBER:
+		return LAZY_CERT | LAZY_TRUST;
+	case CKA_MODULUS:
+	case CKA_PUBLIC_EXPONENT:
+		return LAZY_KEY;
+	case CKA_CERT_SHA1_HASH:
+	case CKA_TRUST_SERVER_AUTH:
+	case CKA_TRUST_CLIENT_AUTH:
+	case CKA_TRUST_EMAIL_PROTECTION:
+	case CKA_TRUST_CODE_SIGNING:
+		return LAZY_TRUST;
+	default:
+		return 0;
 	}
+}
 
-	for (i = 0; i < cert_list_count; i++) {
-		SecCertificateRef cert = cert_list[i].cert;
-		CFDataRef subject = NULL, issuer = NULL, serial = NULL;
-		unsigned char *hash = NULL;
-		unsigned int hashlen;
-		md_context mdc;
-		CFStringRef subjstr;
-		char *subjc;
-		unsigned char *objid = NULL;
-		unsigned int objidlen;
+/*
+ * Generate the lazy attributes for an object.  This is called via
+ * dispatch_once_f() so it only happens once per object.  We collect
+ * everything first, then intern all of the values (the same certificate
+ * can appear in the certificate slot and on a token, and every CA has
+ * the same trust values) and copy the attribute array.
+ */
 
-		OBJINIT(cert_obj_list, cert_obj_count, NULL);
+#define LAZY_ADD(attribute, ptr, len) \
+do { \
+	la[n].type = attribute; \
+	la[n].pValue = (void *) (ptr); \
+	la[n].ulValueLen = len; \
+	n++; \
+} while (0)
 
-		/*
-		 * Add in an object for each certificate.
-		 */
+#define LAZY_ADD_DATA(attribute, data) \
+	LAZY_ADD(attribute, CFDataGetBytePtr(data), CFDataGetLength(data))
 
-		get_index_bytes(i, &objid, &objidlen);
+static void
+obj_materialize(void *context)
+{
+	struct obj_info *obj = (struct obj_info *) context;
+	SecCertificateRef cert = obj->id ? obj->id->cert : obj->cert;
+	CFDataRef d = NULL;
+	CK_TRUST trust = CKT_NSS_TRUSTED_DELEGATOR;
+	CK_ATTRIBUTE la[LAZY_MAX_ATTRS];
+	unsigned char hash[CC_MD_MAX_LEN];
+	const unsigned char *der = NULL;
+	unsigned int i, n = 0, hashlen;
+	struct cert_parts parts;
+	bool parsed = false;
+	md_context mdc;
 
-		cl = CKO_CERTIFICATE;
-		cert_obj_list[cert_obj_count].class = cl;
-		ADD_ATTR(cert_obj_list, cert_obj_count, CKA_CLASS, cl);
-		ADD_ATTR_SIZE(cert_obj_list, cert_obj_count, CKA_ID, objid,
-			      objidlen);
-		ADD_ATTR(cert_obj_list, cert_obj_count,
-			 CKA_CERTIFICATE_TYPE, ct);
-		b = CK_TRUE;
-		ADD_ATTR(cert_obj_list, cert_obj_count, CKA_TOKEN, b);
+	/*
+	 * Everything we need (including the key modulus and exponent,
+	 * which come from the certificate's SubjectPublicKeyInfo) is in the
+	 * certificate, so parse it once and point the attributes at the
+	 * pieces; blob_intern() makes the only copy.
+	 */
+
+	if (obj->lazy && cert) {
+		d = SP_CALL(SecCertificateCopyData, cert);
+		if (d) {
+			der = CFDataGetBytePtr(d);
+			parsed = cert_parse(der, CFDataGetLength(d), &parts);
+		}
+	}
 
-		subjstr = SecCertificateCopySubjectSummary(cert_list[i].cert);
-		subjc = getstrcopy(subjstr);
+#define LAZY_ADD_SLICE(attribute, slice) \
+do { \
+	if (parsed && (slice).len) \
+		LAZY_ADD(attribute, DER_SLICE_PTR(der, slice), (slice).len); \
+} while (0)
 
-		ADD_ATTR_SIZE(cert_obj_list, cert_obj_count, CKA_LABEL,
-			      subjc, strlen(subjc));
+	if ((obj->lazy & LAZY_CERT) && d) {
+		LAZY_ADD_DATA(CKA_VALUE, d);
+		LAZY_ADD_SLICE(CKA_SUBJECT, parts.subject);
+		LAZY_ADD_SLICE(CKA_ISSUER, parts.issuer);
+		LAZY_ADD_SLICE(CKA_SERIAL_NUMBER, parts.serial);
+	}
 
-		free(subjc);
-		CFRelease(subjstr);
+	if (obj->lazy & LAZY_SUBJECT)
+		LAZY_ADD_SLICE(CKA_SUBJECT, parts.subject);
 
-		d = SecCertificateCopyData(cert);
-		ADD_ATTR_SIZE(cert_obj_list, cert_obj_count, CKA_VALUE,
-			      CFDataGetBytePtr(d), CFDataGetLength(d));
-		get_certificate_info(d, &serial, &issuer, &subject);
+	if ((obj->lazy & LAZY_TRUST) && d) {
+		LAZY_ADD_SLICE(CKA_ISSUER, parts.issuer);
+		LAZY_ADD_SLICE(CKA_SERIAL_NUMBER, parts.serial);
 
 		if (cc_md_init(CKM_SHA_1, &mdc)) {
-			cc_md_update(mdc, CFDataGetBytePtr(d),
+			cc_md_update(&mdc, CFDataGetBytePtr(d),
 				     CFDataGetLength(d));
-			cc_md_final(mdc, &hash, &hashlen);
+			hashlen = cc_md_final(&mdc, hash);
+			LAZY_ADD(CKA_CERT_SHA1_HASH, hash, hashlen);
 		}
 
-		CFRelease(d);
-
-		if (subject)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count,
-				      CKA_SUBJECT, CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
-		if (issuer)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count, CKA_ISSUER,
-				      CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count,
-				      CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
-
-		NEW_OBJECT(cert_obj_list, cert_obj_count, cert_obj_size);
-		OBJINIT(cert_obj_list, cert_obj_count, NULL);
-
-		cl = CKO_NSS_TRUST;
-		cert_obj_list[cert_obj_count].class = cl;
-		ADD_ATTR(cert_obj_list, cert_obj_count, CKA_CLASS, cl);
-		b = CK_TRUE;
-		ADD_ATTR(cert_obj_list, cert_obj_count, CKA_TOKEN, b);
-
-		if (issuer)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count, CKA_ISSUER,
-				      CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count,
-				      CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
-		if (hash)
-			ADD_ATTR_SIZE(cert_obj_list, cert_obj_count,
-				      CKA_CERT_SHA1_HASH, hash, hashlen);
-
 		/*
 		 * As far as I can tell, CAs should have these various
 		 * trust objects set, but other certificates (servers,
 		 * users) should NOT.
 		 */
 
-		if (is_cert_ca(cert)) {
-			ADD_ATTR(cert_obj_list, cert_obj_count,
-				 CKA_TRUST_SERVER_AUTH, trust);
-			ADD_ATTR(cert_obj_list, cert_obj_count,
-				 CKA_TRUST_CLIENT_AUTH, trust);
-			ADD_ATTR(cert_obj_list, cert_obj_count,
-				 CKA_TRUST_EMAIL_PROTECTION, trust);
-			ADD_ATTR(cert_obj_list, cert_obj_count,
-				 CKA_TRUST_CODE_SIGNING, trust);
+		if (parsed && parts.is_ca) {
+			LAZY_ADD(CKA_TRUST_SERVER_AUTH, &trust, sizeof(trust));
+			LAZY_ADD(CKA_TRUST_CLIENT_AUTH, &trust, sizeof(trust));
+			LAZY_ADD(CKA_TRUST_EMAIL_PROTECTION, &trust,
+				 sizeof(trust));
+			LAZY_ADD(CKA_TRUST_CODE_SIGNING, &trust, sizeof(trust));
 #if 0
-			ADD_ATTR(cert_obj_list, cert_obj_count,
-				 CKA_TRUST_STEP_UP_APPROVED, trust);
+			LAZY_ADD(CKA_TRUST_STEP_UP_APPROVED, &trust,
+				 sizeof(trust));
 #endif
 		}
-
-		NEW_OBJECT(cert_obj_list, cert_obj_count, cert_obj_size);
-
-		if (objid)
-			free(objid);
-
-		if (subject)
-			CFRelease(subject);
-		if (issuer)
-			CFRelease(issuer);
-		if (serial)
-			CFRelease(serial);
-		if (hash)
-			free(hash);
-	}
-}
-
-/*
- * Free our object list and all associated data
- */
-
-static void
-obj_free(struct obj_info **obj, unsigned int *count, unsigned int *size)
-{
-	int i, j;
-
-	for (i = 0; i < *count; i++) {
-		for (j = 0; j < (*obj)[i].attr_count; j++)
-			free((*obj)[i].attrs[j].pValue);
-		free((*obj)[i].attrs);
 	}
 
-	free(*obj);
-
-	*obj = NULL;
-	*count = *size = 0;
-}
-
-/*
- * Search an object to see if our attributes match.  If we have no
- * attributes then that counts as a match.
- */
-
-static bool
-search_object(struct obj_info *obj, CK_ATTRIBUTE_PTR attrs,
-	      unsigned int attrcount)
-{
-	int i, j;
-
 	/*
-	 * If we get a valid "hit", then goto next to continue the
-	 * attrs loop; if we make to the end of the attrs loop then
-	 * we can return 'true'
+	 * This only finds anything for RSA keys, which is all we
+	 * supported before, too.
 	 */
 
-	for (i = 0; i < attrcount; i++) {
-		for (j = 0; j < obj->attr_count; j++)
-			/*
-			 * For a match, the type has to be the same, both
-			 * have to have the same length, and either both
-			 * are NULL pointers or both have the same contents
-			 */
-			if (obj->attrs[j].type == attrs[i].type &&
-			    obj->attrs[j].ulValueLen == attrs[i].ulValueLen) {
-			    	/*
-				 * We are assuming that we only have one
-				 * copy of an attribute in an object.  So
-				 * if the attribute doesn't match then
-				 * we can short-circuit the match now
-				 */
-				if ((obj->attrs[j].pValue == NULL ||
-				     attrs[i].pValue == NULL) &&
-				    (obj->attrs[j].pValue != attrs[i].pValue))
-					return false;
-
-				/*
-				 * Both are valid pointers and have the same
-				 * length, so do a memcmp().  But again, if
-				 * doesn't match than return false.
-				 */
-				if (memcmp(obj->attrs[j].pValue,
-					   attrs[i].pValue,
-					   attrs[i].ulValueLen) == 0)
-					goto next;
-				else
-					return false;
-			}
-
-		/*
-		 * If we made it here then that means we went through
-		 * every attribute in this object and didn't find a match
-		 * so we can return false now.
-		 */
+	if ((obj->lazy & LAZY_KEY) && obj->id && parsed &&
+	    parts.modulus.len && parts.exponent.len) {
+		LAZY_ADD_SLICE(CKA_MODULUS, parts.modulus);
+		LAZY_ADD_SLICE(CKA_PUBLIC_EXPONENT, parts.exponent);
+	}
 
-		return false;
-next:	;
+#undef LAZY_ADD_SLICE
+
+	if (n > 0) {
+		qsort(la, n, sizeof(CK_ATTRIBUTE), attr_compare);
+
+		obj->lazy_attrs = malloc(sizeof(CK_ATTRIBUTE) * n);
+
+		for (i = 0; i < n; i++) {
+			obj->lazy_attrs[i].type = la[i].type;
+			obj->lazy_attrs[i].pValue =
+				(void *) blob_intern(la[i].pValue,
+						     la[i].ulValueLen);
+			obj->lazy_attrs[i].ulValueLen = la[i].ulValueLen;
+		}
 	}
 
-	return true;
+	obj->lazy_count = n;
+
+	if (d)
+		CFRelease(d);
 }
 
 /*
- * Search an object for a particular attribute; return NULL if not found
+ * Return every attribute for an object (including any lazy ones) in a
+ * single sorted array.  The array must be free()d, but the values point
+ * into the object.
  */
 
 static CK_ATTRIBUTE_PTR
-find_attribute(struct obj_info *obj, CK_ATTRIBUTE_TYPE type)
+obj_all_attrs(struct obj_info *obj, unsigned int *count)
 {
-	int i;
+	CK_ATTRIBUTE_PTR attrs;
 
-	for (i = 0; i < obj->attr_count; i++)
-		if (obj->attrs[i].type == type)
-			return &obj->attrs[i];
+	if (obj->lazy)
+		dispatch_once_f(&obj->lazy_once, obj, obj_materialize);
 
-	return NULL;
+	*count = obj->attr_count + obj->lazy_count;
+	attrs = malloc(sizeof(CK_ATTRIBUTE) * (*count ? *count : 1));
+
+	memcpy(attrs, obj->attrs, sizeof(CK_ATTRIBUTE) * obj->attr_count);
+	if (obj->lazy_count)
+		memcpy(attrs + obj->attr_count, obj->lazy_attrs,
+		       sizeof(CK_ATTRIBUTE) * obj->lazy_count);
+
+	qsort(attrs, *count, sizeof(CK_ATTRIBUTE), attr_compare);
+
+	return attrs;
 }
 
 /*
- * Output information about an attribute
+ * Output information about an attribute (only call this if
+ * LOG_VERBOSE_ENABLED() is true)
  */
 
 static void
@@ -4816,9 +8840,6 @@ dump_attribute(const char *str, CK_ATTRIBUTE_PTR attr)
 {
 	char *cn;
 
-	if (!os_log_debug_enabled(logsys))
-		return;
-
 	switch (attr->type) {
 	case CKA_CLASS:
 		os_log_debug(logsys, "%s: CKA_CLASS: %s", str,
@@ -4921,6 +8942,37 @@ prefkey_arrayget(const char *key, const char **default_list)
 	return ret;
 }
 
+/*
+ * Fetch an integer preference; if it's not set (or isn't a number)
+ * return the default.
+ */
+
+static int
+prefkey_intget(const char *key, int default_value)
+{
+	CFPropertyListRef propref;
+	CFStringRef keyref;
+	int ret = default_value;
+
+	keyref = CFStringCreateWithCString(NULL, key, kCFStringEncodingUTF8);
+
+	propref = CFPreferencesCopyAppValue(keyref, CFSTR(APPIDENTIFIER));
+	CFRelease(keyref);
+
+	if (! propref)
+		return ret;
+
+	if (CFGetTypeID(propref) != CFNumberGetTypeID() ||
+	    ! CFNumberGetValue(propref, kCFNumberIntType, &ret)) {
+		logtype("Preference is not an integer", propref);
+		ret = default_value;
+	}
+
+	CFRelease(propref);
+
+	return ret;
+}
+
 /*
  * See if a particular key is set in our preferences dictionary.
  *
@@ -5031,25 +9083,6 @@ get_index_bytes(unsigned int index, unsigned char **retbytes,
 	*retlength = length;
 }
 
-/*
- * Return a pointer to the mechanism mapping structure, which contains
- * the mappings from the Cryptoki mechanism name to the constants used by
- * the Apple Security framework
- */
-
-const static struct mechanism_map *
-get_mechmap(CK_MECHANISM_TYPE mechtype)
-{
-	int i;
-
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mechtype == keychain_mechmap[i].cki_mech)
-			return &keychain_mechmap[i];
-	}
-
-	return NULL;
-}
-
 /*
  * Validate the mechanism params (if given) and map the mechanism and
  * parameters to Security framework algorithms
@@ -5062,7 +9095,8 @@ mech_param_validate(CK_MECHANISM_PTR mptr, const struct mechanism_map *mechmap,
 {
 	CK_RSA_PKCS_OAEP_PARAMS_PTR oaep;
 	CK_RSA_PKCS_PSS_PARAMS_PTR pss;
-	int i;
+	const struct param_map *params, *pm;
+	unsigned int i, count;
 
 	/*
 	 * Handle the various type of mechanism parameters
@@ -5151,14 +9185,16 @@ mech_param_validate(CK_MECHANISM_PTR mptr, const struct mechanism_map *mechmap,
 
 		/*
 		 * Find the appropriate mechanism to return that matches
-		 * the MGF and the hash algorithm.
+		 * the MGF and the hash algorithm.  We only need to look
+		 * at the parameter entries for this mechanism.
 		 */
 
-		for (i = 0; i < keychain_param_map_size; i++) {
-			if (mptr->mechanism ==
-					keychain_param_map[i].base_type &&
-			    oaep->hashAlg == keychain_param_map[i].hash_alg &&
-			    oaep->mgf == keychain_param_map[i].mgf)
+		params = mechmap_params(mechmap, &count);
+
+		for (i = 0; i < count; i++) {
+			pm = &params[i];
+			if (oaep->hashAlg == pm->hash_alg &&
+			    oaep->mgf == pm->mgf)
 				goto found;
 		}
 
@@ -5187,12 +9223,12 @@ mech_param_validate(CK_MECHANISM_PTR mptr, const struct mechanism_map *mechmap,
 
 		pss = (CK_RSA_PKCS_PSS_PARAMS_PTR) mptr->pParameter;
 
-		for (i = 0; i < keychain_param_map_size; i++) {
-			if (mptr->mechanism ==
-					keychain_param_map[i].base_type &&
-			    pss->hashAlg == keychain_param_map[i].hash_alg &&
-			    pss->mgf == keychain_param_map[i].mgf &&
-			    pss->sLen == keychain_param_map[i].slen)
+		params = mechmap_params(mechmap, &count);
+
+		for (i = 0; i < count; i++) {
+			pm = &params[i];
+			if (pss->hashAlg == pm->hash_alg &&
+			    pss->mgf == pm->mgf && pss->sLen == pm->slen)
 				goto found;
 		}
 
@@ -5206,28 +9242,25 @@ mech_param_validate(CK_MECHANISM_PTR mptr, const struct mechanism_map *mechmap,
 
 found:
 	if (encalg) {
-		*encalg = keychain_param_map[i].encalg ?
-					*keychain_param_map[i].encalg : NULL;
+		*encalg = pm->encalg ? *pm->encalg : NULL;
 		os_log_debug(logsys, "Encryption algorithm chosen: %{public}@",
 			     *encalg);
 	}
 
 	if (signalg) {
-		*signalg = keychain_param_map[i].signalg ?
-					*keychain_param_map[i].signalg : NULL;
+		*signalg = pm->signalg ? *pm->signalg : NULL;
 		os_log_debug(logsys, "Signing algorithm chosen: %{public}@",
 			     *signalg);
 	}
 
 	if (dsignalg) {
-		*dsignalg = keychain_param_map[i].dsignalg ?
-					*keychain_param_map[i].dsignalg : NULL;
+		*dsignalg = pm->dsignalg ? *pm->dsignalg : NULL;
 		os_log_debug(logsys, "Digest signing algorithm chosen: "
 			     "%{public}@", *dsignalg);
 	}
 
 	if (digest) {
-		*digest = keychain_param_map[i].hash_alg;
+		*digest = pm->hash_alg;
 		os_log_debug(logsys, "Digest algorithm chosen: %{public}s",
 			     getCKMName(*digest));
 	}
@@ -5278,6 +9311,213 @@ array_free(char **array)
 	free(array);
 }
 
+/*
+ * Add data to a signature or verification digest, streaming it if it's
+ * big enough (or if this operation is already streaming).  If we can't
+ * get a stream, just hash it here.
+ */
+
+static void
+sess_md_update(struct session *se, CK_BYTE_PTR data, CK_ULONG len)
+{
+	if (hash_streaming && (se->streaming || len >= STREAM_MIN_UPDATE)) {
+		if (! se->mdstream && ! (se->mdstream = md_stream_new())) {
+			os_log_debug(logsys, "Unable to create digest stream");
+		} else {
+			se->streaming = true;
+			md_stream_update(se->mdstream, &se->mdc, data, len);
+			return;
+		}
+	}
+
+	cc_md_update(&se->mdc, data, len);
+}
+
+/*
+ * Wait for any streamed data to be added to our digest; after this the
+ * session owns se->mdc again.
+ */
+
+static void
+sess_md_wait(struct session *se)
+{
+	if (! se->streaming)
+		return;
+
+	md_stream_wait(se->mdstream);
+	se->streaming = false;
+}
+
+/*
+ * Return a CFData for some input data, for passing into the Security
+ * framework.  The framework is allowed to hang onto the CFData after the
+ * call returns, so small inputs (which is what we mostly see, signing a
+ * digest) get their own immutable copy; CFDataCreate() keeps the bytes
+ * in the same allocation as the object.  Anything bigger gets a no-copy
+ * wrapper, like we've always done.
+ *
+ * Either way the CFData itself comes from input_allocator, which hands
+ * out slots from a fixed pool (and only falls back to malloc() if the
+ * pool is all in use, or for something that doesn't fit in a slot).  A
+ * slot only goes back in the pool when CoreFoundation frees the object,
+ * so if the framework does keep a reference nobody else gets that slot
+ * until it lets go; it's just that normally, creating these doesn't
+ * allocate anything.
+ *
+ * The returned reference must be released, as usual.
+ */
+
+#define INPUT_COPY_MAX	1024
+#define INPUT_SLOTS	64		/* One bit each in input_pool_used */
+#define INPUT_SLOT_SIZE	(INPUT_COPY_MAX + 256)
+
+static CFAllocatorRef input_allocator;
+static dispatch_once_t input_allocator_once;
+static _Alignas(16) unsigned char input_pool[INPUT_SLOTS][INPUT_SLOT_SIZE];
+static _Atomic uint64_t input_pool_used;
+
+static CFDataRef
+input_cfdata(const unsigned char *data, CK_ULONG len)
+{
+	dispatch_once_f(&input_allocator_once, NULL, input_allocator_init);
+
+	if (len > INPUT_COPY_MAX)
+		return CFDataCreateWithBytesNoCopy(input_allocator, data, len,
+						   kCFAllocatorNull);
+
+	return CFDataCreate(input_allocator, data, len);
+}
+
+static void
+input_allocator_init(void *dummy)
+{
+	CFAllocatorContext ctx = {
+		.version = 0,
+		.allocate = input_alloc,
+		.reallocate = input_realloc,
+		.deallocate = input_dealloc,
+	};
+
+	input_allocator = CFAllocatorCreate(NULL, &ctx);
+}
+
+/*
+ * Return the pool slot number for a pointer, or -1 if it isn't one of ours
+ */
+
+static int
+input_slot(void *ptr)
+{
+	uintptr_t p = (uintptr_t) ptr, base = (uintptr_t) input_pool;
+
+	if (p < base || p >= base + sizeof(input_pool))
+		return -1;
+
+	return (p - base) / INPUT_SLOT_SIZE;
+}
+
+static void *
+input_alloc(CFIndex size, CFOptionFlags hint, void *info)
+{
+	uint64_t used = atomic_load(&input_pool_used);
+	int slot;
+
+	if (size > INPUT_SLOT_SIZE)
+		return malloc(size);
+
+	do {
+		if (used == UINT64_MAX)
+			return malloc(size);
+		slot = __builtin_ctzll(~used);
+	} while (! atomic_compare_exchange_weak(&input_pool_used, &used,
+						used | (1ULL << slot)));
+
+	return input_pool[slot];
+}
+
+static void *
+input_realloc(void *ptr, CFIndex size, CFOptionFlags hint, void *info)
+{
+	int slot = input_slot(ptr);
+	void *p;
+
+	if (slot < 0)
+		return realloc(ptr, size);
+
+	if (size <= INPUT_SLOT_SIZE)
+		return ptr;
+
+	if ((p = malloc(size)) != NULL) {
+		memcpy(p, ptr, INPUT_SLOT_SIZE);
+		input_dealloc(ptr, info);
+	}
+
+	return p;
+}
+
+static void
+input_dealloc(void *ptr, void *info)
+{
+	int slot = input_slot(ptr);
+
+	if (slot < 0)
+		free(ptr);
+	else
+		atomic_fetch_and(&input_pool_used, ~(1ULL << slot));
+}
+
+/*
+ * If the certificate slot has been refreshed since this session got its
+ * objects, switch the session over to the new ones.  A refresh keeps
+ * every object in the same place (see cert_refresh()), so handles the
+ * application already has still work.  This is only done when there is
+ * no search in progress (from C_FindObjectsInit()).  Called with the
+ * session locked.
+ *
+ * C_GetAttributeValue() doesn't take the session lock, so we can only
+ * release the old set once nobody is counted in objs_readers; anyone who
+ * comes in after we've switched gets the new set.  If there are readers
+ * we hang onto the old set until next time, and we don't switch again
+ * until it's gone, so a session never has more than two sets.
+ */
+
+static void
+sess_objs_update(struct session *se)
+{
+	struct obj_set *objs, *old = se->objs;
+
+	if (se->token)
+		return;
+
+	if (se->old_objs) {
+		if (atomic_load(&se->objs_readers) > 0)
+			return;
+		obj_set_put(se->old_objs);
+		se->old_objs = NULL;
+	}
+
+	if (! (objs = cert_objs_get()))
+		return;
+
+	if (objs == old) {
+		obj_set_put(objs);
+		return;
+	}
+
+	os_log_debug(logsys, "Switching session to object set version %u "
+		     "(%u objects)", objs->version, objs->count);
+
+	se->obj_list = objs->list;
+	se->obj_list_count = objs->count;
+	se->obj_idx = objs->idx;
+	atomic_store(&se->objs, objs);
+
+	if (atomic_load(&se->objs_readers) > 0)
+		se->old_objs = old;
+	else
+		obj_set_put(old);
+}
+
 /*
  * Free a session
  */
@@ -5285,30 +9525,18 @@ array_free(char **array)
 static void
 sess_free(struct session *se)
 {
-	int i;
-
 	LOCK_MUTEX(se->mutex);
 
-	for (i = 0; i < se->search_attrs_count; i++)
-		free(se->search_attrs[i].pValue);
-
 	free(se->search_attrs);
+	free(se->search_list);
 
 	if (se->key)
 		CFRelease(se->key);
 
-	if (se->mdc) {
-		/*
-		 * At this point we need to finalize the digest, but
-		 * just discard the results.
-		 */
-
-		unsigned char *digest;
-		unsigned int size;
+	md_stream_free(se->mdstream);
 
-		cc_md_final(se->mdc, &digest, &size);
-		free(digest);
-	}
+	obj_set_put(se->objs);
+	obj_set_put(se->old_objs);
 
 	if (se->token)
 		slot_entry_free(se->token, true);
@@ -5318,6 +9546,219 @@ sess_free(struct session *se)
 	free(se);
 }
 
+/*
+ * Return the slot in the session table for a given index, or NULL
+ * if that slot doesn't exist.
+ */
+
+static struct sess_slot *
+sess_slot_get(unsigned int index)
+{
+	struct sess_slot *chunk;
+
+	if (index / SESS_CHUNK >= SESS_MAX_CHUNKS)
+		return NULL;
+
+	chunk = atomic_load(&sess_chunks[index / SESS_CHUNK]);
+
+	return chunk ? &chunk[index % SESS_CHUNK] : NULL;
+}
+
+/*
+ * Build a session handle for a table slot
+ */
+
+static CK_SESSION_HANDLE
+sess_handle(unsigned int index, struct sess_slot *ss)
+{
+	return ((CK_SESSION_HANDLE) (atomic_load(&ss->gen) & SESS_GEN_MASK) <<
+		SESS_INDEX_BITS) | (index + 1);
+}
+
+/*
+ * Look up a session handle and return it with a new reference (drop it
+ * with sess_put()); returns NULL if the handle is invalid or stale.
+ * Doesn't take any locks.
+ */
+
+static struct session *
+sess_lookup(CK_SESSION_HANDLE handle)
+{
+	CK_SESSION_HANDLE index = handle & SESS_INDEX_MASK;
+	struct sess_slot *ss;
+	struct session *se;
+
+	if (index == 0 || (handle >> SESS_INDEX_BITS) > SESS_GEN_MASK)
+		return NULL;
+
+	if (! (ss = sess_slot_get(index - 1)))
+		return NULL;
+
+	/*
+	 * sess_remove() won't let go of the session until we're out of
+	 * here (see above)
+	 */
+
+	atomic_fetch_add(&ss->readers, 1);
+
+	se = atomic_load(&ss->sess);
+
+	if (! se || (atomic_load(&ss->gen) & SESS_GEN_MASK) !=
+					(handle >> SESS_INDEX_BITS))
+		se = NULL;
+	else
+		atomic_fetch_add_explicit(&se->refcount, 1,
+					  memory_order_relaxed);
+
+	atomic_fetch_sub(&ss->readers, 1);
+
+	return se;
+}
+
+/*
+ * Drop a session reference, and free the session if it was the last one
+ */
+
+static void
+sess_put(struct session *se)
+{
+	if (atomic_fetch_sub_explicit(&se->refcount, 1,
+				      memory_order_acq_rel) == 1)
+		sess_free(se);
+}
+
+/*
+ * Add a session to the table and return the new handle, or 0 if the
+ * table is full.  Must be called with sess_mutex held.
+ */
+
+static CK_SESSION_HANDLE
+sess_insert(struct session *se)
+{
+	struct sess_slot *ss;
+	unsigned int i, index;
+
+	/*
+	 * If the freelist is empty, add another chunk and put all of
+	 * its slots on the freelist.  Make sure the chunk is completely
+	 * initialized before we publish it.
+	 */
+
+	if (sess_free_head == SESS_NO_FREE) {
+		struct sess_slot *chunk;
+
+		if (sess_chunk_count >= SESS_MAX_CHUNKS)
+			return 0;
+
+		chunk = malloc(sizeof(*chunk) * SESS_CHUNK);
+
+		for (i = 0; i < SESS_CHUNK; i++) {
+			atomic_init(&chunk[i].sess, NULL);
+			atomic_init(&chunk[i].gen, 1);
+			atomic_init(&chunk[i].readers, 0);
+			chunk[i].next_free = i + 1 < SESS_CHUNK ?
+				sess_chunk_count * SESS_CHUNK + i + 1 :
+				SESS_NO_FREE;
+		}
+
+		atomic_store(&sess_chunks[sess_chunk_count], chunk);
+		sess_free_head = sess_chunk_count * SESS_CHUNK;
+		sess_chunk_count++;
+	}
+
+	index = sess_free_head;
+	ss = sess_slot_get(index);
+	sess_free_head = ss->next_free;
+
+	atomic_store(&ss->sess, se);
+
+	return sess_handle(index, ss);
+}
+
+/*
+ * Remove a session from the table and return it (or NULL if the handle
+ * was not valid); the caller gets the table's reference.  Must be called
+ * with sess_mutex held.
+ */
+
+static struct session *
+sess_remove(CK_SESSION_HANDLE handle)
+{
+	struct session *se;
+	struct sess_slot *ss;
+	unsigned int index;
+
+	if (! (se = sess_lookup(handle)))
+		return NULL;
+
+	sess_put(se);
+
+	index = (handle & SESS_INDEX_MASK) - 1;
+	ss = sess_slot_get(index);
+
+	atomic_fetch_add(&ss->gen, 1);
+	atomic_store(&ss->sess, NULL);
+
+	/*
+	 * Once this is zero, any lookup that still found this session
+	 * already has its own reference.  This is only ever a few
+	 * instructions, so just spin.
+	 */
+
+	while (atomic_load(&ss->readers) > 0)
+		sched_yield();
+
+	ss->next_free = sess_free_head;
+	sess_free_head = index;
+
+	return se;
+}
+
+/*
+ * Free any sessions still open and release the entire session table.
+ * Must be called with sess_mutex held.
+ */
+
+static void
+sess_table_free(void)
+{
+	struct sess_slot *chunk;
+	struct session *se;
+	unsigned int i, j;
+
+	for (i = 0; i < sess_chunk_count; i++) {
+		chunk = atomic_load(&sess_chunks[i]);
+		for (j = 0; j < SESS_CHUNK; j++)
+			if ((se = atomic_load(&chunk[j].sess)) != NULL)
+				sess_put(se);
+		atomic_store(&sess_chunks[i], NULL);
+		free(chunk);
+	}
+
+	sess_chunk_count = 0;
+	sess_free_head = SESS_NO_FREE;
+}
+
+/*
+ * Bracket a private key operation on a token; this is where we limit
+ * the number of operations in flight.  A NULL token (the certificate
+ * slot) is fine, since we never do private key operations there.
+ */
+
+static void
+token_op_begin(struct slot_entry *token)
+{
+	if (token && token->op_sem)
+		dispatch_semaphore_wait(token->op_sem, DISPATCH_TIME_FOREVER);
+}
+
+static void
+token_op_end(struct slot_entry *token)
+{
+	if (token && token->op_sem)
+		dispatch_semaphore_signal(token->op_sem);
+}
+
 /*
  * Logout from our token
  */
@@ -5333,6 +9774,7 @@ token_logout(struct slot_entry *token)
 
 	if (token->lacontext) {
 		lacontext_logout(token->lacontext);
+		lacontext_free(token->lacontext);
 		token->lacontext = NULL;
 	}
 
@@ -83,6 +83,9 @@
 #define kLACredentialSmartCardPIN -3
 #endif /* kLACredentialSmartCardPIN */
 
+static CK_RV la_evaluate(LAContext *, void **, enum la_keyusage *,
+			 unsigned int);
+
 /*
  * Allocate and return a new LAContext
  */
@@ -90,7 +93,12 @@
 void *
 lacontext_new(void)
 {
-	LAContext *lac = [[LAContext alloc] init];
+	LAContext *lac;
+	os_signpost_id_t spid;
+
+	SP_BEGIN(spid, "LAContext init");
+	lac = [[LAContext alloc] init];
+	SP_END(spid, "LAContext init");
 
 	/*
 	 * Since we are not using ARC, I believe this is correct; we
@@ -103,6 +111,20 @@ lacontext_new(void)
 	return lac;
 }
 
+/*
+ * Take another reference to an LAContext (release it with
+ * lacontext_free()), for anyone who needs it without holding the token
+ * lock.  Works on NULL, too.
+ */
+
+void *
+lacontext_retain(void *l)
+{
+	LAContext *lac = (LAContext *) l;
+
+	return [lac retain];
+}
+
 void
 lacontext_free(void *l)
 {
@@ -112,19 +134,30 @@ lacontext_free(void *l)
 }
 
 
+/*
+ * Set the PIN in our LAContext and then verify it against every access
+ * control object we were given.  Identities on the same card tend to
+ * share access control objects, so the caller only gives us each distinct
+ * one once.
+ *
+ * Since a wrong PIN will count against the card's retry counter once for
+ * every evaluation, we check the first access control object by itself;
+ * if that works then the PIN is correct, and we go on to the rest.
+ */
+
 CK_RV
-lacontext_auth(void *l, unsigned char *bytes, size_t len, void *sec,
-	       enum la_keyusage usage)
+lacontext_auth(void *l, unsigned char *bytes, size_t len, void **sec,
+	       enum la_keyusage *usage, unsigned int count)
 {
 	LAContext *lac = (LAContext *) l;
 	NSData *password = [[NSData alloc] initWithBytes:bytes length: len];
-	SecAccessControlRef secaccess = sec;
-	LAAccessControlOperation acc_control;
-	__block BOOL b;
-	__block NSError *e_ref = NULL;
-	dispatch_semaphore_t sema;
+	BOOL b;
+	CK_RV rv;
+	os_signpost_id_t spid;
 
+	SP_BEGIN(spid, "LAContext setCredential");
 	b = [lac setCredential: password type: kLACredentialSmartCardPIN];
+	SP_END(spid, "LAContext setCredential");
 
 	[password release];
 
@@ -136,49 +169,98 @@ lacontext_auth(void *l, unsigned char *bytes, size_t len, void *sec,
 		return CKR_GENERAL_ERROR;
 	}
 
-	switch (usage) {
-	case USAGE_SIGN:
-		acc_control = LAAccessControlOperationUseKeySign;
-		break;
-	case USAGE_DECRYPT:
-		acc_control = LAAccessControlOperationUseKeyDecrypt;
-		break;
-	}
+	if (count == 0)
+		return CKR_OK;
+
+	if ((rv = la_evaluate(lac, sec, usage, 1)) != CKR_OK || count == 1)
+		return rv;
+
+	return la_evaluate(lac, sec + 1, usage + 1, count - 1);
+}
+
+/*
+ * Evaluate a list of access control objects with our LAContext, one at a
+ * time.  Nothing says an LAContext can have more than one evaluation in
+ * progress, so we wait for each one to finish before starting the next.
+ * We still evaluate all of them even if one fails, so everything that
+ * went wrong gets logged.
+ */
+
+static CK_RV
+la_evaluate(LAContext *lac, void **sec, enum la_keyusage *usage,
+	    unsigned int count)
+{
+	BOOL *success = calloc(count, sizeof(*success));
+	NSError **errors = calloc(count, sizeof(*errors));
+	dispatch_group_t group = dispatch_group_create();
+	LAAccessControlOperation acc_control;
+	CK_RV rv = CKR_OK;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		SecAccessControlRef secaccess = sec[i];
+		unsigned int n = i;
+		os_signpost_id_t spid;
+
+		switch (usage[i]) {
+		case USAGE_SIGN:
+			acc_control = LAAccessControlOperationUseKeySign;
+			break;
+		case USAGE_DECRYPT:
+			acc_control = LAAccessControlOperationUseKeyDecrypt;
+			break;
+		}
 
 #if 0
-	lac.interactionNotAllowed = TRUE;
+		lac.interactionNotAllowed = TRUE;
 #endif
-	sema = dispatch_semaphore_create(0);
-
-	[lac evaluateAccessControl: secaccess
-			operation: acc_control
-			localizedReason: @"authenticate to your smartcard"
-			reply: ^(BOOL success, NSError *err) {
-				b = success;
-				if (! success) {
-					/*
-					 * It seems the error argument
-					 * gets released after this block
-					 * is complete, so retain it so
-					 * we can still use it
-					 */
-					e_ref = err;
-					[e_ref retain];
-				}
-				dispatch_semaphore_signal(sema);
-			}];
-
-	dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
-	dispatch_release(sema);
-
-	if (b != YES) {
-		os_log_debug(logsys, "evaluateAccessControl failed: %d "
-			     "%{public}@", (int) e_ref.code, e_ref);
-		[e_ref release];
-		return CKR_PIN_INCORRECT;
+		dispatch_group_enter(group);
+
+		/*
+		 * The interval ends when the reply block is called
+		 */
+
+		SP_BEGIN(spid, "LAContext evaluateAccessControl");
+
+		[lac evaluateAccessControl: secaccess
+				operation: acc_control
+				localizedReason: @"authenticate to your smartcard"
+				reply: ^(BOOL ok, NSError *err) {
+					SP_END(spid, "LAContext "
+					       "evaluateAccessControl");
+					success[n] = ok;
+					if (! ok) {
+						/*
+						 * It seems the error argument
+						 * gets released after this
+						 * block is complete, so retain
+						 * it so we can still use it
+						 */
+						errors[n] = err;
+						[errors[n] retain];
+					}
+					dispatch_group_leave(group);
+				}];
+
+		dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
 	}
 
-	return CKR_OK;
+	dispatch_release(group);
+
+	for (i = 0; i < count; i++) {
+		if (success[i] != YES) {
+			os_log_debug(logsys, "evaluateAccessControl failed: %d "
+				     "%{public}@", (int) errors[i].code,
+				     errors[i]);
+			[errors[i] release];
+			rv = CKR_PIN_INCORRECT;
+		}
+	}
+
+	free(success);
+	free(errors);
+
+	return rv;
 }
 
 void
@@ -186,8 +268,11 @@ lacontext_logout(void *l)
 {
 	LAContext *lac = (LAContext *) l;
 	BOOL b;
+	os_signpost_id_t spid;
 
+	SP_BEGIN(spid, "LAContext setCredential");
 	b = [lac setCredential: NULL type: kLACredentialSmartCardPIN];
+	SP_END(spid, "LAContext setCredential");
 
 	if (b != YES)
 		os_log_debug(logsys, "WARNING: unable to logout of credential");
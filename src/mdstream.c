@@ -0,0 +1,188 @@
+/*
+ * Pipelined message digests (see mdstream.h)
+ *
+ * Each stream has a ring of STREAM_BUFFERS buffers and its own serial
+ * queue.  Full buffers are handed to the queue in ring order, and since
+ * the queue is serial they also come back in ring order; so the next
+ * buffer in the ring is always the one that has been in use the longest,
+ * and the semaphore (which counts free buffers) is all we need to know
+ * when we can fill it again.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CommonCrypto/CommonCrypto.h>
+#include <dispatch/dispatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mypkcs11.h"
+#include "ccglue.h"
+#include "mdstream.h"
+#include "config.h"
+
+#define STREAM_BUFFERS	4
+#define STREAM_BUFSIZE	(4 * 1024 * 1024)
+
+struct stream_buf {
+	struct _md_stream *	stream;		/* Stream we belong to */
+	md_context *		context;	/* Digest to update */
+	unsigned char *		data;		/* Buffer data */
+	size_t			len;		/* Amount of data in buffer */
+};
+
+struct _md_stream {
+	dispatch_queue_t	queue;		/* Our hashing queue */
+	dispatch_semaphore_t	free_bufs;	/* Count of free buffers */
+	struct stream_buf	bufs[STREAM_BUFFERS]; /* Buffer ring */
+	struct stream_buf *	cur;		/* Buffer being filled */
+	unsigned int		next;		/* Next buffer in ring */
+};
+
+static void stream_submit(struct _md_stream *);
+static void stream_hash(void *);
+static void stream_noop(void *);
+
+/*
+ * Allocate a new stream and its buffers
+ */
+
+md_stream
+md_stream_new(void)
+{
+	struct _md_stream *stream = calloc(1, sizeof(*stream));
+	unsigned int i;
+
+	if (! stream)
+		return NULL;
+
+	for (i = 0; i < STREAM_BUFFERS; i++) {
+		stream->bufs[i].stream = stream;
+		if (! (stream->bufs[i].data = malloc(STREAM_BUFSIZE)))
+			goto fail;
+	}
+
+	stream->queue = dispatch_queue_create(APPIDENTIFIER ".mdstream",
+					      DISPATCH_QUEUE_SERIAL);
+	stream->free_bufs = dispatch_semaphore_create(STREAM_BUFFERS);
+
+	return stream;
+
+fail:
+	for (i = 0; i < STREAM_BUFFERS; i++)
+		free(stream->bufs[i].data);
+	free(stream);
+
+	return NULL;
+}
+
+/*
+ * Copy data into our buffers, handing each one off to be hashed as it
+ * fills up.  If there's no free buffer, wait for one.
+ */
+
+void
+md_stream_update(md_stream stream, md_context *context,
+		 const unsigned char *data, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (! stream->cur) {
+			dispatch_semaphore_wait(stream->free_bufs,
+						DISPATCH_TIME_FOREVER);
+			stream->cur = &stream->bufs[stream->next];
+			stream->next = (stream->next + 1) % STREAM_BUFFERS;
+			stream->cur->context = context;
+			stream->cur->len = 0;
+		}
+
+		n = STREAM_BUFSIZE - stream->cur->len;
+		if (n > len)
+			n = len;
+
+		memcpy(stream->cur->data + stream->cur->len, data, n);
+		stream->cur->len += n;
+		data += n;
+		len -= n;
+
+		if (stream->cur->len == STREAM_BUFSIZE)
+			stream_submit(stream);
+	}
+}
+
+/*
+ * Hash anything left over and wait until everything is done.  Since the
+ * queue is serial, once a no-op block has run, everything we gave it
+ * before has run too.
+ */
+
+void
+md_stream_wait(md_stream stream)
+{
+	if (stream->cur) {
+		if (stream->cur->len > 0) {
+			stream_submit(stream);
+		} else {
+			stream->cur = NULL;
+			dispatch_semaphore_signal(stream->free_bufs);
+		}
+	}
+
+	dispatch_sync_f(stream->queue, NULL, stream_noop);
+}
+
+/*
+ * Free a stream.  All of the buffers have to be back before we can
+ * release the semaphore (dispatch won't let us release one whose count
+ * is below where it started).
+ */
+
+void
+md_stream_free(md_stream stream)
+{
+	unsigned int i;
+
+	if (! stream)
+		return;
+
+	md_stream_wait(stream);
+
+	dispatch_release(stream->queue);
+	dispatch_release(stream->free_bufs);
+
+	for (i = 0; i < STREAM_BUFFERS; i++)
+		free(stream->bufs[i].data);
+
+	free(stream);
+}
+
+/*
+ * Hand the buffer we're filling to the queue
+ */
+
+static void
+stream_submit(struct _md_stream *stream)
+{
+	dispatch_async_f(stream->queue, stream->cur, stream_hash);
+	stream->cur = NULL;
+}
+
+/*
+ * Hash a single buffer, and put it back in the ring (runs on the
+ * stream queue)
+ */
+
+static void
+stream_hash(void *context)
+{
+	struct stream_buf *buf = (struct stream_buf *) context;
+
+	cc_md_update(buf->context, buf->data, buf->len);
+
+	dispatch_semaphore_signal(buf->stream->free_bufs);
+}
+
+static void
+stream_noop(void *context)
+{
+}
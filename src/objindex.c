@@ -0,0 +1,338 @@
+/*
+ * An index of object attributes, so C_FindObjects doesn't have to
+ * compare the search template against every single object.
+ *
+ * This is a basic chained hash table keyed on the attribute type and
+ * value.  Each entry holds the list of object handles which have that
+ * attribute.  Since objects are added in handle order the handle lists
+ * are always sorted, which means searches return objects in the same
+ * order as a linear scan would.
+ *
+ * Some attributes are expensive to compute, so an index can also have a
+ * "deferred" part: a second index that is only filled in (by a caller
+ * supplied function) the first time a search needs one of its types.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <dispatch/dispatch.h>
+
+#include "mypkcs11.h"
+#include "objindex.h"
+
+struct idx_entry {
+	struct idx_entry *	next;		/* Next entry in bucket */
+	uint32_t		hash;		/* Hash of type + value */
+	CK_ATTRIBUTE_TYPE	type;		/* Attribute type */
+	CK_ULONG		len;		/* Length of value */
+	unsigned char *		value;		/* Copy of attribute value */
+	CK_OBJECT_HANDLE *	handles;	/* Objects with this value */
+	unsigned int		count;		/* Count of handles */
+	unsigned int		size;		/* Size of handles array */
+};
+
+struct _obj_index {
+	struct idx_entry **	buckets;	/* Hash buckets */
+	unsigned int		nbuckets;	/* Number of buckets */
+	unsigned int		nentries;	/* Number of unique entries */
+	unsigned int		types;		/* Types present (idx_bit()) */
+	objidx_fill		fill;		/* Deferred fill function */
+	void *			fill_context;	/* Argument to fill function */
+	dispatch_once_t		fill_once;	/* Deferred index is built */
+	obj_index		deferred;	/* Deferred index */
+};
+
+#define INITIAL_BUCKETS 64
+
+static uint32_t idx_hash(CK_ATTRIBUTE_TYPE, const unsigned char *, CK_ULONG);
+static struct idx_entry *idx_find(obj_index, CK_ATTRIBUTE_TYPE,
+				  const unsigned char *, CK_ULONG, uint32_t);
+static void idx_grow(obj_index);
+static void idx_fill(void *);
+
+/*
+ * Return a bit representing this attribute type if it is a type we
+ * index, otherwise 0
+ */
+
+static unsigned int
+idx_bit(CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_CLASS:
+		return 1 << 0;
+	case CKA_ID:
+		return 1 << 1;
+	case CKA_LABEL:
+		return 1 << 2;
+	case CKA_SUBJECT:
+		return 1 << 3;
+	case CKA_ISSUER:
+		return 1 << 4;
+	case CKA_SERIAL_NUMBER:
+		return 1 << 5;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Create a new (empty) index
+ */
+
+obj_index
+objidx_create(void)
+{
+	obj_index index = malloc(sizeof(*index));
+
+	index->nbuckets = INITIAL_BUCKETS;
+	index->nentries = 0;
+	index->buckets = calloc(index->nbuckets, sizeof(*index->buckets));
+	index->types = 0;
+	index->fill = NULL;
+	index->fill_context = NULL;
+	index->fill_once = 0;
+	index->deferred = NULL;
+
+	return index;
+}
+
+/*
+ * Set the function used to fill in our deferred index
+ */
+
+void
+objidx_defer(obj_index index, objidx_fill fill, void *context)
+{
+	index->fill = fill;
+	index->fill_context = context;
+}
+
+/*
+ * Add an attribute to the index.  Note that we assume handles are
+ * added in increasing order.
+ */
+
+void
+objidx_add(obj_index index, CK_ATTRIBUTE_PTR attr, CK_OBJECT_HANDLE handle)
+{
+	struct idx_entry *e;
+	uint32_t hash;
+
+	if (! index || ! idx_bit(attr->type) || attr->pValue == NULL ||
+	    attr->ulValueLen == CK_UNAVAILABLE_INFORMATION)
+		return;
+
+	index->types |= idx_bit(attr->type);
+
+	hash = idx_hash(attr->type, attr->pValue, attr->ulValueLen);
+
+	e = idx_find(index, attr->type, attr->pValue, attr->ulValueLen, hash);
+
+	if (! e) {
+		unsigned int b;
+
+		if (index->nentries >= index->nbuckets * 2)
+			idx_grow(index);
+
+		e = malloc(sizeof(*e));
+		e->hash = hash;
+		e->type = attr->type;
+		e->len = attr->ulValueLen;
+		e->value = malloc(e->len ? e->len : 1);
+		memcpy(e->value, attr->pValue, e->len);
+		e->handles = NULL;
+		e->count = e->size = 0;
+
+		b = hash % index->nbuckets;
+		e->next = index->buckets[b];
+		index->buckets[b] = e;
+		index->nentries++;
+	}
+
+	/*
+	 * If an object has the same attribute twice (it shouldn't) make
+	 * sure we don't add the handle twice.
+	 */
+
+	if (e->count > 0 && e->handles[e->count - 1] == handle)
+		return;
+
+	if (e->count >= e->size) {
+		e->size = e->size ? e->size * 2 : 4;
+		e->handles = realloc(e->handles, e->size * sizeof(*e->handles));
+	}
+
+	e->handles[e->count++] = handle;
+}
+
+/*
+ * Find the candidate list for this template.  We use the shortest
+ * list of any indexed attribute in the template; if any indexed
+ * attribute has no entry at all, then nothing can match.  An attribute
+ * only counts as indexed if the index has seen that type; if it's not
+ * in our main index, check the deferred index (building it if we have to).
+ */
+
+bool
+objidx_lookup(obj_index index, CK_ATTRIBUTE_PTR template, unsigned int count,
+	      CK_OBJECT_HANDLE **ret_handles, unsigned int *ret_count)
+{
+	struct idx_entry *e, *best = NULL;
+	bool indexed = false;
+	unsigned int i, bit;
+	obj_index idx;
+
+	if (! index)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (! (bit = idx_bit(template[i].type)) ||
+		    template[i].pValue == NULL ||
+		    template[i].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+			continue;
+
+		idx = index;
+
+		if (! (index->types & bit)) {
+			if (! index->fill)
+				continue;
+			dispatch_once_f(&index->fill_once, index, idx_fill);
+			if (! (index->deferred->types & bit))
+				continue;
+			idx = index->deferred;
+		}
+
+		indexed = true;
+
+		e = idx_find(idx, template[i].type, template[i].pValue,
+			     template[i].ulValueLen,
+			     idx_hash(template[i].type, template[i].pValue,
+				      template[i].ulValueLen));
+
+		if (! e) {
+			*ret_handles = malloc(sizeof(**ret_handles));
+			*ret_count = 0;
+			return true;
+		}
+
+		if (! best || e->count < best->count)
+			best = e;
+	}
+
+	if (! indexed)
+		return false;
+
+	*ret_handles = malloc(best->count * sizeof(**ret_handles));
+	memcpy(*ret_handles, best->handles,
+	       best->count * sizeof(**ret_handles));
+	*ret_count = best->count;
+
+	return true;
+}
+
+/*
+ * Free our index and all of the entries in it
+ */
+
+void
+objidx_free(obj_index index)
+{
+	struct idx_entry *e, *next;
+	unsigned int i;
+
+	if (! index)
+		return;
+
+	for (i = 0; i < index->nbuckets; i++) {
+		for (e = index->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e->value);
+			free(e->handles);
+			free(e);
+		}
+	}
+
+	objidx_free(index->deferred);
+
+	free(index->buckets);
+	free(index);
+}
+
+/*
+ * Build our deferred index (called via dispatch_once_f())
+ */
+
+static void
+idx_fill(void *context)
+{
+	obj_index index = (obj_index) context;
+
+	index->deferred = objidx_create();
+	index->fill(index->deferred, index->fill_context);
+}
+
+/*
+ * FNV-1a, seeded with the attribute type
+ */
+
+static uint32_t
+idx_hash(CK_ATTRIBUTE_TYPE type, const unsigned char *value, CK_ULONG len)
+{
+	uint32_t hash = 2166136261U;
+	CK_ULONG i;
+
+	hash ^= (uint32_t) type;
+	hash *= 16777619U;
+
+	for (i = 0; i < len; i++) {
+		hash ^= value[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Find a particular entry in the index
+ */
+
+static struct idx_entry *
+idx_find(obj_index index, CK_ATTRIBUTE_TYPE type, const unsigned char *value,
+	 CK_ULONG len, uint32_t hash)
+{
+	struct idx_entry *e;
+
+	for (e = index->buckets[hash % index->nbuckets]; e != NULL; e = e->next)
+		if (e->hash == hash && e->type == type && e->len == len &&
+		    memcmp(e->value, value, len) == 0)
+			return e;
+
+	return NULL;
+}
+
+/*
+ * Double the number of buckets and rehash everything
+ */
+
+static void
+idx_grow(obj_index index)
+{
+	unsigned int i, nbuckets = index->nbuckets * 2;
+	struct idx_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+	struct idx_entry *e, *next;
+
+	for (i = 0; i < index->nbuckets; i++) {
+		for (e = index->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash % nbuckets];
+			buckets[e->hash % nbuckets] = e;
+		}
+	}
+
+	free(index->buckets);
+	index->buckets = buckets;
+	index->nbuckets = nbuckets;
+}
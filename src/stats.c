@@ -0,0 +1,254 @@
+/*
+ * Performance statistics for every PKCS#11 function
+ *
+ * These are always on, so they have to be cheap; every counter is a
+ * relaxed atomic, and recording a call is a handful of atomic adds.
+ * There's no attempt to make a snapshot of all of them consistent, since
+ * they are only ever used as totals.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <mach/mach_time.h>
+
+#include "mypkcs11.h"
+#include "keychain_pkcs11.h"
+#include "keychain_pkcs11_ext.h"
+#include "stats.h"
+#include "debug.h"
+#include "config.h"
+
+struct stat_entry {
+	atomic_ullong	calls;			/* Number of calls */
+	atomic_ullong	errors;			/* Calls that failed */
+	atomic_ullong	total;			/* Total time (ns) */
+	atomic_ullong	histogram[CK_KEYCHAIN_STATS_BUCKETS];
+};
+
+static struct stat_entry stats[STAT_COUNT];
+
+static const char *stat_names[STAT_COUNT] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+	"C_KeychainSignBatch",
+	"C_KeychainGetStats",
+	"certificate_scan",
+	"token_insert",
+};
+
+/*
+ * Our error code counts.  This is a small open-addressed hash table;
+ * a slot is claimed by storing the error code (plus one, so zero means
+ * the slot is empty) with a compare-and-swap.  If the table fills up
+ * then we just stop counting new error codes; there aren't anywhere
+ * near this many error codes that we actually return.
+ */
+
+#define ERROR_SLOTS 64
+
+static struct {
+	atomic_ulong	rv;			/* Error code + 1 */
+	atomic_ullong	count;			/* Times returned */
+} error_counts[ERROR_SLOTS];
+
+static mach_timebase_info_data_t timebase;
+
+static void record_error(CK_RV);
+
+/*
+ * Get the timebase so we can convert mach_absolute_time() to
+ * nanoseconds (called when we set up logging)
+ */
+
+void
+stats_init(void)
+{
+	mach_timebase_info(&timebase);
+}
+
+uint64_t
+stats_start(void)
+{
+	return mach_absolute_time();
+}
+
+/*
+ * Record a single call
+ */
+
+void
+stats_record(enum stat_id stat, uint64_t start, CK_RV rv)
+{
+	struct stat_entry *s = &stats[stat];
+	uint64_t ns = mach_absolute_time() - start, usec;
+	unsigned int bucket;
+
+	if (timebase.denom)
+		ns = ns * timebase.numer / timebase.denom;
+
+	usec = ns / 1000;
+	bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+
+	if (bucket >= CK_KEYCHAIN_STATS_BUCKETS)
+		bucket = CK_KEYCHAIN_STATS_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&s->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->total, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->histogram[bucket], 1,
+				  memory_order_relaxed);
+
+	if (rv != CKR_OK && rv != CK_UNAVAILABLE_INFORMATION) {
+		atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+		record_error(rv);
+	}
+}
+
+/*
+ * Count an error code
+ */
+
+static void
+record_error(CK_RV rv)
+{
+	unsigned int i, slot = (unsigned int) (rv % ERROR_SLOTS);
+	unsigned long expected;
+
+	for (i = 0; i < ERROR_SLOTS; i++, slot = (slot + 1) % ERROR_SLOTS) {
+		expected = atomic_load_explicit(&error_counts[slot].rv,
+						memory_order_relaxed);
+
+		/*
+		 * If the compare-and-swap fails, expected is set to whatever
+		 * code got there first (which might be ours).
+		 */
+
+		if (expected == 0 &&
+		    atomic_compare_exchange_strong(&error_counts[slot].rv,
+						   &expected, rv + 1))
+			goto found;
+
+		if (expected == rv + 1)
+			goto found;
+	}
+
+	return;
+
+found:
+	atomic_fetch_add_explicit(&error_counts[slot].count, 1,
+				  memory_order_relaxed);
+}
+
+/*
+ * Copy out our statistics (see C_KeychainGetStats())
+ */
+
+unsigned int
+stats_get(CK_KEYCHAIN_STAT_PTR statlist, unsigned int count,
+	  CK_KEYCHAIN_ERROR_STAT_PTR errors, unsigned int *errcount)
+{
+	unsigned int i, j, n = 0;
+	unsigned long rv;
+
+	for (i = 0; i < STAT_COUNT && i < count && statlist; i++) {
+		struct stat_entry *s = &stats[i];
+
+		statlist[i].name = stat_names[i];
+		statlist[i].calls = atomic_load_explicit(&s->calls,
+							 memory_order_relaxed);
+		statlist[i].errors = atomic_load_explicit(&s->errors,
+							  memory_order_relaxed);
+		statlist[i].total_usec = atomic_load_explicit(&s->total,
+						memory_order_relaxed) / 1000;
+		for (j = 0; j < CK_KEYCHAIN_STATS_BUCKETS; j++)
+			statlist[i].histogram[j] =
+				atomic_load_explicit(&s->histogram[j],
+						     memory_order_relaxed);
+	}
+
+	for (i = 0; i < ERROR_SLOTS; i++) {
+		rv = atomic_load_explicit(&error_counts[i].rv,
+					  memory_order_relaxed);
+		if (rv == 0)
+			continue;
+		if (errors && n < *errcount) {
+			errors[n].rv = rv - 1;
+			errors[n].count = atomic_load_explicit(
+						&error_counts[i].count,
+						memory_order_relaxed);
+		}
+		n++;
+	}
+
+	*errcount = n;
+
+	return STAT_COUNT;
+}
+
+/*
+ * Write out all of our statistics to the log.  This is at the default
+ * log level (unlike everything else we log) since if someone asked for
+ * this, they want to see it.
+ */
+
+void
+stats_dump(void)
+{
+	char hist[CK_KEYCHAIN_STATS_BUCKETS * 24];
+	unsigned int i, j, len;
+	unsigned long long calls, n;
+	unsigned long rv;
+	bool last;
+	os_log_t statlog;
+
+	/*
+	 * Use our own log handle, since logsys is disabled if someone set
+	 * logLevel to 0 and they still want these.
+	 */
+
+	statlog = os_log_create(APPIDENTIFIER, "general");
+
+	for (i = 0; i < STAT_COUNT; i++) {
+		struct stat_entry *s = &stats[i];
+
+		calls = atomic_load_explicit(&s->calls, memory_order_relaxed);
+
+		if (calls == 0)
+			continue;
+
+		hist[0] = '\0';
+
+		for (j = 0, len = 0; j < CK_KEYCHAIN_STATS_BUCKETS; j++) {
+			last = j == CK_KEYCHAIN_STATS_BUCKETS - 1;
+			n = atomic_load_explicit(&s->histogram[j],
+						 memory_order_relaxed);
+			if (n == 0)
+				continue;
+			len += snprintf(hist + len, sizeof(hist) - len,
+					"%s%s%luus:%llu", len ? " " : "",
+					last ? ">=" : "<",
+					last ? 1UL << (j - 1) : 1UL << j, n);
+			if (len >= sizeof(hist))
+				break;
+		}
+
+		os_log(statlog, "stats: %{public}s: %llu calls, %llu errors, "
+		       "%llu us total, %{public}s", stat_names[i], calls,
+		       atomic_load_explicit(&s->errors, memory_order_relaxed),
+		       atomic_load_explicit(&s->total,
+					    memory_order_relaxed) / 1000, hist);
+	}
+
+	for (i = 0; i < ERROR_SLOTS; i++) {
+		rv = atomic_load_explicit(&error_counts[i].rv,
+					  memory_order_relaxed);
+		if (rv == 0)
+			continue;
+		os_log(statlog, "stats: error %{public}s returned %llu times",
+		       getCKRName(rv - 1),
+		       atomic_load_explicit(&error_counts[i].count,
+					    memory_order_relaxed));
+	}
+}
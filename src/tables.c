@@ -151,6 +151,50 @@ const struct mechanism_map keychain_mechmap[] = {
 	  NULL, 0,	/* Another special case; no digest algorithm */
 	  true,
 	},
+	/*
+	 * Plain message digests; these don't use a key at all, and are
+	 * done in software using CommonCrypto.
+	 */
+	{
+	  CKM_SHA_1, 0, 0,
+	  CKF_DIGEST, NONE,
+	  NULL,
+	  NULL,
+	  NULL,
+	  CKM_SHA_1, false,
+	},
+	{
+	  CKM_SHA224, 0, 0,
+	  CKF_DIGEST, NONE,
+	  NULL,
+	  NULL,
+	  NULL,
+	  CKM_SHA224, false,
+	},
+	{
+	  CKM_SHA256, 0, 0,
+	  CKF_DIGEST, NONE,
+	  NULL,
+	  NULL,
+	  NULL,
+	  CKM_SHA256, false,
+	},
+	{
+	  CKM_SHA384, 0, 0,
+	  CKF_DIGEST, NONE,
+	  NULL,
+	  NULL,
+	  NULL,
+	  CKM_SHA384, false,
+	},
+	{
+	  CKM_SHA512, 0, 0,
+	  CKF_DIGEST, NONE,
+	  NULL,
+	  NULL,
+	  NULL,
+	  CKM_SHA512, false,
+	},
 };
 
 const unsigned int keychain_mechmap_size = sizeof(keychain_mechmap) /
@@ -301,6 +345,94 @@ const struct param_map keychain_param_map[] = {
 const unsigned int keychain_param_map_size = sizeof(keychain_param_map) /
 					sizeof(keychain_param_map[0]);
 
+/*
+ * The mechanism lookup index.  Every mechanism we support has a small
+ * number (well below MECHMAP_INDEX_SIZE), so rather than searching through
+ * keychain_mechmap every time someone calls C_SignInit() we just use the
+ * mechanism type as an array index.  Each entry is the keychain_mechmap
+ * index plus one, so zero means we don't support that mechanism.  We also
+ * record where each mechanism's parameters start in keychain_param_map
+ * (all entries for a mechanism are next to each other), so parameter
+ * validation only has to look at the entries for that mechanism.
+ *
+ * These get built by mechmap_init(); it would be nice to generate them
+ * at compile time, but keeping them in sync with the tables above by hand
+ * is asking for trouble.
+ */
+
+#define MECHMAP_INDEX_SIZE 0x400
+#define MECHMAP_COUNT (sizeof(keychain_mechmap) / sizeof(keychain_mechmap[0]))
+
+static unsigned char mechmap_index[MECHMAP_INDEX_SIZE];
+
+static struct {
+	unsigned char	first;		/* First keychain_param_map entry */
+	unsigned char	count;		/* Number of entries */
+} param_range[MECHMAP_COUNT];
+
+void
+mechmap_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < MECHMAP_COUNT; i++) {
+		CK_MECHANISM_TYPE mech = keychain_mechmap[i].cki_mech;
+
+		if (mech < MECHMAP_INDEX_SIZE && mechmap_index[mech] == 0)
+			mechmap_index[mech] = i + 1;
+
+		param_range[i].first = param_range[i].count = 0;
+
+		for (j = 0; j < keychain_param_map_size; j++) {
+			if (keychain_param_map[j].base_type != mech)
+				continue;
+			if (param_range[i].count == 0)
+				param_range[i].first = j;
+			param_range[i].count++;
+		}
+	}
+}
+
+/*
+ * Find the mechanism map entry for a particular mechanism (returns NULL
+ * if we don't support it)
+ */
+
+const struct mechanism_map *
+mechmap_lookup(CK_MECHANISM_TYPE mech)
+{
+	unsigned int i;
+
+	if (mech < MECHMAP_INDEX_SIZE) {
+		i = mechmap_index[mech];
+		return i ? &keychain_mechmap[i - 1] : NULL;
+	}
+
+	/*
+	 * We don't have any of these now, but just in case someone adds
+	 * a vendor mechanism to the table.
+	 */
+
+	for (i = 0; i < MECHMAP_COUNT; i++)
+		if (keychain_mechmap[i].cki_mech == mech)
+			return &keychain_mechmap[i];
+
+	return NULL;
+}
+
+/*
+ * Return the parameter map entries for a mechanism
+ */
+
+const struct param_map *
+mechmap_params(const struct mechanism_map *mm, unsigned int *count)
+{
+	unsigned int i = mm - keychain_mechmap;
+
+	*count = param_range[i].count;
+	return &keychain_param_map[param_range[i].first];
+}
+
 /*
  * Mapping of Security framework constants to Cryptoki constants
  */
@@ -17,6 +17,11 @@
  * to iterate through all of the available smartcards and THEN call the
  * insertion handler function and deal with any duplicate registrations.
  * If this behavior changes, we'll have to rethink how this works.
+ *
+ * It also means that start_token_watcher() doesn't return until every
+ * inserted token has been added.  If the asyncTokenScan preference is
+ * set, the main library calls us from a background queue so that's not
+ * C_Initialize()'s problem.
  */
 
 #import <CryptoTokenKit/CryptoTokenKit.h>
@@ -40,6 +45,8 @@ static void remove_token(NSString *);
 void
 start_token_watcher(void)
 {
+	os_signpost_id_t spid;
+
 	/*
 	 * If we've already got a watcher instance, then just return.
 	 * This shouldn't happen.
@@ -48,11 +55,15 @@ start_token_watcher(void)
 	if (tkwatcher)
 		return;
 
+	SP_BEGIN(spid, "TKTokenWatcher setInsertionHandler");
+
 	tkwatcher = [TKTokenWatcher new];
 
 	[tkwatcher setInsertionHandler:
 		^(NSString *t) { add_token(t, tkwatcher); }];
 
+	SP_END(spid, "TKTokenWatcher setInsertionHandler");
+
 	/*
 	 * By this point, all insertion handlers should be called
 	 */
@@ -69,11 +80,15 @@ void stop_token_watcher(void)
 static void
 add_token(NSString *tokenid, TKTokenWatcher *watcher)
 {
+	os_signpost_id_t spid;
+
 	/*
 	 * Call the main library to add the token to the slot list
 	 */
 
+	SP_BEGIN(spid, "Token insertion");
 	add_token_id((CFStringRef) tokenid);
+	SP_END(spid, "Token insertion");
 
 	/*
 	 * After we register the token, register a removal handler
@@ -92,5 +107,9 @@ add_token(NSString *tokenid, TKTokenWatcher *watcher)
 static void
 remove_token(NSString *tokenid)
 {
+	os_signpost_id_t spid;
+
+	SP_BEGIN(spid, "Token removal");
 	remove_token_id((CFStringRef) tokenid);
+	SP_END(spid, "Token removal");
 }
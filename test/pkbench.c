@@ -0,0 +1,862 @@
+/*
+ * Benchmark driver for keychain-pkcs11
+ *
+ * pkcs11_test and pktest tell us if things work, but not how fast they
+ * are.  This runs the operations that applications (mostly NSS-based
+ * ones) do all of the time and reports latency percentiles and
+ * throughput, so we have some numbers to compare when something changes.
+ *
+ * Each benchmark runs in one or more threads; every thread has its own
+ * session and runs the operation "iterations" times.  The latency of each
+ * operation is recorded and the percentiles are computed over every
+ * thread's samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mypkcs11.h"
+#include "debug.h"
+
+static void usage(const char *);
+static char *default_library = ".libs/keychain-pkcs11.dylib";
+
+#define CHECKRV(func) \
+	do { \
+		if (rv != CKR_OK) { \
+			fprintf(stderr, "Call to " #func " failed: %s\n", \
+				getCKRName(rv)); \
+			goto out; \
+		} \
+	} while (0)
+
+/*
+ * Everything our benchmark operations need to know
+ */
+
+struct bench_ctx {
+	CK_FUNCTION_LIST_PTR	p11;
+	CK_SLOT_ID		slot;
+	CK_OBJECT_HANDLE	cert;		/* A certificate object */
+	CK_OBJECT_HANDLE	privkey;	/* A private key object */
+	CK_OBJECT_HANDLE	pubkey;		/* Matching public key */
+	CK_BYTE_PTR		sig;		/* Signature of bench_data */
+	CK_ULONG		siglen;		/* Signature length */
+	CK_ATTRIBUTE_PTR	template;	/* Template for find benchmark */
+	CK_ULONG		tcount;		/* Template count */
+};
+
+/*
+ * Per-thread state
+ */
+
+struct worker {
+	struct bench_ctx *	ctx;
+	CK_SESSION_HANDLE	session;
+	CK_RV (*op)(struct worker *);		/* Operation to run */
+	unsigned int		iterations;	/* Iterations to run */
+	uint64_t *		samples;	/* Latency, in nanoseconds */
+	unsigned int		count;		/* Count of samples */
+	CK_RV			rv;		/* First failure */
+};
+
+/*
+ * What we print out for each benchmark
+ */
+
+struct result {
+	const char *		name;
+	unsigned int		threads;
+	unsigned int		ops;
+	unsigned int		failures;
+	uint64_t		wall;		/* Nanoseconds */
+	uint64_t		mean;
+	uint64_t		p50;
+	uint64_t		p90;
+	uint64_t		p99;
+	uint64_t		max;
+};
+
+static void run_bench(struct bench_ctx *, const char *,
+		      CK_RV (*)(struct worker *), unsigned int, unsigned int);
+static void *worker_run(void *);
+static void report(struct result *, uint64_t *, unsigned int);
+static void print_result(struct result *);
+static uint64_t now(void);
+static int sample_cmp(const void *, const void *);
+static CK_OBJECT_HANDLE find_one(struct bench_ctx *, CK_SESSION_HANDLE,
+				 CK_ATTRIBUTE_PTR, CK_ULONG);
+static CK_RV get_attr(CK_FUNCTION_LIST_PTR, CK_SESSION_HANDLE,
+		      CK_OBJECT_HANDLE, CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR);
+
+static CK_RV op_slotlist(struct worker *);
+static CK_RV op_find(struct worker *);
+static CK_RV op_getattr(struct worker *);
+static CK_RV op_sign(struct worker *);
+static CK_RV op_sign_multi(struct worker *);
+static CK_RV op_verify(struct worker *);
+static CK_RV op_verify_multi(struct worker *);
+
+static int csv_output = 0;
+
+/*
+ * The data we sign; multi-part operations feed it in BENCH_PARTS pieces.
+ */
+
+#define BENCH_PARTS 4
+static CK_BYTE bench_data[4096];
+static CK_MECHANISM bench_mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+
+/*
+ * How long we wait for a token to show up after C_Initialize(), in
+ * milliseconds
+ */
+
+#define SLOT_WAIT 10000
+
+int
+main(int argc, char *argv[])
+{
+	int c;
+	char *library = default_library, *end, *pin = NULL;
+	void *handle;
+	unsigned int threads = 1, iterations = 1000, init_iterations = 5;
+	unsigned int i;
+	int slot_given = 0;
+	bool initialized = false;
+	CK_FUNCTION_LIST_PTR p11;
+	CK_RV (*getflist)(CK_FUNCTION_LIST_PTR_PTR) = NULL;
+	CK_RV rv = CKR_OK;
+	CK_ULONG count;
+	CK_SLOT_ID *slotlist = NULL;
+	CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+	CK_OBJECT_CLASS class;
+	CK_ATTRIBUTE tmpl[3], idattr = { CKA_ID, NULL, 0 };
+	CK_ATTRIBUTE issuer = { CKA_ISSUER, NULL, 0 };
+	CK_ATTRIBUTE serial = { CKA_SERIAL_NUMBER, NULL, 0 };
+	CK_ATTRIBUTE subject = { CKA_SUBJECT, NULL, 0 };
+	struct bench_ctx ctx;
+	struct result res;
+	uint64_t *samples, start, ready;
+
+	struct option longopts[] = {
+		{ "library",	required_argument, NULL, 'l' },
+		{ "slot",	required_argument, NULL, 's' },
+		{ "threads",	required_argument, NULL, 't' },
+		{ "iterations",	required_argument, NULL, 'i' },
+		{ "init-iterations", required_argument, NULL, 'I' },
+		{ "pin",	required_argument, NULL, 'p' },
+		{ "csv",	no_argument,	&csv_output, 1 },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'l':
+			library = optarg;
+			break;
+		case 's':
+			ctx.slot = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0') {
+				fprintf(stderr, "Invalid slot: %s\n", optarg);
+				exit(1);
+			}
+			slot_given = 1;
+			break;
+		case 't':
+		case 'i':
+		case 'I':
+			i = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || i == 0) {
+				fprintf(stderr, "Invalid count: %s\n", optarg);
+				exit(1);
+			}
+			if (c == 't')
+				threads = i;
+			else if (c == 'i')
+				iterations = i;
+			else
+				init_iterations = i;
+			break;
+		case 'p':
+			pin = optarg;
+			break;
+		case 0:
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (!(handle = dlopen(library, RTLD_NOW))) {
+		fprintf(stderr, "Unable to dlopen %s: %s\n", library,
+			dlerror());
+		exit(1);
+	}
+
+	if (!(getflist = dlsym(handle, "C_GetFunctionList"))) {
+		fprintf(stderr, "Unable to resolve C_GetFunctionList: %s\n",
+			dlerror());
+		exit(1);
+	}
+
+	rv = (*getflist)(&p11);
+
+	CHECKRV(GetFunctionList);
+
+	ctx.p11 = p11;
+	ctx.cert = ctx.privkey = ctx.pubkey = CK_INVALID_HANDLE;
+
+	for (i = 0; i < sizeof(bench_data); i++)
+		bench_data[i] = i & 0xff;
+
+	if (csv_output)
+		printf("name,threads,ops,failures,wall_us,ops_per_sec,"
+		       "mean_us,p50_us,p90_us,p99_us,max_us\n");
+
+	/*
+	 * Time C_Initialize(), and how long it takes until there is a
+	 * token present (tokens show up asynchronously, so we have to poll).
+	 * We do this a few times, since the first time through is usually
+	 * slower than the rest.
+	 */
+
+	samples = malloc(sizeof(*samples) * init_iterations * 2);
+
+	for (i = 0; i < init_iterations; i++) {
+		start = now();
+
+		rv = p11->C_Initialize(NULL);
+
+		CHECKRV(C_Initialize);
+
+		samples[i] = now() - start;
+		initialized = true;
+
+		do {
+			rv = p11->C_GetSlotList(CK_TRUE, NULL, &count);
+			CHECKRV(C_GetSlotList);
+			if (count > 0)
+				break;
+			usleep(1000);
+		} while ((now() - start) / 1000000 < SLOT_WAIT);
+
+		ready = now() - start;
+
+		if (count == 0) {
+			fprintf(stderr, "No token found after %d ms\n",
+				SLOT_WAIT);
+			rv = CKR_TOKEN_NOT_PRESENT;
+			goto out;
+		}
+
+		samples[init_iterations + i] = ready;
+
+		/*
+		 * Leave the module initialized after the last pass
+		 */
+
+		if (i < init_iterations - 1) {
+			initialized = false;
+			rv = p11->C_Finalize(NULL);
+			CHECKRV(C_Finalize);
+		}
+	}
+
+	memset(&res, 0, sizeof(res));
+	res.name = "C_Initialize";
+	res.threads = 1;
+	report(&res, samples, init_iterations);
+
+	memset(&res, 0, sizeof(res));
+	res.name = "first_slot_ready";
+	res.threads = 1;
+	report(&res, samples + init_iterations, init_iterations);
+
+	free(samples);
+
+	/*
+	 * If we weren't given a slot, use the first one with a token
+	 */
+
+	if (! slot_given) {
+		rv = p11->C_GetSlotList(CK_TRUE, NULL, &count);
+		CHECKRV(C_GetSlotList);
+		slotlist = malloc(sizeof(*slotlist) * count);
+		rv = p11->C_GetSlotList(CK_TRUE, slotlist, &count);
+		CHECKRV(C_GetSlotList);
+		ctx.slot = slotlist[0];
+	}
+
+	if (! csv_output)
+		printf("Using slot %lu, %u thread%s, %u iterations\n\n",
+		       ctx.slot, threads, threads == 1 ? "" : "s", iterations);
+
+	rv = p11->C_OpenSession(ctx.slot, CKF_SERIAL_SESSION, NULL, NULL,
+				&session);
+
+	CHECKRV(C_OpenSession);
+
+	if (pin) {
+		rv = p11->C_Login(session, CKU_USER, (CK_UTF8CHAR_PTR) pin,
+				  strlen(pin));
+		CHECKRV(C_Login);
+	}
+
+	/*
+	 * Find the objects we use for the rest of the benchmarks
+	 */
+
+	class = CKO_CERTIFICATE;
+	tmpl[0].type = CKA_CLASS;
+	tmpl[0].pValue = &class;
+	tmpl[0].ulValueLen = sizeof(class);
+
+	ctx.cert = find_one(&ctx, session, tmpl, 1);
+
+	if (ctx.cert != CK_INVALID_HANDLE) {
+		get_attr(p11, session, ctx.cert, CKA_ISSUER, &issuer);
+		get_attr(p11, session, ctx.cert, CKA_SERIAL_NUMBER, &serial);
+		get_attr(p11, session, ctx.cert, CKA_SUBJECT, &subject);
+	}
+
+	class = CKO_PRIVATE_KEY;
+	ctx.privkey = find_one(&ctx, session, tmpl, 1);
+
+	if (ctx.privkey != CK_INVALID_HANDLE &&
+	    get_attr(p11, session, ctx.privkey, CKA_ID, &idattr) == CKR_OK) {
+		class = CKO_PUBLIC_KEY;
+		tmpl[1] = idattr;
+		ctx.pubkey = find_one(&ctx, session, tmpl, 2);
+	}
+
+	run_bench(&ctx, "C_GetSlotList+C_GetTokenInfo", op_slotlist,
+		  threads, iterations);
+
+	/*
+	 * The searches NSS does all of the time: every certificate, every
+	 * private key, the key for a particular certificate (via CKA_ID),
+	 * a certificate by issuer and serial number (and the trust object
+	 * for it), and certificates by subject.
+	 */
+
+	class = CKO_CERTIFICATE;
+	ctx.template = tmpl;
+	ctx.tcount = 1;
+	run_bench(&ctx, "C_FindObjects(certificates)", op_find, threads,
+		  iterations);
+
+	class = CKO_PRIVATE_KEY;
+	run_bench(&ctx, "C_FindObjects(private keys)", op_find, threads,
+		  iterations);
+
+	if (idattr.pValue) {
+		tmpl[1] = idattr;
+		ctx.tcount = 2;
+		run_bench(&ctx, "C_FindObjects(key by id)", op_find, threads,
+			  iterations);
+	}
+
+	if (issuer.pValue && serial.pValue) {
+		class = CKO_CERTIFICATE;
+		tmpl[1] = issuer;
+		tmpl[2] = serial;
+		ctx.tcount = 3;
+		run_bench(&ctx, "C_FindObjects(cert by issuer/serial)",
+			  op_find, threads, iterations);
+
+		class = CKO_NSS_TRUST;
+		run_bench(&ctx, "C_FindObjects(trust by issuer/serial)",
+			  op_find, threads, iterations);
+	}
+
+	if (subject.pValue) {
+		class = CKO_CERTIFICATE;
+		tmpl[1] = subject;
+		ctx.tcount = 2;
+		run_bench(&ctx, "C_FindObjects(cert by subject)", op_find,
+			  threads, iterations);
+	}
+
+	if (ctx.cert != CK_INVALID_HANDLE)
+		run_bench(&ctx, "C_GetAttributeValue", op_getattr, threads,
+			  iterations);
+
+	/*
+	 * Signing needs us to be logged in (if the token needs a PIN,
+	 * anyway), and verification needs a signature.
+	 */
+
+	if (ctx.privkey != CK_INVALID_HANDLE) {
+		rv = p11->C_SignInit(session, &bench_mech, ctx.privkey);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(session, bench_data,
+					 sizeof(bench_data), NULL,
+					 &ctx.siglen);
+		if (rv == CKR_OK) {
+			ctx.sig = malloc(ctx.siglen);
+			rv = p11->C_Sign(session, bench_data,
+					 sizeof(bench_data), ctx.sig,
+					 &ctx.siglen);
+		}
+
+		if (rv == CKR_OK) {
+			run_bench(&ctx, "C_Sign", op_sign, threads,
+				  iterations);
+			run_bench(&ctx, "C_SignUpdate/C_SignFinal",
+				  op_sign_multi, threads, iterations);
+		} else {
+			fprintf(stderr, "Skipping signing benchmarks: %s%s\n",
+				getCKRName(rv), pin ? "" :
+				" (maybe you need --pin?)");
+			free(ctx.sig);
+			ctx.sig = NULL;
+		}
+	}
+
+	if (ctx.sig && ctx.pubkey != CK_INVALID_HANDLE) {
+		run_bench(&ctx, "C_Verify", op_verify, threads, iterations);
+		run_bench(&ctx, "C_VerifyUpdate/C_VerifyFinal",
+			  op_verify_multi, threads, iterations);
+	}
+
+	rv = CKR_OK;
+
+out:
+	if (session != CK_INVALID_HANDLE)
+		p11->C_CloseSession(session);
+
+	if (initialized)
+		p11->C_Finalize(NULL);
+
+	free(slotlist);
+	free(ctx.sig);
+	free(idattr.pValue);
+	free(issuer.pValue);
+	free(serial.pValue);
+	free(subject.pValue);
+
+	dlclose(handle);
+
+	exit(rv == CKR_OK ? 0 : 1);
+}
+
+static void
+usage(const char *argv0)
+{
+	printf("Usage: %s [option] [...option]\n\n", argv0);
+	printf("Options are:\n");
+	printf("\t--library LIBRARY\tPKCS#11 module to load\n");
+	printf("\t\t\t\tDefault is %s\n", default_library);
+	printf("\t--slot SLOT\t\tSlot to use (default is first slot with "
+	       "a token)\n");
+	printf("\t--threads N\t\tNumber of threads (default 1)\n");
+	printf("\t--iterations N\t\tIterations per thread (default 1000)\n");
+	printf("\t--init-iterations N\tC_Initialize iterations (default 5)\n");
+	printf("\t--pin PIN\t\tLog into the token for signing benchmarks\n");
+	printf("\t--csv\t\t\tPrint results as CSV\n");
+
+	exit(1);
+}
+
+/*
+ * Run a single benchmark in "threads" threads and print out the results
+ */
+
+static void
+run_bench(struct bench_ctx *ctx, const char *name, CK_RV (*op)(struct worker *),
+	  unsigned int threads, unsigned int iterations)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	pthread_t *tids = calloc(threads, sizeof(*tids));
+	uint64_t *samples, start;
+	unsigned int i, count = 0;
+	struct result res;
+	CK_RV rv = CKR_OK;
+
+	memset(&res, 0, sizeof(res));
+	res.name = name;
+	res.threads = threads;
+
+	for (i = 0; i < threads; i++) {
+		workers[i].ctx = ctx;
+		workers[i].op = op;
+		workers[i].iterations = iterations;
+		workers[i].samples = malloc(sizeof(uint64_t) * iterations);
+		workers[i].rv = ctx->p11->C_OpenSession(ctx->slot,
+							CKF_SERIAL_SESSION,
+							NULL, NULL,
+							&workers[i].session);
+		if (workers[i].rv != CKR_OK) {
+			fprintf(stderr, "%s: C_OpenSession failed: %s\n",
+				name, getCKRName(workers[i].rv));
+			goto out;
+		}
+	}
+
+	start = now();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, worker_run, &workers[i]);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	res.wall = now() - start;
+
+	samples = malloc(sizeof(*samples) * threads * iterations);
+
+	for (i = 0; i < threads; i++) {
+		memcpy(samples + count, workers[i].samples,
+		       sizeof(*samples) * workers[i].count);
+		count += workers[i].count;
+		res.failures += iterations - workers[i].count;
+		if (rv == CKR_OK)
+			rv = workers[i].rv;
+	}
+
+	if (rv != CKR_OK)
+		fprintf(stderr, "%s: operation failed: %s\n", name,
+			getCKRName(rv));
+
+	report(&res, samples, count);
+
+	free(samples);
+
+out:
+	for (i = 0; i < threads; i++) {
+		if (workers[i].session != CK_INVALID_HANDLE)
+			ctx->p11->C_CloseSession(workers[i].session);
+		free(workers[i].samples);
+	}
+
+	free(workers);
+	free(tids);
+}
+
+/*
+ * The body of a benchmark thread.  If an operation fails we stop, since
+ * the rest are likely to fail too.
+ */
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	unsigned int i;
+	uint64_t start;
+	CK_RV rv;
+
+	for (i = 0; i < w->iterations; i++) {
+		start = now();
+		rv = w->op(w);
+		if (rv != CKR_OK) {
+			w->rv = rv;
+			break;
+		}
+		w->samples[w->count++] = now() - start;
+	}
+
+	return NULL;
+}
+
+/*
+ * Compute the statistics for a benchmark and print them out.  This
+ * sorts the samples.
+ */
+
+static void
+report(struct result *res, uint64_t *samples, unsigned int count)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	res->ops = count;
+
+	if (count > 0) {
+		qsort(samples, count, sizeof(*samples), sample_cmp);
+
+		for (i = 0; i < count; i++)
+			total += samples[i];
+
+		res->mean = total / count;
+		res->p50 = samples[(count - 1) * 50 / 100];
+		res->p90 = samples[(count - 1) * 90 / 100];
+		res->p99 = samples[(count - 1) * 99 / 100];
+		res->max = samples[count - 1];
+	}
+
+	/*
+	 * If we don't have a wall clock time (single-threaded timings
+	 * like C_Initialize) then the throughput is just based on the
+	 * operation time.
+	 */
+
+	if (res->wall == 0)
+		res->wall = total;
+
+	print_result(res);
+}
+
+static void
+print_result(struct result *res)
+{
+	double ops_sec = res->wall ? (double) res->ops * 1e9 / res->wall : 0;
+
+	if (csv_output) {
+		printf("\"%s\",%u,%u,%u,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+		       res->name, res->threads, res->ops, res->failures,
+		       res->wall / 1e3, ops_sec, res->mean / 1e3,
+		       res->p50 / 1e3, res->p90 / 1e3, res->p99 / 1e3,
+		       res->max / 1e3);
+		return;
+	}
+
+	printf("%s:\n", res->name);
+	printf("\t%u ops (%u failed) in %.3f ms, %.1f ops/sec\n", res->ops,
+	       res->failures, res->wall / 1e6, ops_sec);
+	printf("\tmean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+	       "max %.1f us\n", res->mean / 1e3, res->p50 / 1e3,
+	       res->p90 / 1e3, res->p99 / 1e3, res->max / 1e3);
+}
+
+/*
+ * Return a monotonic timestamp, in nanoseconds
+ */
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Return the first object matching a template (or CK_INVALID_HANDLE)
+ */
+
+static CK_OBJECT_HANDLE
+find_one(struct bench_ctx *ctx, CK_SESSION_HANDLE session,
+	 CK_ATTRIBUTE_PTR template, CK_ULONG count)
+{
+	CK_OBJECT_HANDLE obj = CK_INVALID_HANDLE;
+	CK_ULONG n = 0;
+
+	if (ctx->p11->C_FindObjectsInit(session, template, count) != CKR_OK)
+		return CK_INVALID_HANDLE;
+
+	if (ctx->p11->C_FindObjects(session, &obj, 1, &n) != CKR_OK || n == 0)
+		obj = CK_INVALID_HANDLE;
+
+	ctx->p11->C_FindObjectsFinal(session);
+
+	return obj;
+}
+
+/*
+ * Retrieve a single attribute into an allocated buffer
+ */
+
+static CK_RV
+get_attr(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+	 CK_OBJECT_HANDLE obj, CK_ATTRIBUTE_TYPE type, CK_ATTRIBUTE_PTR attr)
+{
+	CK_RV rv;
+
+	attr->type = type;
+	attr->pValue = NULL;
+	attr->ulValueLen = 0;
+
+	rv = p11->C_GetAttributeValue(session, obj, attr, 1);
+
+	if (rv != CKR_OK)
+		return rv;
+
+	attr->pValue = malloc(attr->ulValueLen ? attr->ulValueLen : 1);
+
+	rv = p11->C_GetAttributeValue(session, obj, attr, 1);
+
+	if (rv != CKR_OK) {
+		free(attr->pValue);
+		attr->pValue = NULL;
+	}
+
+	return rv;
+}
+
+/*
+ * Our benchmark operations
+ */
+
+static CK_RV
+op_slotlist(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	CK_SLOT_ID slots[16];
+	CK_ULONG count = sizeof(slots)/sizeof(slots[0]);
+	CK_TOKEN_INFO info;
+	CK_RV rv;
+
+	if ((rv = p11->C_GetSlotList(CK_TRUE, slots, &count)) != CKR_OK)
+		return rv;
+
+	return p11->C_GetTokenInfo(w->ctx->slot, &info);
+}
+
+static CK_RV
+op_find(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	CK_OBJECT_HANDLE objs[16];
+	CK_ULONG count;
+	CK_RV rv;
+
+	rv = p11->C_FindObjectsInit(w->session, w->ctx->template,
+				    w->ctx->tcount);
+
+	if (rv != CKR_OK)
+		return rv;
+
+	do {
+		rv = p11->C_FindObjects(w->session, objs,
+					sizeof(objs)/sizeof(objs[0]), &count);
+	} while (rv == CKR_OK && count > 0);
+
+	if (rv != CKR_OK) {
+		p11->C_FindObjectsFinal(w->session);
+		return rv;
+	}
+
+	return p11->C_FindObjectsFinal(w->session);
+}
+
+/*
+ * Fetch the attributes NSS wants when it loads a certificate.  Size the
+ * value first, like most applications do.
+ */
+
+static CK_RV
+op_getattr(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	unsigned char buf[8192];
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_LABEL, NULL, 0 },
+		{ CKA_ID, NULL, 0 },
+		{ CKA_VALUE, NULL, 0 },
+	};
+	CK_ULONG i, off = 0, count = sizeof(attrs)/sizeof(attrs[0]);
+	CK_RV rv;
+
+	rv = p11->C_GetAttributeValue(w->session, w->ctx->cert, attrs, count);
+
+	if (rv != CKR_OK)
+		return rv;
+
+	for (i = 0; i < count; i++) {
+		if (off + attrs[i].ulValueLen > sizeof(buf))
+			return CKR_BUFFER_TOO_SMALL;
+		attrs[i].pValue = buf + off;
+		off += attrs[i].ulValueLen;
+	}
+
+	return p11->C_GetAttributeValue(w->session, w->ctx->cert, attrs, count);
+}
+
+static CK_RV
+op_sign(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	unsigned char sig[1024];
+	CK_ULONG siglen = sizeof(sig);
+	CK_RV rv;
+
+	if ((rv = p11->C_SignInit(w->session, &bench_mech,
+				  w->ctx->privkey)) != CKR_OK)
+		return rv;
+
+	return p11->C_Sign(w->session, bench_data, sizeof(bench_data), sig,
+			   &siglen);
+}
+
+static CK_RV
+op_sign_multi(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	unsigned char sig[1024];
+	CK_ULONG siglen = sizeof(sig);
+	unsigned int i;
+	CK_RV rv;
+
+	if ((rv = p11->C_SignInit(w->session, &bench_mech,
+				  w->ctx->privkey)) != CKR_OK)
+		return rv;
+
+	for (i = 0; i < BENCH_PARTS; i++) {
+		rv = p11->C_SignUpdate(w->session, bench_data + i *
+				       (sizeof(bench_data) / BENCH_PARTS),
+				       sizeof(bench_data) / BENCH_PARTS);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	return p11->C_SignFinal(w->session, sig, &siglen);
+}
+
+static CK_RV
+op_verify(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	CK_RV rv;
+
+	if ((rv = p11->C_VerifyInit(w->session, &bench_mech,
+				    w->ctx->pubkey)) != CKR_OK)
+		return rv;
+
+	return p11->C_Verify(w->session, bench_data, sizeof(bench_data),
+			     w->ctx->sig, w->ctx->siglen);
+}
+
+static CK_RV
+op_verify_multi(struct worker *w)
+{
+	CK_FUNCTION_LIST_PTR p11 = w->ctx->p11;
+	unsigned int i;
+	CK_RV rv;
+
+	if ((rv = p11->C_VerifyInit(w->session, &bench_mech,
+				    w->ctx->pubkey)) != CKR_OK)
+		return rv;
+
+	for (i = 0; i < BENCH_PARTS; i++) {
+		rv = p11->C_VerifyUpdate(w->session, bench_data + i *
+					 (sizeof(bench_data) / BENCH_PARTS),
+					 sizeof(bench_data) / BENCH_PARTS);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	return p11->C_VerifyFinal(w->session, w->ctx->sig, w->ctx->siglen);
+}
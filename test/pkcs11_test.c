@@ -23,6 +23,7 @@
  */
 
 #include "pkcs11_test.h"
+#include "keychain_pkcs11_ext.h"
 #include "config.h"
 
 #include <stdarg.h>
@@ -32,6 +33,11 @@
 #include <signal.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <mach-o/loader.h>
 
 /*
  * Dump one or more attributes of an object
@@ -229,6 +235,23 @@ struct op_list {
 static void getdata(const char *, unsigned char **, size_t *);
 static CK_ULONG getnum(const char *, const char *);
 
+/*
+ * Run a multithreaded signing benchmark
+ */
+
+static void sign_benchmark(CK_FUNCTION_LIST_PTR, CK_SLOT_ID, CK_MECHANISM_PTR,
+			   struct op_list *, unsigned int, unsigned int,
+			   unsigned int);
+static bool alloc_check(CK_FUNCTION_LIST_PTR, CK_SESSION_HANDLE,
+			CK_MECHANISM_PTR, struct op_list *, unsigned int);
+
+/*
+ * Check that searches still find every certificate after the slot
+ * picks up a Keychain change
+ */
+
+static bool refresh_check(CK_FUNCTION_LIST_PTR, CK_SLOT_ID, unsigned int);
+
 static void
 usage(const char *progname)
 {
@@ -237,6 +260,10 @@ usage(const char *progname)
     fprintf(stderr, "Valid flags are:\n");
     fprintf(stderr, "\t-a attr\t\tNumeric attribute to dump (may be repeated "
     		    "with -F)\n");
+    fprintf(stderr, "\t-A\t\tCount heap allocations while digesting (and "
+		    "signing,\n");
+    fprintf(stderr, "\t\t\twith -S or -N) <iterations> times; fail if "
+		    "the module allocates\n");
     fprintf(stderr, "\t-c class\tNumeric class of objects to select; \n");
     fprintf(stderr, "\t\t\tdefault is to apply to all objects\n");
     fprintf(stderr, "\t-D filename\tData to decrypt, requires -o, ");
@@ -253,6 +280,10 @@ usage(const char *progname)
     fprintf(stderr, "\t-N num\t\tSign <num> bytes of NULs (may be "
     		    "repeated)\n");
     fprintf(stderr, "\t-n progname\tSet program name to <progname>\n");
+    fprintf(stderr, "\t-R seconds\tWait up to <seconds> for the "
+		    "certificates in the slot\n");
+    fprintf(stderr, "\t\t\tto change, and check that searches find "
+		    "all of them\n");
     fprintf(stderr, "\t-o object\tObject number to select for inspection or "
     		    "use for other\n");
     fprintf(stderr, "\t\t\toperations; affects next argument, may be repeated\n");
@@ -262,6 +293,16 @@ usage(const char *progname)
 #endif
     fprintf(stderr, "\t-S signdata\tData to sign; requires -o, "
 		    "may be repeated\n");
+    fprintf(stderr, "\t-t threads\tRun the first signing operation "
+		    "(-S or -N) in <threads>\n");
+    fprintf(stderr, "\t\t\tthreads at once, each with their own session, "
+		    "and report\n");
+    fprintf(stderr, "\t\t\tthe number of operations per second\n");
+    fprintf(stderr, "\t-i iterations\tNumber of signatures per thread for "
+		    "-t or -A (default 100)\n");
+    fprintf(stderr, "\t-b batchsize\tWith -t, sign <batchsize> copies at "
+		    "a time using\n");
+    fprintf(stderr, "\t\t\tthe C_KeychainSignBatch extension\n");
     fprintf(stderr, "\t-T\t\tAllow the use of slots WITHOUT tokens\n");
     fprintf(stderr, "\t-v filename\tFilename of data to verify signature;\n");
     fprintf(stderr, "\t\t\tuse -V for signature data and -o to select key\n");
@@ -318,12 +359,17 @@ int main(int argc, char *argv[]) {
     bool forcenologin = false;
     bool requiretoken = true;
     bool waitslot = false;
+    bool alloccheck = false;
+    unsigned int refresh_wait = 0;
+    unsigned int bench_threads = 0;
+    unsigned int bench_iterations = 100;
+    unsigned int bench_batch = 0;
 
     struct attr_list *attr_head = NULL, *attr_tail = NULL, *attr;
 
     int i;
 
-    while ((i = getopt(argc, argv, "a:c:D:E:f:F:lLN:n:o:S:s:Tv:V:wW")) != -1) {
+    while ((i = getopt(argc, argv, "Aa:b:c:D:E:f:F:i:lLN:n:o:R:S:s:t:Tv:V:wW")) != -1) {
 	switch (i) {
 	case 'a':
 	    if (!attr_filename && !attr_filetemplate) {
@@ -458,6 +504,18 @@ int main(int argc, char *argv[]) {
 		sign_tail = sign;
 	    }
 
+	    break;
+	case 'A':
+	    alloccheck = true;
+	    break;
+	case 'b':
+	    bench_batch = getnum(optarg, "Invalid batch size");
+	    break;
+	case 'i':
+	    bench_iterations = getnum(optarg, "Invalid iteration count");
+	    break;
+	case 't':
+	    bench_threads = getnum(optarg, "Invalid thread count");
 	    break;
 	case 'T':
 	    requiretoken = false;
@@ -466,6 +524,9 @@ int main(int argc, char *argv[]) {
 	    sObject = getnum(optarg, "Invalid object number");
 	    cls = -1;
 	    break;
+	case 'R':
+	    refresh_wait = getnum(optarg, "Invalid number of seconds");
+	    break;
 	case 'v':
 	    verify_data = optarg;
 	    break;
@@ -502,7 +563,19 @@ int main(int argc, char *argv[]) {
         return(1);
     }
 
-    rv = p11p->C_Initialize(NULL);
+    /*
+     * If we're running multiple threads, we need the library to do locking
+     */
+
+    if (bench_threads > 0) {
+	CK_C_INITIALIZE_ARGS initargs;
+
+	memset(&initargs, 0, sizeof(initargs));
+	initargs.flags = CKF_OS_LOCKING_OK;
+	rv = p11p->C_Initialize(&initargs);
+    } else {
+	rv = p11p->C_Initialize(NULL);
+    }
     if (rv != CKR_OK) {
         fprintf(stderr, "Error initalizing library (rv = %X)\n", (unsigned int) rv);
         return(2);
@@ -589,6 +662,8 @@ int main(int argc, char *argv[]) {
 	if (waitslot && p11p->C_GetSlotInfo) {
 	    struct timespec ts, start, end;
 	    time_t seconds, milli;
+	    CK_SLOT_ID evslot;
+	    bool usepoll = false;
 
 	    ts.tv_sec = 0;
 	    ts.tv_nsec = 1E8;
@@ -612,7 +687,24 @@ int main(int argc, char *argv[]) {
 		if (sInfo.flags & CKF_TOKEN_PRESENT)
 		    break;
 
-		nanosleep(&ts, NULL);
+		/*
+		 * Block until the library tells us something changed;
+		 * if it can't do that, fall back to polling.
+		 */
+
+		if (! usepoll) {
+		    rv = p11p->C_WaitForSlotEvent(0, &evslot, NULL);
+		    if (rv == CKR_FUNCTION_NOT_SUPPORTED)
+			usepoll = true;
+		    else if (rv != CKR_OK) {
+			fprintf(stderr, "C_WaitForSlotEvent failed "
+				"(rv = %s)\n", getCKRName(rv));
+			exit(1);
+		    }
+		}
+
+		if (usepoll)
+		    nanosleep(&ts, NULL);
 	    }
 
 	    clock_gettime(CLOCK_REALTIME, &end);
@@ -803,8 +895,19 @@ int main(int argc, char *argv[]) {
 
 	    free(out);
 	}
+
+	if (bench_threads > 0)
+	    sign_benchmark(p11p, slot, &mech, sign_head, bench_threads,
+			   bench_iterations, bench_batch);
     }
 
+    if (alloccheck && ! alloc_check(p11p, hSession, &mech, sign_head,
+				    bench_iterations))
+	exit(1);
+
+    if (refresh_wait > 0 && ! refresh_check(p11p, slot, refresh_wait))
+	exit(1);
+
     if (enc_head) {
 	for (enc = enc_head; enc != NULL; enc = enc->next) {
 	    CK_BYTE_PTR out = NULL;
@@ -903,7 +1006,8 @@ int main(int argc, char *argv[]) {
 	}
     }
 
-    if (!attr_head && !sign_head && !enc_head && !dec_head) {
+    if (!attr_head && !sign_head && !enc_head && !dec_head && !alloccheck &&
+	!refresh_wait) {
 	if (sObject != -1) {
 	    dump_object_info(p11p, hSession, sObject, -1);
 	} else {
@@ -1387,9 +1491,10 @@ CK_RV login(CK_FUNCTION_LIST_PTR p11p, CK_TOKEN_INFO_PTR tInfo, CK_SESSION_HANDL
 }
 
 
+static LpHandleType p11lib_handle = NULL;
+
 CK_RV load_library(char *library, CK_FUNCTION_LIST_PTR *p11p) {
     CK_RV rv;
-    LpHandleType p11lib_handle = NULL;
     CK_RV (*getflist)(CK_FUNCTION_LIST_PTR_PTR);
 
     if (!library) {
@@ -2015,3 +2120,587 @@ getnum(const char *number, const char *errstring)
 
     return val;
 }
+
+/*
+ * Our signing benchmark.  Every thread opens a separate session to the
+ * same slot (the login state is per-token, so we are already logged in)
+ * and performs the same signing operation over and over again.  We report
+ * the total number of signatures per second across all threads.
+ *
+ * If a batch size is given, each thread signs that many copies of the
+ * data per C_SignInit() using C_KeychainSignBatch().
+ */
+
+struct bench_arg {
+    CK_FUNCTION_LIST_PTR p11p;
+    CK_SLOT_ID		slot;
+    CK_MECHANISM_PTR	mech;
+    struct op_list	*op;
+    unsigned int	iterations;
+    unsigned int	batch;
+    CK_C_KeychainSignBatch batchfunc;
+    unsigned int	success;
+    unsigned int	failed;
+};
+
+static void
+bench_batch(struct bench_arg *ba, CK_SESSION_HANDLE session)
+{
+    CK_BYTE_PTR *in = calloc(ba->batch, sizeof(*in));
+    CK_ULONG_PTR inlen = calloc(ba->batch, sizeof(*inlen));
+    CK_ULONG_PTR siglen = calloc(ba->batch, sizeof(*siglen));
+    CK_BYTE_PTR sigbuf = NULL;
+    CK_ULONG stride = 0;
+    unsigned int i, n;
+    CK_RV rv;
+
+    for (i = 0; i < ba->batch; i++) {
+	in[i] = ba->op->data;
+	inlen[i] = ba->op->size;
+    }
+
+    for (i = 0; i < ba->iterations; i += n) {
+	n = ba->iterations - i < ba->batch ? ba->iterations - i : ba->batch;
+
+	rv = ba->p11p->C_SignInit(session, ba->mech, ba->op->object);
+
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "C_SignInit failed (rv = %s)\n", getCKRName(rv));
+	    ba->failed += n;
+	    continue;
+	}
+
+	if (! sigbuf) {
+	    rv = ba->batchfunc(session, n, in, inlen, NULL, 0, siglen);
+	    if (rv != CKR_OK) {
+		fprintf(stderr, "C_KeychainSignBatch failed (rv = %s)\n",
+			getCKRName(rv));
+		ba->failed += n;
+		continue;
+	    }
+	    stride = siglen[0];
+	    sigbuf = malloc(stride * ba->batch);
+	}
+
+	rv = ba->batchfunc(session, n, in, inlen, sigbuf, stride, siglen);
+
+	if (rv != CKR_OK) {
+	    unsigned int j;
+
+	    fprintf(stderr, "C_KeychainSignBatch failed (rv = %s)\n",
+		    getCKRName(rv));
+	    for (j = 0; j < n; j++)
+		if (siglen[j] == CK_UNAVAILABLE_INFORMATION)
+		    ba->failed++;
+		else
+		    ba->success++;
+	    continue;
+	}
+
+	ba->success += n;
+    }
+
+    free(in);
+    free(inlen);
+    free(siglen);
+    free(sigbuf);
+}
+
+static void *
+bench_thread(void *arg)
+{
+    struct bench_arg *ba = arg;
+    CK_SESSION_HANDLE session;
+    CK_BYTE_PTR out = NULL;
+    CK_ULONG outsize = 0, outlen;
+    CK_RV rv;
+    unsigned int i;
+
+    rv = ba->p11p->C_OpenSession(ba->slot, CKF_SERIAL_SESSION, NULL, NULL,
+				 &session);
+
+    if (rv != CKR_OK) {
+	fprintf(stderr, "C_OpenSession failed (rv = %s)\n", getCKRName(rv));
+	ba->failed = ba->iterations;
+	return NULL;
+    }
+
+    if (ba->batch > 0) {
+	bench_batch(ba, session);
+	ba->p11p->C_CloseSession(session);
+	return NULL;
+    }
+
+    for (i = 0; i < ba->iterations; i++) {
+	rv = ba->p11p->C_SignInit(session, ba->mech, ba->op->object);
+
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "C_SignInit failed (rv = %s)\n", getCKRName(rv));
+	    ba->failed++;
+	    continue;
+	}
+
+	if (! out) {
+	    rv = ba->p11p->C_Sign(session, ba->op->data, ba->op->size, NULL,
+				  &outsize);
+	    if (rv != CKR_OK) {
+		fprintf(stderr, "C_Sign failed (rv = %s)\n", getCKRName(rv));
+		ba->failed++;
+		continue;
+	    }
+	    out = malloc(outsize);
+	}
+
+	outlen = outsize;
+
+	rv = ba->p11p->C_Sign(session, ba->op->data, ba->op->size, out,
+			      &outlen);
+
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "C_Sign failed (rv = %s)\n", getCKRName(rv));
+	    ba->failed++;
+	    continue;
+	}
+
+	ba->success++;
+    }
+
+    free(out);
+    ba->p11p->C_CloseSession(session);
+
+    return NULL;
+}
+
+static void
+sign_benchmark(CK_FUNCTION_LIST_PTR p11p, CK_SLOT_ID slot,
+	       CK_MECHANISM_PTR mech, struct op_list *op, unsigned int threads,
+	       unsigned int iterations, unsigned int batch)
+{
+    struct bench_arg *args = calloc(threads, sizeof(*args));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    struct timespec start, end;
+    unsigned int i, success = 0, failed = 0;
+    double elapsed;
+    CK_C_KeychainSignBatch batchfunc = NULL;
+
+    if (batch > 0) {
+	batchfunc = (CK_C_KeychainSignBatch) GetFuncFromMod(p11lib_handle,
+						"C_KeychainSignBatch");
+	if (! batchfunc) {
+	    fprintf(stderr, "C_KeychainSignBatch not found in library\n");
+	    return;
+	}
+	printf("Using batches of %u signature%s\n", batch,
+	       batch == 1 ? "" : "s");
+    }
+
+    printf("Running signing benchmark: %u thread%s, %u signature%s "
+	   "per thread\n", threads, threads == 1 ? "" : "s", iterations,
+	   iterations == 1 ? "" : "s");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < threads; i++) {
+	args[i].p11p = p11p;
+	args[i].slot = slot;
+	args[i].mech = mech;
+	args[i].op = op;
+	args[i].iterations = iterations;
+	args[i].batch = batch;
+	args[i].batchfunc = batchfunc;
+	if (pthread_create(&tids[i], NULL, bench_thread, &args[i]) != 0) {
+	    fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+    }
+
+    for (i = 0; i < threads; i++) {
+	pthread_join(tids[i], NULL);
+	success += args[i].success;
+	failed += args[i].failed;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1E9;
+
+    printf("%u signature%s (%u failed) in %.3f seconds: %.1f ops/sec\n",
+	   success, success == 1 ? "" : "s", failed, elapsed,
+	   elapsed > 0 ? success / elapsed : 0.0);
+
+    free(args);
+    free(tids);
+}
+
+/*
+ * Our allocation check.  We count every heap allocation made on this
+ * thread while running the same operation over and over again; after
+ * the first time through, the module itself shouldn't need to allocate
+ * anything.  We use malloc_logger for this, which is the hook that the
+ * malloc stack logging tools use; it isn't in any public header, so we
+ * have to declare it ourselves.
+ *
+ * Digests are done entirely inside of the module, so any allocation
+ * there is a failure.  Signatures are done by the Security framework,
+ * which allocates the signature it returns (at least), so for those we
+ * look at who asked for each allocation: we walk up the stack past
+ * malloc itself and the libraries that allocate on behalf of their
+ * callers (libc, CoreFoundation, libdispatch), and if the next frame is
+ * in the module, the allocation is the module's.  Those are a failure;
+ * everything else gets reported.
+ */
+
+typedef void (malloc_logger_t)(uint32_t, uintptr_t, uintptr_t, uintptr_t,
+			       uintptr_t, uint32_t);
+extern malloc_logger_t *malloc_logger;
+
+#define MALLOC_LOG_TYPE_ALLOCATE 2
+#define ALLOC_FRAMES	64
+
+struct image_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+static pthread_t alloc_thread;
+static unsigned long alloc_count;
+static unsigned long alloc_module_count;
+static struct image_range alloc_module;
+static struct image_range alloc_skip[4];
+static __thread bool alloc_busy;
+
+/*
+ * Find the text segment of the image containing an address
+ */
+
+static void
+image_range(const void *addr, struct image_range *r)
+{
+    const struct mach_header_64 *mh;
+    const struct load_command *lc;
+    Dl_info info;
+    uint32_t i;
+
+    r->start = r->end = 0;
+
+    if (! addr || ! dladdr(addr, &info) || ! info.dli_fbase)
+	return;
+
+    mh = (const struct mach_header_64 *) info.dli_fbase;
+    lc = (const struct load_command *) (mh + 1);
+
+    for (i = 0; i < mh->ncmds; i++) {
+	if (lc->cmd == LC_SEGMENT_64) {
+	    const struct segment_command_64 *seg =
+				(const struct segment_command_64 *) lc;
+
+	    if (strcmp(seg->segname, SEG_TEXT) == 0) {
+		r->start = (uintptr_t) mh;
+		r->end = r->start + seg->vmsize;
+		return;
+	    }
+	}
+	lc = (const struct load_command *) ((const char *) lc + lc->cmdsize);
+    }
+}
+
+static bool
+in_image(const struct image_range *r, const void *addr)
+{
+    return (uintptr_t) addr >= r->start && (uintptr_t) addr < r->end;
+}
+
+static void
+alloc_logger(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+	     uintptr_t result, uint32_t skip)
+{
+    void *frames[ALLOC_FRAMES];
+    int i, j, n;
+
+    if (! (type & MALLOC_LOG_TYPE_ALLOCATE) || alloc_busy ||
+	! pthread_equal(pthread_self(), alloc_thread))
+	return;
+
+    alloc_busy = true;
+    alloc_count++;
+
+    n = backtrace(frames, ALLOC_FRAMES);
+
+    /*
+     * Frame 0 is us
+     */
+
+    for (i = 1; i < n; i++) {
+	for (j = 0; j < sizeof(alloc_skip) / sizeof(alloc_skip[0]); j++)
+	    if (in_image(&alloc_skip[j], frames[i]))
+		break;
+	if (j == sizeof(alloc_skip) / sizeof(alloc_skip[0]))
+	    break;
+    }
+
+    if (i < n && in_image(&alloc_module, frames[i]))
+	alloc_module_count++;
+
+    alloc_busy = false;
+}
+
+static bool
+alloc_digest(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE session,
+	     CK_MECHANISM_PTR mech, unsigned char *data, CK_ULONG len)
+{
+    unsigned char digest[64];
+    CK_ULONG digestlen = sizeof(digest);
+    CK_RV rv;
+
+    if ((rv = p11p->C_DigestInit(session, mech)) != CKR_OK ||
+	(rv = p11p->C_DigestUpdate(session, data, len)) != CKR_OK ||
+	(rv = p11p->C_DigestUpdate(session, data, len)) != CKR_OK ||
+	(rv = p11p->C_DigestFinal(session, digest, &digestlen)) != CKR_OK) {
+	fprintf(stderr, "Digest failed (rv = %s)\n", getCKRName(rv));
+	return false;
+    }
+
+    return true;
+}
+
+static bool
+alloc_sign(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE session,
+	   CK_MECHANISM_PTR mech, struct op_list *op, unsigned char *sig,
+	   CK_ULONG siglen)
+{
+    CK_RV rv;
+
+    if ((rv = p11p->C_SignInit(session, mech, op->object)) != CKR_OK ||
+	(rv = p11p->C_Sign(session, op->data, op->size, sig,
+			   &siglen)) != CKR_OK) {
+	fprintf(stderr, "Sign failed (rv = %s)\n", getCKRName(rv));
+	return false;
+    }
+
+    return true;
+}
+
+static bool
+alloc_check(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE session,
+	    CK_MECHANISM_PTR mech, struct op_list *op, unsigned int iterations)
+{
+    CK_MECHANISM dmech = { CKM_SHA256, NULL, 0 };
+    unsigned char data[1024];
+    unsigned char sig[1024];
+    unsigned int i;
+    bool ok = true;
+
+    memset(data, 'A', sizeof(data));
+    alloc_thread = pthread_self();
+
+    /*
+     * We don't link against CoreFoundation ourselves, but the module
+     * has brought it in by now.
+     */
+
+    image_range((const void *) p11p->C_Sign, &alloc_module);
+    image_range(dlsym(RTLD_DEFAULT, "malloc"), &alloc_skip[0]);
+    image_range(dlsym(RTLD_DEFAULT, "strdup"), &alloc_skip[1]);
+    image_range(dlsym(RTLD_DEFAULT, "CFDataCreate"), &alloc_skip[2]);
+    image_range(dlsym(RTLD_DEFAULT, "dispatch_async_f"), &alloc_skip[3]);
+
+    /*
+     * Run everything once first, so anything the module allocates the
+     * first time (and then reuses) doesn't count.
+     */
+
+    if (! alloc_digest(p11p, session, &dmech, data, sizeof(data)))
+	return false;
+
+    alloc_count = 0;
+    malloc_logger = alloc_logger;
+
+    for (i = 0; i < iterations; i++)
+	if (! alloc_digest(p11p, session, &dmech, data, sizeof(data)))
+	    break;
+
+    malloc_logger = NULL;
+
+    printf("Digest: %lu allocation%s in %u iteration%s: %s\n", alloc_count,
+	   alloc_count == 1 ? "" : "s", i, i == 1 ? "" : "s",
+	   alloc_count == 0 && i == iterations ? "OK" : "FAILED");
+
+    if (alloc_count != 0 || i != iterations)
+	ok = false;
+
+    if (! op)
+	return ok;
+
+    if (! alloc_sign(p11p, session, mech, op, sig, sizeof(sig)))
+	return false;
+
+    alloc_count = alloc_module_count = 0;
+    malloc_logger = alloc_logger;
+
+    for (i = 0; i < iterations; i++)
+	if (! alloc_sign(p11p, session, mech, op, sig, sizeof(sig)))
+	    break;
+
+    malloc_logger = NULL;
+
+    printf("Sign: %lu module allocation%s in %u iteration%s: %s\n",
+	   alloc_module_count, alloc_module_count == 1 ? "" : "s", i,
+	   i == 1 ? "" : "s",
+	   alloc_module_count == 0 && i == iterations ? "OK" : "FAILED");
+    printf("Sign: %lu other allocation%s (%.1f per signature, mostly the "
+	   "Security framework)\n", alloc_count - alloc_module_count,
+	   alloc_count - alloc_module_count == 1 ? "" : "s",
+	   i > 0 ? (double) (alloc_count - alloc_module_count) / i : 0.0);
+
+    if (alloc_module_count != 0 || i != iterations)
+	ok = false;
+
+    return ok;
+}
+
+/*
+ * Find all of the objects matching a template; returns the number found
+ * (up to max), or -1 on error.
+ */
+
+static int
+find_all(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE session,
+	 CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_OBJECT_HANDLE *objs,
+	 CK_ULONG max)
+{
+    CK_ULONG found = 0;
+    CK_RV rv;
+
+    if ((rv = p11p->C_FindObjectsInit(session, template, count)) != CKR_OK) {
+	fprintf(stderr, "C_FindObjectsInit failed (rv = %s)\n",
+		getCKRName(rv));
+	return -1;
+    }
+
+    rv = p11p->C_FindObjects(session, objs, max, &found);
+    p11p->C_FindObjectsFinal(session);
+
+    if (rv != CKR_OK) {
+	fprintf(stderr, "C_FindObjects failed (rv = %s)\n", getCKRName(rv));
+	return -1;
+    }
+
+    return (int) found;
+}
+
+/*
+ * Make sure every certificate can be found by searching on each of the
+ * attributes that come from the certificate contents.  Returns the number
+ * of certificates, or -1 if any search came up short.
+ */
+
+#define MAX_REFRESH_CERTS 4096
+
+static int
+search_certs(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE session)
+{
+    static CK_OBJECT_HANDLE certs[MAX_REFRESH_CERTS];
+    static CK_OBJECT_HANDLE found[MAX_REFRESH_CERTS];
+    CK_ATTRIBUTE_TYPE types[] = { CKA_SUBJECT, CKA_ISSUER, CKA_SERIAL_NUMBER };
+    CK_OBJECT_CLASS cls = CKO_CERTIFICATE;
+    CK_ATTRIBUTE template[2] = { { CKA_CLASS, &cls, sizeof(cls) } };
+    int ncerts, nfound, i, j, k;
+    bool ok = true;
+
+    if ((ncerts = find_all(p11p, session, template, 1, certs,
+			   MAX_REFRESH_CERTS)) < 0)
+	return -1;
+
+    for (i = 0; i < ncerts; i++) {
+	for (j = 0; j < sizeof(types) / sizeof(types[0]); j++) {
+	    CK_ATTRIBUTE attr = { types[j], NULL, 0 };
+	    CK_RV rv;
+
+	    if ((rv = p11p->C_GetAttributeValue(session, certs[i], &attr,
+						1)) != CKR_OK) {
+		fprintf(stderr, "Can't get attribute %lu of object %lu "
+			"(rv = %s)\n", types[j], certs[i], getCKRName(rv));
+		ok = false;
+		continue;
+	    }
+
+	    attr.pValue = malloc(attr.ulValueLen ? attr.ulValueLen : 1);
+	    p11p->C_GetAttributeValue(session, certs[i], &attr, 1);
+	    template[1] = attr;
+
+	    nfound = find_all(p11p, session, template, 2, found,
+			      MAX_REFRESH_CERTS);
+
+	    for (k = 0; k < nfound; k++)
+		if (found[k] == certs[i])
+		    break;
+
+	    if (nfound < 0 || k == nfound) {
+		fprintf(stderr, "Search on attribute %lu didn't find "
+			"certificate object %lu\n", types[j], certs[i]);
+		ok = false;
+	    }
+
+	    free(attr.pValue);
+	}
+    }
+
+    return ok ? ncerts : -1;
+}
+
+/*
+ * Wait for the certificates in the slot to change (somebody has to add or
+ * remove one in the Keychain while we wait), then check that we can
+ * still find all of them.  Refreshed slots can end up with a mix of
+ * copied and newly built objects, so this is worth checking.  We use the
+ * same session throughout, since an open session should pick up the
+ * new objects too.
+ */
+
+static bool
+refresh_check(CK_FUNCTION_LIST_PTR p11p, CK_SLOT_ID slot, unsigned int wait)
+{
+    CK_SESSION_HANDLE session;
+    struct timespec ts = { 1, 0 };
+    int before, after = -1;
+    unsigned int i;
+    CK_RV rv;
+
+    if ((rv = p11p->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL,
+				  &session)) != CKR_OK) {
+	fprintf(stderr, "C_OpenSession failed (rv = %s)\n", getCKRName(rv));
+	return false;
+    }
+
+    if ((before = search_certs(p11p, session)) < 0) {
+	printf("Refresh: search check FAILED before refresh\n");
+	p11p->C_CloseSession(session);
+	return false;
+    }
+
+    printf("Refresh: %d certificate%s; add or remove a certificate in the "
+	   "Keychain now\n", before, before == 1 ? "" : "s");
+    printf("Waiting up to %u seconds ...", wait);
+    fflush(stdout);
+
+    for (i = 0; i < wait; i++) {
+	nanosleep(&ts, NULL);
+
+	if ((after = search_certs(p11p, session)) != before)
+	    break;
+    }
+
+    printf("\n");
+    p11p->C_CloseSession(session);
+
+    if (after == before) {
+	printf("Refresh: certificates didn't change, nothing to check\n");
+	return true;
+    }
+
+    printf("Refresh: %d certificate%s after refresh: %s\n", after,
+	   after == 1 ? "" : "s", after >= 0 ? "OK" : "FAILED");
+
+    return after >= 0;
+}